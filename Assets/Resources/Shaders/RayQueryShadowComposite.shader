@@ -0,0 +1,31 @@
+// Writes the result of the compute shadow pass to the camera target, the compute counterpart of ray_shadow.frag
+Shader "Hidden/RayQueryShadowComposite"
+{
+   Properties
+   {
+      _MainTex ("Texture", 2D) = "white" {}
+   }
+   SubShader
+   {
+      Cull Off ZWrite Off ZTest Always
+
+      Pass
+      {
+         CGPROGRAM
+         #pragma vertex vert_img
+         #pragma fragment frag
+
+         #include "UnityCG.cginc"
+
+         // r = shadow, g = AO, set by RayTracingHelper.SetupComputeShadow
+         sampler2D _RayQueryShadowTexture;
+
+         fixed4 frag (v2f_img i) : SV_Target
+         {
+            float2 shadow = tex2D(_RayQueryShadowTexture, i.uv).rg;
+            return fixed4((shadow.r * shadow.g).xxx, 1.0);
+         }
+         ENDCG
+      }
+   }
+}
@@ -2,7 +2,9 @@ using System;
 using System.Collections;
 using System.Collections.Generic;
 using System.Runtime.InteropServices;
+using Unity.Collections.LowLevel.Unsafe;
 using UnityEngine;
+using UnityEngine.Rendering;
 
 public class RayTracingHelper
 {
@@ -13,6 +15,30 @@ public class RayTracingHelper
    [DllImport("RenderingPlugin")]
    public static extern void Prepare();
 
+   [DllImport("RenderingPlugin")]
+   public static extern void SetPipelineCachePath(string path);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void SetRenderTargetSize(int width, int height);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void SetDepthPrepass(bool enabled);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void SetComputeShadowTargets(IntPtr depthTexture, IntPtr outputTexture, int downsample);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void SetComputeShadowTemporal(bool enabled);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void SetQualityTier(int tier);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void SetMeshOptimization(int flags);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void SetTriangleSplitting(float areaRatio, float budget);
+
    [DllImport("RenderingPlugin")]
    public static extern int AddLight(
       int lightId,
@@ -44,22 +70,115 @@ public class RayTracingHelper
    public static extern int AddSharedMesh(int sharedMeshInstanceId, IntPtr verticesArray, IntPtr normalsArray,
       IntPtr tangentsArray, IntPtr uvsArray, int vertexCount, IntPtr indicesArray, int indexCount);
 
+   [DllImport("RenderingPlugin")]
+   public static extern int AddSharedMeshNative(int sharedMeshInstanceId, IntPtr vertexBuffer, int vertexStride,
+      int positionOffset, int positionFormat, int normalOffset, int vertexCount, IntPtr indexBuffer, bool indices16,
+      int indexCount);
+
+   // Laid out like VulkanRT::MeshIngest::VertexLayout, formats are VkFormat and a stream of -1 means no normals
+   [StructLayout(LayoutKind.Sequential)]
+   public struct RayQueryVertexLayout
+   {
+      [MarshalAs(UnmanagedType.ByValArray, SizeConst = 4)]
+      public int[] streamStrides;
+      public int positionStream;
+      public int positionOffset;
+      public int positionFormat;
+      public int normalStream;
+      public int normalOffset;
+      public int normalFormat;
+      public int tangentStream;
+      public int tangentOffset;
+      public int tangentFormat;
+      public int uvStream;
+      public int uvOffset;
+      public int uvFormat;
+   }
+
+   [DllImport("RenderingPlugin")]
+   public static extern int AddSharedMeshLayout(int sharedMeshInstanceId, ref RayQueryVertexLayout vertexLayout,
+      IntPtr[] vertexStreams, int vertexCount, IntPtr indices, bool indices16, int indexCount);
+
+   [DllImport("RenderingPlugin")]
+   public static extern int AddSharedMesh16(int sharedMeshInstanceId, IntPtr verticesArray, IntPtr normalsArray,
+      IntPtr tangentsArray, IntPtr uvsArray, int vertexCount, IntPtr indicesArray, int indexCount);
+
    [DllImport("RenderingPlugin")]
    public static extern int AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId,
-      IntPtr l2wMatrix, IntPtr w2lMatrix);
+      IntPtr l2wMatrix, IntPtr w2lMatrix, int mask, int flags);
+
+   [DllImport("RenderingPlugin")]
+   public static extern int AddTlasInstances(int count, IntPtr gameObjectInstanceIds, int sharedMeshInstanceId,
+      IntPtr l2wMatrices, IntPtr w2lMatrices, int mask, int flags);
 
    [DllImport("RenderingPlugin")]
    public static extern void RemoveTlasInstance(int gameObjectInstanceId);
 
+   // Released once the last TLAS instance using the mesh is removed
+   [DllImport("RenderingPlugin")]
+   public static extern void RemoveSharedMesh(int sharedMeshInstanceId);
+
+   // Non zero while an added mesh waits for the ImportNativeMeshes event or for its transfer
+   [DllImport("RenderingPlugin")]
+   public static extern int IsSharedMeshPending(int sharedMeshInstanceId);
+
+   // Non zero when the plugin computed the mesh's bounds while ingesting it, not for AddSharedMeshNative meshes
+   [DllImport("RenderingPlugin")]
+   public static extern int GetSharedMeshBounds(int sharedMeshInstanceId, out Vector3 boundsMin, out Vector3 boundsMax);
+
+   // Meshes and instances added while an arena is active belong to it, DestroyArena removes all of them at once
+   [DllImport("RenderingPlugin")]
+   public static extern int CreateArena();
+
+   [DllImport("RenderingPlugin")]
+   public static extern void SetActiveArena(int arena);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void DestroyArena(int arena);
+
    [DllImport("RenderingPlugin")]
    public static extern void UpdateTlasInstance(int gameObjectInstanceId, IntPtr l2wMatrix,
       IntPtr w2lMatrix);
 
    [DllImport("RenderingPlugin")]
-   public static extern void UpdateCameraMat(float x, float y, float z, IntPtr w2camProj);
+   public static extern void UpdateTlasInstances(int count, IntPtr gameObjectInstanceIds, IntPtr l2wMatrices,
+      IntPtr w2lMatrices);
+
+   [DllImport("RenderingPlugin")]
+   public static extern int GetTlasInstanceHandle(int gameObjectInstanceId);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void UpdateTlasInstancesByHandle(int count, IntPtr handles, IntPtr l2wMatrices,
+      IntPtr w2lMatrices);
+
+   [DllImport("RenderingPlugin")]
+   public static extern void UpdateTlasInstanceMask(int gameObjectInstanceId, int mask, int flags);
+
+   [DllImport("RenderingPlugin")]
+   private static extern IntPtr GetTransformArena(out int capacity);
+
+   [DllImport("RenderingPlugin")]
+   private static extern IntPtr PublishTransformArena(out int capacity);
+
+   // Instance mask bits, match kRayQueryMask* in the plugin
+   public const int MaskShadowCaster = 0x01;
+   public const int MaskAOOccluder = 0x02;
+   public const int MaskDefault = 0xFF;
+
+   // VkGeometryInstanceFlagBitsKHR
+   public const int InstanceFlagCullDisable = 0x1;
+   public const int InstanceFlagFlipFacing = 0x2;
+   public const int InstanceFlagForceOpaque = 0x4;
+   public const int InstanceFlagForceNoOpaque = 0x8;
+
+   // SetMeshOptimization bits, match MeshOptimizer::kOptimize* in the plugin
+   public const int MeshOptimizeVertexCache = 0x1;
+   public const int MeshOptimizeOverdraw = 0x2;
+   public const int MeshOptimizeVertexFetch = 0x4;
+   public const int MeshOptimizeVertexCacheAndFetch = MeshOptimizeVertexCache | MeshOptimizeVertexFetch;
 
    [DllImport("RenderingPlugin")]
-   public static extern void UpdateModelMat(int sharedMeshInstanceId, IntPtr l2w);
+   public static extern void UpdateCameraMat(int cameraInstanceId, float x, float y, float z, IntPtr w2camProj);
 
    [DllImport("RenderingPlugin")]
    public static extern IntPtr GetEventAndDataFunc();
@@ -143,9 +262,15 @@ public class RayTracingHelper
       IntPtr uvsPtr,
       IntPtr indicesPtr,
       int totalVertices,
-      int totalIndices
+      int totalIndices,
+      bool indices16 = false
    )
    {
+      if (indices16)
+      {
+         return AddSharedMesh16(meshId, verticesPtr, normalsPtr, tangentsPtr, uvsPtr, totalVertices, indicesPtr, totalIndices) > 0;
+      }
+
       int ret = AddSharedMesh(
          meshId,
          verticesPtr,
@@ -159,19 +284,400 @@ public class RayTracingHelper
       return ret > 0;
    }
 
+   // VK_FORMAT_R32G32B32_SFLOAT
+   private const int VkFormatR32G32B32Sfloat = 106;
+   private const int VkFormatR32G32B32A32Sfloat = 109;
+   private const int VkFormatR16G16B16A16Sfloat = 97;
+   private const int VkFormatR8G8B8A8Snorm = 38;
+   private const int VkFormatR16G16B16A16Snorm = 91;
+   private const int VkFormatR32G32Sfloat = 103;
+   private const int VkFormatR16G16Sfloat = 83;
+
+   // VkFormat the plugin reads a vertex attribute as, -1 when it can't
+   private static int GetVertexAttributeVkFormat(VertexAttributeFormat format, int dimension)
+   {
+      switch (format)
+      {
+         case VertexAttributeFormat.Float32:
+            return dimension == 2 ? VkFormatR32G32Sfloat : dimension == 3 ? VkFormatR32G32B32Sfloat :
+               dimension == 4 ? VkFormatR32G32B32A32Sfloat : -1;
+         case VertexAttributeFormat.Float16:
+            return dimension == 2 ? VkFormatR16G16Sfloat : dimension == 4 ? VkFormatR16G16B16A16Sfloat : -1;
+         case VertexAttributeFormat.SNorm8:
+            return dimension == 4 ? VkFormatR8G8B8A8Snorm : -1;
+         case VertexAttributeFormat.SNorm16:
+            return dimension == 4 ? VkFormatR16G16B16A16Snorm : -1;
+         default:
+            return -1;
+      }
+   }
+
+   /// <summary>
+   /// Register a readable mesh by its raw vertex streams, half and normalized attributes are converted by the plugin.
+   /// With generateNormals the mesh normals and tangents are ignored, the plugin computes angle weighted normals and
+   /// MikkTSpace style tangents from the first uv channel on its worker threads. Otherwise tangents and the first uv
+   /// channel go along when the plugin reads their format, missing tangents are generated.
+   /// False when a format or the topology isn't supported, use AddMeshToRayTracingSystem then
+   /// </summary>
+   public static unsafe bool AddMeshToRayTracingSystemMeshData(int meshId, Mesh mesh, bool generateNormals = false)
+   {
+      if (!mesh.isReadable)
+      {
+         return false;
+      }
+
+      var layout = new RayQueryVertexLayout
+         { streamStrides = new int[4], normalStream = -1, tangentStream = -1, uvStream = -1 };
+      layout.positionStream = mesh.GetVertexAttributeStream(VertexAttribute.Position);
+      layout.positionOffset = mesh.GetVertexAttributeOffset(VertexAttribute.Position);
+      layout.positionFormat = GetVertexAttributeVkFormat(mesh.GetVertexAttributeFormat(VertexAttribute.Position),
+         mesh.GetVertexAttributeDimension(VertexAttribute.Position));
+      if (layout.positionFormat < 0 || layout.positionFormat == VkFormatR8G8B8A8Snorm ||
+          layout.positionFormat == VkFormatR16G16B16A16Snorm || layout.positionFormat == VkFormatR32G32Sfloat ||
+          layout.positionFormat == VkFormatR16G16Sfloat)
+      {
+         return false;
+      }
+
+      if (!generateNormals && mesh.HasVertexAttribute(VertexAttribute.Normal))
+      {
+         layout.normalStream = mesh.GetVertexAttributeStream(VertexAttribute.Normal);
+         layout.normalOffset = mesh.GetVertexAttributeOffset(VertexAttribute.Normal);
+         layout.normalFormat = GetVertexAttributeVkFormat(mesh.GetVertexAttributeFormat(VertexAttribute.Normal),
+            mesh.GetVertexAttributeDimension(VertexAttribute.Normal));
+         if (layout.normalFormat < 0 || layout.normalFormat == VkFormatR32G32Sfloat ||
+             layout.normalFormat == VkFormatR16G16Sfloat)
+         {
+            return false;
+         }
+      }
+
+      // Shading attributes are optional, one the plugin can't read is left out instead of failing the mesh.
+      // Tangents have to follow the normals, so generated normals get generated tangents too
+      if (!generateNormals && mesh.HasVertexAttribute(VertexAttribute.Tangent) &&
+          mesh.GetVertexAttributeDimension(VertexAttribute.Tangent) == 4)
+      {
+         layout.tangentFormat = GetVertexAttributeVkFormat(mesh.GetVertexAttributeFormat(VertexAttribute.Tangent), 4);
+         if (layout.tangentFormat >= 0)
+         {
+            layout.tangentStream = mesh.GetVertexAttributeStream(VertexAttribute.Tangent);
+            layout.tangentOffset = mesh.GetVertexAttributeOffset(VertexAttribute.Tangent);
+         }
+      }
+
+      if (mesh.HasVertexAttribute(VertexAttribute.TexCoord0) &&
+          mesh.GetVertexAttributeDimension(VertexAttribute.TexCoord0) == 2)
+      {
+         layout.uvFormat = GetVertexAttributeVkFormat(mesh.GetVertexAttributeFormat(VertexAttribute.TexCoord0), 2);
+         if (layout.uvFormat >= 0)
+         {
+            layout.uvStream = mesh.GetVertexAttributeStream(VertexAttribute.TexCoord0);
+            layout.uvOffset = mesh.GetVertexAttributeOffset(VertexAttribute.TexCoord0);
+         }
+      }
+
+      // The index buffer is handed over as one triangle list that indexes the whole vertex buffer
+      int indexCount = 0;
+      for (int subMesh = 0; subMesh < mesh.subMeshCount; ++subMesh)
+      {
+         var subMeshDesc = mesh.GetSubMesh(subMesh);
+         if (subMeshDesc.topology != MeshTopology.Triangles || subMeshDesc.baseVertex != 0)
+         {
+            return false;
+         }
+         indexCount = Math.Max(indexCount, subMeshDesc.indexStart + subMeshDesc.indexCount);
+      }
+
+      using (var meshDataArray = Mesh.AcquireReadOnlyMeshData(mesh))
+      {
+         var meshData = meshDataArray[0];
+         var streams = new IntPtr[4];
+
+         // The plugin reads Unity's own copy of the streams, it stays valid until meshDataArray is disposed
+         for (int stream = 0; stream < meshData.vertexBufferCount && stream < streams.Length; ++stream)
+         {
+            if (stream != layout.positionStream && stream != layout.normalStream &&
+                stream != layout.tangentStream && stream != layout.uvStream)
+            {
+               continue;
+            }
+
+            layout.streamStrides[stream] = meshData.GetVertexBufferStride(stream);
+            streams[stream] = (IntPtr)NativeArrayUnsafeUtility.GetUnsafeReadOnlyPtr(meshData.GetVertexData<byte>(stream));
+         }
+
+         var indices16 = meshData.indexFormat == IndexFormat.UInt16;
+         var indices = indices16
+            ? (IntPtr)NativeArrayUnsafeUtility.GetUnsafeReadOnlyPtr(meshData.GetIndexData<ushort>())
+            : (IntPtr)NativeArrayUnsafeUtility.GetUnsafeReadOnlyPtr(meshData.GetIndexData<int>());
+
+         int ret = AddSharedMeshLayout(meshId, ref layout, streams, meshData.vertexCount, indices, indices16, indexCount);
+
+         return ret > 0;
+      }
+   }
+
+   /// <summary>
+   /// Give the mesh the bounds the plugin worked out while ingesting it, instead of RecalculateBounds on the main thread
+   /// </summary>
+   public static bool ApplyMeshBounds(int meshId, Mesh mesh)
+   {
+      if (GetSharedMeshBounds(meshId, out var boundsMin, out var boundsMax) == 0)
+      {
+         return false;
+      }
+
+      var bounds = new Bounds();
+      bounds.SetMinMax(boundsMin, boundsMax);
+      mesh.bounds = bounds;
+      return true;
+   }
+
+   /// <summary>
+   /// Register a mesh by its GPU buffers so its data never comes back to the CPU. The plugin copies it on the next
+   /// ImportNativeMeshes event. False when the layout can't be copied as is, use AddMeshToRayTracingSystem then
+   /// </summary>
+   public static bool AddMeshToRayTracingSystemNative(int meshId, Mesh mesh)
+   {
+      if (!mesh.HasVertexAttribute(VertexAttribute.Normal) ||
+          mesh.GetVertexAttributeFormat(VertexAttribute.Position) != VertexAttributeFormat.Float32 ||
+          mesh.GetVertexAttributeDimension(VertexAttribute.Position) != 3 ||
+          mesh.GetVertexAttributeFormat(VertexAttribute.Normal) != VertexAttributeFormat.Float32 ||
+          mesh.GetVertexAttributeDimension(VertexAttribute.Normal) != 3)
+      {
+         return false;
+      }
+
+      int stream = mesh.GetVertexAttributeStream(VertexAttribute.Position);
+      if (mesh.GetVertexAttributeStream(VertexAttribute.Normal) != stream)
+      {
+         return false;
+      }
+
+      // The index buffer is copied as one triangle list that indexes the whole vertex buffer
+      int indexCount = 0;
+      for (int subMesh = 0; subMesh < mesh.subMeshCount; ++subMesh)
+      {
+         var subMeshDesc = mesh.GetSubMesh(subMesh);
+         if (subMeshDesc.topology != MeshTopology.Triangles || subMeshDesc.baseVertex != 0)
+         {
+            return false;
+         }
+         indexCount = Math.Max(indexCount, subMeshDesc.indexStart + subMeshDesc.indexCount);
+      }
+
+      // The plugin copies the indices and repacks the vertices in a compute shader, changing the targets recreates
+      // the buffers so upload right away
+      mesh.vertexBufferTarget |= GraphicsBuffer.Target.CopySource | GraphicsBuffer.Target.Raw;
+      mesh.indexBufferTarget |= GraphicsBuffer.Target.CopySource;
+      mesh.UploadMeshData(false);
+
+      var vertexBuffer = mesh.GetVertexBuffer(stream);
+      var indexBuffer = mesh.GetIndexBuffer();
+
+      int ret = AddSharedMeshNative(
+         meshId,
+         vertexBuffer.GetNativeBufferPtr(),
+         mesh.GetVertexBufferStride(stream),
+         mesh.GetVertexAttributeOffset(VertexAttribute.Position),
+         VkFormatR32G32B32Sfloat,
+         mesh.GetVertexAttributeOffset(VertexAttribute.Normal),
+         mesh.vertexCount,
+         indexBuffer.GetNativeBufferPtr(),
+         mesh.indexFormat == IndexFormat.UInt16,
+         indexCount
+      );
+
+      if (ret == 1)
+      {
+         pendingNativeMeshBuffers[meshId] = new[] { vertexBuffer, indexBuffer };
+      }
+      else
+      {
+         vertexBuffer.Dispose();
+         indexBuffer.Dispose();
+      }
+      return ret > 0;
+   }
+
+   // Unity's buffers of meshes added by AddMeshToRayTracingSystemNative, held so the pointers the plugin was given
+   // stay valid until it has copied them
+   private static Dictionary<int, GraphicsBuffer[]> pendingNativeMeshBuffers = new Dictionary<int, GraphicsBuffer[]>();
+   private static List<int> importedMeshIds = new List<int>();
+
+   private static void ReleaseImportedMeshBuffers()
+   {
+      foreach (var entry in pendingNativeMeshBuffers)
+      {
+         if (IsSharedMeshPending(entry.Key) == 0)
+         {
+            importedMeshIds.Add(entry.Key);
+         }
+      }
+
+      foreach (int meshId in importedMeshIds)
+      {
+         foreach (var buffer in pendingNativeMeshBuffers[meshId])
+         {
+            buffer.Dispose();
+         }
+         pendingNativeMeshBuffers.Remove(meshId);
+      }
+      importedMeshIds.Clear();
+   }
+
    public static bool CreateTlAS(int gameobjectId, int meshId,
       IntPtr local2worldPtr,
-      IntPtr world2localPtr)
+      IntPtr world2localPtr,
+      int mask = MaskDefault,
+      int flags = InstanceFlagCullDisable)
    {
-      int ret = AddTlasInstance(gameobjectId, meshId, local2worldPtr, world2localPtr);
+      int ret = AddTlasInstance(gameobjectId, meshId, local2worldPtr, world2localPtr, mask, flags);
       return ret > 0;
    }
 
+   // Many instances of one mesh in a single call, e.g. foliage spawned from a matrix array. Returns how many were added
+   public static int CreateTLASInstances(int[] gameobjectIds, int meshId,
+      Matrix4x4[] local2world,
+      Matrix4x4[] world2local,
+      int mask = MaskDefault,
+      int flags = InstanceFlagCullDisable)
+   {
+      int count = Math.Min(gameobjectIds.Length, Math.Min(local2world.Length, world2local.Length));
+      if (count == 0)
+      {
+         return 0;
+      }
+
+      var idsHandle = GCHandle.Alloc(gameobjectIds, GCHandleType.Pinned);
+      var l2wHandle = GCHandle.Alloc(local2world, GCHandleType.Pinned);
+      var w2lHandle = GCHandle.Alloc(world2local, GCHandleType.Pinned);
+
+      int added = AddTlasInstances(count, idsHandle.AddrOfPinnedObject(), meshId,
+         l2wHandle.AddrOfPinnedObject(), w2lHandle.AddrOfPinnedObject(), mask, flags);
+
+      idsHandle.Free();
+      l2wHandle.Free();
+      w2lHandle.Free();
+
+      return added;
+   }
+
+   public static void UpdateTLASMask(int gameobjectId, int mask, int flags)
+   {
+      UpdateTlasInstanceMask(gameobjectId, mask, flags);
+   }
+
    public static void RemoveTLAS(int gameobjectId)
    {
       RemoveTlasInstance(gameobjectId);
    }
 
+   // Transforms queued by QueueTlasInstanceTransform, sent in one call by FlushTlasInstanceTransforms
+   private static int[] transformHandles = new int[64];
+   private static Matrix4x4[] transformL2W = new Matrix4x4[64];
+   private static Matrix4x4[] transformW2L = new Matrix4x4[64];
+   private static int transformCount = 0;
+   private const int MaxQueuedTransforms = 4096;
+
+   public static void QueueTlasInstanceTransform(int handle, Matrix4x4 local2world, Matrix4x4 world2local)
+   {
+      // Nothing flushes while the render coroutine isn't running, e.g. in edit mode, so the queue stays bounded
+      if (transformCount == MaxQueuedTransforms)
+      {
+         FlushTlasInstanceTransforms();
+      }
+      else if (transformCount == transformHandles.Length)
+      {
+         Array.Resize(ref transformHandles, transformCount * 2);
+         Array.Resize(ref transformL2W, transformCount * 2);
+         Array.Resize(ref transformW2L, transformCount * 2);
+      }
+
+      transformHandles[transformCount] = handle;
+      transformL2W[transformCount] = local2world;
+      transformW2L[transformCount] = world2local;
+      transformCount++;
+   }
+
+   // One slot of the native transform arena, matches RayTracerTransformSlot in the plugin
+   [StructLayout(LayoutKind.Sequential)]
+   private struct TransformSlot
+   {
+      public Vector4 row0;
+      public Vector4 row1;
+      public Vector4 row2;
+      public uint flags;
+      public int handle;
+      private uint padding0;
+      private uint padding1;
+   }
+
+   private const uint TransformSlotDirty = 0x1;
+
+   // Handles carry the instance's slot in the low bits and a generation above, matches kTlasHandleIndexBits in the plugin
+   private const int TlasHandleIndexMask = (1 << 20) - 1;
+   private static readonly int TransformSlotSize = Marshal.SizeOf(typeof(TransformSlot));
+
+   // Write half of the native arena, swapped by PublishTlasInstanceTransforms
+   private static IntPtr transformArena = IntPtr.Zero;
+   private static int transformArenaCapacity = 0;
+
+   /// <summary>
+   /// Write a transform straight into the plugin's transform arena, picked up by the next TLAS build after
+   /// PublishTlasInstanceTransforms. Falls back to the queue when the plugin can't hand out the arena
+   /// </summary>
+   public static void WriteTlasInstanceTransform(int handle, Matrix4x4 local2world)
+   {
+      int index = handle & TlasHandleIndexMask;
+      if (index >= transformArenaCapacity)
+      {
+         transformArena = GetTransformArena(out transformArenaCapacity);
+      }
+
+      if (transformArena == IntPtr.Zero || index >= transformArenaCapacity)
+      {
+         QueueTlasInstanceTransform(handle, local2world, local2world.inverse);
+         return;
+      }
+
+      var slot = new TransformSlot
+      {
+         row0 = local2world.GetRow(0),
+         row1 = local2world.GetRow(1),
+         row2 = local2world.GetRow(2),
+         flags = TransformSlotDirty,
+         handle = handle
+      };
+      Marshal.StructureToPtr(slot, IntPtr.Add(transformArena, index * TransformSlotSize), false);
+   }
+
+   public static void PublishTlasInstanceTransforms()
+   {
+      transformArena = PublishTransformArena(out transformArenaCapacity);
+   }
+
+   public static void FlushTlasInstanceTransforms()
+   {
+      if (transformCount == 0)
+      {
+         return;
+      }
+
+      var handlesHandle = GCHandle.Alloc(transformHandles, GCHandleType.Pinned);
+      var l2wHandle = GCHandle.Alloc(transformL2W, GCHandleType.Pinned);
+      var w2lHandle = GCHandle.Alloc(transformW2L, GCHandleType.Pinned);
+
+      UpdateTlasInstancesByHandle(transformCount, handlesHandle.AddrOfPinnedObject(),
+         l2wHandle.AddrOfPinnedObject(), w2lHandle.AddrOfPinnedObject());
+
+      handlesHandle.Free();
+      l2wHandle.Free();
+      w2lHandle.Free();
+
+      transformCount = 0;
+   }
+
    public static void UpdateTRSAndTLASToRayTracingSystem(
       int gameobjectId,
       IntPtr local2worldPtr,
@@ -182,7 +688,78 @@ public class RayTracingHelper
    }
    
    private static string[] needShader =
-      { "ray_shadowVert", "ray_shadowFrag"};
+      { "ray_shadowVert", "ray_shadowFrag", "ray_depthVert", "ray_shadowTraceComp", "ray_shadowUpsampleComp", "ray_lightCullComp",
+        "ray_meshRepackComp"};
+
+   // Trace shadow and AO in compute at 1 / ComputeShadowDownsample resolution instead of the raster pass, 0 disables it
+   public static int ComputeShadowDownsample = 0;
+
+   // Accumulate a few rays per frame over reprojected history instead of tracing the full AO set every frame
+   public static bool ComputeShadowTemporal = true;
+
+   // -1 picks by device type, 0 shadows only, 1/2/3 shadows + 4/9/16 AO rays, 4 AO only
+   public static int QualityTier = -1;
+
+   // How meshes added from CPU data are reordered before upload, set before any mesh is added. Off by default, the
+   // reordering runs on the thread that adds the mesh, so MeshOptimizeVertexCacheAndFetch suits load time ingest
+   public static int MeshOptimization = 0;
+
+   // Split long, thin triangles for the BLAS while their bounding box surface is above TriangleSplitAreaRatio times
+   // their area, up to TriangleSplitBudget times the original triangle count. Helps meshes with long walls and beams
+   public static bool SplitLongTriangles = false;
+   public static float TriangleSplitAreaRatio = 16.0f;
+   public static float TriangleSplitBudget = 1.5f;
+
+   // r = shadow, g = AO at camera resolution, bound globally as _RayQueryShadowTexture
+   private static RenderTexture computeShadowTexture;
+
+   // Draws computeShadowTexture to the camera target in place of the raster shadow pass
+   private static Material computeShadowComposite;
+
+   private static bool SetupComputeShadow(Camera camera)
+   {
+      if (ComputeShadowDownsample <= 0)
+      {
+         SetComputeShadowTargets(IntPtr.Zero, IntPtr.Zero, 0);
+         return false;
+      }
+
+      camera.depthTextureMode |= DepthTextureMode.Depth;
+      var depthTexture = Shader.GetGlobalTexture("_CameraDepthTexture");
+      if (!depthTexture)
+      {
+         return false;
+      }
+
+      if (!computeShadowComposite)
+      {
+         var compositeShader = Shader.Find("Hidden/RayQueryShadowComposite");
+         if (!compositeShader)
+         {
+            Debug.LogError("Hidden/RayQueryShadowComposite not found, falling back to the raster shadow pass");
+            ComputeShadowDownsample = 0;
+            SetComputeShadowTargets(IntPtr.Zero, IntPtr.Zero, 0);
+            return false;
+         }
+         computeShadowComposite = new Material(compositeShader);
+      }
+
+      if (!computeShadowTexture || computeShadowTexture.width != camera.pixelWidth || computeShadowTexture.height != camera.pixelHeight)
+      {
+         if (computeShadowTexture)
+         {
+            computeShadowTexture.Release();
+         }
+         computeShadowTexture = new RenderTexture(camera.pixelWidth, camera.pixelHeight, 0, RenderTextureFormat.RG16, RenderTextureReadWrite.Linear);
+         computeShadowTexture.enableRandomWrite = true;
+         computeShadowTexture.Create();
+         Shader.SetGlobalTexture("_RayQueryShadowTexture", computeShadowTexture);
+      }
+
+      SetComputeShadowTargets(depthTexture.GetNativeTexturePtr(), computeShadowTexture.GetNativeTexturePtr(), ComputeShadowDownsample);
+      SetComputeShadowTemporal(ComputeShadowTemporal);
+      return true;
+   }
     
    public static void LoadShaderData()
    {
@@ -202,11 +779,21 @@ public class RayTracingHelper
       }
    }
    
-   private static void CreateOrUpdateLight(bool isCreate)
+   // Lights register themselves through RayTracingLight, this only attaches it to the ones in the scene at startup.
+   // Lights created later need the component to be traced
+   private static void AttachLights()
+   {
+      foreach (var light in UnityEngine.Object.FindObjectsOfType<Light>())
+      {
+         if (!light.GetComponent<RayTracingLight>())
+         {
+            light.gameObject.AddComponent<RayTracingLight>();
+         }
+      }
+   }
+
+   public static void CreateOrUpdateLight(Light light, bool isCreate)
    {
-      GameObject obj = GameObject.Find("Directional Light");
-      if (!obj) return;
-      Light light = obj.GetComponent<Light>();
       int lightId = light.GetInstanceID();
       var lightPos = light.transform.position;
       var lightDir = light.transform.forward;
@@ -234,8 +821,13 @@ public class RayTracingHelper
    
    public static void Init()
    {
-      CreateOrUpdateLight(true);
+      AttachLights();
       LoadShaderData();
+      SetPipelineCachePath(System.IO.Path.Combine(Application.persistentDataPath, "rayquery_pipeline.cache"));
+      SetDepthPrepass(true);
+      SetQualityTier(QualityTier);
+      SetMeshOptimization(MeshOptimization);
+      SetTriangleSplitting(SplitLongTriangles ? TriangleSplitAreaRatio : 0.0f, TriangleSplitBudget);
       Prepare();
    }
 
@@ -257,11 +849,26 @@ public class RayTracingHelper
          var w2camProj = proj * w2cam;
          var w2camProjHandle = GCHandle.Alloc(w2camProj, GCHandleType.Pinned);
         
-         RayTracingHelper.UpdateCameraMat(camPos.x, camPos.y, camPos.z, w2camProjHandle.AddrOfPinnedObject());
+         RayTracingHelper.UpdateCameraMat(m_camera.GetInstanceID(), camPos.x, camPos.y, camPos.z, w2camProjHandle.AddrOfPinnedObject());
          w2camProjHandle.Free();    
-         CreateOrUpdateLight(false);
-         
-         GL.IssuePluginEvent(GetEventAndDataFunc(), 1);
+         FlushTlasInstanceTransforms();
+         PublishTlasInstanceTransforms();
+         SetRenderTargetSize(m_camera.pixelWidth, m_camera.pixelHeight);
+         ReleaseImportedMeshBuffers();
+
+         // Copies meshes added by AddMeshToRayTracingSystemNative, then bins lights into screen tiles.
+         // Both have to be outside the render pass the shadow draws run in
+         GL.IssuePluginEvent(GetEventAndDataFunc(), 4);
+         GL.IssuePluginEvent(GetEventAndDataFunc(), 3);
+         if (SetupComputeShadow(m_camera))
+         {
+            GL.IssuePluginEvent(GetEventAndDataFunc(), 2);
+            Graphics.Blit(computeShadowTexture, (RenderTexture)null, computeShadowComposite);
+         }
+         else
+         {
+            GL.IssuePluginEvent(GetEventAndDataFunc(), 1);
+         }
       }
    }
 }
@@ -0,0 +1,66 @@
+using UnityEngine;
+
+// Keeps its Light registered with the plugin while enabled and only sends changes,
+// RayTracingHelper.Init adds it to lights already in the scene
+[ExecuteInEditMode]
+[RequireComponent(typeof(Light))]
+public class RayTracingLight : MonoBehaviour
+{
+    private Light m_light;
+    private bool m_registered = false;
+
+    // Last values handed to the plugin
+    private Color m_color;
+    private float m_intensity;
+    private float m_bounceIntensity;
+    private float m_range;
+    private float m_spotAngle;
+    private LightType m_type;
+    private bool m_lightEnabled;
+
+    void OnEnable()
+    {
+        m_light = this.GetComponent<Light>();
+        RayTracingHelper.CreateOrUpdateLight(m_light, true);
+        m_registered = true;
+        CacheLight();
+    }
+
+    private void OnDisable()
+    {
+        if (m_registered)
+        {
+            RayTracingHelper.RemoveLight(m_light.GetInstanceID());
+            m_registered = false;
+        }
+    }
+
+    void Update()
+    {
+        if (!m_registered || (!this.transform.hasChanged && !LightChanged()))
+        {
+            return;
+        }
+
+        RayTracingHelper.CreateOrUpdateLight(m_light, false);
+        CacheLight();
+    }
+
+    bool LightChanged()
+    {
+        return m_light.color != m_color || m_light.intensity != m_intensity || m_light.bounceIntensity != m_bounceIntensity ||
+            m_light.range != m_range || m_light.spotAngle != m_spotAngle || m_light.type != m_type || m_light.enabled != m_lightEnabled;
+    }
+
+    void CacheLight()
+    {
+        m_color = m_light.color;
+        m_intensity = m_light.intensity;
+        m_bounceIntensity = m_light.bounceIntensity;
+        m_range = m_light.range;
+        m_spotAngle = m_light.spotAngle;
+        m_type = m_light.type;
+        m_lightEnabled = m_light.enabled;
+        this.transform.hasChanged = false;
+    }
+}
@@ -17,9 +17,16 @@ public class RayTracingMeshFilter : MonoBehaviour
     [ReadOnly]
 
     public bool SharedMeshRegisteredWithRayTracer = false;
+
+    // Hand the plugin the mesh's GPU buffers instead of copying vertices and indices through managed arrays
+    public bool UseNativeMeshBuffers = false;
+
+    // Leave the mesh untouched and let the plugin compute the normals, instead of recalculating them on the main thread
+    public bool GenerateNormalsNatively = false;
     
     private MeshFilter m_meshFilter;
     private bool m_hasCreateTLAS = false;
+    private int m_tlasHandle = -1;
     
 
     void OnEnable()
@@ -31,6 +38,16 @@ public class RayTracingMeshFilter : MonoBehaviour
     private void OnDisable()
     {
         RayTracingHelper.RemoveTlasInstance(this.GameObjectId);
+        m_tlasHandle = -1;
+    }
+
+    private void OnDestroy()
+    {
+        if (SharedMeshRegisteredWithRayTracer)
+        {
+            RayTracingHelper.RemoveSharedMesh(this.SharedMeshInstanceID);
+            SharedMeshRegisteredWithRayTracer = false;
+        }
     }
 
     void Init()
@@ -45,15 +62,42 @@ public class RayTracingMeshFilter : MonoBehaviour
 
     void CreateRayTracingData()
     {
+        if (GenerateNormalsNatively && RayTracingHelper.AddMeshToRayTracingSystemMeshData(this.SharedMeshInstanceID, m_meshFilter.sharedMesh, true))
+        {
+            // Stands in for RecalculateBounds, the plugin already read every position
+            RayTracingHelper.ApplyMeshBounds(this.SharedMeshInstanceID, m_meshFilter.sharedMesh);
+            SharedMeshRegisteredWithRayTracer = true;
+            CreateTLAS();
+            return;
+        }
+
         m_meshFilter.sharedMesh.RecalculateNormals();
         m_meshFilter.sharedMesh.RecalculateTangents();
         m_meshFilter.sharedMesh.RecalculateBounds();
+
+        if (UseNativeMeshBuffers && RayTracingHelper.AddMeshToRayTracingSystemNative(this.SharedMeshInstanceID, m_meshFilter.sharedMesh))
+        {
+            SharedMeshRegisteredWithRayTracer = true;
+            CreateTLAS();
+            return;
+        }
+
+        // Raw vertex streams converted by the plugin, no Vector3 arrays on the managed side
+        if (RayTracingHelper.AddMeshToRayTracingSystemMeshData(this.SharedMeshInstanceID, m_meshFilter.sharedMesh))
+        {
+            SharedMeshRegisteredWithRayTracer = true;
+            CreateTLAS();
+            return;
+        }
         
         var vertices = m_meshFilter.sharedMesh.vertices;
         var normals = m_meshFilter.sharedMesh.normals;
         var tangents = m_meshFilter.sharedMesh.tangents;
         var uv = m_meshFilter.sharedMesh.uv;
-        var indices = m_meshFilter.sharedMesh.triangles;
+
+        // 16 bit meshes keep their indices 16 bit all the way to the index buffer
+        var indices16 = m_meshFilter.sharedMesh.indexFormat == UnityEngine.Rendering.IndexFormat.UInt16;
+        Array indices = indices16 ? (Array)GetIndices16(m_meshFilter.sharedMesh) : m_meshFilter.sharedMesh.triangles;
         
         var verticesHandle = GCHandle.Alloc(vertices, GCHandleType.Pinned);
         var normalsHandle = GCHandle.Alloc(normals, GCHandleType.Pinned);
@@ -65,11 +109,12 @@ public class RayTracingMeshFilter : MonoBehaviour
             this.SharedMeshInstanceID,
             verticesHandle.AddrOfPinnedObject(),
             normalsHandle.AddrOfPinnedObject(),
-            tangentsHandle.AddrOfPinnedObject(),
-            uvsHandle.AddrOfPinnedObject(),
+            tangents.Length == vertices.Length ? tangentsHandle.AddrOfPinnedObject() : IntPtr.Zero,
+            uv.Length == vertices.Length ? uvsHandle.AddrOfPinnedObject() : IntPtr.Zero,
             indicesHandle.AddrOfPinnedObject(),
             vertices.Length,
-            indices.Length
+            indices.Length,
+            indices16
         );
         
         verticesHandle.Free();
@@ -81,6 +126,20 @@ public class RayTracingMeshFilter : MonoBehaviour
         CreateTLAS();
     }
     
+    // Same order as Mesh.triangles, every sub mesh one after the other
+    static ushort[] GetIndices16(Mesh mesh)
+    {
+        var indices = new List<ushort>();
+        var subMeshIndices = new List<ushort>();
+        for (int subMesh = 0; subMesh < mesh.subMeshCount; ++subMesh)
+        {
+            mesh.GetIndices(subMeshIndices, subMesh);
+            indices.AddRange(subMeshIndices);
+        }
+
+        return indices.ToArray();
+    }
+
     void CreateTLAS()
     {
         var local2world = this.transform.localToWorldMatrix;
@@ -97,46 +156,30 @@ public class RayTracingMeshFilter : MonoBehaviour
         );
         
         Debug.LogFormat("GameObject {0} Create TLAS {1}",this.GameObjectId, m_hasCreateTLAS);
+
+        // Also fine when the instance already existed, the handle is looked up either way
+        m_tlasHandle = RayTracingHelper.GetTlasInstanceHandle(this.GameObjectId);
+        this.transform.hasChanged = false;
         
         local2worldHandle.Free();
         world2localHandle.Free();
     }
 
-    void UpdateLocal2World()
-    {
-        var local2world = this.transform.localToWorldMatrix;
-        var local2worldHandle = GCHandle.Alloc(local2world, GCHandleType.Pinned);
-        RayTracingHelper.UpdateModelMat(this.SharedMeshInstanceID, local2worldHandle.AddrOfPinnedObject());
-        local2worldHandle.Free();
-    }
-
     void UpdateTLASTRS()
     {
-        if (!m_hasCreateTLAS)
+        if (m_tlasHandle < 0 || !this.transform.hasChanged)
         {
             return;
         }
-        
-        var local2world = this.transform.localToWorldMatrix;
-        var world2local = this.transform.worldToLocalMatrix;
-        
-        var local2worldHandle = GCHandle.Alloc(local2world, GCHandleType.Pinned);
-        var world2localHandle = GCHandle.Alloc(world2local, GCHandleType.Pinned);
-        
-        RayTracingHelper.UpdateTRSAndTLASToRayTracingSystem(
-            this.GameObjectId,
-            local2worldHandle.AddrOfPinnedObject(),
-            world2localHandle.AddrOfPinnedObject()
-        );
-        
-        local2worldHandle.Free();
-        world2localHandle.Free();
+
+        // Written in place into the plugin's transform arena, handed over once per frame by RayTracingHelper
+        RayTracingHelper.WriteTlasInstanceTransform(m_tlasHandle, this.transform.localToWorldMatrix);
+        this.transform.hasChanged = false;
     }
 
     // Update is called once per frame
     void Update()
     {
-        UpdateLocal2World();
         UpdateTLASTRS();
     }
 }
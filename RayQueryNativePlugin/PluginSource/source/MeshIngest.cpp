@@ -0,0 +1,1255 @@
+#include "MeshIngest.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MESH_INGEST_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define MESH_INGEST_NEON 1
+#include <arm_neon.h>
+#endif
+
+// MSVC emits AVX2 and F16C intrinsics without /arch, GCC and Clang need the function to opt in
+#if defined(MESH_INGEST_X86) && !defined(_MSC_VER)
+#define MESH_INGEST_TARGET_AVX2 __attribute__((target("avx2,f16c")))
+#else
+#define MESH_INGEST_TARGET_AVX2
+#endif
+
+namespace VulkanRT
+{
+	namespace MeshIngest
+	{
+		namespace
+		{
+			typedef void (*InterleaveFunc)(RayQueryVertex*, const float*, const float*, uint32_t);
+			typedef void (*StreamCopyFunc)(uint8_t*, const uint8_t*, size_t);
+			typedef void (*NarrowIndicesFunc)(uint16_t*, const int32_t*, uint32_t);
+
+			// Decodes count attributes stride bytes apart into the xyz of out[8 * i], w is set to 0.
+			// out walks a RayQueryVertex array, 8 floats per vertex
+			typedef void (*DecodeFunc)(float*, const uint8_t*, uint32_t, uint32_t, VkFormat);
+
+			struct Kernels
+			{
+				InterleaveFunc interleave;
+				StreamCopyFunc streamCopy;
+				NarrowIndicesFunc narrowIndices;
+				DecodeFunc decode;
+				const char* name;
+			};
+
+			// Vertices decoded into a cached block before it is streamed to the destination in whole lines
+			const uint32_t kGatherBlockSize = 64;
+
+			const float kSnorm8Scale = 1.0f / 127.0f;
+			const float kSnorm16Scale = 1.0f / 32767.0f;
+
+			uint32_t FormatSize(VkFormat format)
+			{
+				switch (format)
+				{
+				case VK_FORMAT_R32G32B32_SFLOAT:
+					return 12;
+				case VK_FORMAT_R32G32B32A32_SFLOAT:
+					return 16;
+				case VK_FORMAT_R16G16B16A16_SFLOAT:
+				case VK_FORMAT_R16G16B16A16_SNORM:
+				case VK_FORMAT_R32G32_SFLOAT:
+					return 8;
+				case VK_FORMAT_R8G8B8A8_SNORM:
+				case VK_FORMAT_R16G16_SFLOAT:
+					return 4;
+				default:
+					return 0;
+				}
+			}
+
+			// attribute is 0 to 3 for position, normal, tangent and uv. Normalized integers can't hold positions
+			bool IsAttributeFormatSupported(uint32_t attribute, VkFormat format)
+			{
+				switch (format)
+				{
+				case VK_FORMAT_R32G32B32_SFLOAT:
+					return attribute <= 1;
+				case VK_FORMAT_R32G32B32A32_SFLOAT:
+				case VK_FORMAT_R16G16B16A16_SFLOAT:
+					return attribute <= 2;
+				case VK_FORMAT_R8G8B8A8_SNORM:
+				case VK_FORMAT_R16G16B16A16_SNORM:
+					return attribute == 1 || attribute == 2;
+				case VK_FORMAT_R32G32_SFLOAT:
+				case VK_FORMAT_R16G16_SFLOAT:
+					return attribute == 3;
+				default:
+					return false;
+				}
+			}
+
+			// Exact for every half value, F16C gives the same result
+			float HalfToFloat(uint16_t half)
+			{
+				const uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+				const uint32_t exponent = (half >> 10) & 0x1fu;
+				const uint32_t mantissa = half & 0x3ffu;
+
+				if (exponent == 0)
+				{
+					// Zero and subnormals are mantissa * 2^-24
+					const float value = static_cast<float>(mantissa) * (1.0f / 16777216.0f);
+					return sign != 0 ? -value : value;
+				}
+
+				const uint32_t bits = exponent == 0x1fu
+					? sign | 0x7f800000u | (mantissa << 13)
+					: sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+				float value;
+				std::memcpy(&value, &bits, sizeof(value));
+				return value;
+			}
+
+			void DecodeOneScalar(float* out, const uint8_t* src, VkFormat format)
+			{
+				switch (format)
+				{
+				case VK_FORMAT_R32G32B32_SFLOAT:
+				case VK_FORMAT_R32G32B32A32_SFLOAT:
+					std::memcpy(out, src, 3 * sizeof(float));
+					break;
+				case VK_FORMAT_R16G16B16A16_SFLOAT:
+				{
+					uint16_t half[3];
+					std::memcpy(half, src, sizeof(half));
+					for (int c = 0; c < 3; ++c)
+					{
+						out[c] = HalfToFloat(half[c]);
+					}
+					break;
+				}
+				case VK_FORMAT_R8G8B8A8_SNORM:
+					for (int c = 0; c < 3; ++c)
+					{
+						out[c] = std::max(static_cast<float>(static_cast<int8_t>(src[c])) * kSnorm8Scale, -1.0f);
+					}
+					break;
+				case VK_FORMAT_R16G16B16A16_SNORM:
+				{
+					int16_t snorm[3];
+					std::memcpy(snorm, src, sizeof(snorm));
+					for (int c = 0; c < 3; ++c)
+					{
+						out[c] = std::max(static_cast<float>(snorm[c]) * kSnorm16Scale, -1.0f);
+					}
+					break;
+				}
+				default:
+					out[0] = out[1] = out[2] = 0.0f;
+					break;
+				}
+				out[3] = 0.0f;
+			}
+
+			// Tangents and uvs keep every component, only the scalar path reads them
+			void DecodeAttributeScalar(float* out, const uint8_t* src, VkFormat format)
+			{
+				switch (format)
+				{
+				case VK_FORMAT_R32G32B32A32_SFLOAT:
+					std::memcpy(out, src, 4 * sizeof(float));
+					break;
+				case VK_FORMAT_R32G32_SFLOAT:
+					std::memcpy(out, src, 2 * sizeof(float));
+					break;
+				case VK_FORMAT_R16G16B16A16_SFLOAT:
+				case VK_FORMAT_R16G16_SFLOAT:
+				{
+					const int components = format == VK_FORMAT_R16G16_SFLOAT ? 2 : 4;
+					uint16_t half[4];
+					std::memcpy(half, src, components * sizeof(uint16_t));
+					for (int c = 0; c < components; ++c)
+					{
+						out[c] = HalfToFloat(half[c]);
+					}
+					break;
+				}
+				case VK_FORMAT_R8G8B8A8_SNORM:
+					for (int c = 0; c < 4; ++c)
+					{
+						out[c] = std::max(static_cast<float>(static_cast<int8_t>(src[c])) * kSnorm8Scale, -1.0f);
+					}
+					break;
+				case VK_FORMAT_R16G16B16A16_SNORM:
+				{
+					int16_t snorm[4];
+					std::memcpy(snorm, src, sizeof(snorm));
+					for (int c = 0; c < 4; ++c)
+					{
+						out[c] = std::max(static_cast<float>(snorm[c]) * kSnorm16Scale, -1.0f);
+					}
+					break;
+				}
+				default:
+					break;
+				}
+			}
+
+			void DecodeScalar(float* out, const uint8_t* src, uint32_t stride, uint32_t count, VkFormat format)
+			{
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					DecodeOneScalar(out + 8 * i, src + static_cast<size_t>(stride) * i, format);
+				}
+			}
+
+			void InterleaveScalar(RayQueryVertex* dst, const float* positions, const float* normals, uint32_t vertexCount)
+			{
+				for (uint32_t i = 0; i < vertexCount; ++i)
+				{
+					dst[i].position = vec3(positions[3 * i + 0], positions[3 * i + 1], positions[3 * i + 2]);
+					dst[i].normal = vec3(normals[3 * i + 0], normals[3 * i + 1], normals[3 * i + 2]);
+				}
+			}
+
+			void StreamCopyScalar(uint8_t* dst, const uint8_t* src, size_t size)
+			{
+				std::memcpy(dst, src, size);
+			}
+
+			void NarrowIndicesScalar(uint16_t* dst, const int32_t* indices, uint32_t indexCount)
+			{
+				for (uint32_t i = 0; i < indexCount; ++i)
+				{
+					dst[i] = static_cast<uint16_t>(indices[i]);
+				}
+			}
+
+			bool IsAligned(const void* p, uintptr_t alignment)
+			{
+				return (reinterpret_cast<uintptr_t>(p) & (alignment - 1)) == 0;
+			}
+
+			// Bytes to copy before dst reaches the alignment, never more than size
+			size_t AlignmentHead(const void* dst, uintptr_t alignment, size_t size)
+			{
+				const size_t head = (alignment - (reinterpret_cast<uintptr_t>(dst) & (alignment - 1))) & (alignment - 1);
+				return std::min(head, size);
+			}
+
+#if defined(MESH_INGEST_X86)
+			// The float3 loads read one float past the vertex, so the last vertex of each array goes through the scalar path
+			void InterleaveSSE(RayQueryVertex* dst, const float* positions, const float* normals, uint32_t vertexCount)
+			{
+				if (vertexCount == 0 || !IsAligned(dst, 16))
+				{
+					InterleaveScalar(dst, positions, normals, vertexCount);
+					return;
+				}
+
+				const __m128 xyzMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+				float* out = reinterpret_cast<float*>(dst);
+
+				const uint32_t simdCount = vertexCount - 1;
+				for (uint32_t i = 0; i < simdCount; ++i)
+				{
+					const __m128 p = _mm_and_ps(_mm_loadu_ps(positions + 3 * i), xyzMask);
+					const __m128 n = _mm_and_ps(_mm_loadu_ps(normals + 3 * i), xyzMask);
+
+					_mm_stream_ps(out + 8 * i + 0, p);
+					_mm_stream_ps(out + 8 * i + 4, n);
+				}
+				_mm_sfence();
+
+				InterleaveScalar(dst + simdCount, positions + 3 * simdCount, normals + 3 * simdCount, 1);
+			}
+
+			void StreamCopySSE(uint8_t* dst, const uint8_t* src, size_t size)
+			{
+				size_t i = AlignmentHead(dst, 16, size);
+				std::memcpy(dst, src, i);
+
+				for (; i + 16 <= size; i += 16)
+				{
+					_mm_stream_si128(reinterpret_cast<__m128i*>(dst + i), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+				}
+				_mm_sfence();
+
+				std::memcpy(dst + i, src + i, size - i);
+			}
+
+			// SSE2 has no half conversion, those go through the scalar path.
+			// The float3 load reads 4 bytes past the attribute, so the last one is decoded by the scalar path
+			void DecodeSSE(float* out, const uint8_t* src, uint32_t stride, uint32_t count, VkFormat format)
+			{
+				if (count == 0)
+				{
+					return;
+				}
+
+				const __m128 xyzMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+
+				switch (format)
+				{
+				case VK_FORMAT_R32G32B32_SFLOAT:
+					for (uint32_t i = 0; i + 1 < count; ++i)
+					{
+						_mm_store_ps(out + 8 * i, _mm_and_ps(_mm_loadu_ps(reinterpret_cast<const float*>(src + static_cast<size_t>(stride) * i)), xyzMask));
+					}
+					DecodeOneScalar(out + 8 * (count - 1), src + static_cast<size_t>(stride) * (count - 1), format);
+					break;
+				case VK_FORMAT_R32G32B32A32_SFLOAT:
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						_mm_store_ps(out + 8 * i, _mm_and_ps(_mm_loadu_ps(reinterpret_cast<const float*>(src + static_cast<size_t>(stride) * i)), xyzMask));
+					}
+					break;
+				case VK_FORMAT_R8G8B8A8_SNORM:
+				{
+					// Move each byte to the top of its lane, the arithmetic shift sign extends it
+					const __m128 scale = _mm_set1_ps(kSnorm8Scale);
+					const __m128 minusOne = _mm_set1_ps(-1.0f);
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						int32_t packed;
+						std::memcpy(&packed, src + static_cast<size_t>(stride) * i, sizeof(packed));
+						__m128i v = _mm_cvtsi32_si128(packed);
+						v = _mm_unpacklo_epi8(v, v);
+						v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 24);
+						const __m128 f = _mm_max_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), scale), minusOne);
+						_mm_store_ps(out + 8 * i, _mm_and_ps(f, xyzMask));
+					}
+					break;
+				}
+				case VK_FORMAT_R16G16B16A16_SNORM:
+				{
+					const __m128 scale = _mm_set1_ps(kSnorm16Scale);
+					const __m128 minusOne = _mm_set1_ps(-1.0f);
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + static_cast<size_t>(stride) * i));
+						const __m128i wide = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+						const __m128 f = _mm_max_ps(_mm_mul_ps(_mm_cvtepi32_ps(wide), scale), minusOne);
+						_mm_store_ps(out + 8 * i, _mm_and_ps(f, xyzMask));
+					}
+					break;
+				}
+				default:
+					DecodeScalar(out, src, stride, count, format);
+					break;
+				}
+			}
+
+			// Same as DecodeSSE with F16C for halves and AVX sign extension
+			MESH_INGEST_TARGET_AVX2 void DecodeAVX2(float* out, const uint8_t* src, uint32_t stride, uint32_t count, VkFormat format)
+			{
+				const __m128 xyzMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+
+				switch (format)
+				{
+				case VK_FORMAT_R16G16B16A16_SFLOAT:
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + static_cast<size_t>(stride) * i));
+						_mm_store_ps(out + 8 * i, _mm_and_ps(_mm_cvtph_ps(v), xyzMask));
+					}
+					break;
+				case VK_FORMAT_R8G8B8A8_SNORM:
+				{
+					const __m128 scale = _mm_set1_ps(kSnorm8Scale);
+					const __m128 minusOne = _mm_set1_ps(-1.0f);
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						int32_t packed;
+						std::memcpy(&packed, src + static_cast<size_t>(stride) * i, sizeof(packed));
+						const __m128i v = _mm_cvtepi8_epi32(_mm_cvtsi32_si128(packed));
+						const __m128 f = _mm_max_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), scale), minusOne);
+						_mm_store_ps(out + 8 * i, _mm_and_ps(f, xyzMask));
+					}
+					break;
+				}
+				case VK_FORMAT_R16G16B16A16_SNORM:
+				{
+					const __m128 scale = _mm_set1_ps(kSnorm16Scale);
+					const __m128 minusOne = _mm_set1_ps(-1.0f);
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						const __m128i v = _mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + static_cast<size_t>(stride) * i)));
+						const __m128 f = _mm_max_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), scale), minusOne);
+						_mm_store_ps(out + 8 * i, _mm_and_ps(f, xyzMask));
+					}
+					break;
+				}
+				default:
+					DecodeSSE(out, src, stride, count, format);
+					break;
+				}
+			}
+
+			// Two vertices per iteration, one full 64 byte line of the destination
+			MESH_INGEST_TARGET_AVX2 void InterleaveAVX2(RayQueryVertex* dst, const float* positions, const float* normals, uint32_t vertexCount)
+			{
+				if (vertexCount == 0 || !IsAligned(dst, 32))
+				{
+					InterleaveSSE(dst, positions, normals, vertexCount);
+					return;
+				}
+
+				const __m256 xyzMask = _mm256_castsi256_ps(_mm256_set_epi32(0, -1, -1, -1, 0, -1, -1, -1));
+				float* out = reinterpret_cast<float*>(dst);
+
+				// Keep the last vertex out of the loop, its float3 loads would read past the arrays
+				const uint32_t pairCount = (vertexCount - 1) / 2;
+				for (uint32_t pair = 0; pair < pairCount; ++pair)
+				{
+					const uint32_t i = pair * 2;
+
+					const __m256 v0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(positions + 3 * i)), _mm_loadu_ps(normals + 3 * i), 1);
+					const __m256 v1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(positions + 3 * i + 3)), _mm_loadu_ps(normals + 3 * i + 3), 1);
+
+					_mm256_stream_ps(out + 8 * i + 0, _mm256_and_ps(v0, xyzMask));
+					_mm256_stream_ps(out + 8 * i + 8, _mm256_and_ps(v1, xyzMask));
+				}
+				_mm_sfence();
+
+				const uint32_t done = pairCount * 2;
+				InterleaveScalar(dst + done, positions + 3 * done, normals + 3 * done, vertexCount - done);
+			}
+
+			// A full 64 byte line per iteration
+			MESH_INGEST_TARGET_AVX2 void StreamCopyAVX2(uint8_t* dst, const uint8_t* src, size_t size)
+			{
+				size_t i = AlignmentHead(dst, 32, size);
+				std::memcpy(dst, src, i);
+
+				for (; i + 64 <= size; i += 64)
+				{
+					const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+					const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+					_mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i), a);
+					_mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + 32), b);
+				}
+				_mm_sfence();
+
+				std::memcpy(dst + i, src + i, size - i);
+			}
+
+			// 32 indices, a full 64 byte line of uint16, per iteration. Indices are below 65536, so the unsigned saturation never clamps
+			MESH_INGEST_TARGET_AVX2 void NarrowIndicesAVX2(uint16_t* dst, const int32_t* indices, uint32_t indexCount)
+			{
+				uint32_t i = 0;
+				for (; i < indexCount && !IsAligned(dst + i, 32); ++i)
+				{
+					dst[i] = static_cast<uint16_t>(indices[i]);
+				}
+
+				for (; i + 32 <= indexCount; i += 32)
+				{
+					for (uint32_t half = 0; half < 32; half += 16)
+					{
+						const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i + half));
+						const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i + half + 8));
+
+						// packus works per 128 bit lane, put the 64 bit blocks back in order
+						const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+						_mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + half), packed);
+					}
+				}
+				_mm_sfence();
+
+				NarrowIndicesScalar(dst + i, indices + i, indexCount - i);
+			}
+
+			// The AVX2 kernels also convert halves with F16C, which every AVX2 CPU has but is checked anyway
+			bool CpuSupportsAVX2()
+			{
+#if defined(_MSC_VER)
+				int info[4];
+				__cpuid(info, 0);
+				if (info[0] < 7)
+				{
+					return false;
+				}
+
+				// OSXSAVE, AVX and F16C, then check the OS saves the YMM registers
+				__cpuid(info, 1);
+				if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (info[2] & (1 << 29)) == 0 || (_xgetbv(0) & 0x6) != 0x6)
+				{
+					return false;
+				}
+
+				__cpuidex(info, 7, 0);
+				return (info[1] & (1 << 5)) != 0;
+#else
+				return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+#endif
+			}
+#endif
+
+#if defined(MESH_INGEST_NEON)
+			// NEON has no streaming store intrinsic, the two stores still fill the vertex back to back
+			void InterleaveNEON(RayQueryVertex* dst, const float* positions, const float* normals, uint32_t vertexCount)
+			{
+				if (vertexCount == 0 || !IsAligned(dst, 16))
+				{
+					InterleaveScalar(dst, positions, normals, vertexCount);
+					return;
+				}
+
+				float* out = reinterpret_cast<float*>(dst);
+
+				const uint32_t simdCount = vertexCount - 1;
+				for (uint32_t i = 0; i < simdCount; ++i)
+				{
+					const float32x4_t p = vsetq_lane_f32(0.0f, vld1q_f32(positions + 3 * i), 3);
+					const float32x4_t n = vsetq_lane_f32(0.0f, vld1q_f32(normals + 3 * i), 3);
+
+					vst1q_f32(out + 8 * i + 0, p);
+					vst1q_f32(out + 8 * i + 4, n);
+				}
+
+				InterleaveScalar(dst + simdCount, positions + 3 * simdCount, normals + 3 * simdCount, 1);
+			}
+
+			void StreamCopyNEON(uint8_t* dst, const uint8_t* src, size_t size)
+			{
+				size_t i = 0;
+				for (; i + 16 <= size; i += 16)
+				{
+					vst1q_u8(dst + i, vld1q_u8(src + i));
+				}
+
+				std::memcpy(dst + i, src + i, size - i);
+			}
+
+			void NarrowIndicesNEON(uint16_t* dst, const int32_t* indices, uint32_t indexCount)
+			{
+				uint32_t i = 0;
+				for (; i + 8 <= indexCount; i += 8)
+				{
+					const uint16x4_t low = vmovn_u32(vreinterpretq_u32_s32(vld1q_s32(indices + i)));
+					const uint16x4_t high = vmovn_u32(vreinterpretq_u32_s32(vld1q_s32(indices + i + 4)));
+					vst1q_u16(dst + i, vcombine_u16(low, high));
+				}
+
+				NarrowIndicesScalar(dst + i, indices + i, indexCount - i);
+			}
+
+			// The float3 load reads 4 bytes past the attribute, so the last one is decoded by the scalar path
+			void DecodeNEON(float* out, const uint8_t* src, uint32_t stride, uint32_t count, VkFormat format)
+			{
+				if (count == 0)
+				{
+					return;
+				}
+
+				switch (format)
+				{
+				case VK_FORMAT_R32G32B32_SFLOAT:
+					for (uint32_t i = 0; i + 1 < count; ++i)
+					{
+						const float32x4_t v = vld1q_f32(reinterpret_cast<const float*>(src + static_cast<size_t>(stride) * i));
+						vst1q_f32(out + 8 * i, vsetq_lane_f32(0.0f, v, 3));
+					}
+					DecodeOneScalar(out + 8 * (count - 1), src + static_cast<size_t>(stride) * (count - 1), format);
+					break;
+				case VK_FORMAT_R32G32B32A32_SFLOAT:
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						const float32x4_t v = vld1q_f32(reinterpret_cast<const float*>(src + static_cast<size_t>(stride) * i));
+						vst1q_f32(out + 8 * i, vsetq_lane_f32(0.0f, v, 3));
+					}
+					break;
+#if defined(__aarch64__) || defined(_M_ARM64)
+				case VK_FORMAT_R16G16B16A16_SFLOAT:
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						const uint16x4_t v = vld1_u16(reinterpret_cast<const uint16_t*>(src + static_cast<size_t>(stride) * i));
+						vst1q_f32(out + 8 * i, vsetq_lane_f32(0.0f, vcvt_f32_f16(vreinterpret_f16_u16(v)), 3));
+					}
+					break;
+#endif
+				case VK_FORMAT_R8G8B8A8_SNORM:
+				{
+					const float32x4_t minusOne = vdupq_n_f32(-1.0f);
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						uint32_t packed;
+						std::memcpy(&packed, src + static_cast<size_t>(stride) * i, sizeof(packed));
+						const int16x8_t wide = vmovl_s8(vreinterpret_s8_u32(vdup_n_u32(packed)));
+						const float32x4_t f = vmaxq_f32(vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(wide))), kSnorm8Scale), minusOne);
+						vst1q_f32(out + 8 * i, vsetq_lane_f32(0.0f, f, 3));
+					}
+					break;
+				}
+				case VK_FORMAT_R16G16B16A16_SNORM:
+				{
+					const float32x4_t minusOne = vdupq_n_f32(-1.0f);
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						const int16x4_t v = vld1_s16(reinterpret_cast<const int16_t*>(src + static_cast<size_t>(stride) * i));
+						const float32x4_t f = vmaxq_f32(vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(v)), kSnorm16Scale), minusOne);
+						vst1q_f32(out + 8 * i, vsetq_lane_f32(0.0f, f, 3));
+					}
+					break;
+				}
+				default:
+					DecodeScalar(out, src, stride, count, format);
+					break;
+				}
+			}
+#endif
+
+			// Every kernel set this build has and the CPU runs, from the scalar one to the widest
+			std::vector<Kernels> FindKernelSets()
+			{
+				std::vector<Kernels> kernelSets;
+				kernelSets.push_back(Kernels{ InterleaveScalar, StreamCopyScalar, NarrowIndicesScalar, DecodeScalar, "Scalar" });
+#if defined(MESH_INGEST_X86)
+				// SSE2 has no unsigned 32 to 16 bit pack, the scalar narrow loop is left to the compiler
+				kernelSets.push_back(Kernels{ InterleaveSSE, StreamCopySSE, NarrowIndicesScalar, DecodeSSE, "SSE2" });
+				if (CpuSupportsAVX2())
+				{
+					kernelSets.push_back(Kernels{ InterleaveAVX2, StreamCopyAVX2, NarrowIndicesAVX2, DecodeAVX2, "AVX2" });
+				}
+#elif defined(MESH_INGEST_NEON)
+				kernelSets.push_back(Kernels{ InterleaveNEON, StreamCopyNEON, NarrowIndicesNEON, DecodeNEON, "NEON" });
+#endif
+				return kernelSets;
+			}
+
+			const std::vector<Kernels>& GetKernelSets()
+			{
+				static const std::vector<Kernels> kernelSets = FindKernelSets();
+				return kernelSets;
+			}
+
+			// Set by SetKernelSetOverride
+			const Kernels* kernelOverride = nullptr;
+
+			const Kernels& GetKernels()
+			{
+				if (kernelOverride != nullptr)
+				{
+					return *kernelOverride;
+				}
+
+				static const Kernels kernels = GetKernelSets().back();
+				return kernels;
+			}
+
+			void ExtendBounds(const RayQueryVertex* vertices, uint32_t vertexCount, vec3& boundsMin, vec3& boundsMax)
+			{
+				for (uint32_t i = 0; i < vertexCount; ++i)
+				{
+					boundsMin = glm::min(boundsMin, vertices[i].position);
+					boundsMax = glm::max(boundsMax, vertices[i].position);
+				}
+			}
+
+			// Work smaller than this isn't worth waking the workers for
+			const uint32_t kMinTrianglesPerJob = 4096;
+			const uint32_t kMinVerticesPerJob = 8192;
+
+			// Split count items into jobs of at least minPerJob and run job(begin, end) for each of them
+			void ParallelRanges(ThreadPool* pool, uint32_t count, uint32_t minPerJob, const std::function<void(uint32_t, uint32_t)>& job)
+			{
+				const uint32_t maxJobs = pool != nullptr ? pool->GetWorkerCount() + 1 : 1;
+				const uint32_t jobCount = std::max(1u, std::min(maxJobs, count / minPerJob));
+				const uint32_t perJob = (count + jobCount - 1) / jobCount;
+
+				if (jobCount == 1)
+				{
+					job(0, count);
+					return;
+				}
+
+				pool->ParallelFor(jobCount, [&](uint32_t index)
+				{
+					const uint32_t begin = std::min(count, index * perJob);
+					job(begin, std::min(count, begin + perJob));
+				});
+			}
+
+			// Corners of each vertex in index order, so sums over them always add in the same order
+			template <typename Index>
+			void BuildVertexCorners(const Index* indices, uint32_t cornerCount, uint32_t vertexCount, std::vector<uint32_t>& vertexCornerOffsets, std::vector<uint32_t>& vertexCorners)
+			{
+				vertexCornerOffsets.assign(static_cast<size_t>(vertexCount) + 1, 0);
+				for (uint32_t i = 0; i < cornerCount; ++i)
+				{
+					const uint32_t v = static_cast<uint32_t>(indices[i]);
+					if (v < vertexCount)
+					{
+						++vertexCornerOffsets[v + 1];
+					}
+				}
+				for (uint32_t v = 0; v < vertexCount; ++v)
+				{
+					vertexCornerOffsets[v + 1] += vertexCornerOffsets[v];
+				}
+
+				vertexCorners.resize(vertexCornerOffsets[vertexCount]);
+				std::vector<uint32_t> fill(vertexCornerOffsets.begin(), vertexCornerOffsets.end() - 1);
+				for (uint32_t i = 0; i < cornerCount; ++i)
+				{
+					const uint32_t v = static_cast<uint32_t>(indices[i]);
+					if (v < vertexCount)
+					{
+						vertexCorners[fill[v]++] = i;
+					}
+				}
+			}
+
+			// Angle between the two edges leaving corner c of triangle p
+			float CornerAngle(const vec3* p, int c)
+			{
+				const vec3 e1 = p[(c + 1) % 3] - p[c];
+				const vec3 e2 = p[(c + 2) % 3] - p[c];
+				return std::atan2(glm::length(glm::cross(e1, e2)), glm::dot(e1, e2));
+			}
+
+			// Unit vector in the part of v orthogonal to n, zero when v is parallel to it
+			vec3 ProjectToTangentPlane(const vec3& v, const vec3& n)
+			{
+				const vec3 projected = v - n * glm::dot(n, v);
+				const float length = glm::length(projected);
+				return length > 0.0f ? projected / length : vec3(0.0f);
+			}
+
+			template <typename Index>
+			void GenerateTangentsImpl(RayQueryVertexAttributes* attributes, const RayQueryVertex* vertices, uint32_t vertexCount, const Index* indices, uint32_t indexCount, ThreadPool* pool)
+			{
+				const uint32_t triangleCount = indexCount / 3;
+
+				// Like MikkTSpace, the face tangent and bitangent are projected onto the tangent plane of each corner's
+				// vertex and weighted by the corner angle. Each triangle only writes its own three corners
+				std::vector<vec3> cornerTangents(static_cast<size_t>(triangleCount) * 3);
+				std::vector<vec3> cornerBitangents(static_cast<size_t>(triangleCount) * 3);
+				ParallelRanges(pool, triangleCount, kMinTrianglesPerJob, [&](uint32_t begin, uint32_t end)
+				{
+					for (uint32_t t = begin; t < end; ++t)
+					{
+						const uint32_t i[3] = { static_cast<uint32_t>(indices[3 * t + 0]), static_cast<uint32_t>(indices[3 * t + 1]), static_cast<uint32_t>(indices[3 * t + 2]) };
+
+						vec3* tangents = &cornerTangents[3 * static_cast<size_t>(t)];
+						vec3* bitangents = &cornerBitangents[3 * static_cast<size_t>(t)];
+						tangents[0] = tangents[1] = tangents[2] = vec3(0.0f);
+						bitangents[0] = bitangents[1] = bitangents[2] = vec3(0.0f);
+
+						if (i[0] >= vertexCount || i[1] >= vertexCount || i[2] >= vertexCount)
+						{
+							continue;
+						}
+
+						const vec3 p[3] = { vertices[i[0]].position, vertices[i[1]].position, vertices[i[2]].position };
+						const vec3 e1 = p[1] - p[0];
+						const vec3 e2 = p[2] - p[0];
+						const vec2 d1 = attributes[i[1]].uv - attributes[i[0]].uv;
+						const vec2 d2 = attributes[i[2]].uv - attributes[i[0]].uv;
+
+						// Triangles without uv area have no tangent and leave the vertex to its other triangles
+						const float uvArea = d1.x * d2.y - d2.x * d1.y;
+						if (!(std::abs(uvArea) > 0.0f) || !(glm::length(glm::cross(e1, e2)) > 0.0f))
+						{
+							continue;
+						}
+
+						// Only the direction matters, the sign of the uv area keeps it pointing along +u and +v
+						const float orientation = uvArea > 0.0f ? 1.0f : -1.0f;
+						const vec3 faceTangent = (e1 * d2.y - e2 * d1.y) * orientation;
+						const vec3 faceBitangent = (e2 * d1.x - e1 * d2.x) * orientation;
+
+						for (int c = 0; c < 3; ++c)
+						{
+							const vec3& normal = vertices[i[c]].normal;
+							const float angle = CornerAngle(p, c);
+							tangents[c] = ProjectToTangentPlane(faceTangent, normal) * angle;
+							bitangents[c] = ProjectToTangentPlane(faceBitangent, normal) * angle;
+						}
+					}
+				});
+
+				std::vector<uint32_t> vertexCornerOffsets;
+				std::vector<uint32_t> vertexCorners;
+				BuildVertexCorners(indices, triangleCount * 3, vertexCount, vertexCornerOffsets, vertexCorners);
+
+				ParallelRanges(pool, vertexCount, kMinVerticesPerJob, [&](uint32_t begin, uint32_t end)
+				{
+					for (uint32_t v = begin; v < end; ++v)
+					{
+						vec3 tangent(0.0f);
+						vec3 bitangent(0.0f);
+						for (uint32_t c = vertexCornerOffsets[v]; c < vertexCornerOffsets[v + 1]; ++c)
+						{
+							tangent += cornerTangents[vertexCorners[c]];
+							bitangent += cornerBitangents[vertexCorners[c]];
+						}
+
+						// Any direction in the tangent plane when the uvs don't give one
+						const vec3& normal = vertices[v].normal;
+						tangent = ProjectToTangentPlane(tangent, normal);
+						if (tangent == vec3(0.0f))
+						{
+							tangent = ProjectToTangentPlane(std::abs(normal.x) < 0.9f ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f), normal);
+						}
+
+						// Unity rebuilds the bitangent as cross(normal, tangent) * w
+						const float handedness = glm::dot(glm::cross(normal, tangent), bitangent) < 0.0f ? -1.0f : 1.0f;
+						attributes[v].tangent = vec4(tangent, handedness);
+					}
+				});
+			}
+
+			template <typename Index>
+			void GenerateNormalsImpl(RayQueryVertex* vertices, uint32_t vertexCount, const Index* indices, uint32_t indexCount, ThreadPool* pool)
+			{
+				const uint32_t triangleCount = indexCount / 3;
+
+				// Angle weighted unit face normal of every corner, each triangle only writes its own three
+				std::vector<vec3> cornerNormals(static_cast<size_t>(triangleCount) * 3);
+				ParallelRanges(pool, triangleCount, kMinTrianglesPerJob, [&](uint32_t begin, uint32_t end)
+				{
+					for (uint32_t t = begin; t < end; ++t)
+					{
+						const uint32_t i0 = static_cast<uint32_t>(indices[3 * t + 0]);
+						const uint32_t i1 = static_cast<uint32_t>(indices[3 * t + 1]);
+						const uint32_t i2 = static_cast<uint32_t>(indices[3 * t + 2]);
+
+						vec3* corners = &cornerNormals[3 * static_cast<size_t>(t)];
+						corners[0] = corners[1] = corners[2] = vec3(0.0f);
+
+						if (i0 >= vertexCount || i1 >= vertexCount || i2 >= vertexCount)
+						{
+							continue;
+						}
+
+						const vec3 p[3] = { vertices[i0].position, vertices[i1].position, vertices[i2].position };
+						const vec3 faceNormal = glm::cross(p[1] - p[0], p[2] - p[0]);
+						const float faceLength = glm::length(faceNormal);
+						if (!(faceLength > 0.0f))
+						{
+							continue;
+						}
+
+						const vec3 unitNormal = faceNormal / faceLength;
+						for (int c = 0; c < 3; ++c)
+						{
+							corners[c] = unitNormal * CornerAngle(p, c);
+						}
+					}
+				});
+
+				std::vector<uint32_t> vertexCornerOffsets;
+				std::vector<uint32_t> vertexCorners;
+				BuildVertexCorners(indices, triangleCount * 3, vertexCount, vertexCornerOffsets, vertexCorners);
+
+				ParallelRanges(pool, vertexCount, kMinVerticesPerJob, [&](uint32_t begin, uint32_t end)
+				{
+					for (uint32_t v = begin; v < end; ++v)
+					{
+						vec3 normal(0.0f);
+						for (uint32_t c = vertexCornerOffsets[v]; c < vertexCornerOffsets[v + 1]; ++c)
+						{
+							normal += cornerNormals[vertexCorners[c]];
+						}
+
+						const float length = glm::length(normal);
+						vertices[v].normal = length > 0.0f ? normal / length : vec3(0.0f);
+					}
+				});
+			}
+		}
+
+		void InterleaveVertices(RayQueryVertex* dst, const float* positions, const float* normals, uint32_t vertexCount)
+		{
+			GetKernels().interleave(dst, positions, normals, vertexCount);
+		}
+
+		bool IsLayoutSupported(const VertexLayout& layout)
+		{
+			const VertexAttributeLayout* attributes[4] = { &layout.position, &layout.normal, &layout.tangent, &layout.uv };
+			for (uint32_t a = 0; a < 4; ++a)
+			{
+				const VertexAttributeLayout& attribute = *attributes[a];
+				if (attribute.stream < 0 && a != 0)
+				{
+					continue;
+				}
+
+				const uint32_t size = FormatSize(attribute.format);
+				if (size == 0 || !IsAttributeFormatSupported(a, attribute.format))
+				{
+					return false;
+				}
+
+				if (attribute.stream < 0 || attribute.stream >= static_cast<int32_t>(kMaxVertexStreams)
+					|| attribute.offset + size > layout.streamStrides[attribute.stream])
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		VertexLayout PackedFloat3Layout(bool tangents, bool uvs)
+		{
+			VertexLayout layout = {};
+			layout.streamStrides[0] = 3 * sizeof(float);
+			layout.streamStrides[1] = 3 * sizeof(float);
+			layout.streamStrides[2] = tangents ? 4 * sizeof(float) : 0;
+			layout.streamStrides[3] = uvs ? 2 * sizeof(float) : 0;
+			layout.position = { 0, 0, VK_FORMAT_R32G32B32_SFLOAT };
+			layout.normal = { 1, 0, VK_FORMAT_R32G32B32_SFLOAT };
+			layout.tangent = { tangents ? 2 : -1, 0, VK_FORMAT_R32G32B32A32_SFLOAT };
+			layout.uv = { uvs ? 3 : -1, 0, VK_FORMAT_R32G32_SFLOAT };
+			return layout;
+		}
+
+		bool HasAttributes(const VertexLayout& layout)
+		{
+			return layout.tangent.stream >= 0 || layout.uv.stream >= 0;
+		}
+
+		void GatherVertices(RayQueryVertex* dst, const VertexLayout& layout, const void* const* streams, uint32_t vertexCount, vec3* boundsMin, vec3* boundsMax)
+		{
+			const Kernels& kernels = GetKernels();
+
+			vec3 blockMin(std::numeric_limits<float>::max());
+			vec3 blockMax(-std::numeric_limits<float>::max());
+
+			// Separate packed float3 arrays have their own kernel that writes straight to the destination
+			if (layout.normal.stream >= 0 && layout.position.stream != layout.normal.stream
+				&& layout.position.format == VK_FORMAT_R32G32B32_SFLOAT && layout.normal.format == VK_FORMAT_R32G32B32_SFLOAT
+				&& layout.position.offset == 0 && layout.normal.offset == 0
+				&& layout.streamStrides[layout.position.stream] == 3 * sizeof(float) && layout.streamStrides[layout.normal.stream] == 3 * sizeof(float))
+			{
+				const float* positions = static_cast<const float*>(streams[layout.position.stream]);
+				kernels.interleave(dst, positions, static_cast<const float*>(streams[layout.normal.stream]), vertexCount);
+
+				if (boundsMin != nullptr && boundsMax != nullptr)
+				{
+					for (uint32_t i = 0; i < vertexCount; ++i)
+					{
+						const vec3 position(positions[3 * i + 0], positions[3 * i + 1], positions[3 * i + 2]);
+						blockMin = glm::min(blockMin, position);
+						blockMax = glm::max(blockMax, position);
+					}
+					*boundsMin = vertexCount > 0 ? blockMin : vec3(0.0f);
+					*boundsMax = vertexCount > 0 ? blockMax : vec3(0.0f);
+				}
+				return;
+			}
+
+			const uint32_t positionStride = layout.streamStrides[layout.position.stream];
+			const uint8_t* positions = static_cast<const uint8_t*>(streams[layout.position.stream]) + layout.position.offset;
+
+			const bool hasNormals = layout.normal.stream >= 0;
+			const uint32_t normalStride = hasNormals ? layout.streamStrides[layout.normal.stream] : 0;
+			const uint8_t* normals = hasNormals ? static_cast<const uint8_t*>(streams[layout.normal.stream]) + layout.normal.offset : nullptr;
+
+			alignas(64) RayQueryVertex block[kGatherBlockSize];
+			if (!hasNormals)
+			{
+				for (uint32_t i = 0; i < kGatherBlockSize; ++i)
+				{
+					block[i].normal = vec3(0.0f);
+				}
+			}
+
+			for (uint32_t first = 0; first < vertexCount; first += kGatherBlockSize)
+			{
+				const uint32_t count = std::min(kGatherBlockSize, vertexCount - first);
+
+				kernels.decode(reinterpret_cast<float*>(&block[0].position), positions + static_cast<size_t>(positionStride) * first, positionStride, count, layout.position.format);
+				if (hasNormals)
+				{
+					kernels.decode(reinterpret_cast<float*>(&block[0].normal), normals + static_cast<size_t>(normalStride) * first, normalStride, count, layout.normal.format);
+				}
+
+				if (boundsMin != nullptr && boundsMax != nullptr)
+				{
+					ExtendBounds(block, count, blockMin, blockMax);
+				}
+
+				kernels.streamCopy(reinterpret_cast<uint8_t*>(dst + first), reinterpret_cast<const uint8_t*>(block), sizeof(RayQueryVertex) * count);
+			}
+
+			if (boundsMin != nullptr && boundsMax != nullptr)
+			{
+				*boundsMin = vertexCount > 0 ? blockMin : vec3(0.0f);
+				*boundsMax = vertexCount > 0 ? blockMax : vec3(0.0f);
+			}
+		}
+
+		void GatherAttributes(RayQueryVertexAttributes* dst, const VertexLayout& layout, const void* const* streams, uint32_t vertexCount)
+		{
+			const bool hasTangents = layout.tangent.stream >= 0;
+			const uint32_t tangentStride = hasTangents ? layout.streamStrides[layout.tangent.stream] : 0;
+			const uint8_t* tangents = hasTangents ? static_cast<const uint8_t*>(streams[layout.tangent.stream]) + layout.tangent.offset : nullptr;
+
+			const bool hasUVs = layout.uv.stream >= 0;
+			const uint32_t uvStride = hasUVs ? layout.streamStrides[layout.uv.stream] : 0;
+			const uint8_t* uvs = hasUVs ? static_cast<const uint8_t*>(streams[layout.uv.stream]) + layout.uv.offset : nullptr;
+
+			alignas(64) RayQueryVertexAttributes block[kGatherBlockSize];
+			std::memset(block, 0, sizeof(block));
+
+			const Kernels& kernels = GetKernels();
+			for (uint32_t first = 0; first < vertexCount; first += kGatherBlockSize)
+			{
+				const uint32_t count = std::min(kGatherBlockSize, vertexCount - first);
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					if (hasTangents)
+					{
+						DecodeAttributeScalar(&block[i].tangent.x, tangents + static_cast<size_t>(tangentStride) * (first + i), layout.tangent.format);
+					}
+					if (hasUVs)
+					{
+						DecodeAttributeScalar(&block[i].uv.x, uvs + static_cast<size_t>(uvStride) * (first + i), layout.uv.format);
+					}
+				}
+
+				kernels.streamCopy(reinterpret_cast<uint8_t*>(dst + first), reinterpret_cast<const uint8_t*>(block), sizeof(RayQueryVertexAttributes) * count);
+			}
+		}
+
+		void CopyVertices(RayQueryVertex* dst, const RayQueryVertex* vertices, uint32_t vertexCount)
+		{
+			GetKernels().streamCopy(reinterpret_cast<uint8_t*>(dst), reinterpret_cast<const uint8_t*>(vertices), sizeof(RayQueryVertex) * vertexCount);
+		}
+
+		void CopyAttributes(RayQueryVertexAttributes* dst, const RayQueryVertexAttributes* attributes, uint32_t vertexCount)
+		{
+			GetKernels().streamCopy(reinterpret_cast<uint8_t*>(dst), reinterpret_cast<const uint8_t*>(attributes), sizeof(RayQueryVertexAttributes) * vertexCount);
+		}
+
+		void GenerateNormals(RayQueryVertex* vertices, uint32_t vertexCount, const int32_t* indices, uint32_t indexCount, ThreadPool* pool)
+		{
+			GenerateNormalsImpl(vertices, vertexCount, indices, indexCount, pool);
+		}
+
+		void GenerateNormals(RayQueryVertex* vertices, uint32_t vertexCount, const uint16_t* indices, uint32_t indexCount, ThreadPool* pool)
+		{
+			GenerateNormalsImpl(vertices, vertexCount, indices, indexCount, pool);
+		}
+
+		void GenerateTangents(RayQueryVertexAttributes* attributes, const RayQueryVertex* vertices, uint32_t vertexCount, const int32_t* indices, uint32_t indexCount, ThreadPool* pool)
+		{
+			GenerateTangentsImpl(attributes, vertices, vertexCount, indices, indexCount, pool);
+		}
+
+		void GenerateTangents(RayQueryVertexAttributes* attributes, const RayQueryVertex* vertices, uint32_t vertexCount, const uint16_t* indices, uint32_t indexCount, ThreadPool* pool)
+		{
+			GenerateTangentsImpl(attributes, vertices, vertexCount, indices, indexCount, pool);
+		}
+
+		uint64_t HashShadingSource(const RayQueryVertex* vertices, const RayQueryVertexAttributes* attributes, bool hashNormals, uint32_t vertexCount, const void* indices, size_t indexSize, uint32_t indexCount)
+		{
+			// FNV-1a over 32 bit words, the padding of RayQueryVertex is never read
+			uint64_t hash = 0xcbf29ce484222325ull;
+			auto add = [&hash](const void* data, size_t size)
+			{
+				const uint8_t* bytes = static_cast<const uint8_t*>(data);
+				for (size_t i = 0; i + 4 <= size; i += 4)
+				{
+					uint32_t word;
+					std::memcpy(&word, bytes + i, sizeof(word));
+					hash = (hash ^ word) * 0x100000001b3ull;
+				}
+			};
+
+			const uint32_t counts[3] = { vertexCount, indexCount, (hashNormals ? 1u : 0u) | (attributes != nullptr ? 2u : 0u) };
+			add(counts, sizeof(counts));
+			for (uint32_t v = 0; v < vertexCount; ++v)
+			{
+				add(&vertices[v].position, sizeof(vec3));
+				if (hashNormals)
+				{
+					add(&vertices[v].normal, sizeof(vec3));
+				}
+				if (attributes != nullptr)
+				{
+					add(&attributes[v].uv, sizeof(vec2));
+				}
+			}
+
+			// 16 bit indices are hashed in pairs, an odd last one is padded
+			add(indices, indexSize * indexCount);
+			if ((indexSize * indexCount) % 4 != 0)
+			{
+				uint32_t last = 0;
+				std::memcpy(&last, static_cast<const uint8_t*>(indices) + indexSize * indexCount - 2, 2);
+				add(&last, sizeof(last));
+			}
+			return hash;
+		}
+
+		void CopyIndices(uint32_t* dst, const int32_t* indices, uint32_t indexCount)
+		{
+			GetKernels().streamCopy(reinterpret_cast<uint8_t*>(dst), reinterpret_cast<const uint8_t*>(indices), sizeof(uint32_t) * indexCount);
+		}
+
+		void CopyIndices16(uint16_t* dst, const uint16_t* indices, uint32_t indexCount)
+		{
+			GetKernels().streamCopy(reinterpret_cast<uint8_t*>(dst), reinterpret_cast<const uint8_t*>(indices), sizeof(uint16_t) * indexCount);
+		}
+
+		void NarrowIndices(uint16_t* dst, const int32_t* indices, uint32_t indexCount)
+		{
+			GetKernels().narrowIndices(dst, indices, indexCount);
+		}
+
+		const char* GetKernelName()
+		{
+			return GetKernels().name;
+		}
+
+		uint32_t GetKernelSetCount()
+		{
+			return static_cast<uint32_t>(GetKernelSets().size());
+		}
+
+		const char* GetKernelSetName(uint32_t index)
+		{
+			return index < GetKernelSets().size() ? GetKernelSets()[index].name : nullptr;
+		}
+
+		void SetKernelSetOverride(uint32_t index)
+		{
+			kernelOverride = index < GetKernelSets().size() ? &GetKernelSets()[index] : nullptr;
+		}
+
+#ifndef NDEBUG
+		bool VerifyKernels()
+		{
+			// Odd counts and a misaligned index destination go through every prologue and tail
+			const uint32_t vertexCount = 67;
+			const uint32_t indexCount = 3 * 41;
+
+			std::vector<float> positions(vertexCount * 3);
+			std::vector<float> normals(vertexCount * 3);
+			for (uint32_t i = 0; i < vertexCount * 3; ++i)
+			{
+				positions[i] = static_cast<float>(i) * 0.25f - 10.0f;
+				normals[i] = static_cast<float>(i % 7) - 3.0f;
+			}
+
+			std::vector<int32_t> indices(indexCount);
+			for (uint32_t i = 0; i < indexCount; ++i)
+			{
+				indices[i] = static_cast<int32_t>((i * 31) % vertexCount);
+			}
+
+			std::vector<RayQueryVertex> expectedVertices(vertexCount);
+			std::vector<RayQueryVertex> vertices(vertexCount);
+			InterleaveScalar(expectedVertices.data(), positions.data(), normals.data(), vertexCount);
+			InterleaveVertices(vertices.data(), positions.data(), normals.data(), vertexCount);
+
+			std::vector<uint32_t> copiedIndices(indexCount + 1);
+			CopyIndices(copiedIndices.data() + 1, indices.data(), indexCount);
+
+			std::vector<uint16_t> expectedIndices16(indexCount + 1);
+			std::vector<uint16_t> narrowedIndices(indexCount + 1);
+			std::vector<uint16_t> copiedIndices16(indexCount + 1);
+			NarrowIndicesScalar(expectedIndices16.data() + 1, indices.data(), indexCount);
+			NarrowIndices(narrowedIndices.data() + 1, indices.data(), indexCount);
+			CopyIndices16(copiedIndices16.data() + 1, expectedIndices16.data() + 1, indexCount);
+
+			for (uint32_t i = 0; i < vertexCount; ++i)
+			{
+				if (vertices[i].position != expectedVertices[i].position || vertices[i].normal != expectedVertices[i].normal)
+				{
+					return false;
+				}
+			}
+
+			// Interleaved stream 0: float3 position, half4 normal. Stream 1: snorm8x4 and snorm16x4 normals. Stream 2: float4 position
+			const uint32_t gatherCount = kGatherBlockSize + 3;
+			VertexLayout layout = {};
+			layout.streamStrides[0] = 20;
+			layout.streamStrides[1] = 12;
+			layout.streamStrides[2] = 16;
+			layout.tangent = { -1, 0, VK_FORMAT_UNDEFINED };
+			layout.uv = { -1, 0, VK_FORMAT_UNDEFINED };
+
+			std::vector<uint8_t> streamData[3];
+			for (uint32_t stream = 0; stream < 3; ++stream)
+			{
+				streamData[stream].resize(static_cast<size_t>(layout.streamStrides[stream]) * gatherCount);
+				for (size_t i = 0; i < streamData[stream].size(); ++i)
+				{
+					streamData[stream][i] = static_cast<uint8_t>((i * 2654435761u) >> 13);
+				}
+			}
+			for (uint32_t i = 0; i < gatherCount; ++i)
+			{
+				// Finite floats and halves, the generated bytes could be NaN
+				float position[4] = { positions[(3 * i) % positions.size()], -0.5f * i, 3.0f, 1.0f };
+				std::memcpy(&streamData[0][20 * i], position, 3 * sizeof(float));
+				std::memcpy(&streamData[2][16 * i], position, sizeof(position));
+				for (int c = 0; c < 4; ++c)
+				{
+					streamData[0][20 * i + 12 + 2 * c + 1] &= 0xbb;
+				}
+			}
+			const void* streams[kMaxVertexStreams] = { streamData[0].data(), streamData[1].data(), streamData[2].data(), nullptr };
+
+			const VertexAttributeLayout positionLayouts[3] = {
+				{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT }, { 2, 0, VK_FORMAT_R32G32B32A32_SFLOAT }, { 0, 12, VK_FORMAT_R16G16B16A16_SFLOAT } };
+			const VertexAttributeLayout normalLayouts[4] = {
+				{ 0, 12, VK_FORMAT_R16G16B16A16_SFLOAT }, { 1, 0, VK_FORMAT_R8G8B8A8_SNORM }, { 1, 4, VK_FORMAT_R16G16B16A16_SNORM }, { -1, 0, VK_FORMAT_UNDEFINED } };
+
+			std::vector<RayQueryVertex> gathered(gatherCount);
+			std::vector<RayQueryVertex> expectedGathered(gatherCount);
+			for (const auto& positionLayout : positionLayouts)
+			{
+				for (const auto& normalLayout : normalLayouts)
+				{
+					layout.position = positionLayout;
+					layout.normal = normalLayout;
+					if (!IsLayoutSupported(layout))
+					{
+						return false;
+					}
+
+					for (uint32_t i = 0; i < gatherCount; ++i)
+					{
+						DecodeOneScalar(reinterpret_cast<float*>(&expectedGathered[i].position),
+							static_cast<const uint8_t*>(streams[positionLayout.stream]) + layout.streamStrides[positionLayout.stream] * i + positionLayout.offset, positionLayout.format);
+						expectedGathered[i].normal = vec3(0.0f);
+						if (normalLayout.stream >= 0)
+						{
+							DecodeOneScalar(reinterpret_cast<float*>(&expectedGathered[i].normal),
+								static_cast<const uint8_t*>(streams[normalLayout.stream]) + layout.streamStrides[normalLayout.stream] * i + normalLayout.offset, normalLayout.format);
+						}
+					}
+
+					GatherVertices(gathered.data(), layout, streams, gatherCount);
+					for (uint32_t i = 0; i < gatherCount; ++i)
+					{
+						if (gathered[i].position != expectedGathered[i].position || gathered[i].normal != expectedGathered[i].normal)
+						{
+							return false;
+						}
+					}
+				}
+			}
+
+			return std::memcmp(indices.data(), copiedIndices.data() + 1, indexCount * sizeof(uint32_t)) == 0
+				&& std::memcmp(expectedIndices16.data() + 1, narrowedIndices.data() + 1, indexCount * sizeof(uint16_t)) == 0
+				&& std::memcmp(expectedIndices16.data() + 1, copiedIndices16.data() + 1, indexCount * sizeof(uint16_t)) == 0;
+		}
+#endif
+	}
+}
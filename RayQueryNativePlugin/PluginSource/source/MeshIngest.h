@@ -0,0 +1,202 @@
+#pragma once
+
+#include <cstdint>
+#include "PlatformBase.h"
+#include "RayQueryShsaderConst.h"
+
+#ifndef UNITY_VULKAN_HEADER
+#define UNITY_VULKAN_HEADER <vulkan/vulkan.h>
+#endif
+
+#define VK_NO_PROTOTYPES
+#include UNITY_VULKAN_HEADER
+
+namespace VulkanRT
+{
+	class ThreadPool;
+
+	/// <summary>
+	/// Kernels that copy Unity mesh arrays into mapped vertex and index buffers.
+	/// The destination is usually write-combined host memory, so the SIMD paths write whole vertices with streaming stores
+	/// and never read it back. The widest kernel the CPU supports is picked once, the scalar one is used otherwise.
+	/// </summary>
+	namespace MeshIngest
+	{
+		// Unity meshes have at most 4 vertex streams
+		static const uint32_t kMaxVertexStreams = 4;
+
+		/// <summary>
+		/// Where one attribute lives, stream -1 when the mesh doesn't have it
+		/// </summary>
+		struct VertexAttributeLayout
+		{
+			int32_t  stream;
+			uint32_t offset;
+			VkFormat format;
+		};
+
+		/// <summary>
+		/// Vertex layout of a Unity Mesh.MeshData, laid out like RayQueryVertexLayout in RayTracingHelper.cs.
+		/// Positions take R32G32B32_SFLOAT, R32G32B32A32_SFLOAT or R16G16B16A16_SFLOAT,
+		/// normals also R8G8B8A8_SNORM and R16G16B16A16_SNORM, only xyz is read.
+		/// Tangents take the four component formats and keep w, uvs R32G32_SFLOAT or R16G16_SFLOAT
+		/// </summary>
+		struct VertexLayout
+		{
+			uint32_t              streamStrides[kMaxVertexStreams];
+			VertexAttributeLayout position;
+			VertexAttributeLayout normal;
+			VertexAttributeLayout tangent;
+			VertexAttributeLayout uv;
+		};
+
+		/// <summary>
+		/// Check every attribute has a supported format and fits its stream's stride
+		/// </summary>
+		bool IsLayoutSupported(const VertexLayout& layout);
+
+		/// <summary>
+		/// Layout of the separate arrays AddSharedMesh takes, float3 positions and normals as streams 0 and 1,
+		/// float4 tangents and float2 uvs as streams 2 and 3 when the mesh has them
+		/// </summary>
+		VertexLayout PackedFloat3Layout(bool tangents = false, bool uvs = false);
+
+		/// <summary>
+		/// True when the layout has a tangent or a uv, the mesh then gets a RayQueryVertexAttributes buffer
+		/// </summary>
+		bool HasAttributes(const VertexLayout& layout);
+
+		/// <summary>
+		/// Convert and interleave vertices from any supported layout into RayQueryVertex in one pass over the destination.
+		/// A missing normal is written as zero
+		/// </summary>
+		/// <param name="dst">Mapped vertex buffer</param>
+		/// <param name="layout">Checked with IsLayoutSupported</param>
+		/// <param name="streams">kMaxVertexStreams pointers, only the ones the layout uses are read</param>
+		/// <param name="vertexCount"></param>
+		/// <param name="boundsMin">Optional, receives the smallest position, read from the source and never from dst. Zero for an empty mesh</param>
+		/// <param name="boundsMax">Optional, receives the largest position. Zero for an empty mesh</param>
+		void GatherVertices(RayQueryVertex* dst, const VertexLayout& layout, const void* const* streams, uint32_t vertexCount, vec3* boundsMin = nullptr, vec3* boundsMax = nullptr);
+
+		/// <summary>
+		/// Convert the tangents and uvs of any supported layout into RayQueryVertexAttributes, a missing one is written as zero
+		/// </summary>
+		/// <param name="dst">Cached memory or a mapped buffer, written in whole elements</param>
+		/// <param name="layout">Checked with IsLayoutSupported</param>
+		/// <param name="streams">kMaxVertexStreams pointers, only the ones the layout uses are read</param>
+		/// <param name="vertexCount"></param>
+		void GatherAttributes(RayQueryVertexAttributes* dst, const VertexLayout& layout, const void* const* streams, uint32_t vertexCount);
+
+		/// <summary>
+		/// Stream whole vertices to a mapped vertex buffer
+		/// </summary>
+		void CopyVertices(RayQueryVertex* dst, const RayQueryVertex* vertices, uint32_t vertexCount);
+
+		/// <summary>
+		/// Stream whole attributes to a mapped attribute buffer
+		/// </summary>
+		void CopyAttributes(RayQueryVertexAttributes* dst, const RayQueryVertexAttributes* attributes, uint32_t vertexCount);
+
+		/// <summary>
+		/// Replace the normals with the sum of the unit normals of the triangles around each vertex, weighted by the corner angle.
+		/// Runs across pool when it is set. The result doesn't depend on the number of threads
+		/// </summary>
+		/// <param name="vertices">Cached memory, the normals are read back</param>
+		/// <param name="vertexCount"></param>
+		/// <param name="indices">Triangle list, out of range indices drop their triangle</param>
+		/// <param name="indexCount"></param>
+		/// <param name="pool">Optional worker pool</param>
+		void GenerateNormals(RayQueryVertex* vertices, uint32_t vertexCount, const int32_t* indices, uint32_t indexCount, ThreadPool* pool);
+		void GenerateNormals(RayQueryVertex* vertices, uint32_t vertexCount, const uint16_t* indices, uint32_t indexCount, ThreadPool* pool);
+
+		/// <summary>
+		/// Replace the tangents with MikkTSpace style ones built from the uvs. Each triangle's tangent and bitangent are projected
+		/// onto the tangent plane of the corner's vertex normal and summed with the corner angle as weight, w is the handedness
+		/// Unity expects. Vertices aren't split on uv seams, the result matches MikkTSpace where seams already have their own vertices.
+		/// Runs across pool when it is set. The result doesn't depend on the number of threads
+		/// </summary>
+		/// <param name="attributes">Uvs are read, tangents written</param>
+		/// <param name="vertices">Positions and final normals</param>
+		/// <param name="vertexCount"></param>
+		/// <param name="indices">Triangle list, out of range indices drop their triangle</param>
+		/// <param name="indexCount"></param>
+		/// <param name="pool">Optional worker pool</param>
+		void GenerateTangents(RayQueryVertexAttributes* attributes, const RayQueryVertex* vertices, uint32_t vertexCount, const int32_t* indices, uint32_t indexCount, ThreadPool* pool);
+		void GenerateTangents(RayQueryVertexAttributes* attributes, const RayQueryVertex* vertices, uint32_t vertexCount, const uint16_t* indices, uint32_t indexCount, ThreadPool* pool);
+
+		/// <summary>
+		/// Hash of everything generated normals and tangents depend on, so meshes with the same data can share them
+		/// </summary>
+		/// <param name="vertices">Positions, and normals when hashNormals is set</param>
+		/// <param name="attributes">Optional, the uvs are hashed</param>
+		/// <param name="hashNormals">Set when the normals come from the mesh instead of being generated</param>
+		/// <param name="vertexCount"></param>
+		/// <param name="indices">int32 or uint16 triangle list</param>
+		/// <param name="indexSize">4 or 2</param>
+		/// <param name="indexCount"></param>
+		uint64_t HashShadingSource(const RayQueryVertex* vertices, const RayQueryVertexAttributes* attributes, bool hashNormals, uint32_t vertexCount, const void* indices, size_t indexSize, uint32_t indexCount);
+
+		/// <summary>
+		/// Interleave tightly packed float3 positions and normals into RayQueryVertex
+		/// </summary>
+		/// <param name="dst">Mapped vertex buffer</param>
+		/// <param name="positions">vertexCount * 3 floats</param>
+		/// <param name="normals">vertexCount * 3 floats</param>
+		/// <param name="vertexCount"></param>
+		void InterleaveVertices(RayQueryVertex* dst, const float* positions, const float* normals, uint32_t vertexCount);
+
+		/// <summary>
+		/// Copy Unity's int indices into a uint32 index buffer
+		/// </summary>
+		/// <param name="dst">Mapped index buffer</param>
+		/// <param name="indices"></param>
+		/// <param name="indexCount"></param>
+		void CopyIndices(uint32_t* dst, const int32_t* indices, uint32_t indexCount);
+
+		/// <summary>
+		/// Copy 16 bit indices into a uint16 index buffer
+		/// </summary>
+		/// <param name="dst">Mapped index buffer</param>
+		/// <param name="indices"></param>
+		/// <param name="indexCount"></param>
+		void CopyIndices16(uint16_t* dst, const uint16_t* indices, uint32_t indexCount);
+
+		/// <summary>
+		/// Store Unity's int indices as uint16, only valid when every index is below 65536
+		/// </summary>
+		/// <param name="dst">Mapped index buffer</param>
+		/// <param name="indices"></param>
+		/// <param name="indexCount"></param>
+		void NarrowIndices(uint16_t* dst, const int32_t* indices, uint32_t indexCount);
+
+		/// <summary>
+		/// Name of the kernel set in use, for the log
+		/// </summary>
+		const char* GetKernelName();
+
+		/// <summary>
+		/// Number of kernel sets this build has and the CPU runs, index 0 is the scalar one
+		/// </summary>
+		uint32_t GetKernelSetCount();
+
+		/// <summary>
+		/// Name of a kernel set, nullptr past GetKernelSetCount
+		/// </summary>
+		const char* GetKernelSetName(uint32_t index);
+
+		/// <summary>
+		/// Run the functions above with one kernel set instead of the selected one, an index past GetKernelSetCount goes back to it.
+		/// Not thread safe, for tests that compare the sets
+		/// </summary>
+		void SetKernelSetOverride(uint32_t index);
+
+#ifndef NDEBUG
+		/// <summary>
+		/// Run the selected kernels and the scalar ones on the same generated mesh and compare the output.
+		/// Debug builds call this once before the first mesh is ingested
+		/// </summary>
+		/// <returns>True when both produce the same vertices and indices</returns>
+		bool VerifyKernels();
+#endif
+	}
+}
@@ -0,0 +1,393 @@
+#include "MeshOptimizer.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+namespace VulkanRT
+{
+	namespace MeshOptimizer
+	{
+		namespace
+		{
+			// Meshes up to this many triangles are ordered as a whole, bigger ones in chunks of it on the worker pool
+			const uint32_t kTrianglesPerChunk = 1u << 16;
+
+			// Tipsify dead ends closer together than this are not worth sorting apart for overdraw
+			const uint32_t kMinClusterTriangles = 64;
+
+			struct Cluster
+			{
+				uint32_t begin;
+				uint32_t end;
+				float    sortKey;
+			};
+
+			uint32_t SpreadBits10(uint32_t x)
+			{
+				x &= 0x3ff;
+				x = (x | (x << 16)) & 0x030000ff;
+				x = (x | (x << 8)) & 0x0300f00f;
+				x = (x | (x << 4)) & 0x030c30c3;
+				x = (x | (x << 2)) & 0x09249249;
+				return x;
+			}
+
+			// Chunks are cut from the index buffer, so neighbouring triangles have to be close in it first. Sorting along
+			// a Morton curve of the centroids keeps every chunk a compact piece of the surface whatever order the mesh came in
+			void SortTrianglesSpatially(uint32_t* indices, uint32_t triangleCount, const RayQueryVertex* vertices)
+			{
+				std::vector<vec3> centroids(triangleCount);
+				vec3 boundsMin(FLT_MAX);
+				vec3 boundsMax(-FLT_MAX);
+				for (uint32_t t = 0; t < triangleCount; ++t)
+				{
+					centroids[t] = (vertices[indices[3 * t + 0]].position + vertices[indices[3 * t + 1]].position + vertices[indices[3 * t + 2]].position) * (1.0f / 3.0f);
+					boundsMin = glm::min(boundsMin, centroids[t]);
+					boundsMax = glm::max(boundsMax, centroids[t]);
+				}
+
+				const vec3 extent = boundsMax - boundsMin;
+				const vec3 scale = glm::max(extent, vec3(FLT_MIN));
+
+				std::vector<std::pair<uint32_t, uint32_t>> keys(triangleCount);
+				for (uint32_t t = 0; t < triangleCount; ++t)
+				{
+					const vec3 cell = (centroids[t] - boundsMin) / scale * 1023.0f;
+					keys[t].first = SpreadBits10(static_cast<uint32_t>(cell.x)) | (SpreadBits10(static_cast<uint32_t>(cell.y)) << 1) | (SpreadBits10(static_cast<uint32_t>(cell.z)) << 2);
+					keys[t].second = t;
+				}
+				std::sort(keys.begin(), keys.end());
+
+				std::vector<uint32_t> sorted(3 * static_cast<size_t>(triangleCount));
+				for (uint32_t t = 0; t < triangleCount; ++t)
+				{
+					std::copy(indices + 3 * static_cast<size_t>(keys[t].second), indices + 3 * static_cast<size_t>(keys[t].second) + 3, sorted.begin() + 3 * static_cast<size_t>(t));
+				}
+				std::copy(sorted.begin(), sorted.end(), indices);
+			}
+
+			// Outward facing clusters far from the center tend to hide the rest, so they go first
+			float ClusterSortKey(const uint32_t* localIndices, const std::vector<uint32_t>& localVertices, uint32_t begin, uint32_t end,
+				const RayQueryVertex* vertices, const vec3& meshCenter)
+			{
+				vec3 centroid(0.0f);
+				vec3 normal(0.0f);
+				for (uint32_t t = begin; t < end; ++t)
+				{
+					const vec3& p0 = vertices[localVertices[localIndices[3 * t + 0]]].position;
+					const vec3& p1 = vertices[localVertices[localIndices[3 * t + 1]]].position;
+					const vec3& p2 = vertices[localVertices[localIndices[3 * t + 2]]].position;
+
+					centroid += (p0 + p1 + p2) * (1.0f / 3.0f);
+					normal += glm::cross(p1 - p0, p2 - p0);
+				}
+				centroid /= static_cast<float>(end - begin);
+
+				const float length = glm::length(normal);
+				return length > 0.0f ? glm::dot(centroid - meshCenter, normal / length) : 0.0f;
+			}
+
+			// Tipsify (Sander, Nehab and Barczak 2007) on triangleCount triangles, written back in place
+			void TipsifyChunk(uint32_t* indices, uint32_t triangleCount, const RayQueryVertex* vertices, bool overdraw, const vec3& meshCenter)
+			{
+				const uint32_t indexCount = triangleCount * 3;
+
+				// Number the vertices of the chunk from 0 so the per vertex state only covers them
+				std::vector<uint32_t> localVertices(indices, indices + indexCount);
+				std::sort(localVertices.begin(), localVertices.end());
+				localVertices.erase(std::unique(localVertices.begin(), localVertices.end()), localVertices.end());
+				const uint32_t localCount = static_cast<uint32_t>(localVertices.size());
+
+				std::vector<uint32_t> localIndices(indexCount);
+				for (uint32_t i = 0; i < indexCount; ++i)
+				{
+					localIndices[i] = static_cast<uint32_t>(std::lower_bound(localVertices.begin(), localVertices.end(), indices[i]) - localVertices.begin());
+				}
+
+				// Triangles around each vertex
+				std::vector<uint32_t> adjacencyOffsets(localCount + 1, 0);
+				for (uint32_t i = 0; i < indexCount; ++i)
+				{
+					++adjacencyOffsets[localIndices[i] + 1];
+				}
+				for (uint32_t v = 0; v < localCount; ++v)
+				{
+					adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+				}
+
+				std::vector<uint32_t> adjacency(indexCount);
+				std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+				for (uint32_t i = 0; i < indexCount; ++i)
+				{
+					adjacency[fill[localIndices[i]]++] = i / 3;
+				}
+
+				// Triangles not emitted yet around each vertex
+				std::vector<uint32_t> liveTriangles(localCount);
+				for (uint32_t v = 0; v < localCount; ++v)
+				{
+					liveTriangles[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+				}
+
+				// A vertex is in the FIFO cache while time - cacheTime <= kCacheSize, time only moves on a miss
+				std::vector<uint32_t> cacheTime(localCount, 0);
+				uint32_t time = kCacheSize + 1;
+
+				std::vector<uint8_t> emitted(triangleCount, 0);
+				std::vector<uint32_t> deadEnd;
+				std::vector<uint32_t> candidates;
+				std::vector<uint32_t> output;
+				output.reserve(indexCount);
+
+				// First triangle of each cluster, a cluster ends where Tipsify hits a dead end
+				std::vector<uint32_t> clusterStarts(1, 0);
+
+				uint32_t cursor = 0;
+				int64_t fanning = localCount > 0 ? 0 : -1;
+				while (fanning >= 0)
+				{
+					const uint32_t f = static_cast<uint32_t>(fanning);
+
+					candidates.clear();
+					for (uint32_t a = adjacencyOffsets[f]; a < adjacencyOffsets[f + 1]; ++a)
+					{
+						const uint32_t t = adjacency[a];
+						if (emitted[t])
+						{
+							continue;
+						}
+
+						for (uint32_t c = 0; c < 3; ++c)
+						{
+							const uint32_t v = localIndices[3 * t + c];
+							output.push_back(v);
+							deadEnd.push_back(v);
+							candidates.push_back(v);
+							--liveTriangles[v];
+
+							if (time - cacheTime[v] > kCacheSize)
+							{
+								cacheTime[v] = time++;
+							}
+						}
+						emitted[t] = 1;
+					}
+
+					// Prefer the candidate that is still in the cache and will stay there while its remaining triangles are emitted
+					fanning = -1;
+					int64_t bestPriority = -1;
+					for (uint32_t v : candidates)
+					{
+						if (liveTriangles[v] == 0)
+						{
+							continue;
+						}
+
+						int64_t priority = 0;
+						if (time - cacheTime[v] + 2 * liveTriangles[v] <= kCacheSize)
+						{
+							priority = time - cacheTime[v];
+						}
+						if (priority > bestPriority)
+						{
+							bestPriority = priority;
+							fanning = v;
+						}
+					}
+
+					if (fanning < 0)
+					{
+						const uint32_t emittedTriangles = static_cast<uint32_t>(output.size() / 3);
+						if (emittedTriangles - clusterStarts.back() >= kMinClusterTriangles && emittedTriangles < triangleCount)
+						{
+							clusterStarts.push_back(emittedTriangles);
+						}
+
+						// Most recently emitted vertex that still has triangles, then the next one in vertex order
+						while (!deadEnd.empty() && fanning < 0)
+						{
+							const uint32_t v = deadEnd.back();
+							deadEnd.pop_back();
+							if (liveTriangles[v] > 0)
+							{
+								fanning = v;
+							}
+						}
+
+						for (; cursor < localCount && fanning < 0; ++cursor)
+						{
+							if (liveTriangles[cursor] > 0)
+							{
+								fanning = cursor;
+							}
+						}
+					}
+				}
+
+				const uint32_t* ordered = output.data();
+				std::vector<uint32_t> sorted;
+				if (overdraw && vertices != nullptr && clusterStarts.size() > 1)
+				{
+					std::vector<Cluster> clusters(clusterStarts.size());
+					for (size_t c = 0; c < clusters.size(); ++c)
+					{
+						clusters[c].begin = clusterStarts[c];
+						clusters[c].end = c + 1 < clusterStarts.size() ? clusterStarts[c + 1] : triangleCount;
+						clusters[c].sortKey = ClusterSortKey(output.data(), localVertices, clusters[c].begin, clusters[c].end, vertices, meshCenter);
+					}
+					std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.sortKey > b.sortKey; });
+
+					sorted.reserve(indexCount);
+					for (const Cluster& cluster : clusters)
+					{
+						sorted.insert(sorted.end(), output.begin() + 3 * cluster.begin, output.begin() + 3 * cluster.end);
+					}
+					ordered = sorted.data();
+				}
+
+				for (uint32_t i = 0; i < indexCount; ++i)
+				{
+					indices[i] = localVertices[ordered[i]];
+				}
+			}
+		}
+
+		float ComputeACMR(const uint32_t* indices, uint32_t indexCount, uint32_t vertexCount)
+		{
+			if (indexCount < 3)
+			{
+				return 0.0f;
+			}
+
+			std::vector<uint32_t> cacheTime(vertexCount, 0);
+			uint32_t time = kCacheSize + 1;
+			uint32_t misses = 0;
+
+			for (uint32_t i = 0; i < indexCount; ++i)
+			{
+				const uint32_t v = indices[i];
+				if (time - cacheTime[v] > kCacheSize)
+				{
+					cacheTime[v] = time++;
+					++misses;
+				}
+			}
+
+			return static_cast<float>(misses) / static_cast<float>(indexCount / 3);
+		}
+
+		void OptimizeVertexCache(uint32_t* indices, uint32_t indexCount, uint32_t vertexCount, const RayQueryVertex* vertices, bool overdraw, ThreadPool* pool)
+		{
+			const uint32_t triangleCount = indexCount / 3;
+			if (triangleCount == 0)
+			{
+				return;
+			}
+
+			vec3 meshCenter(0.0f);
+			if (overdraw && vertices != nullptr && vertexCount > 0)
+			{
+				for (uint32_t v = 0; v < vertexCount; ++v)
+				{
+					meshCenter += vertices[v].position;
+				}
+				meshCenter /= static_cast<float>(vertexCount);
+			}
+
+			const uint32_t chunkCount = (triangleCount + kTrianglesPerChunk - 1) / kTrianglesPerChunk;
+			if (chunkCount > 1 && vertices != nullptr)
+			{
+				SortTrianglesSpatially(indices, triangleCount, vertices);
+			}
+
+			auto orderChunk = [&](uint32_t chunk)
+			{
+				const uint32_t first = chunk * kTrianglesPerChunk;
+				const uint32_t count = std::min(kTrianglesPerChunk, triangleCount - first);
+				TipsifyChunk(indices + 3 * static_cast<size_t>(first), count, vertices, overdraw, meshCenter);
+			};
+
+			if (pool != nullptr && chunkCount > 1)
+			{
+				pool->ParallelFor(chunkCount, orderChunk);
+			}
+			else
+			{
+				for (uint32_t chunk = 0; chunk < chunkCount; ++chunk)
+				{
+					orderChunk(chunk);
+				}
+			}
+		}
+
+		void OptimizeVertexFetch(RayQueryVertex* vertices, uint32_t vertexCount, uint32_t* indices, uint32_t indexCount, RayQueryVertexAttributes* attributes)
+		{
+			std::vector<uint32_t> remap(vertexCount, ~0u);
+			uint32_t next = 0;
+
+			for (uint32_t i = 0; i < indexCount; ++i)
+			{
+				uint32_t& newIndex = remap[indices[i]];
+				if (newIndex == ~0u)
+				{
+					newIndex = next++;
+				}
+				indices[i] = newIndex;
+			}
+
+			for (uint32_t v = 0; v < vertexCount; ++v)
+			{
+				if (remap[v] == ~0u)
+				{
+					remap[v] = next++;
+				}
+			}
+
+			std::vector<RayQueryVertex> reordered(vertexCount);
+			for (uint32_t v = 0; v < vertexCount; ++v)
+			{
+				reordered[remap[v]] = vertices[v];
+			}
+			std::copy(reordered.begin(), reordered.end(), vertices);
+
+			if (attributes != nullptr)
+			{
+				std::vector<RayQueryVertexAttributes> reorderedAttributes(vertexCount);
+				for (uint32_t v = 0; v < vertexCount; ++v)
+				{
+					reorderedAttributes[remap[v]] = attributes[v];
+				}
+				std::copy(reorderedAttributes.begin(), reorderedAttributes.end(), attributes);
+			}
+		}
+
+		bool OptimizeMesh(RayQueryVertex* vertices, uint32_t vertexCount, uint32_t* indices, uint32_t indexCount, uint32_t flags, ThreadPool* pool, float& acmrBefore, float& acmrAfter, RayQueryVertexAttributes* attributes)
+		{
+			for (uint32_t i = 0; i < indexCount; ++i)
+			{
+				if (indices[i] >= vertexCount)
+				{
+					return false;
+				}
+			}
+
+			acmrBefore = ComputeACMR(indices, indexCount, vertexCount);
+
+			// Overdraw ordering sorts the clusters the cache pass produces, so it implies it
+			if ((flags & (kOptimizeVertexCache | kOptimizeOverdraw)) != 0)
+			{
+				OptimizeVertexCache(indices, indexCount, vertexCount, vertices, (flags & kOptimizeOverdraw) != 0, pool);
+			}
+
+			if ((flags & kOptimizeVertexFetch) != 0)
+			{
+				OptimizeVertexFetch(vertices, vertexCount, indices, indexCount, attributes);
+			}
+
+			acmrAfter = ComputeACMR(indices, indexCount, vertexCount);
+			return true;
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include "RayQueryShsaderConst.h"
+
+namespace VulkanRT
+{
+	class ThreadPool;
+
+	/// <summary>
+	/// Ingest time reordering of shared meshes for the raster draw and the BLAS build. Only the order of triangles and
+	/// vertices changes, every triangle keeps its vertices and winding so the rendered image stays the same.
+	/// </summary>
+	namespace MeshOptimizer
+	{
+		// Stages of OptimizeMesh, combined with |
+		static const uint32_t kOptimizeVertexCache = 0x1;
+		static const uint32_t kOptimizeOverdraw = 0x2;
+		static const uint32_t kOptimizeVertexFetch = 0x4;
+
+		// FIFO post-transform cache size the triangles are ordered and measured for
+		static const uint32_t kCacheSize = 16;
+
+		/// <summary>
+		/// Average cache miss ratio, vertices transformed per triangle with a kCacheSize FIFO cache. 3 is the worst, 0.5 the best a regular grid gets
+		/// </summary>
+		float ComputeACMR(const uint32_t* indices, uint32_t indexCount, uint32_t vertexCount);
+
+		/// <summary>
+		/// Reorder triangles for the post-transform cache with Tipsify. Big meshes are split into chunks of triangles
+		/// that are ordered in parallel on pool, the chunks keep their place in the index buffer
+		/// </summary>
+		/// <param name="indices">Triangle list, reordered in place</param>
+		/// <param name="vertices">Positions for overdraw and for splitting big meshes into compact chunks, can be nullptr</param>
+		/// <param name="overdraw">Also sort the clusters Tipsify leaves behind from the outside in</param>
+		/// <param name="pool">Optional worker pool</param>
+		void OptimizeVertexCache(uint32_t* indices, uint32_t indexCount, uint32_t vertexCount, const RayQueryVertex* vertices, bool overdraw, ThreadPool* pool);
+
+		/// <summary>
+		/// Renumber vertices in the order the indices first use them and move the vertices to match.
+		/// Unreferenced vertices go to the end, the vertex count doesn't change. attributes, when set, moves with its vertex
+		/// </summary>
+		void OptimizeVertexFetch(RayQueryVertex* vertices, uint32_t vertexCount, uint32_t* indices, uint32_t indexCount, RayQueryVertexAttributes* attributes = nullptr);
+
+		/// <summary>
+		/// Run the stages selected by flags, vertices and indices are reordered in place
+		/// </summary>
+		/// <param name="flags">kOptimize* bits</param>
+		/// <param name="acmrBefore">ACMR of the original order</param>
+		/// <param name="acmrAfter">ACMR of the final order</param>
+		/// <param name="attributes">Optional, one per vertex, reordered with the vertices</param>
+		/// <returns>False without touching anything when an index is out of range</returns>
+		bool OptimizeMesh(RayQueryVertex* vertices, uint32_t vertexCount, uint32_t* indices, uint32_t indexCount, uint32_t flags, ThreadPool* pool, float& acmrBefore, float& acmrAfter, RayQueryVertexAttributes* attributes = nullptr);
+	}
+}
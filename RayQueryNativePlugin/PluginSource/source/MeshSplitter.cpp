@@ -0,0 +1,203 @@
+#include "MeshSplitter.h"
+
+#include <algorithm>
+#include <array>
+#include <queue>
+#include <unordered_map>
+
+namespace VulkanRT
+{
+	namespace MeshSplitter
+	{
+		namespace
+		{
+			struct Candidate
+			{
+				float    wastedSurface;
+				uint32_t triangle;
+
+				bool operator<(const Candidate& other) const { return wastedSurface < other.wastedSurface; }
+			};
+
+			uint64_t EdgeKey(uint32_t a, uint32_t b)
+			{
+				return a < b ? (static_cast<uint64_t>(a) << 32) | b : (static_cast<uint64_t>(b) << 32) | a;
+			}
+
+			// Box surface beyond what areaRatio allows, 0 for triangles that are fine or have no area to split
+			float WastedSurface(const vec3& p0, const vec3& p1, const vec3& p2, float areaRatio)
+			{
+				const float area = 0.5f * glm::length(glm::cross(p1 - p0, p2 - p0));
+				if (!(area > 0.0f))
+				{
+					return 0.0f;
+				}
+
+				const vec3 extent = glm::max(glm::max(p0, p1), p2) - glm::min(glm::min(p0, p1), p2);
+				const float surface = 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+				return std::max(surface - areaRatio * area, 0.0f);
+			}
+		}
+
+		bool SplitLongTriangles(const RayQueryVertex* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount,
+			float areaRatio, uint32_t maxTriangles, std::vector<vec3>& positions, std::vector<uint32_t>& splitIndices)
+		{
+			positions.clear();
+			splitIndices.clear();
+
+			const uint32_t triangleCount = indexCount / 3;
+			if (triangleCount == 0 || maxTriangles <= triangleCount)
+			{
+				return false;
+			}
+
+			std::vector<vec3> points(vertexCount);
+			for (uint32_t v = 0; v < vertexCount; ++v)
+			{
+				points[v] = vertices[v].position;
+			}
+
+			std::vector<std::array<uint32_t, 3>> triangles(triangleCount);
+			std::vector<uint8_t> alive(triangleCount, 1);
+			std::priority_queue<Candidate> candidates;
+			for (uint32_t t = 0; t < triangleCount; ++t)
+			{
+				triangles[t] = { indices[3 * t + 0], indices[3 * t + 1], indices[3 * t + 2] };
+
+				const float wasted = WastedSurface(points[triangles[t][0]], points[triangles[t][1]], points[triangles[t][2]], areaRatio);
+				if (wasted > 0.0f && triangles[t][0] != triangles[t][1] && triangles[t][1] != triangles[t][2] && triangles[t][2] != triangles[t][0])
+				{
+					candidates.push({ wasted, t });
+				}
+			}
+
+			if (candidates.empty())
+			{
+				return false;
+			}
+
+			// Triangles on each edge, built once something has to be split. A triangle with a repeated corner would sit on
+			// one edge twice and be split twice, it has no area and is kept as it is instead
+			std::unordered_map<uint64_t, std::vector<uint32_t>> edgeTriangles;
+			edgeTriangles.reserve(static_cast<size_t>(triangleCount) * 3 / 2);
+			auto repeatedCorner = [&](uint32_t t)
+			{
+				return triangles[t][0] == triangles[t][1] || triangles[t][1] == triangles[t][2] || triangles[t][2] == triangles[t][0];
+			};
+			auto linkTriangle = [&](uint32_t t)
+			{
+				if (repeatedCorner(t))
+				{
+					return;
+				}
+				for (uint32_t c = 0; c < 3; ++c)
+				{
+					edgeTriangles[EdgeKey(triangles[t][c], triangles[t][(c + 1) % 3])].push_back(t);
+				}
+			};
+			auto unlinkTriangle = [&](uint32_t t)
+			{
+				for (uint32_t c = 0; c < 3; ++c)
+				{
+					std::vector<uint32_t>& sharing = edgeTriangles[EdgeKey(triangles[t][c], triangles[t][(c + 1) % 3])];
+					auto found = std::find(sharing.begin(), sharing.end(), t);
+					if (found != sharing.end())
+					{
+						sharing.erase(found);
+					}
+				}
+			};
+			for (uint32_t t = 0; t < triangleCount; ++t)
+			{
+				linkTriangle(t);
+			}
+
+			uint32_t liveTriangles = triangleCount;
+			std::vector<uint32_t> sharing;
+			while (!candidates.empty())
+			{
+				const uint32_t t = candidates.top().triangle;
+				candidates.pop();
+				if (!alive[t])
+				{
+					continue;
+				}
+
+				// Longest edge, from corner longest to the next one
+				uint32_t longest = 0;
+				float longestLength = -1.0f;
+				for (uint32_t c = 0; c < 3; ++c)
+				{
+					const vec3 edge = points[triangles[t][(c + 1) % 3]] - points[triangles[t][c]];
+					const float length = glm::dot(edge, edge);
+					if (length > longestLength)
+					{
+						longestLength = length;
+						longest = c;
+					}
+				}
+
+				const uint32_t a = triangles[t][longest];
+				const uint32_t b = triangles[t][(longest + 1) % 3];
+				sharing = edgeTriangles[EdgeKey(a, b)];
+
+				// Every triangle on the edge turns into two
+				if (liveTriangles + static_cast<uint32_t>(sharing.size()) > maxTriangles)
+				{
+					break;
+				}
+
+				const uint32_t middle = static_cast<uint32_t>(points.size());
+				points.push_back((points[a] + points[b]) * 0.5f);
+
+				for (uint32_t s : sharing)
+				{
+					const std::array<uint32_t, 3> corners = triangles[s];
+					unlinkTriangle(s);
+					alive[s] = 0;
+
+					uint32_t first = 0;
+					while (EdgeKey(corners[first], corners[(first + 1) % 3]) != EdgeKey(a, b))
+					{
+						++first;
+					}
+					const uint32_t p = corners[first];
+					const uint32_t q = corners[(first + 1) % 3];
+					const uint32_t r = corners[(first + 2) % 3];
+
+					const std::array<uint32_t, 3> halves[2] = { { p, middle, r }, { middle, q, r } };
+					for (const std::array<uint32_t, 3>& half : halves)
+					{
+						const uint32_t added = static_cast<uint32_t>(triangles.size());
+						triangles.push_back(half);
+						alive.push_back(1);
+						linkTriangle(added);
+
+						const float wasted = WastedSurface(points[half[0]], points[half[1]], points[half[2]], areaRatio);
+						if (wasted > 0.0f)
+						{
+							candidates.push({ wasted, added });
+						}
+					}
+				}
+				liveTriangles += static_cast<uint32_t>(sharing.size());
+			}
+
+			if (liveTriangles == triangleCount)
+			{
+				return false;
+			}
+
+			positions.swap(points);
+			splitIndices.reserve(static_cast<size_t>(liveTriangles) * 3);
+			for (size_t t = 0; t < triangles.size(); ++t)
+			{
+				if (alive[t])
+				{
+					splitIndices.insert(splitIndices.end(), triangles[t].begin(), triangles[t].end());
+				}
+			}
+			return true;
+		}
+	}
+}
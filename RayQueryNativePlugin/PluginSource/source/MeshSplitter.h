@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "RayQueryShsaderConst.h"
+
+namespace VulkanRT
+{
+	/// <summary>
+	/// Ingest time splitting of long, thin triangles for the BLAS input. Their bounding boxes cover far more space than
+	/// the triangles do, so rays visit them everywhere. The split set covers exactly the same surface and is only built
+	/// into the BLAS, the draw keeps the original triangles
+	/// </summary>
+	namespace MeshSplitter
+	{
+		/// <summary>
+		/// Bisect the longest edge of the triangle wasting the most bounding box surface until no triangle's box surface
+		/// is above areaRatio times its area or maxTriangles is reached. Every triangle on a split edge is split with it,
+		/// so the result has no T-junctions for rays to leak through
+		/// </summary>
+		/// <param name="indices">Triangle list, every index below vertexCount</param>
+		/// <param name="areaRatio">Box surface over triangle area a triangle may have, 4 is the least an axis aligned triangle gets</param>
+		/// <param name="maxTriangles">Triangle budget of the split set</param>
+		/// <param name="positions">The original positions followed by the new ones</param>
+		/// <param name="splitIndices">Triangle list of the split set, winding is kept</param>
+		/// <returns>False when no triangle was split, outputs are left empty then</returns>
+		bool SplitLongTriangles(const RayQueryVertex* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount,
+			float areaRatio, uint32_t maxTriangles, std::vector<vec3>& positions, std::vector<uint32_t>& splitIndices);
+	}
+}
@@ -15,6 +15,7 @@ using vec3 = glm::highp_vec3;
 using vec4 = glm::highp_vec4;
 using mat4 = glm::highp_mat4;
 using quat = glm::highp_quat;
+using ivec2 = glm::highp_ivec2;
 
 
 
@@ -41,19 +42,118 @@ struct GlobalUniform
 	alignas(16) vec3 camera_position;
 	alignas(16) vec3 light_position;
 	alignas(16) vec3 light_direction;
+	alignas(16) mat4 inv_view_proj;
+	alignas(16) mat4 prev_view_proj;
+	alignas(16) uint32_t light_count;   // 0 falls back to light_position
+	uint32_t frame_index;               // seeds the stochastic light picks of ray_shadow.frag
 };
 
-struct PerMeshUniform
+// Light types, same values as UnityEngine.LightType
+const int32_t kRayQueryLightTypeSpot        = 0;
+const int32_t kRayQueryLightTypeDirectional = 1;
+const int32_t kRayQueryLightTypePoint       = 2;
+
+// One registered light, std430 element of the light buffer. A zeroed entry is a disabled light
+struct RayQueryLight
+{
+	align16 vec4 position_range;        // xyz world position, w range
+	align16 vec4 direction_cos_angle;   // xyz forward, w cosine of half the spot angle
+	align16 vec4 color_intensity;
+	align4  int32_t type;
+	align4  int32_t enabled;
+	align4  int32_t light_instance_id;
+	align4  int32_t padding;
+};
+
+// Walker alias table entry, one per light buffer element. Column i is kept with probability threshold, otherwise alias is taken.
+// pdf is the chance of picking light i at all, the ratio of its power to the total
+struct RayQueryLightAlias
+{
+	align4 float    threshold;
+	align4 uint32_t alias;
+	align4 float    pdf;
+	align4 uint32_t padding;
+};
+
+// Lights are binned into kLightTileSize square screen tiles, each tile is kMaxLightsPerTile + 1 uints: the count then the indices
+const uint32_t kLightTileSize = 16;
+const uint32_t kMaxLightsPerTile = 31;
+
+struct LightCullConstants
+{
+	align8 ivec2    target_size;
+	align4 uint32_t tile_size;
+};
+
+// Tiles of the tile light buffer bound to ray_shadow.frag, pushed with the draws. tile_count_x is 0 when no cull pass ran right before
+struct LightTileConstants
+{
+	align4 uint32_t tile_count_x;
+	align4 uint32_t tile_count_y;
+	align4 uint32_t tile_size;
+};
+
+// ray_mesh_repack.comp reads Unity's stream as 32 bit words, so the stride and both offsets are in words
+struct MeshRepackConstants
 {
-	align64 mat4 model;
+	align4 uint32_t vertex_count;
+	align4 uint32_t stride_words;
+	align4 uint32_t position_word;
+	align4 uint32_t normal_word;
 };
 
+struct ComputeShadowConstants
+{
+	align8 ivec2 visibility_size;
+	align8 ivec2 output_size;
+	align4 int   downsample;
+	align4 int   frame_index;
+	align4 int   temporal;
+};
+
+// TLAS instance mask bits, shadow rays only visit casters and AO rays only occluders
+const uint32_t kRayQueryMaskShadowCaster = 0x01;
+const uint32_t kRayQueryMaskAOOccluder   = 0x02;
+const uint32_t kRayQueryMaskDefault      = 0xFF;
+
+// Specialization constants of ray_shadow.frag, constant_id follows member order
+struct RayQueryShadowSpecialization
+{
+	uint32_t ao_samples_each;   // AO rays are ao_samples_each^2, 0 removes AO
+	float    ao_max_distance;
+	float    ray_tmin;
+	uint32_t enable_ao;         // VkBool32
+	uint32_t enable_shadow;     // VkBool32
+	uint32_t shadow_ray_budget; // lights past this many are sampled stochastically
+};
+
+// Each tier compiles to its own specialized pipelines
+enum class RayQueryQualityTier
+{
+	Auto = -1,          // picked from the device type at Prepare
+	ShadowsOnly = 0,    // AO off
+	AO4 = 1,
+	AO9 = 2,
+	AO16 = 3,
+	AOOnly = 4,         // 9 AO rays, no shadow ray
+	Count = 5
+};
+
+
 struct RayQueryVertex
 {
 	alignas(16) vec3 position;
 	alignas(16) vec3 normal;
 };
 
+// Shading attributes kept next to the vertex buffer, one per RayQueryVertex in the same order.
+// Zero when the mesh doesn't have them
+struct RayQueryVertexAttributes
+{
+	alignas(16) vec4 tangent;
+	alignas(16) vec2 uv;
+};
+
 struct RayQueryTLASInstanceData
 {
 	align64 mat4        localToWorld;
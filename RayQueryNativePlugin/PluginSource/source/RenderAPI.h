@@ -8,6 +8,8 @@
 
 struct IUnityInterfaces;
 
+namespace VulkanRT { namespace MeshIngest { struct VertexLayout; } }
+
 // Super-simple "graphics abstraction". This is nothing like how a proper platform abstraction layer would look like;
 // all this does is a base interface for whatever our plugin sample needs. Which is only "draw some triangles"
 // and "modify a texture" at this point.
@@ -35,16 +37,150 @@ public:
 		/// <param name="meshInstanceId"></param>
 		/// <param name="sharedMeshInstanceId"></param>
 		/// <param name="l2wMatrix"></param>
-	virtual AddResourceResult AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId, float* l2wMatrix, float* w2lMatrix) = 0;
+		/// <param name="mask">Instance mask, kRayQueryMaskShadowCaster and kRayQueryMaskAOOccluder select which rays see it</param>
+		/// <param name="flags">VkGeometryInstanceFlagBitsKHR, facing cull and opacity overrides</param>
+	virtual AddResourceResult AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId, float* l2wMatrix, float* w2lMatrix, int mask, int flags) = 0;
+
+	/// <summary>
+	/// Add count instances of one shared mesh in a single call, for large instanced sets. Ids that already exist are skipped.
+	/// The batch takes one contiguous block of new pool slots, the id lookup still costs a std::map node per instance
+	/// </summary>
+	/// <param name="gameObjectInstanceIds">count ids</param>
+	/// <param name="l2wMatrices">count Unity matrices, 16 floats each</param>
+	/// <param name="w2lMatrices">count Unity matrices, 16 floats each</param>
+	/// <returns>Number of instances added</returns>
+	virtual int AddTlasInstances(int count, const int* gameObjectInstanceIds, int sharedMeshInstanceId, const float* l2wMatrices, const float* w2lMatrices, int mask, int flags) = 0;
+
+	/// <summary>
+	/// Add a mesh from separate Unity arrays. tangentsArray (float4) and uvsArray (float2) can be nullptr when the mesh doesn't have them
+	/// </summary>
 	virtual AddResourceResult AddSharedMesh(int sharedMeshInstanceId, float* verticesArray, float* normalsArray, float* tangentsArray, float* uvsArray, int vertexCount, int* indicesArray, int indexCount) = 0;
+
+	/// <summary>
+	/// AddSharedMesh for meshes with IndexFormat.UInt16, the indices are copied as they are and stay 16 bit
+	/// </summary>
+	virtual AddResourceResult AddSharedMesh16(int sharedMeshInstanceId, float* verticesArray, float* normalsArray, float* tangentsArray, float* uvsArray, int vertexCount, unsigned short* indicesArray, int indexCount) = 0;
+
+	/// <summary>
+	/// Add a shared mesh straight from Unity's GPU buffers, Mesh.GetVertexBuffer and GetIndexBuffer. Both need GraphicsBuffer.Target.CopySource,
+	/// the vertex buffer also GraphicsBuffer.Target.Raw unless it already has the RayQueryVertex layout. The mesh is copied on the GPU by the next
+	/// ImportNativeMeshes, instances can be added right away. The buffers have to stay alive while IsSharedMeshPending returns true.
+	/// Other layouts return Error while ray_meshRepackComp isn't available, nothing is registered then
+	/// </summary>
+	/// <param name="vertexBuffer">Vertex stream holding both position and normal</param>
+	/// <param name="vertexStride">Bytes between two vertices of the stream</param>
+	/// <param name="positionOffset">Byte offset of the position in a vertex</param>
+	/// <param name="positionFormat">VkFormat of the position, VK_FORMAT_R32G32B32_SFLOAT</param>
+	/// <param name="normalOffset">Byte offset of the float3 normal in a vertex</param>
+	/// <param name="indices16">The index buffer holds uint16 instead of uint32</param>
+	virtual AddResourceResult AddSharedMeshNative(int sharedMeshInstanceId, void* vertexBuffer, int vertexStride, int positionOffset, int positionFormat, int normalOffset, int vertexCount, void* indexBuffer, bool indices16, int indexCount) = 0;
+
+	/// <summary>
+	/// Add a shared mesh from the raw vertex streams of a Unity Mesh.MeshData, converted and interleaved in one pass.
+	/// Without a normal attribute, angle weighted normals are generated from the triangles on the worker threads
+	/// </summary>
+	/// <param name="vertexLayout">Stream strides, offset and VkFormat of the position and normal</param>
+	/// <param name="vertexStreams">One pointer per stream, unused streams can be null</param>
+	/// <param name="indices">uint16 when indices16 is set, uint32 otherwise</param>
+	virtual AddResourceResult AddSharedMeshLayout(int sharedMeshInstanceId, const VulkanRT::MeshIngest::VertexLayout* vertexLayout, const void* const* vertexStreams, int vertexCount, const void* indices, bool indices16, int indexCount) = 0;
+
+	/// <summary>
+	/// Copy the meshes queued by AddSharedMeshNative out of Unity's buffers and build their BLAS, has to run outside a render pass
+	/// </summary>
+	virtual void ImportNativeMeshes() = 0;
+
+	/// <summary>
+	/// True while an added mesh waits for ImportNativeMeshes or for its transfer to finish
+	/// </summary>
+	virtual bool IsSharedMeshPending(int sharedMeshInstanceId) = 0;
+
+	/// <summary>
+	/// Object space bounds of an added mesh's positions, computed while it was ingested
+	/// </summary>
+	/// <param name="boundsMin">3 floats</param>
+	/// <param name="boundsMax">3 floats</param>
+	/// <returns>False for unknown meshes and AddSharedMeshNative ones, their positions are never read on the CPU</returns>
+	virtual bool GetSharedMeshBounds(int sharedMeshInstanceId, float* boundsMin, float* boundsMax) = 0;
 	virtual void UpdateTlasInstance(int gameObjectInstanceId, float* l2wMatrix, float* w2lMatrix) = 0;
 
+	/// <summary>
+	/// Update the transforms of many instances in one call
+	/// </summary>
+	/// <param name="count"></param>
+	/// <param name="gameObjectInstanceIds">count ids</param>
+	/// <param name="l2wMatrices">count Unity matrices, 16 floats each</param>
+	/// <param name="w2lMatrices">count Unity matrices, 16 floats each</param>
+	virtual void UpdateTlasInstances(int count, const int* gameObjectInstanceIds, const float* l2wMatrices, const float* w2lMatrices) = 0;
+
+	/// <summary>
+	/// Handle of an added instance for UpdateTlasInstancesByHandle and the transform arena, -1 when it doesn't exist.
+	/// Updates through it are ignored once the instance is removed, even when another instance takes its place
+	/// </summary>
+	/// <param name="gameObjectInstanceId"></param>
+	virtual int GetTlasInstanceHandle(int gameObjectInstanceId) = 0;
+
+	/// <summary>
+	/// UpdateTlasInstances addressed by GetTlasInstanceHandle handles, skips the id lookup
+	/// </summary>
+	/// <param name="count"></param>
+	/// <param name="handles"></param>
+	/// <param name="l2wMatrices"></param>
+	/// <param name="w2lMatrices"></param>
+	virtual void UpdateTlasInstancesByHandle(int count, const int* handles, const float* l2wMatrices, const float* w2lMatrices) = 0;
+
+	/// <summary>
+	/// Write half of the transform arena, RayTracerTransformSlot per pool index of a TLAS instance handle. Grows it to cover every handle
+	/// handed out so far, the pointer is only valid until the next GetTransformArena or PublishTransformArena
+	/// </summary>
+	/// <param name="capacity">Number of slots behind the pointer</param>
+	virtual void* GetTransformArena(int* capacity) = 0;
+
+	/// <summary>
+	/// Hand the slots written since the last publish to the render thread and return the half to write next
+	/// </summary>
+	/// <param name="capacity">Number of slots behind the pointer</param>
+	virtual void* PublishTransformArena(int* capacity) = 0;
+
+	/// <summary>
+	/// Change mask and flags of an instance, applied with the next TLAS update instead of a rebuild
+	/// </summary>
+	/// <param name="gameObjectInstanceId"></param>
+	/// <param name="mask"></param>
+	/// <param name="flags"></param>
+	virtual void UpdateTlasInstanceMask(int gameObjectInstanceId, int mask, int flags) = 0;
+
 	/// <summary>
 	/// Removes instance to be removed on next tlas build
 	/// </summary>
 	/// <param name="meshInstanceIndex"></param>
 	virtual void RemoveTlasInstance(int gameObjectInstanceId) = 0;
 
+	/// <summary>
+	/// Remove a shared mesh. Its buffers, BLAS and pipeline are released once the last TLAS instance using it is removed,
+	/// and destroyed when the GPU is done with the frames that used them. Adding the mesh again before that keeps it
+	/// </summary>
+	/// <param name="sharedMeshInstanceId"></param>
+	virtual void RemoveSharedMesh(int sharedMeshInstanceId) = 0;
+
+	/// <summary>
+	/// Create an arena, e.g. one per loaded scene. Meshes and instances added while it is active belong to it
+	/// </summary>
+	/// <returns>Arena handle, never 0</returns>
+	virtual int CreateArena() = 0;
+
+	/// <summary>
+	/// Select the arena following adds go to, 0 for none
+	/// </summary>
+	/// <param name="arena"></param>
+	virtual void SetActiveArena(int arena) = 0;
+
+	/// <summary>
+	/// Remove every instance and mesh of the arena at once with a single TLAS rebuild. Their GPU resources are destroyed
+	/// once the frames using them are done, meshes still used by instances of other arenas are kept until those go
+	/// </summary>
+	/// <param name="arena"></param>
+	virtual void DestroyArena(int arena) = 0;
+
 	virtual void TraceRays(int cameraInstanceId) = 0;
 
 
@@ -52,8 +188,81 @@ public:
 	virtual void UpdateLight(int lightInstanceId, float x, float y, float z, float dx, float dy, float dz, float r, float g, float b, float bounceIntensity, float intensity, float range, float spotAngle, int type, bool enabled) = 0;
 	virtual void RemoveLight(int lightInstanceId) = 0;
 
-	virtual void UpdateCameraMat(float x, float y, float z, float* world2cameraProj) = 0;
-	virtual void UpdateModelMat(int sharedMeshInstanceId, float* l2w) = 0;
+	/// <summary>
+	/// Set the view projection of the camera about to be drawn, the previous one of the same camera is kept for reprojection
+	/// </summary>
+	/// <param name="cameraInstanceId">Instance id of the camera</param>
+	/// <param name="x"></param>
+	/// <param name="y"></param>
+	/// <param name="z"></param>
+	/// <param name="world2cameraProj">GPU projection * world to camera</param>
+	virtual void UpdateCameraMat(int cameraInstanceId, float x, float y, float z, float* world2cameraProj) = 0;
+
+	/// <summary>
+	/// Set file used to persist the pipeline cache between launches, must be called before Prepare
+	/// </summary>
+	/// <param name="path"></param>
+	virtual void SetPipelineCachePath(const char* path) = 0;
+
+	/// <summary>
+	/// Set size of the camera target the ray query pass renders into, needed to bin lights into screen tiles
+	/// </summary>
+	/// <param name="width"></param>
+	/// <param name="height"></param>
+	virtual void SetRenderTargetSize(int width, int height) = 0;
+
+	/// <summary>
+	/// Draw a depth only pass first so ray queries only run for visible fragments, must be called before Prepare
+	/// </summary>
+	/// <param name="enabled"></param>
+	virtual void SetDepthPrepass(bool enabled) = 0;
+
+	/// <summary>
+	/// Set the textures used by TraceShadowsCompute, a downsample of 0 disables the compute shadow pass
+	/// </summary>
+	/// <param name="depthTexture">Native pointer of the camera depth texture</param>
+	/// <param name="outputTexture">Native pointer of a random write texture at camera resolution, receives shadow in r and AO in g</param>
+	/// <param name="downsample">Trace at 1 / downsample of the output resolution, 2 or 4</param>
+	virtual void SetComputeShadowTargets(void* depthTexture, void* outputTexture, int downsample) = 0;
+
+	/// <summary>
+	/// Trace shadow and AO from the camera depth at low resolution and upsample into the output texture, must run outside a render pass
+	/// </summary>
+	virtual void TraceShadowsCompute() = 0;
+
+	/// <summary>
+	/// Trace a couple of rotated rays per pixel each frame and accumulate them over reprojected history instead of the full ray set
+	/// </summary>
+	/// <param name="enabled"></param>
+	virtual void SetComputeShadowTemporal(bool enabled) = 0;
+
+	/// <summary>
+	/// Select the ray query quality tier, each tier compiles its own specialized pipelines
+	/// </summary>
+	/// <param name="tier">RayQueryQualityTier, -1 picks one from the device type</param>
+	virtual void SetQualityTier(int tier) = 0;
+
+	/// <summary>
+	/// Select how meshes added from CPU data are reordered before upload, applies to meshes added afterwards.
+	/// The reordering runs on the thread that adds the mesh, only meshes above MeshOptimizer's chunk size spread across the workers.
+	/// Debug builds log the ACMR before and after
+	/// </summary>
+	/// <param name="flags">MeshOptimizer::kOptimize* bits, 0 (the default) uploads them as they are</param>
+	virtual void SetMeshOptimization(int flags) = 0;
+
+	/// <summary>
+	/// Split long, thin triangles of meshes added from CPU data before their BLAS is built, the draw keeps the original
+	/// triangles. Applies to meshes added afterwards
+	/// </summary>
+	/// <param name="areaRatio">Split while a triangle's bounding box surface is above this times its area, 0 disables splitting</param>
+	/// <param name="budget">Most triangles the BLAS may get, as a multiple of the mesh's triangle count</param>
+	virtual void SetTriangleSplitting(float areaRatio, float budget) = 0;
+
+	/// <summary>
+	/// Bin the registered lights into screen tiles so TraceRays only traces shadow rays for the lights of each tile.
+	/// Has to run outside a render pass before TraceRays, without it every light is visited per pixel
+	/// </summary>
+	virtual void CullLights() = 0;
 };
 
 
@@ -3,7 +3,12 @@
 
 #include "VulkanRTShader.h"
 #include "VulkanRTData.h"
+#include "MeshIngest.h"
+#include "MeshOptimizer.h"
+#include "MeshSplitter.h"
+#include <algorithm>
 #include <array>
+#include <cstddef>
 
 template<typename T, typename... Args>
 std::unique_ptr<T> make_unique(Args&&... args) {
@@ -48,19 +53,75 @@ RenderAPI_VulkanRayQuery::RenderAPI_VulkanRayQuery()
 	, computeQueue_(VK_NULL_HANDLE)
 	, graphicsCommandPool_(VK_NULL_HANDLE)
 	, transferCommandPool_(VK_NULL_HANDLE)
+	, physicalDeviceProperties_(VkPhysicalDeviceProperties())
 	, physicalDeviceMemoryProperties_(VkPhysicalDeviceMemoryProperties())
 	, rayTracingProperties_(VkPhysicalDeviceRayTracingPipelinePropertiesKHR())
 
+	, pushDescriptorSupported_(false)
 	, alreadyPrepared_(false)
 	, alreadyProcessEvent(false)
+	, generatedShadingBytes_(0)
+	, meshRepackDescriptorSetLayout_(VK_NULL_HANDLE)
+	, meshRepackPipelineLayout_(VK_NULL_HANDLE)
+	, meshRepackPipeline_(VK_NULL_HANDLE)
+	, meshRepackDescriptorPool_(VK_NULL_HANDLE)
+	, meshOptimizeFlags_(0)
+	, triangleSplitAreaRatio_(0.0f)
+	, triangleSplitBudget_(1.0f)
+	, activeArena_(VulkanRT::VulkanRTData::kNoArena)
+	, nextArena_(VulkanRT::VulkanRTData::kNoArena + 1)
+	, instanceDataSlot_(0)
+	, instanceDataDirtyBegin_(0)
+	, instanceDataDirtyEnd_(0)
+	, tlas_(VulkanRT::VulkanRTData::RayTracerAccelerationStructure())
 	, rebuildTlas_(true)
 	, updateTlas_(false)
-	, tlas_(VulkanRT::VulkanRTData::RayTracerAccelerationStructure())
-	, descriptorPool_(VK_NULL_HANDLE)
+	, transformArenaWrite_(0)
+	, transformArenaPublished_(false)
 
 	//rt query
 	, globalUniformBufferInfo(VkDescriptorBufferInfo())
+	, rayQueryDescSet(VK_NULL_HANDLE)
+	, descriptorPool_(VK_NULL_HANDLE)
+	, descriptorUpdateTemplate_(VK_NULL_HANDLE)
 	, rayQueryPipelieLayout(VK_NULL_HANDLE)
+	, fallbackPipeline_(VK_NULL_HANDLE)
+	, qualityTier_(RayQueryQualityTier::Auto)
+	, requestedQualityTier_(RayQueryQualityTier::Auto)
+	, staleFallbackPipeline_(VK_NULL_HANDLE)
+	, depthPrepass_(false)
+	, depthPrepassPipeline_(VK_NULL_HANDLE)
+	, depthPrepassPipelinePending_(false)
+	, compiledDepthPrepassPipeline_(VK_NULL_HANDLE)
+	, renderTargetWidth_(0)
+	, renderTargetHeight_(0)
+	, computeShadowDownsample_(0)
+	, computeShadowDepthTexture_(nullptr)
+	, computeShadowOutputTexture_(nullptr)
+	, computeShadowDescriptorSetLayout_(VK_NULL_HANDLE)
+	, computeShadowPipelineLayout_(VK_NULL_HANDLE)
+	, computeShadowTracePipeline_(VK_NULL_HANDLE)
+	, computeShadowUpsamplePipeline_(VK_NULL_HANDLE)
+	, computeShadowDescriptorPool_(VK_NULL_HANDLE)
+	, computeShadowSampler_(VK_NULL_HANDLE)
+	, computeShadowShadersMissingLogged_(false)
+	, visibilityExtent_(VkExtent2D())
+	, computeShadowTemporal_(false)
+	, computeShadowFrameIndex_(0)
+	, historyIndex_(0)
+	, historyValid_(false)
+	, historyCameraInstanceId_(0)
+	, lightsDirty_(true)
+	, lightSampleFrameIndex_(0)
+	, lightSlot_(0)
+	, tileLightSlot_(0)
+	, lightTileConstants_(LightTileConstants())
+	, lightTileFrameNumber_(0)
+	, lightCullDescriptorSetLayout_(VK_NULL_HANDLE)
+	, lightCullPipelineLayout_(VK_NULL_HANDLE)
+	, lightCullPipeline_(VK_NULL_HANDLE)
+	, lightCullDescriptorPool_(VK_NULL_HANDLE)
+	, meshRepackFailed_(false)
 {
 
 }
@@ -338,6 +399,7 @@ void ResolvePropertiesAndQueues_RayQuery(VkPhysicalDevice physicalDevice) {
 
 	NativeLogger::LogInfo("Getting physical device properties");
 	vkGetPhysicalDeviceProperties2(physicalDevice, &physicalDeviceProperties);
+	RenderAPI_VulkanRayQuery::Instance().physicalDeviceProperties_ = physicalDeviceProperties.properties;
 
 	// Get memory properties
 	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &RenderAPI_VulkanRayQuery::Instance().physicalDeviceMemoryProperties_);
@@ -455,6 +517,18 @@ VkResult CreateDevice_RayQuery(VkPhysicalDevice physicalDevice, const VkDeviceCr
 		}
 	}
 
+	// Optional, descriptors fall back to a ring of descriptor sets without it
+	RenderAPI_VulkanRayQuery::Instance().pushDescriptorSupported_ = false;
+	for (auto const& supportExt : s_RayQueryphysicalDeviceExtensionVec) {
+		if (strcmp(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME, supportExt) == 0)
+		{
+			requiredExtensions.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+			RenderAPI_VulkanRayQuery::Instance().pushDescriptorSupported_ = true;
+			break;
+		}
+	}
+	NativeLogger::LogInfoFormat("Push descriptors %s", RenderAPI_VulkanRayQuery::Instance().pushDescriptorSupported_ ? "enabled" : "not supported");
+
 	VkDeviceCreateInfo deviceCreateInfo;
 	deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 	deviceCreateInfo.pNext = &deviceFeatures;
@@ -725,6 +799,12 @@ bool RenderAPI_VulkanRayQuery::ProcessDeviceEvent(UnityGfxDeviceEventType type,
 		eventConfig.flags = kUnityVulkanEventConfigFlag_EnsurePreviousFrameSubmission | kUnityVulkanEventConfigFlag_ModifiesCommandBuffersState;
 		m_UnityVulkan->ConfigureEvent(1, &eventConfig);
 
+		// Compute dispatches and texture transitions are not allowed inside a render pass
+		eventConfig.renderPassPrecondition = kUnityVulkanRenderPass_EnsureOutside;
+		m_UnityVulkan->ConfigureEvent(2, &eventConfig);
+		m_UnityVulkan->ConfigureEvent(3, &eventConfig);
+		m_UnityVulkan->ConfigureEvent(4, &eventConfig);
+
 		InitializeFromUnityInstance(m_UnityVulkan);
 
 		alreadyProcessEvent = true;
@@ -734,7 +814,20 @@ bool RenderAPI_VulkanRayQuery::ProcessDeviceEvent(UnityGfxDeviceEventType type,
 
 		if (m_Instance.device != VK_NULL_HANDLE)
 		{
-			GarbageCollect(true);
+			// Let in-flight compiles finish so their pipelines are destroyed below and land in the saved cache
+			if (workerPool_)
+			{
+				workerPool_->WaitIdle();
+				SwapInCompiledPipelines(0);
+			}
+
+			// Every frame is done by now, this also frees the mesh repack sets before their pool goes
+			// and any pipeline SwapInCompiledPipelines just retired
+			GarbageCollect(UINT64_MAX);
+
+			pipelineCache_.Save();
+			pipelineCache_.Destroy();
+
 			if (rayQueryPipelineMap.size() > 0)
 			{
 				for (auto itor = rayQueryPipelineMap.begin(); itor != rayQueryPipelineMap.end(); ++itor)
@@ -744,14 +837,60 @@ bool RenderAPI_VulkanRayQuery::ProcessDeviceEvent(UnityGfxDeviceEventType type,
 				}
 				rayQueryPipelineMap.clear();
 			}
+			fallbackPipeline_ = VK_NULL_HANDLE;
+			pendingPipelines_.clear();
+
+			if (staleFallbackPipeline_ != VK_NULL_HANDLE)
+			{
+				vkDestroyPipeline(m_Instance.device, staleFallbackPipeline_, NULL);
+				staleFallbackPipeline_ = VK_NULL_HANDLE;
+			}
+
+			if (depthPrepassPipeline_ != VK_NULL_HANDLE)
+			{
+				vkDestroyPipeline(m_Instance.device, depthPrepassPipeline_, NULL);
+				depthPrepassPipeline_ = VK_NULL_HANDLE;
+			}
+			depthPrepassPipelinePending_ = false;
+
+			if (descriptorUpdateTemplate_ != VK_NULL_HANDLE)
+			{
+				vkDestroyDescriptorUpdateTemplateKHR(m_Instance.device, descriptorUpdateTemplate_, NULL);
+				descriptorUpdateTemplate_ = VK_NULL_HANDLE;
+			}
+			descriptorSetSlots_.clear();
+
+			for (auto& slot : instanceDataSlots_)
+			{
+				slot.buffer.Destroy();
+			}
+			instanceDataSlots_.clear();
+			instanceDataSlot_ = 0;
 
 			if (rayQueryPipelieLayout != VK_NULL_HANDLE)
 			{
 				vkDestroyPipelineLayout(m_Instance.device, rayQueryPipelieLayout, NULL);
 				rayQueryPipelieLayout = VK_NULL_HANDLE;
 			}
+
+			drawList_.clear();
+
+			DestroyMeshUploads();
+
+			for (auto& mesh : tlasRetiredSharedMeshes_)
+			{
+				VulkanRT::VulkanRTData::RayTracerGarbageMesh(m_Instance.device, std::move(mesh)).Destroy();
+			}
+			tlasRetiredSharedMeshes_.clear();
+			retiredSharedMeshIds_.clear();
+
+			DestroyComputeShadowResources();
+			DestroyLightResources();
+			DestroyMeshRepackResources();
 		}
 
+		workerPool_.reset();
+
 		m_UnityVulkan = NULL;
 		m_Instance = UnityVulkanInstance();
 		break;
@@ -760,6 +899,59 @@ bool RenderAPI_VulkanRayQuery::ProcessDeviceEvent(UnityGfxDeviceEventType type,
 	return true;
 }
 
+// Constant values of each RayQueryQualityTier for ray_shadow.frag
+static RayQueryShadowSpecialization GetQualitySpecialization(RayQueryQualityTier qualityTier)
+{
+	RayQueryShadowSpecialization specialization;
+	specialization.ao_samples_each = 3;
+	specialization.ao_max_distance = 2.0f;
+	specialization.ray_tmin = 0.01f;
+	specialization.enable_ao = VK_TRUE;
+	specialization.enable_shadow = VK_TRUE;
+	specialization.shadow_ray_budget = 2;
+
+	switch (qualityTier)
+	{
+	case RayQueryQualityTier::ShadowsOnly:
+		specialization.ao_samples_each = 0;
+		specialization.enable_ao = VK_FALSE;
+		specialization.shadow_ray_budget = 4;
+		break;
+	case RayQueryQualityTier::AO4:
+		specialization.ao_samples_each = 2;
+		specialization.shadow_ray_budget = 1;
+		break;
+	case RayQueryQualityTier::AO16:
+		specialization.ao_samples_each = 4;
+		specialization.shadow_ray_budget = 4;
+		break;
+	case RayQueryQualityTier::AOOnly:
+		specialization.enable_shadow = VK_FALSE;
+		break;
+	default:
+		break;
+	}
+
+	return specialization;
+}
+
+// Integrated and software devices start on 4 AO rays, everything else on the original 9
+static RayQueryQualityTier ResolveQualityTier(RayQueryQualityTier qualityTier, const VkPhysicalDeviceProperties& physicalDeviceProperties)
+{
+	if (qualityTier != RayQueryQualityTier::Auto)
+	{
+		return qualityTier;
+	}
+
+	switch (physicalDeviceProperties.deviceType)
+	{
+	case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+		return RayQueryQualityTier::AO9;
+	default:
+		return RayQueryQualityTier::AO4;
+	}
+}
+
 void RenderAPI_VulkanRayQuery::Prepare()
 {
 	NativeLogger::LogInfo("Native Do Prepare");
@@ -788,6 +980,47 @@ void RenderAPI_VulkanRayQuery::Prepare()
 
 	NativeLogger::LogInfo("after createDescriptor");
 
+	if (pipelineCache_.Create(device_, physicalDeviceProperties_, pipelineCachePath_) != VK_SUCCESS)
+	{
+		NativeLogger::LogWarn("Create PipelineCache Failed");
+	}
+
+	if (!workerPool_)
+	{
+		workerPool_.reset(new VulkanRT::ThreadPool());
+	}
+
+	NativeLogger::LogInfoFormat("Mesh ingest kernels %s", VulkanRT::MeshIngest::GetKernelName());
+#ifndef NDEBUG
+	if (!VulkanRT::MeshIngest::VerifyKernels())
+	{
+		NativeLogger::LogError("Mesh ingest kernels don't match the scalar path");
+	}
+#endif
+
+	// Meshes only go through the transfer queue when it is a family of its own, AddSharedMesh writes mapped buffers otherwise
+	if (transferQueue_ != VK_NULL_HANDLE && transferQueueFamilyIndex_ != graphicsQueueFamilyIndex_ && transferCommandPool_ == VK_NULL_HANDLE)
+	{
+		VkCommandPoolCreateInfo commandPoolCreateInfo = {};
+		commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		commandPoolCreateInfo.queueFamilyIndex = transferQueueFamilyIndex_;
+
+		if (vkCreateCommandPool(device_, &commandPoolCreateInfo, nullptr, &transferCommandPool_) != VK_SUCCESS
+			|| meshStagingRing_.Create(device_, physicalDeviceMemoryProperties_, kMeshStagingRingSize) != VK_SUCCESS)
+		{
+			NativeLogger::LogWarn("Mesh staging ring unavailable, meshes are uploaded through mapped buffers");
+			if (transferCommandPool_ != VK_NULL_HANDLE)
+			{
+				vkDestroyCommandPool(device_, transferCommandPool_, nullptr);
+				transferCommandPool_ = VK_NULL_HANDLE;
+			}
+		}
+	}
+
+	qualityTier_ = requestedQualityTier_ = ResolveQualityTier(requestedQualityTier_, physicalDeviceProperties_);
+	NativeLogger::LogInfoFormat("Ray query quality tier %d", static_cast<int>(qualityTier_));
+
 	globalUniformData_.Create(
 		"GlobalUniform",
 		device_,
@@ -801,6 +1034,14 @@ void RenderAPI_VulkanRayQuery::Prepare()
 	globalUniformBufferInfo.offset = 0;
 	globalUniformBufferInfo.range = globalUniformData_.GetSize();
 
+	// Light and tile counts are only written when lights are uploaded or culled, so they must start at 0
+	memset(globalUniformData_.Map(), 0, sizeof(GlobalUniform));
+	globalUniformData_.Unmap();
+
+	// Bound by every draw, so they exist before the first instance or light is added or culled
+	UploadInstanceData(0, 0);
+	UploadLights(0, 0);
+	EnsureTileLightBuffer(1, 0, 0);
 
 	NativeLogger::LogInfo("after data create");
 
@@ -812,6 +1053,9 @@ void RenderAPI_VulkanRayQuery::Prepare()
 
 void RenderAPI_VulkanRayQuery::SetShaderData(int type, const unsigned char* data, int dataSize)
 {
+	// Pipelines are compiled on the worker pool and the render thread, they take a copy under the same lock
+	std::lock_guard<std::mutex> lock(shaderDataMutex_);
+
 	if (type == 0) {
 		rayShadowVertData.assign(data, data + dataSize);
 		rayShadowVertDataSize = dataSize;
@@ -821,6 +1065,32 @@ void RenderAPI_VulkanRayQuery::SetShaderData(int type, const unsigned char* data
 		rayShadowFragData.assign(data, data + dataSize);
 		rayShadowFragDataSize = dataSize;
 	}
+	else if (type == 2)
+	{
+		rayDepthVertData.assign(data, data + dataSize);
+		rayDepthVertDataSize = dataSize;
+	}
+	else if (type == 3)
+	{
+		rayShadowTraceCompData.assign(data, data + dataSize);
+		rayShadowTraceCompDataSize = dataSize;
+	}
+	else if (type == 4)
+	{
+		rayShadowUpsampleCompData.assign(data, data + dataSize);
+		rayShadowUpsampleCompDataSize = dataSize;
+	}
+	else if (type == 5)
+	{
+		rayLightCullCompData.assign(data, data + dataSize);
+		rayLightCullCompDataSize = dataSize;
+	}
+	else if (type == 6)
+	{
+		rayMeshRepackCompData.assign(data, data + dataSize);
+		rayMeshRepackCompDataSize = dataSize;
+		meshRepackFailed_ = false;
+	}
 }
 
 void RenderAPI_VulkanRayQuery::TraceRays(int cameraInstanceId)
@@ -844,53 +1114,195 @@ void RenderAPI_VulkanRayQuery::TraceRays(int cameraInstanceId)
 	if (rayQueryPipelieLayout == VK_NULL_HANDLE)
 	{
 		CreatePipelineLayout();
-		BuildDescriptorBufferInfos(cameraInstanceId, recordingState.currentFrameNumber);
-		UpdateDescriptorSets(cameraInstanceId, recordingState.currentFrameNumber);
 		if (rayQueryPipelieLayout == VK_NULL_HANDLE)
 		{
 			GarbageCollect(recordingState.safeFrameNumber);
 			return;
 		}
+		CreateDescriptorUpdateTemplate();
+	}
+
+	// A grown light buffer is a new handle too, and instance data changes switch to another copy
+	UploadInstanceData(recordingState.currentFrameNumber, recordingState.safeFrameNumber);
+	UploadLights(recordingState.currentFrameNumber, recordingState.safeFrameNumber);
+
+	{
+		auto globalUniform = reinterpret_cast<GlobalUniform*>(globalUniformData_.Map());
+		globalUniform->frame_index = lightSampleFrameIndex_++;
+		globalUniformData_.Unmap();
 	}
 
+	// TLAS rebuilds create a new handle, so this runs every frame and only writes when something changed
+	UpdateDescriptorSets(recordingState.currentFrameNumber, recordingState.safeFrameNumber);
+
 	{
+		ApplyQualityTier(recordingState.currentFrameNumber);
+		SwapInCompiledPipelines(recordingState.currentFrameNumber);
 		CreatePipeline(recordingState.renderPass);
 	}
 
 	if (0 != rayQueryPipelineMap.size() && rayQueryPipelieLayout != VK_NULL_HANDLE)
 	{
-		BuildAndSubmitRayTracingCommandBuffer(cameraInstanceId, recordingState.commandBuffer, recordingState.currentFrameNumber);
+		BuildAndSubmitRayTracingCommandBuffer(recordingState);
 	}
 
 	GarbageCollect(recordingState.safeFrameNumber);
 }
 
 
+// Light buffer element for the values Unity passes, spotAngle is the full cone angle in degrees
+static RayQueryLight MakeLight(int lightInstanceId, float x, float y, float z, float dx, float dy, float dz, float r, float g, float b, float intensity, float range, float spotAngle, int type, bool enabled)
+{
+	RayQueryLight light;
+	light.position_range = vec4(x, y, z, range);
+	light.direction_cos_angle = vec4(glm::normalize(vec3(dx, dy, dz)), cosf(glm::radians(spotAngle * 0.5f)));
+	light.color_intensity = vec4(r, g, b, intensity);
+	light.type = type;
+	light.enabled = enabled ? 1 : 0;
+	light.light_instance_id = lightInstanceId;
+	light.padding = 0;
+
+	// Area lights are baked only in Unity, there is nothing to trace for them
+	if (type != kRayQueryLightTypeSpot && type != kRayQueryLightTypeDirectional && type != kRayQueryLightTypePoint)
+	{
+		light.enabled = 0;
+	}
+
+	return light;
+}
+
+// Rough power of a light for importance sampling, local lights reach further with range and spot lights cover part of the sphere
+static float LightImportance(const RayQueryLight& light)
+{
+	if (light.enabled == 0)
+	{
+		return 0.0f;
+	}
+
+	float importance = std::max(light.color_intensity.x, std::max(light.color_intensity.y, light.color_intensity.z)) * light.color_intensity.w;
+	if (light.type != kRayQueryLightTypeDirectional)
+	{
+		importance *= light.position_range.w;
+	}
+	if (light.type == kRayQueryLightTypeSpot)
+	{
+		importance *= std::max(0.5f * (1.0f - light.direction_cos_angle.w), 0.01f);
+	}
+
+	return std::max(importance, 0.0f);
+}
+
+// Vose's alias method, O(n) to build and O(1) to sample on the GPU
+static void BuildLightAliasTable(const RayQueryLight* lights, uint32_t lightCount, std::vector<RayQueryLightAlias>& table)
+{
+	table.resize(lightCount);
+
+	std::vector<float> scaled(lightCount);
+	double totalImportance = 0.0;
+	for (uint32_t i = 0; i < lightCount; ++i)
+	{
+		scaled[i] = LightImportance(lights[i]);
+		totalImportance += scaled[i];
+	}
+
+	std::vector<uint32_t> small;
+	std::vector<uint32_t> large;
+	for (uint32_t i = 0; i < lightCount; ++i)
+	{
+		table[i].threshold = 1.0f;
+		table[i].alias = i;
+		table[i].pdf = totalImportance > 0.0 ? static_cast<float>(scaled[i] / totalImportance) : 0.0f;
+		table[i].padding = 0;
+
+		scaled[i] = totalImportance > 0.0 ? static_cast<float>(scaled[i] * lightCount / totalImportance) : 1.0f;
+		(scaled[i] < 1.0f ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		const uint32_t less = small.back();
+		const uint32_t more = large.back();
+		small.pop_back();
+
+		table[less].threshold = scaled[less];
+		table[less].alias = more;
+
+		scaled[more] -= 1.0f - scaled[less];
+		if (scaled[more] < 1.0f)
+		{
+			large.pop_back();
+			small.push_back(more);
+		}
+	}
+
+	// Whatever is left is 1 up to rounding and keeps its own column
+}
+
 AddResourceResult RenderAPI_VulkanRayQuery::AddLight(int lightInstanceId, float x, float y, float z, float dx, float dy, float dz, float r, float g, float b, float bounceIntensity, float intensity, float range, float spotAngle, int type, bool enabled)
 {
+	if (lightPool_.find(lightInstanceId) != lightPool_.in_use_end())
+	{
+		return AddResourceResult::AlreadyExists;
+	}
+
+	lightPool_.add(lightInstanceId, MakeLight(lightInstanceId, x, y, z, dx, dy, dz, r, g, b, intensity, range, spotAngle, type, enabled));
+	lightsDirty_ = true;
+
 	return AddResourceResult::Success;
 }
 
 void RenderAPI_VulkanRayQuery::UpdateLight(int lightInstanceId, float x, float y, float z, float dx, float dy, float dz, float r, float g, float b, float bounceIntensity, float intensity, float range, float spotAngle, int type, bool enabled)
 {
-	auto globalUniform = reinterpret_cast<GlobalUniform*>(globalUniformData_.Map());
-	globalUniform->light_position = vec3(x, y, z);
-	globalUniform->light_direction = vec3(dx, dy, dz);
-	globalUniformData_.Unmap();
+	if (lightPool_.find(lightInstanceId) != lightPool_.in_use_end())
+	{
+		lightPool_[lightInstanceId] = MakeLight(lightInstanceId, x, y, z, dx, dy, dz, r, g, b, intensity, range, spotAngle, type, enabled);
+		lightsDirty_ = true;
+	}
+
+	// The compute shadow pass and the fallback with no registered lights still trace a single light
+	if (type == kRayQueryLightTypeDirectional && globalUniformData_.GetBuffer() != VK_NULL_HANDLE)
+	{
+		auto globalUniform = reinterpret_cast<GlobalUniform*>(globalUniformData_.Map());
+		globalUniform->light_position = vec3(x, y, z);
+		globalUniform->light_direction = vec3(dx, dy, dz);
+		globalUniformData_.Unmap();
+	}
 }
 
 void RenderAPI_VulkanRayQuery::RemoveLight(int lightInstanceId)
 {
-	
+	if (lightPool_.find(lightInstanceId) == lightPool_.in_use_end())
+	{
+		return;
+	}
+
+	// Leaves a zeroed, disabled element, so indices of the other lights stay valid
+	lightPool_.remove(lightInstanceId);
+	lightsDirty_ = true;
 }
 
 
-void RenderAPI_VulkanRayQuery::UpdateCameraMat(float x, float y, float z, float* world2cameraProj)
+void RenderAPI_VulkanRayQuery::UpdateCameraMat(int cameraInstanceId, float x, float y, float z, float* world2cameraProj)
 {
 	auto globaluniform = reinterpret_cast<GlobalUniform*>(globalUniformData_.Map());
-	
+
 	FloatArrayToMatrixNoTranspose(world2cameraProj, globaluniform->view_proj);
 
+	// Temporal accumulation reprojects into this camera's view of its last frame, a camera seen for the first time has no motion
+	auto prevViewProj = cameraViewProjs_.find(cameraInstanceId);
+	globaluniform->prev_view_proj = prevViewProj != cameraViewProjs_.end() ? prevViewProj->second : globaluniform->view_proj;
+	cameraViewProjs_[cameraInstanceId] = globaluniform->view_proj;
+
+	// The history was accumulated from another camera
+	if (historyCameraInstanceId_ != cameraInstanceId)
+	{
+		historyValid_ = false;
+		historyCameraInstanceId_ = cameraInstanceId;
+	}
+
+	// The compute shadow pass rebuilds world positions from depth with it
+	globaluniform->inv_view_proj = glm::inverse(globaluniform->view_proj);
+
 	globaluniform->camera_position.x = x;
 	globaluniform->camera_position.y = y;
 	globaluniform->camera_position.z = z;
@@ -898,16 +1310,9 @@ void RenderAPI_VulkanRayQuery::UpdateCameraMat(float x, float y, float z, float*
 	globalUniformData_.Unmap();
 }
 
-
-void RenderAPI_VulkanRayQuery::UpdateModelMat(int sharedMeshInstanceId, float* l2w)
+void RenderAPI_VulkanRayQuery::SetPipelineCachePath(const char* path)
 {
-	auto it = sharedMeshesL2WMatrices_.find(sharedMeshInstanceId);
-	if (it != sharedMeshesL2WMatrices_.end()) {
-		sharedMeshesL2WMatrices_[sharedMeshInstanceId] = l2w;
-	}
-	else {
-		sharedMeshesL2WMatrices_.insert(std::make_pair(sharedMeshInstanceId, l2w));
-	}
+	pipelineCachePath_ = (nullptr == path) ? std::string() : std::string(path);
 }
 
 void RenderAPI_VulkanRayQuery::ManualBuildTlas()
@@ -1013,828 +1418,3931 @@ void RenderAPI_VulkanRayQuery::InitializeFromUnityInstance(IUnityGraphicsVulkan*
 
 AddResourceResult RenderAPI_VulkanRayQuery::AddSharedMesh(int sharedMeshInstanceId, float* verticesArray, float* normalsArray, float* tangentsArray, float* uvsArray, int vertexCount, int* indicesArray, int indexCount)
 {
-	// Check that this shared mesh hasn't been added yet
-	if (sharedMeshesPool_.find(sharedMeshInstanceId) != sharedMeshesPool_.in_use_end())
-	{
-		return AddResourceResult::AlreadyExists;
-	}
-
-	// We can only add tris, make sure the index count reflects this
-	assert(indexCount % 3 == 0);
-
-	auto sentMesh = make_unique<VulkanRT::VulkanRTData::RayTracerMeshSharedData>();
-
-	// Setup where we are going to store the shared mesh data and all data needed for shaders
-	sentMesh->sharedMeshInstanceId = sharedMeshInstanceId;
-	sentMesh->vertexCount = vertexCount;
-	sentMesh->indexCount = indexCount;
+	const void* vertexStreams[VulkanRT::MeshIngest::kMaxVertexStreams] = { verticesArray, normalsArray, tangentsArray, uvsArray };
+	return AddSharedMeshData(sharedMeshInstanceId, VulkanRT::MeshIngest::PackedFloat3Layout(tangentsArray != nullptr, uvsArray != nullptr), vertexStreams, vertexCount, indicesArray, nullptr, indexCount);
+}
 
-	static constexpr VkBufferUsageFlags buffer_usage_flags = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+AddResourceResult RenderAPI_VulkanRayQuery::AddSharedMesh16(int sharedMeshInstanceId, float* verticesArray, float* normalsArray, float* tangentsArray, float* uvsArray, int vertexCount, unsigned short* indicesArray, int indexCount)
+{
+	const void* vertexStreams[VulkanRT::MeshIngest::kMaxVertexStreams] = { verticesArray, normalsArray, tangentsArray, uvsArray };
+	return AddSharedMeshData(sharedMeshInstanceId, VulkanRT::MeshIngest::PackedFloat3Layout(tangentsArray != nullptr, uvsArray != nullptr), vertexStreams, vertexCount, nullptr, indicesArray, indexCount);
+}
 
-	// Setup buffers
-	bool success = true;
-	if (sentMesh->vertexBuffer.Create(
-		"vertexBuffer",
-		device_,
-		physicalDeviceMemoryProperties_,
-		sizeof(RayQueryVertex) * sentMesh->vertexCount,
-		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | buffer_usage_flags,
-		VulkanRT::Buffer::kDefaultMemoryPropertyFlags)
-		!= VK_SUCCESS)
+AddResourceResult RenderAPI_VulkanRayQuery::AddSharedMeshLayout(int sharedMeshInstanceId, const VulkanRT::MeshIngest::VertexLayout* vertexLayout, const void* const* vertexStreams, int vertexCount, const void* indices, bool indices16, int indexCount)
+{
+	if (vertexLayout == nullptr || vertexStreams == nullptr || indices == nullptr || vertexCount <= 0 || indexCount <= 0 || indexCount % 3 != 0)
 	{
-		success = false;
+		return AddResourceResult::Error;
 	}
 
-	if (sentMesh->indexBuffer.Create(
-		"indexBuffer",
-		device_,
-		physicalDeviceMemoryProperties_,
-		sizeof(uint32_t) * sentMesh->indexCount,
-		VK_BUFFER_USAGE_INDEX_BUFFER_BIT | buffer_usage_flags,
-		VulkanRT::Buffer::kDefaultMemoryPropertyFlags)
-		!= VK_SUCCESS)
+	if (!VulkanRT::MeshIngest::IsLayoutSupported(*vertexLayout))
 	{
-		success = false;
+		NativeLogger::LogError("AddSharedMeshLayout: unsupported vertex attribute format or offset");
+		return AddResourceResult::Error;
 	}
 
-
-	if (!success)
+	if (vertexStreams[vertexLayout->position.stream] == nullptr || (vertexLayout->normal.stream >= 0 && vertexStreams[vertexLayout->normal.stream] == nullptr)
+		|| (vertexLayout->tangent.stream >= 0 && vertexStreams[vertexLayout->tangent.stream] == nullptr) || (vertexLayout->uv.stream >= 0 && vertexStreams[vertexLayout->uv.stream] == nullptr))
 	{
 		return AddResourceResult::Error;
 	}
 
-	// Creating buffers was successful.  Move onto getting the data in there
-	auto vertices = reinterpret_cast<RayQueryVertex*>(sentMesh->vertexBuffer.Map());
-	auto indices = reinterpret_cast<uint32_t*>(sentMesh->indexBuffer.Map());
+	return AddSharedMeshData(sharedMeshInstanceId, *vertexLayout, vertexStreams, vertexCount,
+		indices16 ? nullptr : static_cast<const int32_t*>(indices), indices16 ? static_cast<const uint16_t*>(indices) : nullptr, indexCount);
+}
 
-	for (int i = 0; i < vertexCount; ++i)
+AddResourceResult RenderAPI_VulkanRayQuery::AddSharedMeshNative(int sharedMeshInstanceId, void* vertexBuffer, int vertexStride, int positionOffset, int positionFormat, int normalOffset, int vertexCount, void* indexBuffer, bool indices16, int indexCount)
+{
+	if (vertexBuffer == nullptr || indexBuffer == nullptr || vertexCount <= 0 || indexCount <= 0 || indexCount % 3 != 0)
 	{
-		// Build for acceleration structure
-		vertices[i].position.x = verticesArray[3 * i + 0];
-		vertices[i].position.y = verticesArray[3 * i + 1];
-		vertices[i].position.z = verticesArray[3 * i + 2];
-
-		vertices[i].normal.x = normalsArray[3 * i + 0];
-		vertices[i].normal.y = normalsArray[3 * i + 1];
-		vertices[i].normal.z = normalsArray[3 * i + 2];
+		return AddResourceResult::Error;
 	}
 
-
-	for (int i = 0; i < indexCount / 3; ++i)
+	// Positions are copied, not converted, so they have to be in the format the BLAS and ray_shadow.vert read
+	if (positionFormat != VK_FORMAT_R32G32B32_SFLOAT)
 	{
-		// Build for acceleration structure
-		indices[3 * i + 0] = static_cast<uint32_t>(indicesArray[3 * i + 0]);
-		indices[3 * i + 1] = static_cast<uint32_t>(indicesArray[3 * i + 1]);
-		indices[3 * i + 2] = static_cast<uint32_t>(indicesArray[3 * i + 2]);
+		NativeLogger::LogError("AddSharedMeshNative only takes VK_FORMAT_R32G32B32_SFLOAT positions");
+		return AddResourceResult::Error;
 	}
 
-	sentMesh->vertexBuffer.Unmap();
-	sentMesh->indexBuffer.Unmap();
+	// ray_mesh_repack.comp reads the stream in 32 bit words
+	if (vertexStride <= 0 || vertexStride % 4 != 0 || positionOffset < 0 || positionOffset % 4 != 0 || normalOffset < 0 || normalOffset % 4 != 0)
+	{
+		NativeLogger::LogError("AddSharedMeshNative: vertex stride and offsets have to be multiples of 4");
+		return AddResourceResult::Error;
+	}
 
-	// All done creating the data, get it added to the pool
-	sharedMeshesPool_.add(sharedMeshInstanceId, std::move(sentMesh));
+	// Refused before anything is registered, so the caller can still add the mesh from its vertex streams
+	if (vertexStride != sizeof(RayQueryVertex) || positionOffset != offsetof(RayQueryVertex, position) || normalOffset != offsetof(RayQueryVertex, normal))
+	{
+		std::lock_guard<std::mutex> lock(shaderDataMutex_);
+		if (rayMeshRepackCompData.empty() || meshRepackFailed_)
+		{
+			NativeLogger::LogWarn("AddSharedMeshNative: ray_meshRepackComp is not available, only the RayQueryVertex layout is taken");
+			return AddResourceResult::Error;
+		}
+	}
 
-	// Build blas here so we don't have to do it later
-	BuildBlas(sharedMeshInstanceId);
+	// Adding it again takes back a RemoveSharedMesh still waiting for its instances
+	removedSharedMeshes_.erase(sharedMeshInstanceId);
 
+	if (!sharedMeshIds_.insert(std::make_pair(sharedMeshInstanceId, VulkanRT::VulkanRTData::RayTracerMeshBounds())).second)
+	{
+		return AddResourceResult::AlreadyExists;
+	}
+	AddArenaSharedMesh(sharedMeshInstanceId);
+
+	VulkanRT::VulkanRTData::RayTracerNativeMeshRequest request;
+	request.sharedMeshInstanceId = sharedMeshInstanceId;
+	request.nativeVertexBuffer = vertexBuffer;
+	request.nativeIndexBuffer = indexBuffer;
+	request.vertexStride = static_cast<uint32_t>(vertexStride);
+	request.positionOffset = static_cast<uint32_t>(positionOffset);
+	request.normalOffset = static_cast<uint32_t>(normalOffset);
+	request.vertexCount = static_cast<uint32_t>(vertexCount);
+	request.indexType = indices16 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+	request.indexCount = static_cast<uint32_t>(indexCount);
+	request.arena = activeArena_;
+
+	std::lock_guard<std::mutex> lock(pendingNativeMeshesMutex_);
+	pendingNativeMeshes_.push_back(request);
 
 	return AddResourceResult::Success;
 }
 
-AddResourceResult RenderAPI_VulkanRayQuery::AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId, float* l2wMatrix, float* w2lMatrix)
+void RenderAPI_VulkanRayQuery::ImportNativeMeshes()
 {
-	if (meshInstancePool_.find(gameObjectInstanceId) != meshInstancePool_.in_use_end())
+	// Retired first, a mesh added again under the same id must not find the old one still in the pool
+	DestroyRetiredSharedMeshes();
+	FinishMeshUploads();
+
+	// Held until the copies are recorded, so IsSharedMeshPending stays true while Unity's buffers are still needed
+	std::lock_guard<std::mutex> lock(pendingNativeMeshesMutex_);
+
+	if (pendingNativeMeshes_.empty())
 	{
-		return AddResourceResult::AlreadyExists;
+		return;
 	}
 
-	meshInstancePool_.add(gameObjectInstanceId, VulkanRT::VulkanRTData::RayTracerMeshInstanceData());
-	auto& instance = meshInstancePool_[gameObjectInstanceId];
-
-	instance.gameObjectInstanceId = gameObjectInstanceId;
-	instance.sharedMeshInstanceId = sharedMeshInstanceId;
+	// Nothing to record into yet, keep them for the next event
+	UnityVulkanRecordingState recordingState;
+	if (!alreadyPrepared_ || !graphicsInterface_->CommandRecordingState(&recordingState, kUnityVulkanGraphicsQueueAccess_DontCare))
+	{
+		return;
+	}
 
-	FloatArrayToMatrix(l2wMatrix, instance.localToWorld);
-	FloatArrayToMatrix(w2lMatrix, instance.worldToLocal);
+	size_t imported = 0;
+	for (; imported < pendingNativeMeshes_.size(); ++imported)
+	{
+		const auto& request = pendingNativeMeshes_[imported];
 
-	instance.instanceData.Create(
-		"instanceData",
-		device_,
-		physicalDeviceMemoryProperties_,
-		sizeof(RayQueryTLASInstanceData),
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		VkDescriptorSet repackSet = VK_NULL_HANDLE;
+		if (request.vertexStride != sizeof(RayQueryVertex) || request.positionOffset != offsetof(RayQueryVertex, position) || request.normalOffset != offsetof(RayQueryVertex, normal))
+		{
+			// Only meshes queued before the failure get here, the later ones are refused by AddSharedMeshNative
+			if (!CreateMeshRepackPipeline())
+			{
+				NativeLogger::LogError("ImportNativeMeshes: ray_meshRepackComp pipeline not created, meshes that don't have the RayQueryVertex layout are dropped");
+				{
+					std::lock_guard<std::mutex> shaderLock(shaderDataMutex_);
+					meshRepackFailed_ = true;
+				}
+				continue;
+			}
 
-		VulkanRT::Buffer::kDefaultMemoryPropertyFlags
-	);
+			VkDescriptorSetAllocateInfo descriptor_set_allocate_info{};
+			descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+			descriptor_set_allocate_info.descriptorPool = meshRepackDescriptorPool_;
+			descriptor_set_allocate_info.descriptorSetCount = 1;
+			descriptor_set_allocate_info.pSetLayouts = &meshRepackDescriptorSetLayout_;
 
-	rebuildTlas_ = true;
+			// Every set is still in flight, the rest waits for the next event
+			if (vkAllocateDescriptorSets(device_, &descriptor_set_allocate_info, &repackSet) != VK_SUCCESS)
+			{
+				break;
+			}
 
-	NativeLogger::LogInfo("Create TLAS Done");
+			VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbageSet;
+			garbageSet.buffer = make_unique<VulkanRT::VulkanRTData::RayTracerGarbageDescriptorSet>(device_, meshRepackDescriptorPool_, repackSet);
+			garbageSet.frameCount = recordingState.currentFrameNumber;
+			garbageBuffers_.push_back(std::move(garbageSet));
+		}
 
+		if (ImportNativeMesh(recordingState.commandBuffer, repackSet, request))
+		{
+			// Instances that were added while the mesh was pending go into the next TLAS
+			rebuildTlas_ = true;
+		}
+	}
+	pendingNativeMeshes_.erase(pendingNativeMeshes_.begin(), pendingNativeMeshes_.begin() + imported);
 
-	return AddResourceResult::Success;
+	if (!pendingNativeMeshes_.empty())
+	{
+		GarbageCollect(recordingState.safeFrameNumber);
+	}
 }
 
-
-void RenderAPI_VulkanRayQuery::UpdateTlasInstance(int gameObjectInstanceId, float* l2wMatrix, float* w2lMatrix)
+bool RenderAPI_VulkanRayQuery::ImportNativeMesh(VkCommandBuffer commandBuffer, VkDescriptorSet repackSet, const VulkanRT::VulkanRTData::RayTracerNativeMeshRequest& request)
 {
-	FloatArrayToMatrix(l2wMatrix, meshInstancePool_[gameObjectInstanceId].localToWorld);
-	FloatArrayToMatrix(w2lMatrix, meshInstancePool_[gameObjectInstanceId].worldToLocal);
-	updateTlas_ = true;
+	const bool repack = repackSet != VK_NULL_HANDLE;
+
+	// Unity records the barrier that makes its last writes visible to our reads
+	UnityVulkanBuffer unityVertexBuffer;
+	UnityVulkanBuffer unityIndexBuffer;
+	if (!graphicsInterface_->AccessBuffer(request.nativeVertexBuffer,
+			repack ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT,
+			repack ? VK_ACCESS_SHADER_READ_BIT : VK_ACCESS_TRANSFER_READ_BIT,
+			kUnityVulkanResourceAccess_PipelineBarrier, &unityVertexBuffer)
+		|| !graphicsInterface_->AccessBuffer(request.nativeIndexBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, kUnityVulkanResourceAccess_PipelineBarrier, &unityIndexBuffer))
+	{
+		NativeLogger::LogError("ImportNativeMeshes: Unity mesh buffer not accessible");
+		return false;
+	}
 
-	//NativeLogger::LogInfo("Update TLAS Done");
-}
-
-void RenderAPI_VulkanRayQuery::RemoveTlasInstance(int gameObjectInstanceId)
-{
-	meshInstancePool_.remove(gameObjectInstanceId);
-	rebuildTlas_ = true;
-}
-
-void RenderAPI_VulkanRayQuery::BuildBlas(int sharedMeshInstanceId)
-{
-	// Create buffers for the bottom level geometry
-
-		// Setup a single transformation matrix that can be used to transform the whole geometry for a single bottom level acceleration structure
-	VkTransformMatrixKHR transformMatrix = {
-		1.0f, 0.0f, 0.0f, 0.0f,
-		0.0f, 1.0f, 0.0f, 0.0f,
-		0.0f, 0.0f, 1.0f, 0.0f };
-
-	auto transformBuffer = make_unique<VulkanRT::Buffer>();
-	transformBuffer->Create(
-		"transformBuffer",
-		device_,
-		physicalDeviceMemoryProperties_,
-		sizeof(VkTransformMatrixKHR),
-		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-		VulkanRT::Buffer::kDefaultMemoryPropertyFlags);
-	transformBuffer->UploadData(&transformMatrix, sizeof(VkTransformMatrixKHR));
-
-
-	// The bottom level acceleration structure contains one set of triangles as the input geometry
-	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = {};
-	accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-	accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+	if ((unityIndexBuffer.usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT) == 0 || (!repack && (unityVertexBuffer.usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT) == 0))
+	{
+		NativeLogger::LogError("ImportNativeMeshes: mesh buffers need GraphicsBuffer.Target.CopySource");
+		return false;
+	}
 
-	accelerationStructureGeometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-	accelerationStructureGeometry.geometry.triangles.pNext = nullptr;
-	accelerationStructureGeometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-	accelerationStructureGeometry.geometry.triangles.vertexData = sharedMeshesPool_[sharedMeshInstanceId]->vertexBuffer.GetBufferDeviceAddressConst();
-	accelerationStructureGeometry.geometry.triangles.maxVertex = sharedMeshesPool_[sharedMeshInstanceId]->vertexCount;
-	accelerationStructureGeometry.geometry.triangles.vertexStride = sizeof(RayQueryVertex);
-	accelerationStructureGeometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
-	accelerationStructureGeometry.geometry.triangles.indexData = sharedMeshesPool_[sharedMeshInstanceId]->indexBuffer.GetBufferDeviceAddressConst();
-	accelerationStructureGeometry.geometry.triangles.transformData = transformBuffer->GetBufferDeviceAddressConst();
+	if (repack && (unityVertexBuffer.usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) == 0)
+	{
+		NativeLogger::LogError("ImportNativeMeshes: a vertex buffer that needs repacking needs GraphicsBuffer.Target.Raw");
+		return false;
+	}
 
-	// Get the size requirements for buffers involved in the acceleration structure build process
-	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo = {};
-	accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-	accelerationStructureBuildGeometryInfo.geometryCount = 1;
-	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+	const VkDeviceSize indexSize = request.indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+	// The block copy reads whole vertices, the repack only up to the last normal or position
+	const VkDeviceSize lastVertexEnd = repack
+		? static_cast<VkDeviceSize>(request.vertexStride) * (request.vertexCount - 1) + std::max(request.positionOffset, request.normalOffset) + sizeof(vec3)
+		: sizeof(RayQueryVertex) * static_cast<VkDeviceSize>(request.vertexCount);
+	if (lastVertexEnd > unityVertexBuffer.sizeInBytes || indexSize * request.indexCount > unityIndexBuffer.sizeInBytes)
+	{
+		NativeLogger::LogError("ImportNativeMeshes: vertex layout or counts don't fit the Unity buffers");
+		return false;
+	}
 
-	// Number of triangles 
-	const uint32_t primitiveCount = sharedMeshesPool_[sharedMeshInstanceId]->indexCount / 3;
+	auto sentMesh = make_unique<VulkanRT::VulkanRTData::RayTracerMeshSharedData>();
+	sentMesh->sharedMeshInstanceId = request.sharedMeshInstanceId;
+	sentMesh->vertexCount = static_cast<int>(request.vertexCount);
+	sentMesh->indexCount = static_cast<int>(request.indexCount);
+	sentMesh->indexType = request.indexType;
+	sentMesh->arena = request.arena;
 
-	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo = {};
-	accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-	vkGetAccelerationStructureBuildSizesKHR(
-		device_,
-		VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-		&accelerationStructureBuildGeometryInfo,
-		&primitiveCount,
-		&accelerationStructureBuildSizesInfo);
+	// Only ever written by the commands below, so it can live in device local memory
+	static constexpr VkBufferUsageFlags buffer_usage_flags = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 
-	// Create a buffer to hold the acceleration structure
-	sharedMeshesPool_[sharedMeshInstanceId]->blas.buffer.Create(
-		"blas",
+	if (sentMesh->vertexBuffer.Create(
+		"vertexBuffer",
 		device_,
 		physicalDeviceMemoryProperties_,
-		accelerationStructureBuildSizesInfo.accelerationStructureSize,
-		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR,
-		VulkanRT::Buffer::kDefaultMemoryPropertyFlags);
-
-	// Create the acceleration structure
-	VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo = {};
-	accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-	accelerationStructureCreateInfo.buffer = sharedMeshesPool_[sharedMeshInstanceId]->blas.buffer.GetBuffer();
-	accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
-	accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-	vkCreateAccelerationStructureKHR(device_, &accelerationStructureCreateInfo, nullptr, &sharedMeshesPool_[sharedMeshInstanceId]->blas.accelerationStructure);
-
-	// The actual build process starts here
-	// Create a scratch buffer as a temporary storage for the acceleration structure build
-	auto scratchBuffer = make_unique<VulkanRT::Buffer>();
-	scratchBuffer->Create(
-		"scratch",
+		sizeof(RayQueryVertex) * request.vertexCount,
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | buffer_usage_flags,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != VK_SUCCESS
+		|| sentMesh->indexBuffer.Create(
+		"indexBuffer",
 		device_,
 		physicalDeviceMemoryProperties_,
-		accelerationStructureBuildSizesInfo.buildScratchSize,
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo = { };
-	accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-	accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-	accelerationBuildGeometryInfo.dstAccelerationStructure = sharedMeshesPool_[sharedMeshInstanceId]->blas.accelerationStructure;
-	accelerationBuildGeometryInfo.geometryCount = 1;
-	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-	accelerationBuildGeometryInfo.scratchData = scratchBuffer->GetBufferDeviceAddress();
+		indexSize * request.indexCount,
+		VK_BUFFER_USAGE_INDEX_BUFFER_BIT | buffer_usage_flags,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != VK_SUCCESS)
+	{
+		NativeLogger::LogError("ImportNativeMeshes: Create mesh buffers Failed");
+		return false;
+	}
 
-	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo = { };
-	accelerationStructureBuildRangeInfo.primitiveCount = primitiveCount;
-	accelerationStructureBuildRangeInfo.primitiveOffset = 0;
-	accelerationStructureBuildRangeInfo.firstVertex = 0;
-	accelerationStructureBuildRangeInfo.transformOffset = 0;
-	std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationStructureBuildRangeInfos = { &accelerationStructureBuildRangeInfo };
+	if (repack)
+	{
+		// Unity's interleaved stream into the RayQueryVertex layout, one invocation per vertex
+		//  binding 0  ->  Unity's vertex stream
+		//  binding 1  ->  Repacked vertices
+		VkDescriptorBufferInfo sourceInfo = { unityVertexBuffer.buffer, 0, VK_WHOLE_SIZE };
+		VkDescriptorBufferInfo repackedInfo = { sentMesh->vertexBuffer.GetBuffer(), 0, VK_WHOLE_SIZE };
+
+		std::array<VkWriteDescriptorSet, 2> descriptorWrites = {};
+		for (uint32_t i = 0; i < descriptorWrites.size(); ++i)
+		{
+			descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[i].dstSet = repackSet;
+			descriptorWrites[i].dstBinding = i;
+			descriptorWrites[i].descriptorCount = 1;
+			descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		}
+		descriptorWrites[0].pBufferInfo = &sourceInfo;
+		descriptorWrites[1].pBufferInfo = &repackedInfo;
 
-	// Get the bottom acceleration structure's handle, which will be used during the top level acceleration build
-	VkAccelerationStructureDeviceAddressInfoKHR accelerationStructureDeviceAddressInfo{};
-	accelerationStructureDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-	accelerationStructureDeviceAddressInfo.accelerationStructure = sharedMeshesPool_[sharedMeshInstanceId]->blas.accelerationStructure;
-	sharedMeshesPool_[sharedMeshInstanceId]->blas.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(device_, &accelerationStructureDeviceAddressInfo);
+		vkUpdateDescriptorSets(device_, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, VK_NULL_HANDLE);
 
-	graphicsInterface_->EnsureOutsideRenderPass();
+		MeshRepackConstants constants;
+		constants.vertex_count = request.vertexCount;
+		constants.stride_words = request.vertexStride / 4;
+		constants.position_word = request.positionOffset / 4;
+		constants.normal_word = request.normalOffset / 4;
 
-	UnityVulkanRecordingState recordingState;
-	if (!graphicsInterface_->CommandRecordingState(&recordingState, kUnityVulkanGraphicsQueueAccess_DontCare))
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, meshRepackPipeline_);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, meshRepackPipelineLayout_, 0, 1, &repackSet, 0, nullptr);
+		vkCmdPushConstants(commandBuffer, meshRepackPipelineLayout_, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MeshRepackConstants), &constants);
+		vkCmdDispatch(commandBuffer, (request.vertexCount + 63) / 64, 1, 1);
+	}
+	else
 	{
-		return;
+		// Already laid out as RayQueryVertex, the stream is copied as one block
+		const VkBufferCopy vertexRegion = { 0, 0, sizeof(RayQueryVertex) * static_cast<VkDeviceSize>(request.vertexCount) };
+		vkCmdCopyBuffer(commandBuffer, unityVertexBuffer.buffer, sentMesh->vertexBuffer.GetBuffer(), 1, &vertexRegion);
 	}
 
-	vkCmdBuildAccelerationStructuresKHR(
-		recordingState.commandBuffer,
-		1,
-		&accelerationBuildGeometryInfo,
-		accelerationStructureBuildRangeInfos.data());
+	const VkBufferCopy indexRegion = { 0, 0, indexSize * request.indexCount };
+	vkCmdCopyBuffer(commandBuffer, unityIndexBuffer.buffer, sentMesh->indexBuffer.GetBuffer(), 1, &indexRegion);
 
-	auto index = garbageBuffers_.size();
-	garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
-	garbageBuffers_[index].frameCount = recordingState.currentFrameNumber;
-	garbageBuffers_[index].buffer = std::move(scratchBuffer);
+	VkMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = repack ? static_cast<VkAccessFlags>(VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT) : static_cast<VkAccessFlags>(VK_ACCESS_TRANSFER_WRITE_BIT);
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		repack ? static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT) : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_TRANSFER_BIT),
+		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
 
-	index = garbageBuffers_.size();
-	garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
-	garbageBuffers_[index].frameCount = recordingState.currentFrameNumber;
-	garbageBuffers_[index].buffer = std::move(transformBuffer);
+	sharedMeshesPool_.add(request.sharedMeshInstanceId, std::move(sentMesh));
+
+	// Records into the same command buffer, after the copies
+	BuildBlas(request.sharedMeshInstanceId);
+
+	return true;
 }
 
-void RenderAPI_VulkanRayQuery::BuildTlas(VkCommandBuffer commandBuffer, uint64_t currentFrameNumber)
+bool RenderAPI_VulkanRayQuery::CreateMeshRepackPipeline()
 {
-	if (rebuildTlas_ == false && updateTlas_ == false)
+	if (meshRepackPipeline_ != VK_NULL_HANDLE)
 	{
-		return;
+		return true;
 	}
 
-	bool update = updateTlas_;
-	if (rebuildTlas_) {
-		update = false;
+	std::vector<char> meshRepackData;
+	{
+		std::lock_guard<std::mutex> lock(shaderDataMutex_);
+		meshRepackData = rayMeshRepackCompData;
 	}
 
-	if (meshInstancePool_.in_use_size() == 0)
+	if (meshRepackData.empty())
 	{
-		return;
+		return false;
 	}
 
-	if (!update)
+	if (meshRepackDescriptorSetLayout_ == VK_NULL_HANDLE)
 	{
-		std::vector<VkAccelerationStructureInstanceKHR> instanceAccelerationStructures;
-		instanceAccelerationStructures.resize(meshInstancePool_.in_use_size(), VkAccelerationStructureInstanceKHR{});
-
-		uint32_t instanceAccelerationStructuresIndex = 0;
-		for (auto i = meshInstancePool_.in_use_begin(); i != meshInstancePool_.in_use_end(); ++i)
+		std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings;
+		for (uint32_t i = 0; i < 2; ++i)
 		{
-			auto gameObjectInstanceId = (*i).first;
+			VkDescriptorSetLayoutBinding binding{};
+			binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+			binding.binding = i;
+			binding.descriptorCount = 1;
+			set_layout_bindings.push_back(binding);
+		}
 
-			auto& instance = meshInstancePool_[gameObjectInstanceId];
+		VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+		descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		descriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(set_layout_bindings.size());
+		descriptorSetLayoutCreateInfo.pBindings = set_layout_bindings.data();
 
-			const auto& t = instance.localToWorld;
-			VkTransformMatrixKHR transformMatrix = {
-				t[0][0], t[0][1], t[0][2], t[0][3],
-				t[1][0], t[1][1], t[1][2], t[1][3],
-				t[2][0], t[2][1], t[2][2], t[2][3]
-			};
+		VkResult result = vkCreateDescriptorSetLayout(device_, &descriptorSetLayoutCreateInfo, nullptr, &meshRepackDescriptorSetLayout_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create mesh repack DescSetLayout Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			meshRepackDescriptorSetLayout_ = VK_NULL_HANDLE;
+			return false;
+		}
 
-			VkAccelerationStructureInstanceKHR& accelerationStructureInstance = instanceAccelerationStructures[instanceAccelerationStructuresIndex];
-			accelerationStructureInstance.transform = transformMatrix;
-			accelerationStructureInstance.instanceCustomIndex = instanceAccelerationStructuresIndex;
-			accelerationStructureInstance.mask = 0xFF;
-			accelerationStructureInstance.instanceShaderBindingTableRecordOffset = 0;
-			accelerationStructureInstance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-			accelerationStructureInstance.accelerationStructureReference = sharedMeshesPool_[instance.sharedMeshInstanceId]->blas.deviceAddress;
+		std::vector<VkDescriptorPoolSize> pool_sizes = {
+			{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * kMaxMeshRepackSets},
+		};
 
-			auto instanceData = reinterpret_cast<RayQueryTLASInstanceData*>(instance.instanceData.Map());
+		// Sets go back one by one as the frames that used them finish
+		VkDescriptorPoolCreateInfo descriptor_pool_info{};
+		descriptor_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		descriptor_pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+		descriptor_pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+		descriptor_pool_info.pPoolSizes = pool_sizes.data();
+		descriptor_pool_info.maxSets = kMaxMeshRepackSets;
 
+		result = vkCreateDescriptorPool(device_, &descriptor_pool_info, nullptr, &meshRepackDescriptorPool_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create mesh repack Pool Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			meshRepackDescriptorPool_ = VK_NULL_HANDLE;
+			return false;
+		}
+	}
 
-			instanceData->localToWorld = instance.localToWorld;
-			instanceData->worldToLocal = instance.worldToLocal;
+	if (meshRepackPipelineLayout_ == VK_NULL_HANDLE)
+	{
+		VkPushConstantRange push_constant;
+		push_constant.offset = 0;
+		push_constant.size = sizeof(MeshRepackConstants);
+		push_constant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+		VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+		pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipeline_layout_create_info.pushConstantRangeCount = 1;
+		pipeline_layout_create_info.pPushConstantRanges = &push_constant;
+		pipeline_layout_create_info.setLayoutCount = 1;
+		pipeline_layout_create_info.pSetLayouts = &meshRepackDescriptorSetLayout_;
+
+		VkResult result = vkCreatePipelineLayout(device_, &pipeline_layout_create_info, nullptr, &meshRepackPipelineLayout_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create mesh repack PipelineLayout Failed");
+			meshRepackPipelineLayout_ = VK_NULL_HANDLE;
+			return false;
+		}
+	}
 
-			instance.instanceData.Unmap();
+	VulkanRT::Shader shader(device_);
+	if (!shader.LoadFromShaderByte(meshRepackData, static_cast<int>(meshRepackData.size())))
+	{
+		return false;
+	}
 
-			++instanceAccelerationStructuresIndex;
-		}
+	VkComputePipelineCreateInfo pipelineCreateInfo = {};
+	pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineCreateInfo.stage = shader.GetShaderStage(VK_SHADER_STAGE_COMPUTE_BIT);
+	pipelineCreateInfo.layout = meshRepackPipelineLayout_;
 
-		instancesAccelerationStructuresBuffer_.Destroy();
+	VkResult result = vkCreateComputePipelines(device_, pipelineCache_.GetPipelineCache(), 1, &pipelineCreateInfo, nullptr, &meshRepackPipeline_);
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogError("Create mesh repack Pipeline Failed");
+		NativeLogger::LogInfo(vkResultToString(result));
+		meshRepackPipeline_ = VK_NULL_HANDLE;
+		return false;
+	}
 
-		instancesAccelerationStructuresBuffer_.Create(
-			"instanceBuffer",
-			device_,
-			physicalDeviceMemoryProperties_,
-			instanceAccelerationStructures.size() * sizeof(VkAccelerationStructureInstanceKHR),
-			VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-			VulkanRT::Buffer::kDefaultMemoryPropertyFlags);
+	return true;
+}
 
-		instancesAccelerationStructuresBuffer_.UploadData(instanceAccelerationStructures.data(), instancesAccelerationStructuresBuffer_.GetSize());
+void RenderAPI_VulkanRayQuery::DestroyMeshRepackResources()
+{
+	if (meshRepackPipeline_ != VK_NULL_HANDLE)
+	{
+		vkDestroyPipeline(device_, meshRepackPipeline_, nullptr);
+		meshRepackPipeline_ = VK_NULL_HANDLE;
 	}
-	else
+	if (meshRepackPipelineLayout_ != VK_NULL_HANDLE)
 	{
-		auto instances = reinterpret_cast<VkAccelerationStructureInstanceKHR*>(instancesAccelerationStructuresBuffer_.Map());
+		vkDestroyPipelineLayout(device_, meshRepackPipelineLayout_, nullptr);
+		meshRepackPipelineLayout_ = VK_NULL_HANDLE;
+	}
+	if (meshRepackDescriptorPool_ != VK_NULL_HANDLE)
+	{
+		vkDestroyDescriptorPool(device_, meshRepackDescriptorPool_, nullptr);
+		meshRepackDescriptorPool_ = VK_NULL_HANDLE;
+	}
+	if (meshRepackDescriptorSetLayout_ != VK_NULL_HANDLE)
+	{
+		vkDestroyDescriptorSetLayout(device_, meshRepackDescriptorSetLayout_, nullptr);
+		meshRepackDescriptorSetLayout_ = VK_NULL_HANDLE;
+	}
+}
 
-		uint32_t instanceAcclerationStructionIndex = 0;
-		for (auto i = meshInstancePool_.in_use_begin(); i != meshInstancePool_.in_use_end(); ++i)
+VulkanRT::VulkanRTData::RayTracerMeshSharedData* RenderAPI_VulkanRayQuery::FindSharedMesh(int sharedMeshInstanceId)
+{
+	auto itor = sharedMeshesPool_.find(sharedMeshInstanceId);
+	return itor != sharedMeshesPool_.in_use_end() ? sharedMeshesPool_.data()[itor->second].get() : nullptr;
+}
+
+bool RenderAPI_VulkanRayQuery::IsSharedMeshPending(int sharedMeshInstanceId)
+{
+	{
+		std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+		for (const auto& upload : meshUploads_)
 		{
-			auto gameObjectInstanceId = (*i).first;
+			if (!upload.cancelled && upload.mesh->sharedMeshInstanceId == sharedMeshInstanceId)
+			{
+				return true;
+			}
+		}
+	}
 
-			auto& instance = meshInstancePool_[gameObjectInstanceId];
+	std::lock_guard<std::mutex> lock(pendingNativeMeshesMutex_);
+	for (const auto& pending : pendingNativeMeshes_)
+	{
+		if (pending.sharedMeshInstanceId == sharedMeshInstanceId)
+		{
+			return true;
+		}
+	}
 
-			const auto& t = instance.localToWorld;
-			VkTransformMatrixKHR transformMatrix = {
-				t[0][0], t[0][1], t[0][2], t[0][3],
-				t[1][0], t[1][1], t[1][2], t[1][3],
-				t[2][0], t[2][1], t[2][2], t[2][3],
-			};
+	return false;
+}
 
-			instances[instanceAcclerationStructionIndex].transform = transformMatrix;
+bool RenderAPI_VulkanRayQuery::GetSharedMeshBounds(int sharedMeshInstanceId, float* boundsMin, float* boundsMax)
+{
+	auto registered = sharedMeshIds_.find(sharedMeshInstanceId);
+	if (registered == sharedMeshIds_.end() || !registered->second.valid || boundsMin == nullptr || boundsMax == nullptr)
+	{
+		return false;
+	}
 
-			auto instanceData = reinterpret_cast<RayQueryTLASInstanceData*>(instance.instanceData.Map());
+	memcpy(boundsMin, &registered->second.min, 3 * sizeof(float));
+	memcpy(boundsMax, &registered->second.max, 3 * sizeof(float));
+	return true;
+}
 
+bool RenderAPI_VulkanRayQuery::SubmitMeshUpload(std::unique_ptr<VulkanRT::VulkanRTData::RayTracerMeshSharedData>& mesh, VkDeviceSize vertexStagingOffset, VkDeviceSize indexStagingOffset)
+{
+	const VkDeviceSize indexSize = mesh->indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
 
-			instanceData->localToWorld = instance.localToWorld;
-			instanceData->worldToLocal = instance.worldToLocal;
+	VulkanRT::VulkanRTData::RayTracerMeshUpload upload;
+	upload.commandBuffer = VK_NULL_HANDLE;
+	upload.fence = VK_NULL_HANDLE;
+	upload.cancelled = false;
 
-			instance.instanceData.Unmap();
+	// Guards transferCommandPool_, recording two copies is short enough to hold it throughout
+	std::lock_guard<std::mutex> lock(meshUploadsMutex_);
 
-			++instanceAcclerationStructionIndex;
-		}
-		instancesAccelerationStructuresBuffer_.Unmap();
+	VkCommandBufferAllocateInfo commandBufferAllocateInfo = {};
+	commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	commandBufferAllocateInfo.commandPool = transferCommandPool_;
+	commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	commandBufferAllocateInfo.commandBufferCount = 1;
+
+	if (vkAllocateCommandBuffers(device_, &commandBufferAllocateInfo, &upload.commandBuffer) != VK_SUCCESS)
+	{
+		return false;
 	}
 
-	VkAccelerationStructureGeometryInstancesDataKHR accelerationStructureGeometryInstancesData = {};
-	accelerationStructureGeometryInstancesData.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-	accelerationStructureGeometryInstancesData.arrayOfPointers = VK_FALSE;
-	accelerationStructureGeometryInstancesData.data.deviceAddress = instancesAccelerationStructuresBuffer_.GetBufferDeviceAddressConst().deviceAddress;
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(upload.commandBuffer, &beginInfo);
 
-	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = {};
-	accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-	accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-	accelerationStructureGeometry.geometry.instances = accelerationStructureGeometryInstancesData;
+	const VkBufferCopy vertexRegion = { vertexStagingOffset, 0, sizeof(RayQueryVertex) * static_cast<VkDeviceSize>(mesh->vertexCount) };
+	const VkBufferCopy indexRegion = { indexStagingOffset, 0, indexSize * static_cast<VkDeviceSize>(mesh->indexCount) };
+	vkCmdCopyBuffer(upload.commandBuffer, meshStagingRing_.GetBuffer(), mesh->vertexBuffer.GetBuffer(), 1, &vertexRegion);
+	vkCmdCopyBuffer(upload.commandBuffer, meshStagingRing_.GetBuffer(), mesh->indexBuffer.GetBuffer(), 1, &indexRegion);
 
-	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo = {};
-	accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-	accelerationStructureBuildGeometryInfo.geometryCount = 1;
-	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+	// Release half of the ownership transfer, FinishMeshUploads records the acquire on the graphics queue
+	VkBufferMemoryBarrier barriers[2] = {};
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		barriers[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		barriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barriers[i].dstAccessMask = 0;
+		barriers[i].srcQueueFamilyIndex = transferQueueFamilyIndex_;
+		barriers[i].dstQueueFamilyIndex = graphicsQueueFamilyIndex_;
+		barriers[i].offset = 0;
+		barriers[i].size = VK_WHOLE_SIZE;
+	}
+	barriers[0].buffer = mesh->vertexBuffer.GetBuffer();
+	barriers[1].buffer = mesh->indexBuffer.GetBuffer();
+	vkCmdPipelineBarrier(upload.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 2, barriers, 0, nullptr);
 
-	uint32_t instancesCount = static_cast<uint32_t>(meshInstancePool_.in_use_size());
+	vkEndCommandBuffer(upload.commandBuffer);
 
-	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo = {};
-	accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-	vkGetAccelerationStructureBuildSizesKHR(
-		device_,
-		VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-		&accelerationStructureBuildGeometryInfo,
-		&instancesCount,
-		&accelerationStructureBuildSizesInfo
-	);
+	VkFenceCreateInfo fenceCreateInfo = {};
+	fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 
-	if (!update)
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &upload.commandBuffer;
+
+	if (vkCreateFence(device_, &fenceCreateInfo, nullptr, &upload.fence) != VK_SUCCESS
+		|| vkQueueSubmit(transferQueue_, 1, &submitInfo, upload.fence) != VK_SUCCESS)
 	{
-		if (tlas_.accelerationStructure != VK_NULL_HANDLE)
+		if (upload.fence != VK_NULL_HANDLE)
 		{
-			vkDestroyAccelerationStructureKHR(device_, tlas_.accelerationStructure, nullptr);
+			vkDestroyFence(device_, upload.fence, nullptr);
 		}
-		tlas_.buffer.Destroy();
+		vkFreeCommandBuffers(device_, transferCommandPool_, 1, &upload.commandBuffer);
+		return false;
+	}
 
-		tlas_.buffer.Create(
-			"tlas",
-			device_,
-			physicalDeviceMemoryProperties_,
-			accelerationStructureBuildSizesInfo.accelerationStructureSize,
-			VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR,
-			VulkanRT::Buffer::kDefaultMemoryPropertyFlags
-		);
+	upload.mesh = std::move(mesh);
+	meshUploads_.push_back(std::move(upload));
 
-		VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo = {};
-		accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-		accelerationStructureCreateInfo.buffer = tlas_.buffer.GetBuffer();
-		accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
-		accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-		vkCreateAccelerationStructureKHR(device_, &accelerationStructureCreateInfo, nullptr, &tlas_.accelerationStructure);
+	return true;
+}
+
+void RenderAPI_VulkanRayQuery::FinishMeshUploads()
+{
+	std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+
+	if (meshUploads_.empty())
+	{
+		return;
 	}
 
-	//ʵʴtlas
-	auto scratchBuffer = make_unique<VulkanRT::Buffer>();
-	scratchBuffer->Create(
-		"scratch",
+	UnityVulkanRecordingState recordingState;
+	if (!graphicsInterface_->CommandRecordingState(&recordingState, kUnityVulkanGraphicsQueueAccess_DontCare))
+	{
+		return;
+	}
+
+	// The transfer queue runs them in order, stop at the first one still copying so the ring is released front to back.
+	// Meshes written straight into host visible buffers have no fence and are done right away
+	size_t finished = 0;
+	size_t transferred = 0;
+	while (finished < meshUploads_.size() &&
+		(meshUploads_[finished].fence == VK_NULL_HANDLE || vkGetFenceStatus(device_, meshUploads_[finished].fence) == VK_SUCCESS))
+	{
+		if (meshUploads_[finished].fence != VK_NULL_HANDLE)
+		{
+			++transferred;
+		}
+		++finished;
+	}
+
+	if (finished == 0)
+	{
+		return;
+	}
+
+	// Acquire half of the ownership transfers, the fence already ordered the copies before this submission
+	std::vector<VkBufferMemoryBarrier> barriers;
+	barriers.reserve(transferred * 2);
+	for (size_t i = 0; i < finished; ++i)
+	{
+		if (meshUploads_[i].fence == VK_NULL_HANDLE)
+		{
+			continue;
+		}
+
+		const auto& mesh = meshUploads_[i].mesh;
+		for (uint32_t j = 0; j < 2; ++j)
+		{
+			VkBufferMemoryBarrier barrier = {};
+			barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+			barrier.srcQueueFamilyIndex = transferQueueFamilyIndex_;
+			barrier.dstQueueFamilyIndex = graphicsQueueFamilyIndex_;
+			barrier.buffer = j == 0 ? mesh->vertexBuffer.GetBuffer() : mesh->indexBuffer.GetBuffer();
+			barrier.offset = 0;
+			barrier.size = VK_WHOLE_SIZE;
+			barriers.push_back(barrier);
+		}
+	}
+	if (!barriers.empty())
+	{
+		vkCmdPipelineBarrier(recordingState.commandBuffer,
+			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+			VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+			0, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data(), 0, nullptr);
+	}
+
+	for (size_t i = 0; i < finished; ++i)
+	{
+		auto& upload = meshUploads_[i];
+		const int sharedMeshInstanceId = upload.mesh->sharedMeshInstanceId;
+
+		if (upload.fence != VK_NULL_HANDLE)
+		{
+			vkDestroyFence(device_, upload.fence, nullptr);
+			vkFreeCommandBuffers(device_, transferCommandPool_, 1, &upload.commandBuffer);
+			meshStagingRing_.ReleaseOldest();
+		}
+
+		if (upload.cancelled)
+		{
+			VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbageMesh;
+			garbageMesh.buffer = ::make_unique<VulkanRT::VulkanRTData::RayTracerGarbageMesh>(device_, std::move(upload.mesh));
+			garbageMesh.frameCount = recordingState.currentFrameNumber;
+			garbageBuffers_.push_back(std::move(garbageMesh));
+			continue;
+		}
+
+		sharedMeshesPool_.add(sharedMeshInstanceId, std::move(upload.mesh));
+
+		// Records into the same command buffer, after the acquire
+		BuildBlas(sharedMeshInstanceId);
+	}
+	meshUploads_.erase(meshUploads_.begin(), meshUploads_.begin() + finished);
+
+	// Instances that were added while the meshes were uploading go into the next TLAS
+	rebuildTlas_ = true;
+}
+
+void RenderAPI_VulkanRayQuery::DestroyMeshUploads()
+{
+	std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+
+	if (transferQueue_ != VK_NULL_HANDLE && !meshUploads_.empty())
+	{
+		vkQueueWaitIdle(transferQueue_);
+	}
+
+	for (auto& upload : meshUploads_)
+	{
+		vkDestroyFence(device_, upload.fence, nullptr);
+		VulkanRT::VulkanRTData::RayTracerGarbageMesh(device_, std::move(upload.mesh)).Destroy();
+	}
+	meshUploads_.clear();
+
+	if (transferCommandPool_ != VK_NULL_HANDLE)
+	{
+		vkDestroyCommandPool(device_, transferCommandPool_, nullptr);
+		transferCommandPool_ = VK_NULL_HANDLE;
+	}
+
+	meshStagingRing_.Destroy();
+}
+
+AddResourceResult RenderAPI_VulkanRayQuery::AddSharedMeshData(int sharedMeshInstanceId, const VulkanRT::MeshIngest::VertexLayout& vertexLayout, const void* const* vertexStreams, int vertexCount, const int32_t* indices32, const uint16_t* indices16, int indexCount)
+{
+	// Adding it again takes back a RemoveSharedMesh still waiting for its instances
+	removedSharedMeshes_.erase(sharedMeshInstanceId);
+
+	// Check that this shared mesh hasn't been added yet
+	if (sharedMeshIds_.find(sharedMeshInstanceId) != sharedMeshIds_.end())
+	{
+		return AddResourceResult::AlreadyExists;
+	}
+
+	// We can only add tris, make sure the index count reflects this
+	assert(indexCount % 3 == 0);
+
+	auto sentMesh = make_unique<VulkanRT::VulkanRTData::RayTracerMeshSharedData>();
+
+	// Setup where we are going to store the shared mesh data and all data needed for shaders
+	sentMesh->sharedMeshInstanceId = sharedMeshInstanceId;
+	sentMesh->vertexCount = vertexCount;
+	sentMesh->indexCount = indexCount;
+	sentMesh->arena = activeArena_;
+
+	// 32 bit indices are only kept when a 16 bit index can't reach every vertex
+	sentMesh->indexType = (indices16 != nullptr || vertexCount <= 65536) ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+	const size_t indexSize = sentMesh->indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+
+	VulkanRT::VulkanRTData::RayTracerMeshBounds bounds;
+	bounds.valid = true;
+
+	// Generating normals or tangents, reordering or splitting the mesh reads the vertices back, so they are gathered into
+	// cached memory first. Tangents are generated from the uvs when the mesh has those but no tangents
+	const bool splitTriangles = triangleSplitAreaRatio_ > 0.0f && triangleSplitBudget_ > 1.0f;
+	const bool generateNormals = vertexLayout.normal.stream < 0;
+	const bool generateTangents = vertexLayout.uv.stream >= 0 && vertexLayout.tangent.stream < 0;
+	std::vector<RayQueryVertex> cachedVertices;
+	std::vector<RayQueryVertexAttributes> cachedAttributes;
+	std::vector<uint32_t> cachedIndices;
+	if (generateNormals || generateTangents || meshOptimizeFlags_ != 0 || splitTriangles)
+	{
+		cachedVertices.resize(vertexCount);
+		VulkanRT::MeshIngest::GatherVertices(cachedVertices.data(), vertexLayout, vertexStreams, static_cast<uint32_t>(vertexCount), &bounds.min, &bounds.max);
+
+		// Reordering moves the attributes with their vertices
+		if ((meshOptimizeFlags_ != 0 || generateTangents) && VulkanRT::MeshIngest::HasAttributes(vertexLayout))
+		{
+			cachedAttributes.resize(vertexCount);
+			VulkanRT::MeshIngest::GatherAttributes(cachedAttributes.data(), vertexLayout, vertexStreams, static_cast<uint32_t>(vertexCount));
+		}
+
+		if (generateNormals || generateTangents)
+		{
+			GenerateShading(cachedVertices, cachedAttributes, generateNormals, generateTangents, indices32, indices16, indexCount);
+		}
+
+		if (meshOptimizeFlags_ != 0 || splitTriangles)
+		{
+			if (indices16 != nullptr)
+			{
+				cachedIndices.assign(indices16, indices16 + indexCount);
+			}
+			else
+			{
+				cachedIndices.assign(indices32, indices32 + indexCount);
+			}
+
+			if (std::any_of(cachedIndices.begin(), cachedIndices.end(), [vertexCount](uint32_t index) { return index >= static_cast<uint32_t>(vertexCount); }))
+			{
+				NativeLogger::LogWarn("AddSharedMesh: Index out of range, mesh uploaded without reordering or splitting");
+				cachedIndices.clear();
+			}
+		}
+
+		float acmrBefore = 0.0f;
+		float acmrAfter = 0.0f;
+		if (meshOptimizeFlags_ != 0 && !cachedIndices.empty() &&
+			VulkanRT::MeshOptimizer::OptimizeMesh(cachedVertices.data(), static_cast<uint32_t>(vertexCount), cachedIndices.data(), static_cast<uint32_t>(indexCount),
+				meshOptimizeFlags_, workerPool_.get(), acmrBefore, acmrAfter, cachedAttributes.empty() ? nullptr : cachedAttributes.data()))
+		{
+			// The index type is already decided, the reordered indices are narrowed like any other 32 bit input
+			indices32 = reinterpret_cast<const int32_t*>(cachedIndices.data());
+			indices16 = nullptr;
+#ifndef NDEBUG
+			NativeLogger::LogInfoFormat("AddSharedMesh: Mesh %d ACMR %.3f -> %.3f", sharedMeshInstanceId, acmrBefore, acmrAfter);
+#endif
+		}
+
+		// Split after reordering so the split set starts from the final vertex order
+		std::vector<vec3> splitPositions;
+		std::vector<uint32_t> splitIndices;
+		const uint32_t maxSplitTriangles = static_cast<uint32_t>(std::min(static_cast<double>(indexCount / 3) * triangleSplitBudget_, static_cast<double>(UINT32_MAX / 3)));
+		if (splitTriangles && !cachedIndices.empty() &&
+			VulkanRT::MeshSplitter::SplitLongTriangles(cachedVertices.data(), static_cast<uint32_t>(vertexCount), cachedIndices.data(), static_cast<uint32_t>(indexCount),
+				triangleSplitAreaRatio_, maxSplitTriangles, splitPositions, splitIndices) &&
+			CreateBlasInput(*sentMesh, splitPositions, splitIndices))
+		{
+			NativeLogger::LogInfoFormat("AddSharedMesh: Mesh %d split from %d to %d triangles for the BLAS", sharedMeshInstanceId, indexCount / 3, static_cast<int>(splitIndices.size() / 3));
+		}
+	}
+
+	if (VulkanRT::MeshIngest::HasAttributes(vertexLayout) && vertexCount > 0)
+	{
+		CreateAttributeBuffer(*sentMesh, vertexLayout, vertexStreams, cachedAttributes.empty() ? nullptr : cachedAttributes.data());
+	}
+
+	// With room in the staging ring the data is written there and copied into device local buffers on the transfer queue.
+	// Only the main thread allocates from the ring and pushes to meshUploads_, so both happen in the same order without
+	// holding meshUploadsMutex_ while the data is written
+	const VkDeviceSize vertexStagingSize = (sizeof(RayQueryVertex) * static_cast<VkDeviceSize>(vertexCount) + 15) & ~static_cast<VkDeviceSize>(15);
+	VkDeviceSize vertexStagingOffset = 0;
+	uint8_t* staging = nullptr;
+	if (transferCommandPool_ != VK_NULL_HANDLE)
+	{
+		std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+		staging = static_cast<uint8_t*>(meshStagingRing_.Allocate(vertexStagingSize + indexSize * indexCount, 16, vertexStagingOffset));
+	}
+
+	static constexpr VkBufferUsageFlags buffer_usage_flags = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	const VkBufferUsageFlags stagingUsageFlags = staging != nullptr ? static_cast<VkBufferUsageFlags>(VK_BUFFER_USAGE_TRANSFER_DST_BIT) : static_cast<VkBufferUsageFlags>(0);
+	const VkMemoryPropertyFlags memoryPropertyFlags = staging != nullptr ? static_cast<VkMemoryPropertyFlags>(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) : static_cast<VkMemoryPropertyFlags>(VulkanRT::Buffer::kDefaultMemoryPropertyFlags);
+
+	// Setup buffers
+	bool success = true;
+	if (sentMesh->vertexBuffer.Create(
+		"vertexBuffer",
 		device_,
 		physicalDeviceMemoryProperties_,
-		accelerationStructureBuildSizesInfo.buildScratchSize,
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-	);
+		sizeof(RayQueryVertex) * sentMesh->vertexCount,
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | buffer_usage_flags | stagingUsageFlags,
+		memoryPropertyFlags)
+		!= VK_SUCCESS)
+	{
+		success = false;
+	}
 
-	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo = {};
-	accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
-	accelerationBuildGeometryInfo.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-	accelerationBuildGeometryInfo.srcAccelerationStructure = update ? tlas_.accelerationStructure : VK_NULL_HANDLE;
-	accelerationBuildGeometryInfo.dstAccelerationStructure = tlas_.accelerationStructure;
-	accelerationBuildGeometryInfo.geometryCount = 1;
-	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-	accelerationBuildGeometryInfo.scratchData = scratchBuffer->GetBufferDeviceAddress();
+	if (sentMesh->indexBuffer.Create(
+		"indexBuffer",
+		device_,
+		physicalDeviceMemoryProperties_,
+		indexSize * sentMesh->indexCount,
+		VK_BUFFER_USAGE_INDEX_BUFFER_BIT | buffer_usage_flags | stagingUsageFlags,
+		memoryPropertyFlags)
+		!= VK_SUCCESS)
+	{
+		success = false;
+	}
 
-	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo;
-	accelerationStructureBuildRangeInfo.primitiveCount = static_cast<uint32_t>(meshInstancePool_.in_use_size());
-	accelerationStructureBuildRangeInfo.primitiveOffset = 0;
-	accelerationStructureBuildRangeInfo.firstVertex = 0;
-	accelerationStructureBuildRangeInfo.transformOffset = 0;
 
-	std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationStructureBuildRangeInfos = { &accelerationStructureBuildRangeInfo };
+	if (!success)
+	{
+		if (staging != nullptr)
+		{
+			std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+			meshStagingRing_.ReleaseNewest();
+		}
+		VulkanRT::VulkanRTData::RayTracerGarbageMesh(device_, std::move(sentMesh)).Destroy();
+		return AddResourceResult::Error;
+	}
 
-	VkAccelerationStructureDeviceAddressInfoKHR accelerationStructureDeviceAddressInfo = {};
-	accelerationStructureDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-	accelerationStructureDeviceAddressInfo.accelerationStructure = tlas_.accelerationStructure;
-	tlas_.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(device_, &accelerationStructureDeviceAddressInfo);
+	// Creating buffers was successful.  Move onto getting the data in there
+	auto vertices = staging != nullptr ? reinterpret_cast<RayQueryVertex*>(staging) : reinterpret_cast<RayQueryVertex*>(sentMesh->vertexBuffer.Map());
+	auto indices = staging != nullptr ? static_cast<void*>(staging + vertexStagingSize) : sentMesh->indexBuffer.Map();
 
-	vkCmdBuildAccelerationStructuresKHR(
-		commandBuffer,
-		1,
-		&accelerationBuildGeometryInfo,
-		accelerationStructureBuildRangeInfos.data()
-	);
+	// Mapped memory is usually write-combined, the kernels only ever write it in whole vertices
+	if (!cachedVertices.empty())
+	{
+		VulkanRT::MeshIngest::CopyVertices(vertices, cachedVertices.data(), static_cast<uint32_t>(vertexCount));
+	}
+	else
+	{
+		VulkanRT::MeshIngest::GatherVertices(vertices, vertexLayout, vertexStreams, static_cast<uint32_t>(vertexCount), &bounds.min, &bounds.max);
+	}
+	if (indices16 != nullptr)
+	{
+		VulkanRT::MeshIngest::CopyIndices16(reinterpret_cast<uint16_t*>(indices), indices16, static_cast<uint32_t>(indexCount));
+	}
+	else if (sentMesh->indexType == VK_INDEX_TYPE_UINT16)
+	{
+		VulkanRT::MeshIngest::NarrowIndices(reinterpret_cast<uint16_t*>(indices), indices32, static_cast<uint32_t>(indexCount));
+	}
+	else
+	{
+		VulkanRT::MeshIngest::CopyIndices(reinterpret_cast<uint32_t*>(indices), indices32, static_cast<uint32_t>(indexCount));
+	}
+
+	if (staging != nullptr)
+	{
+		// The BLAS is built by FinishMeshUploads once the copy is done
+		if (!SubmitMeshUpload(sentMesh, vertexStagingOffset, vertexStagingOffset + vertexStagingSize))
+		{
+			NativeLogger::LogError("AddSharedMesh: Submit mesh upload Failed");
+			{
+				std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+				meshStagingRing_.ReleaseNewest();
+			}
+			VulkanRT::VulkanRTData::RayTracerGarbageMesh(device_, std::move(sentMesh)).Destroy();
+			return AddResourceResult::Error;
+		}
+		sharedMeshIds_[sharedMeshInstanceId] = bounds;
+		AddArenaSharedMesh(sharedMeshInstanceId);
+		return AddResourceResult::Success;
+	}
+
+	sentMesh->vertexBuffer.Unmap();
+	sentMesh->indexBuffer.Unmap();
+
+	// Already in place, FinishMeshUploads adds it to the pool and builds the BLAS on the render thread
+	VulkanRT::VulkanRTData::RayTracerMeshUpload upload;
+	upload.mesh = std::move(sentMesh);
+	upload.commandBuffer = VK_NULL_HANDLE;
+	upload.fence = VK_NULL_HANDLE;
+	upload.cancelled = false;
+	{
+		std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+		meshUploads_.push_back(std::move(upload));
+	}
+	sharedMeshIds_[sharedMeshInstanceId] = bounds;
+	AddArenaSharedMesh(sharedMeshInstanceId);
+
+	return AddResourceResult::Success;
+}
+
+// Only the facing and opacity bits are meaningful for an instance
+static const VkGeometryInstanceFlagsKHR kInstanceFlagsMask =
+	VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR | VK_GEOMETRY_INSTANCE_TRIANGLE_FLIP_FACING_BIT_KHR |
+	VK_GEOMETRY_INSTANCE_FORCE_OPAQUE_BIT_KHR | VK_GEOMETRY_INSTANCE_FORCE_NO_OPAQUE_BIT_KHR;
+
+AddResourceResult RenderAPI_VulkanRayQuery::AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId, float* l2wMatrix, float* w2lMatrix, int mask, int flags)
+{
+	if (meshInstancePool_.find(gameObjectInstanceId) != meshInstancePool_.in_use_end())
+	{
+		return AddResourceResult::AlreadyExists;
+	}
+
+	meshInstancePool_.add(gameObjectInstanceId, VulkanRT::VulkanRTData::RayTracerMeshInstanceData());
+	InitTlasInstance(meshInstancePool_[gameObjectInstanceId], gameObjectInstanceId, sharedMeshInstanceId, l2wMatrix, w2lMatrix, mask, flags);
+
+	++sharedMeshReferences_[sharedMeshInstanceId];
+
+	// Gets its slot in instanceData_ on the next TLAS rebuild
+	rebuildTlas_ = true;
+
+	NativeLogger::LogInfo("Create TLAS Done");
+
+
+	return AddResourceResult::Success;
+}
+
+
+int RenderAPI_VulkanRayQuery::AddTlasInstances(int count, const int* gameObjectInstanceIds, int sharedMeshInstanceId, const float* l2wMatrices, const float* w2lMatrices, int mask, int flags)
+{
+	if (count <= 0 || gameObjectInstanceIds == nullptr || l2wMatrices == nullptr || w2lMatrices == nullptr)
+	{
+		return 0;
+	}
+
+	// The batch goes to one block of fresh slots rather than the ones freed by earlier removals, so its instances stay
+	// next to each other in the pool. Each id still costs a node in the pool's std::map
+	meshInstancePool_.reserve_append(static_cast<size_t>(count));
+
+	int added = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		if (meshInstancePool_.find(gameObjectInstanceIds[i]) != meshInstancePool_.in_use_end())
+		{
+			continue;
+		}
+
+		const uint32_t index = meshInstancePool_.append(gameObjectInstanceIds[i], VulkanRT::VulkanRTData::RayTracerMeshInstanceData());
+		InitTlasInstance(meshInstancePool_.data()[index], gameObjectInstanceIds[i], sharedMeshInstanceId, l2wMatrices + i * 16, w2lMatrices + i * 16, mask, flags);
+		++added;
+	}
+
+	if (added > 0)
+	{
+		sharedMeshReferences_[sharedMeshInstanceId] += static_cast<uint32_t>(added);
+
+		// All of them get their slots in instanceData_ on the same rebuild
+		rebuildTlas_ = true;
+	}
+
+	NativeLogger::LogInfoFormat("AddTlasInstances: Added %d of %d instances", added, count);
+
+	return added;
+}
+
+void RenderAPI_VulkanRayQuery::InitTlasInstance(VulkanRT::VulkanRTData::RayTracerMeshInstanceData& instance, int gameObjectInstanceId, int sharedMeshInstanceId, const float* l2wMatrix, const float* w2lMatrix, int mask, int flags)
+{
+	instance.gameObjectInstanceId = gameObjectInstanceId;
+	instance.sharedMeshInstanceId = sharedMeshInstanceId;
+	instance.mask = static_cast<uint32_t>(mask) & 0xFF;
+	instance.flags = static_cast<VkGeometryInstanceFlagsKHR>(flags) & kInstanceFlagsMask;
+
+	instance.arena = activeArena_;
+	if (activeArena_ != VulkanRT::VulkanRTData::kNoArena)
+	{
+		arenas_[activeArena_].instances.insert(gameObjectInstanceId);
+	}
+
+	FloatArrayToMatrix(l2wMatrix, instance.localToWorld);
+	FloatArrayToMatrix(w2lMatrix, instance.worldToLocal);
+}
+
+void RenderAPI_VulkanRayQuery::StageTlasInstanceTransform(uint32_t index, const float* l2wMatrix, const float* w2lMatrix)
+{
+	VulkanRT::VulkanRTData::RayTracerPendingTransform pending;
+	pending.handle = MakeTlasInstanceHandle(index);
+	FloatArrayToMatrix(l2wMatrix, pending.localToWorld);
+	FloatArrayToMatrix(w2lMatrix, pending.worldToLocal);
+
+	pendingTransforms_.push_back(pending);
+}
+
+void RenderAPI_VulkanRayQuery::SetTlasInstanceTransform(VulkanRT::VulkanRTData::RayTracerMeshInstanceData& instance, const mat4& localToWorld, const mat4& worldToLocal)
+{
+	instance.localToWorld = localToWorld;
+	instance.worldToLocal = worldToLocal;
+
+	if (instance.customIndex < instanceData_.size())
+	{
+		instanceData_[instance.customIndex].localToWorld = instance.localToWorld;
+		instanceData_[instance.customIndex].worldToLocal = instance.worldToLocal;
+
+		instanceDataDirtyBegin_ = std::min(instanceDataDirtyBegin_, instance.customIndex);
+		instanceDataDirtyEnd_ = std::max(instanceDataDirtyEnd_, instance.customIndex + 1);
+	}
+
+	updateTlas_ = true;
+}
+
+void RenderAPI_VulkanRayQuery::UpdateTlasInstance(int gameObjectInstanceId, float* l2wMatrix, float* w2lMatrix)
+{
+	UpdateTlasInstances(1, &gameObjectInstanceId, l2wMatrix, w2lMatrix);
+
+	//NativeLogger::LogInfo("Update TLAS Done");
+}
+
+void RenderAPI_VulkanRayQuery::UpdateTlasInstances(int count, const int* gameObjectInstanceIds, const float* l2wMatrices, const float* w2lMatrices)
+{
+	std::lock_guard<std::mutex> lock(transformArenaMutex_);
+
+	for (int i = 0; i < count; ++i)
+	{
+		auto itor = meshInstancePool_.find(gameObjectInstanceIds[i]);
+		if (itor == meshInstancePool_.in_use_end())
+		{
+			continue;
+		}
+
+		StageTlasInstanceTransform(static_cast<uint32_t>(itor->second), l2wMatrices + i * 16, w2lMatrices + i * 16);
+	}
+}
+
+void* RenderAPI_VulkanRayQuery::GetTransformArena(int* capacity)
+{
+	std::lock_guard<std::mutex> lock(transformArenaMutex_);
+
+	const size_t handleCount = meshInstancePool_.pool_size();
+	if (transformArena_[0].size() < handleCount)
+	{
+		size_t newCapacity = std::max<size_t>(transformArena_[0].size(), 64);
+		while (newCapacity < handleCount)
+		{
+			newCapacity *= 2;
+		}
+
+		// New slots come zeroed, so not dirty
+		transformArena_[0].resize(newCapacity, VulkanRT::VulkanRTData::RayTracerTransformSlot());
+		transformArena_[1].resize(newCapacity, VulkanRT::VulkanRTData::RayTracerTransformSlot());
+	}
+
+	*capacity = static_cast<int>(transformArena_[transformArenaWrite_].size());
+	return transformArena_[transformArenaWrite_].data();
+}
+
+void* RenderAPI_VulkanRayQuery::PublishTransformArena(int* capacity)
+{
+	{
+		std::lock_guard<std::mutex> lock(transformArenaMutex_);
+
+		// When the render thread hasn't taken the last half yet, keep writing into the current one, its dirty slots go out with the next publish
+		if (!transformArenaPublished_)
+		{
+			transformArenaWrite_ ^= 1;
+			transformArenaPublished_ = true;
+		}
+	}
+
+	return GetTransformArena(capacity);
+}
+
+void RenderAPI_VulkanRayQuery::ConsumeTransformArena()
+{
+	std::lock_guard<std::mutex> lock(transformArenaMutex_);
+
+	auto instances = meshInstancePool_.data();
+
+	for (const auto& pending : pendingTransforms_)
+	{
+		// Staged for an instance removed since, its handle was retired under this lock
+		uint32_t index;
+		if (!ResolveTlasInstanceHandle(pending.handle, index))
+		{
+			continue;
+		}
+
+		SetTlasInstanceTransform(instances[index], pending.localToWorld, pending.worldToLocal);
+	}
+	pendingTransforms_.clear();
+
+	if (!transformArenaPublished_)
+	{
+		return;
+	}
+	transformArenaPublished_ = false;
+
+	auto& slots = transformArena_[transformArenaWrite_ ^ 1];
+	const size_t count = std::min(slots.size(), meshInstancePool_.pool_size());
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		auto& slot = slots[i];
+		if ((slot.flags & VulkanRT::VulkanRTData::kTransformSlotDirty) == 0)
+		{
+			continue;
+		}
+		slot.flags = 0;
+
+		// Written through a handle of an instance removed since
+		auto& instance = instances[i];
+		if (instance.gameObjectInstanceId == 0 || slot.handle != MakeTlasInstanceHandle(static_cast<uint32_t>(i)))
+		{
+			continue;
+		}
+
+		// localToWorld keeps Unity's rows as columns, which is the slot layout
+		mat4 localToWorld;
+		for (int r = 0; r < 3; ++r)
+		{
+			localToWorld[r] = glm::vec4(slot.transform.matrix[r][0], slot.transform.matrix[r][1], slot.transform.matrix[r][2], slot.transform.matrix[r][3]);
+		}
+		localToWorld[3] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+		SetTlasInstanceTransform(instance, localToWorld, glm::inverse(localToWorld));
+	}
+}
+
+int RenderAPI_VulkanRayQuery::GetTlasInstanceHandle(int gameObjectInstanceId)
+{
+	auto itor = meshInstancePool_.find(gameObjectInstanceId);
+	return itor != meshInstancePool_.in_use_end() ? MakeTlasInstanceHandle(itor->second) : -1;
+}
+
+int RenderAPI_VulkanRayQuery::MakeTlasInstanceHandle(uint32_t index) const
+{
+	if (index > VulkanRT::VulkanRTData::kTlasHandleIndexMask)
+	{
+		return -1;
+	}
+
+	const uint32_t generation = index < meshInstanceGenerations_.size() ? meshInstanceGenerations_[index] : 0;
+	return static_cast<int>((generation << VulkanRT::VulkanRTData::kTlasHandleIndexBits) | index);
+}
+
+bool RenderAPI_VulkanRayQuery::ResolveTlasInstanceHandle(int handle, uint32_t& index)
+{
+	if (handle < 0)
+	{
+		return false;
+	}
+
+	index = static_cast<uint32_t>(handle) & VulkanRT::VulkanRTData::kTlasHandleIndexMask;
+
+	// Removed instances are reset to a default element with id 0, Unity never hands that id out
+	return index < meshInstancePool_.pool_size() && meshInstancePool_.data()[index].gameObjectInstanceId != 0 && MakeTlasInstanceHandle(index) == handle;
+}
+
+void RenderAPI_VulkanRayQuery::RetireTlasInstanceHandle(uint32_t index)
+{
+	if (index >= meshInstanceGenerations_.size())
+	{
+		meshInstanceGenerations_.resize(index + 1, 0);
+	}
+	meshInstanceGenerations_[index] = (meshInstanceGenerations_[index] + 1) & VulkanRT::VulkanRTData::kTlasHandleGenerationMask;
+}
+
+void RenderAPI_VulkanRayQuery::UpdateTlasInstancesByHandle(int count, const int* handles, const float* l2wMatrices, const float* w2lMatrices)
+{
+	std::lock_guard<std::mutex> lock(transformArenaMutex_);
+
+	for (int i = 0; i < count; ++i)
+	{
+		uint32_t index;
+		if (!ResolveTlasInstanceHandle(handles[i], index))
+		{
+			continue;
+		}
+
+		StageTlasInstanceTransform(index, l2wMatrices + i * 16, w2lMatrices + i * 16);
+	}
+}
+
+void RenderAPI_VulkanRayQuery::UpdateTlasInstanceMask(int gameObjectInstanceId, int mask, int flags)
+{
+	if (meshInstancePool_.find(gameObjectInstanceId) == meshInstancePool_.in_use_end())
+	{
+		return;
+	}
+
+	auto& instance = meshInstancePool_[gameObjectInstanceId];
+
+	instance.mask = static_cast<uint32_t>(mask) & 0xFF;
+	instance.flags = static_cast<VkGeometryInstanceFlagsKHR>(flags) & kInstanceFlagsMask;
+
+	// Instance descriptions can change freely in a TLAS update, only the count has to stay the same
+	updateTlas_ = true;
+}
+
+void RenderAPI_VulkanRayQuery::RemoveTlasInstance(int gameObjectInstanceId)
+{
+	auto itor = meshInstancePool_.find(gameObjectInstanceId);
+	if (itor == meshInstancePool_.in_use_end())
+	{
+		return;
+	}
+
+	const int sharedMeshInstanceId = meshInstancePool_.data()[itor->second].sharedMeshInstanceId;
+
+	auto arena = arenas_.find(meshInstancePool_.data()[itor->second].arena);
+	if (arena != arenas_.end())
+	{
+		arena->second.instances.erase(gameObjectInstanceId);
+	}
+
+	{
+		// The index gets reused by the next added instance, it must not pick up a transform written for this one
+		std::lock_guard<std::mutex> lock(transformArenaMutex_);
+		for (auto& half : transformArena_)
+		{
+			if (static_cast<size_t>(itor->second) < half.size())
+			{
+				half[itor->second].flags = 0;
+			}
+		}
+		RetireTlasInstanceHandle(itor->second);
+	}
+
+	meshInstancePool_.remove(gameObjectInstanceId);
+	rebuildTlas_ = true;
+
+	ReleaseSharedMeshReference(sharedMeshInstanceId);
+}
+
+void RenderAPI_VulkanRayQuery::ReleaseSharedMeshReference(int sharedMeshInstanceId)
+{
+	// The last instance of a removed mesh takes the mesh along
+	auto references = sharedMeshReferences_.find(sharedMeshInstanceId);
+	if (references != sharedMeshReferences_.end() && --references->second == 0)
+	{
+		sharedMeshReferences_.erase(references);
+		if (removedSharedMeshes_.erase(sharedMeshInstanceId) != 0)
+		{
+			RetireSharedMesh(sharedMeshInstanceId);
+		}
+	}
+}
+
+void RenderAPI_VulkanRayQuery::AddArenaSharedMesh(int sharedMeshInstanceId)
+{
+	if (activeArena_ == VulkanRT::VulkanRTData::kNoArena)
+	{
+		return;
+	}
+
+	arenas_[activeArena_].meshes.insert(sharedMeshInstanceId);
+	sharedMeshArenas_[sharedMeshInstanceId] = activeArena_;
+}
+
+void RenderAPI_VulkanRayQuery::EraseSharedMeshId(int sharedMeshInstanceId)
+{
+	sharedMeshIds_.erase(sharedMeshInstanceId);
+
+	auto meshArena = sharedMeshArenas_.find(sharedMeshInstanceId);
+	if (meshArena == sharedMeshArenas_.end())
+	{
+		return;
+	}
+
+	auto arena = arenas_.find(meshArena->second);
+	if (arena != arenas_.end())
+	{
+		arena->second.meshes.erase(sharedMeshInstanceId);
+	}
+	sharedMeshArenas_.erase(meshArena);
+}
+
+int RenderAPI_VulkanRayQuery::CreateArena()
+{
+	const int arena = nextArena_++;
+	arenas_[arena];
+	return arena;
+}
+
+void RenderAPI_VulkanRayQuery::SetActiveArena(int arena)
+{
+	if (arena != VulkanRT::VulkanRTData::kNoArena && arenas_.find(arena) == arenas_.end())
+	{
+		NativeLogger::LogWarn("SetActiveArena: Unknown arena");
+		return;
+	}
+
+	activeArena_ = arena;
+}
+
+void RenderAPI_VulkanRayQuery::DestroyArena(int arena)
+{
+	auto found = arenas_.find(arena);
+	if (found == arenas_.end())
+	{
+		NativeLogger::LogWarn("DestroyArena: Unknown arena");
+		return;
+	}
+
+	// Only the arena's own ids are visited, the rest of the scene doesn't add to the cost
+	const VulkanRT::VulkanRTData::RayTracerArena contents = std::move(found->second);
+	arenas_.erase(found);
+
+	if (activeArena_ == arena)
+	{
+		activeArena_ = VulkanRT::VulkanRTData::kNoArena;
+	}
+
+	// Instances go first, so the arena's meshes below have lost the references from their own arena
+	std::vector<int> releasedReferences;
+	size_t removedInstances = 0;
+	{
+		// The handles get reused by the next added instances, they must not pick up transforms written for these
+		std::lock_guard<std::mutex> lock(transformArenaMutex_);
+		for (int gameObjectInstanceId : contents.instances)
+		{
+			auto itor = meshInstancePool_.find(gameObjectInstanceId);
+			if (itor == meshInstancePool_.in_use_end())
+			{
+				continue;
+			}
+
+			const uint32_t index = static_cast<uint32_t>(itor->second);
+			for (auto& half : transformArena_)
+			{
+				if (index < half.size())
+				{
+					half[index].flags = 0;
+				}
+			}
+			RetireTlasInstanceHandle(index);
+			releasedReferences.push_back(meshInstancePool_.data()[index].sharedMeshInstanceId);
+
+			meshInstancePool_.remove(gameObjectInstanceId);
+			++removedInstances;
+		}
+	}
+
+	for (int sharedMeshInstanceId : releasedReferences)
+	{
+		ReleaseSharedMeshReference(sharedMeshInstanceId);
+	}
+
+	// Meshes that aren't in the pool yet go right away, like in RemoveSharedMesh
+	{
+		std::lock_guard<std::mutex> lock(pendingNativeMeshesMutex_);
+		pendingNativeMeshes_.erase(std::remove_if(pendingNativeMeshes_.begin(), pendingNativeMeshes_.end(),
+			[this, arena](const VulkanRT::VulkanRTData::RayTracerNativeMeshRequest& request)
+			{
+				if (request.arena != arena)
+				{
+					return false;
+				}
+				EraseSharedMeshId(request.sharedMeshInstanceId);
+				return true;
+			}), pendingNativeMeshes_.end());
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+		for (auto& upload : meshUploads_)
+		{
+			if (!upload.cancelled && upload.mesh->arena == arena)
+			{
+				upload.cancelled = true;
+				EraseSharedMeshId(upload.mesh->sharedMeshInstanceId);
+			}
+		}
+	}
+
+	for (int sharedMeshInstanceId : contents.meshes)
+	{
+		sharedMeshArenas_.erase(sharedMeshInstanceId);
+
+		// Went with the pending requests and uploads above
+		if (sharedMeshIds_.find(sharedMeshInstanceId) == sharedMeshIds_.end())
+		{
+			continue;
+		}
+
+		// Still used by instances of another arena, released along with the last of them
+		auto references = sharedMeshReferences_.find(sharedMeshInstanceId);
+		if (references != sharedMeshReferences_.end() && references->second > 0)
+		{
+			removedSharedMeshes_.insert(sharedMeshInstanceId);
+			continue;
+		}
+
+		RetireSharedMesh(sharedMeshInstanceId);
+	}
+
+	if (removedInstances > 0)
+	{
+		rebuildTlas_ = true;
+	}
+
+	NativeLogger::LogInfoFormat("DestroyArena: Removed %d instances and %d meshes", static_cast<int>(removedInstances), static_cast<int>(contents.meshes.size()));
+}
+
+void RenderAPI_VulkanRayQuery::RemoveSharedMesh(int sharedMeshInstanceId)
+{
+	if (sharedMeshIds_.find(sharedMeshInstanceId) == sharedMeshIds_.end())
+	{
+		NativeLogger::LogWarn("RemoveSharedMesh: Unknown shared mesh");
+		return;
+	}
+
+	// Not in the pool yet so never drawn or traced, these go right away whatever references them
+	{
+		std::lock_guard<std::mutex> lock(pendingNativeMeshesMutex_);
+		auto pending = std::find_if(pendingNativeMeshes_.begin(), pendingNativeMeshes_.end(),
+			[sharedMeshInstanceId](const VulkanRT::VulkanRTData::RayTracerNativeMeshRequest& request) { return request.sharedMeshInstanceId == sharedMeshInstanceId; });
+		if (pending != pendingNativeMeshes_.end())
+		{
+			pendingNativeMeshes_.erase(pending);
+			EraseSharedMeshId(sharedMeshInstanceId);
+			return;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(meshUploadsMutex_);
+		for (auto& upload : meshUploads_)
+		{
+			if (!upload.cancelled && upload.mesh->sharedMeshInstanceId == sharedMeshInstanceId)
+			{
+				upload.cancelled = true;
+				EraseSharedMeshId(sharedMeshInstanceId);
+				return;
+			}
+		}
+	}
+
+	auto references = sharedMeshReferences_.find(sharedMeshInstanceId);
+	if (references != sharedMeshReferences_.end() && references->second > 0)
+	{
+		removedSharedMeshes_.insert(sharedMeshInstanceId);
+		return;
+	}
+
+	RetireSharedMesh(sharedMeshInstanceId);
+}
+
+void RenderAPI_VulkanRayQuery::RetireSharedMesh(int sharedMeshInstanceId)
+{
+	EraseSharedMeshId(sharedMeshInstanceId);
+
+	// The render thread may be reading sharedMeshesPool_, it takes the mesh out itself
+	std::lock_guard<std::mutex> lock(retiredSharedMeshesMutex_);
+	retiredSharedMeshIds_.push_back(sharedMeshInstanceId);
+}
+
+void RenderAPI_VulkanRayQuery::DestroyRetiredSharedMeshes()
+{
+	std::vector<int> retired;
+	{
+		std::lock_guard<std::mutex> lock(retiredSharedMeshesMutex_);
+		retired.swap(retiredSharedMeshIds_);
+	}
+
+	if (retired.empty())
+	{
+		return;
+	}
+
+	// Without a frame number to wait for, keep them for the next event
+	UnityVulkanRecordingState recordingState;
+	if (!graphicsInterface_->CommandRecordingState(&recordingState, kUnityVulkanGraphicsQueueAccess_DontCare))
+	{
+		std::lock_guard<std::mutex> lock(retiredSharedMeshesMutex_);
+		retiredSharedMeshIds_.insert(retiredSharedMeshIds_.begin(), retired.begin(), retired.end());
+		return;
+	}
+
+	for (int sharedMeshInstanceId : retired)
+	{
+		auto itor = sharedMeshesPool_.find(sharedMeshInstanceId);
+		if (itor == sharedMeshesPool_.in_use_end())
+		{
+			continue;
+		}
+
+		std::unique_ptr<VulkanRT::VulkanRTData::RayTracerMeshSharedData> mesh = std::move(sharedMeshesPool_.data()[itor->second]);
+		sharedMeshesPool_.remove(sharedMeshInstanceId);
+
+		// A mesh added again under the same id compiles its own pipeline once it is drawn
+		auto pipeline = rayQueryPipelineMap.find(sharedMeshInstanceId);
+		if (pipeline != rayQueryPipelineMap.end())
+		{
+			const VkPipeline removedPipeline = pipeline->second;
+			rayQueryPipelineMap.erase(pipeline);
+
+			if (removedPipeline != VK_NULL_HANDLE)
+			{
+				// Meshes still compiling draw with the fallback, another finished pipeline takes over
+				if (removedPipeline == fallbackPipeline_)
+				{
+					fallbackPipeline_ = VK_NULL_HANDLE;
+					for (const auto& entry : rayQueryPipelineMap)
+					{
+						if (entry.second != VK_NULL_HANDLE)
+						{
+							fallbackPipeline_ = entry.second;
+							break;
+						}
+					}
+				}
+
+				VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbagePipeline;
+				garbagePipeline.buffer = make_unique<VulkanRT::VulkanRTData::RayTracerGarbagePipeline>(device_, removedPipeline);
+				garbagePipeline.frameCount = recordingState.currentFrameNumber;
+				garbageBuffers_.push_back(std::move(garbagePipeline));
+			}
+		}
+
+		// tlas_ keeps the BLAS address until the rebuild, frames traced before it still reach the mesh
+		tlasRetiredSharedMeshes_.push_back(std::move(mesh));
+		rebuildTlas_ = true;
+	}
+}
+
+void RenderAPI_VulkanRayQuery::DestroyTlasRetiredSharedMeshes(uint64_t currentFrameNumber)
+{
+	for (auto& mesh : tlasRetiredSharedMeshes_)
+	{
+		VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbageMesh;
+		garbageMesh.buffer = ::make_unique<VulkanRT::VulkanRTData::RayTracerGarbageMesh>(device_, std::move(mesh));
+		garbageMesh.frameCount = currentFrameNumber;
+		garbageBuffers_.push_back(std::move(garbageMesh));
+	}
+	tlasRetiredSharedMeshes_.clear();
+}
+
+void RenderAPI_VulkanRayQuery::ClearTlas(uint64_t currentFrameNumber)
+{
+	// Command buffers from earlier frames may still reference the old TLAS through its descriptor
+	if (tlas_.accelerationStructure != VK_NULL_HANDLE)
+	{
+		VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbageTlas;
+		garbageTlas.buffer = make_unique<VulkanRT::VulkanRTData::RayTracerGarbageAccelerationStructure>(device_, tlas_.accelerationStructure, tlas_.buffer);
+		garbageTlas.frameCount = currentFrameNumber;
+		garbageBuffers_.push_back(std::move(garbageTlas));
+
+		tlas_.accelerationStructure = VK_NULL_HANDLE;
+		tlas_.buffer = VulkanRT::Buffer();
+		tlas_.deviceAddress = 0;
+	}
+
+	instanceData_.clear();
+	DestroyTlasRetiredSharedMeshes(currentFrameNumber);
+
+	rebuildTlas_ = false;
+	updateTlas_ = false;
+}
+
+bool RenderAPI_VulkanRayQuery::CreateBlasInput(VulkanRT::VulkanRTData::RayTracerMeshSharedData& mesh, const std::vector<vec3>& positions, const std::vector<uint32_t>& indices)
+{
+	static constexpr VkBufferUsageFlags blasInputUsageFlags = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+
+	// Read once by the build, host visible memory is good enough
+	auto vertexBuffer = make_unique<VulkanRT::Buffer>();
+	auto indexBuffer = make_unique<VulkanRT::Buffer>();
+	if (vertexBuffer->Create("blasInputVertexBuffer", device_, physicalDeviceMemoryProperties_, sizeof(vec3) * positions.size(), blasInputUsageFlags, VulkanRT::Buffer::kDefaultMemoryPropertyFlags) != VK_SUCCESS ||
+		indexBuffer->Create("blasInputIndexBuffer", device_, physicalDeviceMemoryProperties_, sizeof(uint32_t) * indices.size(), blasInputUsageFlags, VulkanRT::Buffer::kDefaultMemoryPropertyFlags) != VK_SUCCESS ||
+		!vertexBuffer->UploadData(positions.data(), sizeof(vec3) * positions.size()) ||
+		!indexBuffer->UploadData(indices.data(), sizeof(uint32_t) * indices.size()))
+	{
+		NativeLogger::LogWarn("AddSharedMesh: Failed to create the split BLAS input, building from the original triangles");
+		vertexBuffer->Destroy();
+		indexBuffer->Destroy();
+		return false;
+	}
+
+	mesh.blasInputVertexBuffer = std::move(vertexBuffer);
+	mesh.blasInputIndexBuffer = std::move(indexBuffer);
+	mesh.blasInputVertexCount = static_cast<uint32_t>(positions.size());
+	mesh.blasInputTriangleCount = static_cast<uint32_t>(indices.size() / 3);
+	return true;
+}
+
+void RenderAPI_VulkanRayQuery::GenerateShading(std::vector<RayQueryVertex>& vertices, std::vector<RayQueryVertexAttributes>& attributes, bool generateNormals, bool generateTangents, const int32_t* indices32, const uint16_t* indices16, int indexCount)
+{
+	const uint32_t vertexCount = static_cast<uint32_t>(vertices.size());
+	const void* indices = indices16 != nullptr ? static_cast<const void*>(indices16) : static_cast<const void*>(indices32);
+	const size_t indexSize = indices16 != nullptr ? sizeof(uint16_t) : sizeof(int32_t);
+	const uint64_t hash = VulkanRT::MeshIngest::HashShadingSource(vertices.data(), generateTangents ? attributes.data() : nullptr, !generateNormals,
+		vertexCount, indices, indexSize, static_cast<uint32_t>(indexCount));
+
+	// Every MeshFilter registers its own copy of a shared Mesh, so the same data usually comes in more than once
+	auto cached = generatedShadingCache_.find(hash);
+	if (cached != generatedShadingCache_.end())
+	{
+		const VulkanRT::VulkanRTData::RayTracerGeneratedShading& shading = cached->second;
+		if (shading.vertexCount == vertexCount && shading.normals.empty() != generateNormals && shading.tangents.empty() != generateTangents)
+		{
+			for (uint32_t v = 0; v < shading.normals.size(); ++v)
+			{
+				vertices[v].normal = shading.normals[v];
+			}
+			for (uint32_t v = 0; v < shading.tangents.size(); ++v)
+			{
+				attributes[v].tangent = shading.tangents[v];
+			}
+			return;
+		}
+	}
+
+	if (generateNormals)
+	{
+		if (indices16 != nullptr)
+		{
+			VulkanRT::MeshIngest::GenerateNormals(vertices.data(), vertexCount, indices16, static_cast<uint32_t>(indexCount), workerPool_.get());
+		}
+		else
+		{
+			VulkanRT::MeshIngest::GenerateNormals(vertices.data(), vertexCount, indices32, static_cast<uint32_t>(indexCount), workerPool_.get());
+		}
+	}
+
+	// After the normals, the tangents are built in their tangent planes
+	if (generateTangents)
+	{
+		if (indices16 != nullptr)
+		{
+			VulkanRT::MeshIngest::GenerateTangents(attributes.data(), vertices.data(), vertexCount, indices16, static_cast<uint32_t>(indexCount), workerPool_.get());
+		}
+		else
+		{
+			VulkanRT::MeshIngest::GenerateTangents(attributes.data(), vertices.data(), vertexCount, indices32, static_cast<uint32_t>(indexCount), workerPool_.get());
+		}
+	}
+
+	// A hash collision keeps the entry that is already there
+	const size_t size = (generateNormals ? sizeof(vec3) * vertexCount : 0) + (generateTangents ? sizeof(vec4) * vertexCount : 0);
+	if (cached != generatedShadingCache_.end() || size > kGeneratedShadingCacheBytes)
+	{
+		return;
+	}
+
+	while (generatedShadingBytes_ + size > kGeneratedShadingCacheBytes)
+	{
+		auto oldest = generatedShadingCache_.find(generatedShadingOrder_.front());
+		generatedShadingBytes_ -= sizeof(vec3) * oldest->second.normals.size() + sizeof(vec4) * oldest->second.tangents.size();
+		generatedShadingCache_.erase(oldest);
+		generatedShadingOrder_.pop_front();
+	}
+
+	VulkanRT::VulkanRTData::RayTracerGeneratedShading& shading = generatedShadingCache_[hash];
+	shading.vertexCount = vertexCount;
+	if (generateNormals)
+	{
+		shading.normals.resize(vertexCount);
+		for (uint32_t v = 0; v < vertexCount; ++v)
+		{
+			shading.normals[v] = vertices[v].normal;
+		}
+	}
+	if (generateTangents)
+	{
+		shading.tangents.resize(vertexCount);
+		for (uint32_t v = 0; v < vertexCount; ++v)
+		{
+			shading.tangents[v] = attributes[v].tangent;
+		}
+	}
+	generatedShadingOrder_.push_back(hash);
+	generatedShadingBytes_ += size;
+}
+
+bool RenderAPI_VulkanRayQuery::CreateAttributeBuffer(VulkanRT::VulkanRTData::RayTracerMeshSharedData& mesh, const VulkanRT::MeshIngest::VertexLayout& vertexLayout, const void* const* vertexStreams, const RayQueryVertexAttributes* cachedAttributes)
+{
+	// Only read by shaders through its device address, host visible memory like the BLAS input
+	auto attributeBuffer = make_unique<VulkanRT::Buffer>();
+	if (attributeBuffer->Create("attributeBuffer", device_, physicalDeviceMemoryProperties_, sizeof(RayQueryVertexAttributes) * mesh.vertexCount,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VulkanRT::Buffer::kDefaultMemoryPropertyFlags) != VK_SUCCESS)
+	{
+		NativeLogger::LogWarn("AddSharedMesh: Failed to create the attribute buffer, mesh added without tangents and uvs");
+		attributeBuffer->Destroy();
+		return false;
+	}
+
+	auto attributes = static_cast<RayQueryVertexAttributes*>(attributeBuffer->Map());
+	if (cachedAttributes != nullptr)
+	{
+		VulkanRT::MeshIngest::CopyAttributes(attributes, cachedAttributes, static_cast<uint32_t>(mesh.vertexCount));
+	}
+	else
+	{
+		VulkanRT::MeshIngest::GatherAttributes(attributes, vertexLayout, vertexStreams, static_cast<uint32_t>(mesh.vertexCount));
+	}
+	attributeBuffer->Unmap();
+
+	mesh.attributeBuffer = std::move(attributeBuffer);
+	return true;
+}
+
+void RenderAPI_VulkanRayQuery::BuildBlas(int sharedMeshInstanceId)
+{
+	// Create buffers for the bottom level geometry
+
+		// Setup a single transformation matrix that can be used to transform the whole geometry for a single bottom level acceleration structure
+	VkTransformMatrixKHR transformMatrix = {
+		1.0f, 0.0f, 0.0f, 0.0f,
+		0.0f, 1.0f, 0.0f, 0.0f,
+		0.0f, 0.0f, 1.0f, 0.0f };
+
+	auto transformBuffer = make_unique<VulkanRT::Buffer>();
+	transformBuffer->Create(
+		"transformBuffer",
+		device_,
+		physicalDeviceMemoryProperties_,
+		sizeof(VkTransformMatrixKHR),
+		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		VulkanRT::Buffer::kDefaultMemoryPropertyFlags);
+	transformBuffer->UploadData(&transformMatrix, sizeof(VkTransformMatrixKHR));
+
+
+	// The bottom level acceleration structure contains one set of triangles as the input geometry
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = {};
+	accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+	accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+
+	accelerationStructureGeometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+	accelerationStructureGeometry.geometry.triangles.pNext = nullptr;
+	accelerationStructureGeometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+	accelerationStructureGeometry.geometry.triangles.transformData = transformBuffer->GetBufferDeviceAddressConst();
+
+	// Number of triangles 
+	uint32_t primitiveCount = sharedMeshesPool_[sharedMeshInstanceId]->indexCount / 3;
+
+	// A split triangle set replaces the draw geometry as the build input
+	VulkanRT::VulkanRTData::RayTracerMeshSharedData& mesh = *sharedMeshesPool_[sharedMeshInstanceId];
+	if (mesh.blasInputIndexBuffer)
+	{
+		accelerationStructureGeometry.geometry.triangles.vertexData = mesh.blasInputVertexBuffer->GetBufferDeviceAddressConst();
+		accelerationStructureGeometry.geometry.triangles.maxVertex = mesh.blasInputVertexCount - 1;
+		accelerationStructureGeometry.geometry.triangles.vertexStride = sizeof(vec3);
+		accelerationStructureGeometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
+		accelerationStructureGeometry.geometry.triangles.indexData = mesh.blasInputIndexBuffer->GetBufferDeviceAddressConst();
+		primitiveCount = mesh.blasInputTriangleCount;
+	}
+	else
+	{
+		accelerationStructureGeometry.geometry.triangles.vertexData = mesh.vertexBuffer.GetBufferDeviceAddressConst();
+		accelerationStructureGeometry.geometry.triangles.maxVertex = mesh.vertexCount > 0 ? static_cast<uint32_t>(mesh.vertexCount - 1) : 0;
+		accelerationStructureGeometry.geometry.triangles.vertexStride = sizeof(RayQueryVertex);
+		accelerationStructureGeometry.geometry.triangles.indexType = mesh.indexType;
+		accelerationStructureGeometry.geometry.triangles.indexData = mesh.indexBuffer.GetBufferDeviceAddressConst();
+	}
+
+	// Get the size requirements for buffers involved in the acceleration structure build process
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo = {};
+	accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationStructureBuildGeometryInfo.geometryCount = 1;
+	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+
+	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo = {};
+	accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+	vkGetAccelerationStructureBuildSizesKHR(
+		device_,
+		VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+		&accelerationStructureBuildGeometryInfo,
+		&primitiveCount,
+		&accelerationStructureBuildSizesInfo);
+
+	// Create a buffer to hold the acceleration structure
+	sharedMeshesPool_[sharedMeshInstanceId]->blas.buffer.Create(
+		"blas",
+		device_,
+		physicalDeviceMemoryProperties_,
+		accelerationStructureBuildSizesInfo.accelerationStructureSize,
+		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR,
+		VulkanRT::Buffer::kDefaultMemoryPropertyFlags);
+
+	// Create the acceleration structure
+	VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo = {};
+	accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+	accelerationStructureCreateInfo.buffer = sharedMeshesPool_[sharedMeshInstanceId]->blas.buffer.GetBuffer();
+	accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
+	accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+	vkCreateAccelerationStructureKHR(device_, &accelerationStructureCreateInfo, nullptr, &sharedMeshesPool_[sharedMeshInstanceId]->blas.accelerationStructure);
+
+	// The actual build process starts here
+	// Create a scratch buffer as a temporary storage for the acceleration structure build
+	auto scratchBuffer = make_unique<VulkanRT::Buffer>();
+	scratchBuffer->Create(
+		"scratch",
+		device_,
+		physicalDeviceMemoryProperties_,
+		accelerationStructureBuildSizesInfo.buildScratchSize,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo = { };
+	accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+	accelerationBuildGeometryInfo.dstAccelerationStructure = sharedMeshesPool_[sharedMeshInstanceId]->blas.accelerationStructure;
+	accelerationBuildGeometryInfo.geometryCount = 1;
+	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+	accelerationBuildGeometryInfo.scratchData = scratchBuffer->GetBufferDeviceAddress();
+
+	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo = { };
+	accelerationStructureBuildRangeInfo.primitiveCount = primitiveCount;
+	accelerationStructureBuildRangeInfo.primitiveOffset = 0;
+	accelerationStructureBuildRangeInfo.firstVertex = 0;
+	accelerationStructureBuildRangeInfo.transformOffset = 0;
+	std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationStructureBuildRangeInfos = { &accelerationStructureBuildRangeInfo };
+
+	// Get the bottom acceleration structure's handle, which will be used during the top level acceleration build
+	VkAccelerationStructureDeviceAddressInfoKHR accelerationStructureDeviceAddressInfo{};
+	accelerationStructureDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+	accelerationStructureDeviceAddressInfo.accelerationStructure = sharedMeshesPool_[sharedMeshInstanceId]->blas.accelerationStructure;
+	sharedMeshesPool_[sharedMeshInstanceId]->blas.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(device_, &accelerationStructureDeviceAddressInfo);
+
+	graphicsInterface_->EnsureOutsideRenderPass();
+
+	UnityVulkanRecordingState recordingState;
+	if (!graphicsInterface_->CommandRecordingState(&recordingState, kUnityVulkanGraphicsQueueAccess_DontCare))
+	{
+		return;
+	}
+
+	vkCmdBuildAccelerationStructuresKHR(
+		recordingState.commandBuffer,
+		1,
+		&accelerationBuildGeometryInfo,
+		accelerationStructureBuildRangeInfos.data());
+
+	auto index = garbageBuffers_.size();
+	garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
+	garbageBuffers_[index].frameCount = recordingState.currentFrameNumber;
+	garbageBuffers_[index].buffer = std::move(scratchBuffer);
+
+	index = garbageBuffers_.size();
+	garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
+	garbageBuffers_[index].frameCount = recordingState.currentFrameNumber;
+	garbageBuffers_[index].buffer = std::move(transformBuffer);
+
+	// The BLAS is never rebuilt, the split input is only needed until this build has run
+	if (mesh.blasInputIndexBuffer)
+	{
+		index = garbageBuffers_.size();
+		garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
+		garbageBuffers_[index].frameCount = recordingState.currentFrameNumber;
+		garbageBuffers_[index].buffer = std::move(mesh.blasInputVertexBuffer);
+
+		index = garbageBuffers_.size();
+		garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
+		garbageBuffers_[index].frameCount = recordingState.currentFrameNumber;
+		garbageBuffers_[index].buffer = std::move(mesh.blasInputIndexBuffer);
+	}
+}
+
+void RenderAPI_VulkanRayQuery::BuildTlas(VkCommandBuffer commandBuffer, uint64_t currentFrameNumber)
+{
+	ConsumeTransformArena();
+
+	if (rebuildTlas_ == false && updateTlas_ == false)
+	{
+		return;
+	}
+
+	// An update needs a TLAS to refit, after ClearTlas only a rebuild will do
+	bool update = updateTlas_;
+	if (rebuildTlas_ || tlas_.accelerationStructure == VK_NULL_HANDLE) {
+		update = false;
+	}
+
+	if (meshInstancePool_.in_use_size() == 0)
+	{
+		ClearTlas(currentFrameNumber);
+		return;
+	}
+
+	if (!update)
+	{
+		std::vector<VkAccelerationStructureInstanceKHR> instanceAccelerationStructures;
+		instanceAccelerationStructures.resize(meshInstancePool_.in_use_size(), VkAccelerationStructureInstanceKHR{});
+
+		instanceData_.resize(meshInstancePool_.in_use_size());
+
+		uint32_t instanceAccelerationStructuresIndex = 0;
+		for (auto i = meshInstancePool_.in_use_begin(); i != meshInstancePool_.in_use_end(); ++i)
+		{
+			auto gameObjectInstanceId = (*i).first;
+
+			auto& instance = meshInstancePool_[gameObjectInstanceId];
+
+			// Its mesh is still waiting for ImportNativeMeshes, which requests another rebuild
+			const auto sharedMesh = FindSharedMesh(instance.sharedMeshInstanceId);
+			if (sharedMesh == nullptr)
+			{
+				instance.customIndex = ~0u;
+				continue;
+			}
+
+			const auto& t = instance.localToWorld;
+			VkTransformMatrixKHR transformMatrix = {
+				t[0][0], t[0][1], t[0][2], t[0][3],
+				t[1][0], t[1][1], t[1][2], t[1][3],
+				t[2][0], t[2][1], t[2][2], t[2][3]
+			};
+
+			VkAccelerationStructureInstanceKHR& accelerationStructureInstance = instanceAccelerationStructures[instanceAccelerationStructuresIndex];
+			accelerationStructureInstance.transform = transformMatrix;
+			accelerationStructureInstance.instanceCustomIndex = instanceAccelerationStructuresIndex;
+			accelerationStructureInstance.mask = instance.mask;
+			accelerationStructureInstance.instanceShaderBindingTableRecordOffset = 0;
+			accelerationStructureInstance.flags = instance.flags;
+			accelerationStructureInstance.accelerationStructureReference = sharedMesh->blas.deviceAddress;
+
+			instance.customIndex = instanceAccelerationStructuresIndex;
+			instanceData_[instanceAccelerationStructuresIndex].localToWorld = instance.localToWorld;
+			instanceData_[instanceAccelerationStructuresIndex].worldToLocal = instance.worldToLocal;
+
+			++instanceAccelerationStructuresIndex;
+		}
+
+		if (instanceAccelerationStructuresIndex == 0)
+		{
+			ClearTlas(currentFrameNumber);
+			return;
+		}
+		instanceAccelerationStructures.resize(instanceAccelerationStructuresIndex);
+		instanceData_.resize(instanceAccelerationStructuresIndex);
+
+		// Indices were reassigned, every element moves
+		instanceDataDirtyBegin_ = 0;
+		instanceDataDirtyEnd_ = static_cast<uint32_t>(instanceData_.size());
+
+		instancesAccelerationStructuresBuffer_.Destroy();
+
+		instancesAccelerationStructuresBuffer_.Create(
+			"instanceBuffer",
+			device_,
+			physicalDeviceMemoryProperties_,
+			instanceAccelerationStructures.size() * sizeof(VkAccelerationStructureInstanceKHR),
+			VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+			VulkanRT::Buffer::kDefaultMemoryPropertyFlags);
+
+		instancesAccelerationStructuresBuffer_.UploadData(instanceAccelerationStructures.data(), instancesAccelerationStructuresBuffer_.GetSize());
+	}
+	else
+	{
+		auto instances = reinterpret_cast<VkAccelerationStructureInstanceKHR*>(instancesAccelerationStructuresBuffer_.Map());
+
+		for (auto i = meshInstancePool_.in_use_begin(); i != meshInstancePool_.in_use_end(); ++i)
+		{
+			auto gameObjectInstanceId = (*i).first;
+
+			auto& instance = meshInstancePool_[gameObjectInstanceId];
+
+			// Left out of the last rebuild
+			if (instance.customIndex >= instanceData_.size())
+			{
+				continue;
+			}
+			const uint32_t instanceAcclerationStructionIndex = instance.customIndex;
+
+			const auto& t = instance.localToWorld;
+			VkTransformMatrixKHR transformMatrix = {
+				t[0][0], t[0][1], t[0][2], t[0][3],
+				t[1][0], t[1][1], t[1][2], t[1][3],
+				t[2][0], t[2][1], t[2][2], t[2][3],
+			};
+
+			instances[instanceAcclerationStructionIndex].transform = transformMatrix;
+			instances[instanceAcclerationStructionIndex].mask = instance.mask;
+			instances[instanceAcclerationStructionIndex].flags = instance.flags;
+		}
+		instancesAccelerationStructuresBuffer_.Unmap();
+	}
+
+	VkAccelerationStructureGeometryInstancesDataKHR accelerationStructureGeometryInstancesData = {};
+	accelerationStructureGeometryInstancesData.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+	accelerationStructureGeometryInstancesData.arrayOfPointers = VK_FALSE;
+	accelerationStructureGeometryInstancesData.data.deviceAddress = instancesAccelerationStructuresBuffer_.GetBufferDeviceAddressConst().deviceAddress;
+
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = {};
+	accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+	accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+	accelerationStructureGeometry.geometry.instances = accelerationStructureGeometryInstancesData;
+
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo = {};
+	accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationStructureBuildGeometryInfo.geometryCount = 1;
+	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+
+	uint32_t instancesCount = static_cast<uint32_t>(instanceData_.size());
+
+	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo = {};
+	accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+	vkGetAccelerationStructureBuildSizesKHR(
+		device_,
+		VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+		&accelerationStructureBuildGeometryInfo,
+		&instancesCount,
+		&accelerationStructureBuildSizesInfo
+	);
+
+	if (!update)
+	{
+		// Command buffers from earlier frames may still reference the old TLAS through its descriptor
+		if (tlas_.accelerationStructure != VK_NULL_HANDLE)
+		{
+			auto index = garbageBuffers_.size();
+			garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
+			garbageBuffers_[index].frameCount = currentFrameNumber;
+			garbageBuffers_[index].buffer = make_unique<VulkanRT::VulkanRTData::RayTracerGarbageAccelerationStructure>(device_, tlas_.accelerationStructure, tlas_.buffer);
+
+			tlas_.accelerationStructure = VK_NULL_HANDLE;
+			tlas_.buffer = VulkanRT::Buffer();
+		}
+		else
+		{
+			tlas_.buffer.Destroy();
+		}
+
+		tlas_.buffer.Create(
+			"tlas",
+			device_,
+			physicalDeviceMemoryProperties_,
+			accelerationStructureBuildSizesInfo.accelerationStructureSize,
+			VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR,
+			VulkanRT::Buffer::kDefaultMemoryPropertyFlags
+		);
+
+		VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo = {};
+		accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+		accelerationStructureCreateInfo.buffer = tlas_.buffer.GetBuffer();
+		accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
+		accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+		vkCreateAccelerationStructureKHR(device_, &accelerationStructureCreateInfo, nullptr, &tlas_.accelerationStructure);
+	}
+
+	//ʵʴtlas
+	auto scratchBuffer = make_unique<VulkanRT::Buffer>();
+	scratchBuffer->Create(
+		"scratch",
+		device_,
+		physicalDeviceMemoryProperties_,
+		accelerationStructureBuildSizesInfo.buildScratchSize,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+	);
+
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo = {};
+	accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+	accelerationBuildGeometryInfo.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+	accelerationBuildGeometryInfo.srcAccelerationStructure = update ? tlas_.accelerationStructure : VK_NULL_HANDLE;
+	accelerationBuildGeometryInfo.dstAccelerationStructure = tlas_.accelerationStructure;
+	accelerationBuildGeometryInfo.geometryCount = 1;
+	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+	accelerationBuildGeometryInfo.scratchData = scratchBuffer->GetBufferDeviceAddress();
+
+	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo;
+	accelerationStructureBuildRangeInfo.primitiveCount = instancesCount;
+	accelerationStructureBuildRangeInfo.primitiveOffset = 0;
+	accelerationStructureBuildRangeInfo.firstVertex = 0;
+	accelerationStructureBuildRangeInfo.transformOffset = 0;
+
+	std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationStructureBuildRangeInfos = { &accelerationStructureBuildRangeInfo };
+
+	VkAccelerationStructureDeviceAddressInfoKHR accelerationStructureDeviceAddressInfo = {};
+	accelerationStructureDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+	accelerationStructureDeviceAddressInfo.accelerationStructure = tlas_.accelerationStructure;
+	tlas_.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(device_, &accelerationStructureDeviceAddressInfo);
+
+	vkCmdBuildAccelerationStructuresKHR(
+		commandBuffer,
+		1,
+		&accelerationBuildGeometryInfo,
+		accelerationStructureBuildRangeInfos.data()
+	);
+
+	auto index = garbageBuffers_.size();
+	garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
+	garbageBuffers_[index].frameCount = currentFrameNumber;
+	garbageBuffers_[index].buffer = std::move(scratchBuffer);
+
+	// The new TLAS no longer references them, frames up to this one were the last to trace them
+	if (!update)
+	{
+		DestroyTlasRetiredSharedMeshes(currentFrameNumber);
+	}
+
+	rebuildTlas_ = false;
+	updateTlas_ = false;
+}
+
+void RenderAPI_VulkanRayQuery::UploadInstanceData(uint64_t currentFrameNumber, uint64_t safeFrameNumber)
+{
+	const uint32_t instanceCount = static_cast<uint32_t>(instanceData_.size());
+
+	// Every copy has to pick up the change, not only the one written this frame
+	instanceDataDirtyEnd_ = std::min(instanceDataDirtyEnd_, instanceCount);
+	if (instanceDataDirtyBegin_ < instanceDataDirtyEnd_)
+	{
+		for (auto& slot : instanceDataSlots_)
+		{
+			slot.dirtyBegin = std::min(slot.dirtyBegin, instanceDataDirtyBegin_);
+			slot.dirtyEnd = std::max(slot.dirtyEnd, instanceDataDirtyEnd_);
+		}
+	}
+	instanceDataDirtyBegin_ = instanceCount;
+	instanceDataDirtyEnd_ = 0;
+
+	// Nothing changed, keep binding the same copy
+	if (instanceDataSlot_ < instanceDataSlots_.size())
+	{
+		auto& slot = instanceDataSlots_[instanceDataSlot_];
+		if (slot.capacity >= instanceCount && slot.dirtyBegin >= std::min(slot.dirtyEnd, instanceCount))
+		{
+			slot.frameNumber = currentFrameNumber;
+			return;
+		}
+	}
+
+	const uint32_t index = AcquireFrameBufferSlot(instanceDataSlots_, instanceDataSlot_, currentFrameNumber, safeFrameNumber);
+	if (index == ~0u)
+	{
+		NativeLogger::LogWarn("All instance data buffers are in flight, keeping the previous one");
+		instanceDataSlots_[instanceDataSlot_].frameNumber = currentFrameNumber;
+		return;
+	}
+
+	auto& slot = instanceDataSlots_[index];
+	if (!ReserveFrameBufferSlot(slot, "instanceData", instanceCount, 64, sizeof(RayQueryTLASInstanceData), currentFrameNumber))
+	{
+		return;
+	}
+
+	slot.dirtyEnd = std::min(slot.dirtyEnd, instanceCount);
+	if (slot.dirtyBegin < slot.dirtyEnd)
+	{
+		slot.buffer.UploadData(
+			instanceData_.data() + slot.dirtyBegin,
+			(slot.dirtyEnd - slot.dirtyBegin) * sizeof(RayQueryTLASInstanceData),
+			slot.dirtyBegin * sizeof(RayQueryTLASInstanceData)
+		);
+	}
+
+	slot.dirtyBegin = instanceCount;
+	slot.dirtyEnd = 0;
+	slot.frameNumber = currentFrameNumber;
+	instanceDataSlot_ = index;
+}
+
+uint32_t RenderAPI_VulkanRayQuery::AcquireFrameBufferSlot(std::vector<VulkanRT::VulkanRTData::RayTracerFrameBufferSlot>& slots, uint32_t current,
+	uint64_t currentFrameNumber, uint64_t safeFrameNumber)
+{
+	// Draws recorded earlier in this frame haven't run yet, so they see the new contents too
+	if (current < slots.size() && slots[current].frameNumber == currentFrameNumber && slots[current].buffer.GetBuffer() != VK_NULL_HANDLE)
+	{
+		return current;
+	}
+
+	for (uint32_t i = 0; i < slots.size(); ++i)
+	{
+		if (slots[i].frameNumber != currentFrameNumber && slots[i].frameNumber <= safeFrameNumber)
+		{
+			return i;
+		}
+	}
+
+	if (slots.size() >= kMaxFrameBufferSlots)
+	{
+		return ~0u;
+	}
+
+	slots.push_back(VulkanRT::VulkanRTData::RayTracerFrameBufferSlot());
+	return static_cast<uint32_t>(slots.size() - 1);
+}
+
+bool RenderAPI_VulkanRayQuery::ReserveFrameBufferSlot(VulkanRT::VulkanRTData::RayTracerFrameBufferSlot& slot, const char* name, uint32_t count, uint32_t minCapacity,
+	VkDeviceSize elementSize, uint64_t currentFrameNumber, VkMemoryPropertyFlags memoryPropertyFlags)
+{
+	if (slot.buffer.GetBuffer() != VK_NULL_HANDLE && slot.capacity >= count)
+	{
+		return true;
+	}
+
+	uint32_t capacity = std::max(minCapacity, slot.capacity);
+	while (capacity < count)
+	{
+		capacity *= 2;
+	}
+
+	if (slot.buffer.GetBuffer() != VK_NULL_HANDLE)
+	{
+		auto index = garbageBuffers_.size();
+		garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
+		garbageBuffers_[index].frameCount = currentFrameNumber;
+		garbageBuffers_[index].buffer = make_unique<VulkanRT::Buffer>(slot.buffer);
+		slot.buffer = VulkanRT::Buffer();
+	}
+
+	VkResult result = slot.buffer.Create(
+		name,
+		device_,
+		physicalDeviceMemoryProperties_,
+		capacity * elementSize,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		memoryPropertyFlags
+	);
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogError("Create frame buffer slot Failed");
+		NativeLogger::LogInfo(name);
+		NativeLogger::LogInfo(vkResultToString(result));
+		slot.buffer = VulkanRT::Buffer();
+		slot.capacity = 0;
+		return false;
+	}
+
+	// A new buffer has none of the contents yet
+	slot.capacity = capacity;
+	slot.dirtyBegin = 0;
+	slot.dirtyEnd = ~0u;
+	return true;
+}
+
+
+void RenderAPI_VulkanRayQuery::CreateDescriptorSetsLayouts()
+{
+	{
+		//ٽṹ
+		VkDescriptorSetLayoutBinding accelerationStructureLayoutBinding{};
+		accelerationStructureLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+		accelerationStructureLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+		accelerationStructureLayoutBinding.binding = 0;
+		accelerationStructureLayoutBinding.descriptorCount = 1;
+
+		//shader uniform
+		VkDescriptorSetLayoutBinding globalUniformLayoutBinding{};
+		globalUniformLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		globalUniformLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+		globalUniformLayoutBinding.binding = 1;
+		globalUniformLayoutBinding.descriptorCount = 1;
+
+		//per instance data, indexed by instanceCustomIndex
+		VkDescriptorSetLayoutBinding instanceDataLayoutBinding{};
+		instanceDataLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		instanceDataLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+		instanceDataLayoutBinding.binding = 2;
+		instanceDataLayoutBinding.descriptorCount = 1;
+
+		//registered lights
+		VkDescriptorSetLayoutBinding lightsLayoutBinding{};
+		lightsLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		lightsLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		lightsLayoutBinding.binding = 3;
+		lightsLayoutBinding.descriptorCount = 1;
+
+		//light indices per screen tile
+		VkDescriptorSetLayoutBinding tileLightsLayoutBinding{};
+		tileLightsLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		tileLightsLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		tileLightsLayoutBinding.binding = 4;
+		tileLightsLayoutBinding.descriptorCount = 1;
+
+		//alias table for stochastic light selection
+		VkDescriptorSetLayoutBinding lightAliasLayoutBinding{};
+		lightAliasLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		lightAliasLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		lightAliasLayoutBinding.binding = 5;
+		lightAliasLayoutBinding.descriptorCount = 1;
+
+		std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings =
+		{
+			accelerationStructureLayoutBinding,
+			globalUniformLayoutBinding,
+			instanceDataLayoutBinding,
+			lightsLayoutBinding,
+			tileLightsLayoutBinding,
+			lightAliasLayoutBinding
+		};
+
+		VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+		descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		descriptorSetLayoutCreateInfo.flags = pushDescriptorSupported_ ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0;
+		descriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(set_layout_bindings.size());
+		descriptorSetLayoutCreateInfo.pBindings = set_layout_bindings.data();
+
+		VkResult result = vkCreateDescriptorSetLayout(device_, &descriptorSetLayoutCreateInfo, nullptr, &rayQueryDescrioptorSetLayout);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogInfo("CreateDescSetLayout Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+		}
+
+	}
+}
+
+void RenderAPI_VulkanRayQuery::CreatePipelineLayout()
+{
+	VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+	pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+
+	// Per draw state comes from the instance data buffer through firstInstance, only the light tiles are pushed once per pass
+	VkPushConstantRange push_constant;
+	push_constant.offset = 0;
+	push_constant.size = sizeof(LightTileConstants);
+	push_constant.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+	pipeline_layout_create_info.pushConstantRangeCount = 1;
+	pipeline_layout_create_info.pPushConstantRanges = &push_constant;
+	pipeline_layout_create_info.setLayoutCount = 1;
+	pipeline_layout_create_info.pSetLayouts = &rayQueryDescrioptorSetLayout;
+
+	VkResult ret = vkCreatePipelineLayout(device_, &pipeline_layout_create_info, nullptr, &rayQueryPipelieLayout);
+
+	if (ret != VK_SUCCESS) {
+		NativeLogger::LogError("Create PipelineLayout Failed");
+	}
+}
+
+void RenderAPI_VulkanRayQuery::CreatePipeline(VkRenderPass renderPass)
+{
+	{
+		std::lock_guard<std::mutex> lock(shaderDataMutex_);
+		if (rayShadowVertData.empty() || rayShadowFragData.empty())
+		{
+			return;
+		}
+	}
+
+	for (auto itor = sharedMeshesPool_.in_use_begin(); itor != sharedMeshesPool_.in_use_end(); ++itor)
+	{
+		int idx = itor->first;
+
+		if (rayQueryPipelineMap.find(idx) != rayQueryPipelineMap.end() || pendingPipelines_.find(idx) != pendingPipelines_.end())
+		{
+			continue;
+		}
+
+		pendingPipelines_.insert(idx);
+
+		// Compile off the render thread, the result is picked up by SwapInCompiledPipelines at the start of a later frame
+		const RayQueryQualityTier qualityTier = qualityTier_;
+		const bool depthEqual = depthPrepassPipeline_ != VK_NULL_HANDLE;
+		workerPool_->Enqueue([this, idx, renderPass, qualityTier, depthEqual]()
+		{
+			VulkanRT::VulkanRTData::RayTracerCompiledPipeline compiled;
+			compiled.sharedMeshInstanceId = idx;
+			compiled.qualityTier = qualityTier;
+			compiled.depthEqual = depthEqual;
+			compiled.pipeline = CompilePipeline(renderPass, false, depthEqual, qualityTier);
+
+			std::lock_guard<std::mutex> lock(compiledPipelinesMutex_);
+			compiledPipelines_.push_back(compiled);
+		});
+	}
+
+	if (depthPrepass_ && depthPrepassPipeline_ == VK_NULL_HANDLE && !depthPrepassPipelinePending_)
+	{
+		depthPrepassPipelinePending_ = true;
+
+		workerPool_->Enqueue([this, renderPass]()
+		{
+			// No fragment stage, so the quality tier doesn't matter
+			VkPipeline pipeline = CompilePipeline(renderPass, true, false, RayQueryQualityTier::Auto);
+
+			std::lock_guard<std::mutex> lock(compiledPipelinesMutex_);
+			compiledDepthPrepassPipeline_ = pipeline;
+		});
+	}
+}
+
+VkPipeline RenderAPI_VulkanRayQuery::CompilePipeline(VkRenderPass renderPass, bool depthOnly, bool depthEqual, RayQueryQualityTier qualityTier)
+{
+	VulkanRT::Shader rayShadowVert(device_);
+	VulkanRT::Shader rayShadowFrag(device_);
+
+	// Runs on a worker, SetShaderData may replace the SPIR-V at any time so work on a copy
+	std::vector<char> vertData;
+	std::vector<char> fragData;
+	bool positionOnly;
+	{
+		std::lock_guard<std::mutex> lock(shaderDataMutex_);
+
+		// The depth pre-pass only needs positions, but falls back to the full vertex shader and stream if no depth shader was given
+		positionOnly = depthOnly && !rayDepthVertData.empty();
+		vertData = positionOnly ? rayDepthVertData : rayShadowVertData;
+		fragData = rayShadowFragData;
+	}
+
+	//create rtquery shader
+	if (!vertData.empty()) {
+		rayShadowVert.LoadFromShaderByte(vertData, static_cast<int>(vertData.size()));
+	}
+	else {
+		return VK_NULL_HANDLE;
+	}
+
+	if (!fragData.empty())
+	{
+		rayShadowFrag.LoadFromShaderByte(fragData, static_cast<int>(fragData.size()));
+	}
+	else {
+		return VK_NULL_HANDLE;
+	}
+
+	// constant_id 0..4 of ray_shadow.frag, the driver drops the AO or shadow code a tier turns off
+	const RayQueryShadowSpecialization specialization = GetQualitySpecialization(qualityTier);
+	const std::array<VkSpecializationMapEntry, 6> specializationEntries = { {
+		{ 0, offsetof(RayQueryShadowSpecialization, ao_samples_each), sizeof(uint32_t) },
+		{ 1, offsetof(RayQueryShadowSpecialization, ao_max_distance), sizeof(float) },
+		{ 2, offsetof(RayQueryShadowSpecialization, ray_tmin), sizeof(float) },
+		{ 3, offsetof(RayQueryShadowSpecialization, enable_ao), sizeof(uint32_t) },
+		{ 4, offsetof(RayQueryShadowSpecialization, enable_shadow), sizeof(uint32_t) },
+		{ 5, offsetof(RayQueryShadowSpecialization, shadow_ray_budget), sizeof(uint32_t) },
+	} };
+
+	VkSpecializationInfo specializationInfo = {};
+	specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+	specializationInfo.pMapEntries = specializationEntries.data();
+	specializationInfo.dataSize = sizeof(specialization);
+	specializationInfo.pData = &specialization;
+
+	const std::array<VkPipelineShaderStageCreateInfo, 2> shader_stages = {
+		rayShadowVert.GetShaderStage(VK_SHADER_STAGE_VERTEX_BIT),
+		rayShadowFrag.GetShaderStage(VK_SHADER_STAGE_FRAGMENT_BIT, &specializationInfo)
+	};
+
+	VkPipelineInputAssemblyStateCreateInfo CreateInfo = {};
+	CreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	CreateInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	CreateInfo.primitiveRestartEnable = VK_FALSE;
+	CreateInfo.flags = 0;
+
+	VkPipelineRasterizationStateCreateInfo RasterizationCreateInfo = {};
+	RasterizationCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	RasterizationCreateInfo.polygonMode = VK_POLYGON_MODE_FILL;
+	RasterizationCreateInfo.cullMode = VK_CULL_MODE_BACK_BIT;
+	RasterizationCreateInfo.frontFace = VK_FRONT_FACE_CLOCKWISE;
+	RasterizationCreateInfo.depthClampEnable = VK_FALSE;
+	RasterizationCreateInfo.rasterizerDiscardEnable = VK_FALSE;
+	RasterizationCreateInfo.depthBiasEnable = VK_FALSE;
+	RasterizationCreateInfo.lineWidth = 1.0f;
+	RasterizationCreateInfo.flags = 0;
+
+	VkPipelineColorBlendAttachmentState ColorBlendAttachmentCreateInfo[1] = {};
+	ColorBlendAttachmentCreateInfo[0].colorWriteMask = depthOnly ? 0 : 0xf;
+	ColorBlendAttachmentCreateInfo[0].blendEnable = VK_FALSE;
+
+	VkPipelineColorBlendStateCreateInfo ColorBlendCreateInfo = {};
+	ColorBlendCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	ColorBlendCreateInfo.attachmentCount = 1;
+	ColorBlendCreateInfo.pAttachments = ColorBlendAttachmentCreateInfo;
+
+
+	VkPipelineViewportStateCreateInfo ViewportCreateInfo = {};
+	ViewportCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	ViewportCreateInfo.viewportCount = 1;
+	ViewportCreateInfo.scissorCount = 1;
+	ViewportCreateInfo.flags = 0;
+
+	const VkDynamicState dynamicStateEnables[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo DynamicCreateInfo = {};
+	DynamicCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	DynamicCreateInfo.pDynamicStates = dynamicStateEnables;
+	DynamicCreateInfo.dynamicStateCount = sizeof(dynamicStateEnables) / sizeof(*dynamicStateEnables);
+	DynamicCreateInfo.flags = 0;
+
+	VkPipelineMultisampleStateCreateInfo MultiSampleCreateInfo = {};
+	MultiSampleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	MultiSampleCreateInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	MultiSampleCreateInfo.flags = 0;
+
+	VkPipelineDepthStencilStateCreateInfo DepthStencilCreateInfo = {};
+	DepthStencilCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	// With the pre-pass the depth buffer already holds the nearest surface, so only the visible fragment passes EQUAL
+	const bool depthTestedAgainstPrepass = depthEqual && !depthOnly;
+
+	DepthStencilCreateInfo.depthTestEnable = VK_TRUE;
+	DepthStencilCreateInfo.depthWriteEnable = depthTestedAgainstPrepass ? VK_FALSE : VK_TRUE;
+	DepthStencilCreateInfo.depthBoundsTestEnable = VK_FALSE;
+	DepthStencilCreateInfo.stencilTestEnable = VK_FALSE;
+	DepthStencilCreateInfo.depthCompareOp = depthTestedAgainstPrepass ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_GREATER_OR_EQUAL; // Unity/Vulkan uses reverse Z
+	DepthStencilCreateInfo.front = DepthStencilCreateInfo.back;
+	DepthStencilCreateInfo.back.failOp = VK_STENCIL_OP_KEEP;
+	DepthStencilCreateInfo.back.passOp = VK_STENCIL_OP_KEEP;
+	DepthStencilCreateInfo.back.compareOp = VK_COMPARE_OP_ALWAYS;
+
+	// Vertex:  ray_shadow.vert
+	// float3 vpos;
+	// float3 normal;
+	VkVertexInputBindingDescription VertexInputDesc = {};
+	VertexInputDesc.binding = 0;
+	VertexInputDesc.stride = sizeof(RayQueryVertex);
+	VertexInputDesc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+	VkVertexInputAttributeDescription VertexInputAttrDesc[2];
+	VertexInputAttrDesc[0].binding = 0;
+	VertexInputAttrDesc[0].location = 0;
+	VertexInputAttrDesc[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+	VertexInputAttrDesc[0].offset = 0;
+
+	VertexInputAttrDesc[1].binding = 0;
+	VertexInputAttrDesc[1].location = 1;
+	VertexInputAttrDesc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+	VertexInputAttrDesc[1].offset = offsetof(RayQueryVertex, normal);
+
+	VkPipelineVertexInputStateCreateInfo VertexInputCreateInfo = {};
+	VertexInputCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	VertexInputCreateInfo.vertexBindingDescriptionCount = 1;
+	VertexInputCreateInfo.pVertexBindingDescriptions = &VertexInputDesc;
+	VertexInputCreateInfo.vertexAttributeDescriptionCount = positionOnly ? 1 : 2;
+	VertexInputCreateInfo.pVertexAttributeDescriptions = VertexInputAttrDesc;
+
+	VkGraphicsPipelineCreateInfo pipelineCreateInfo = {};
+	pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineCreateInfo.layout = rayQueryPipelieLayout;
+	pipelineCreateInfo.renderPass = renderPass;
+
+	pipelineCreateInfo.stageCount = depthOnly ? 1 : static_cast<uint32_t>(shader_stages.size());
+	pipelineCreateInfo.pStages = shader_stages.data();
+	pipelineCreateInfo.pVertexInputState = &VertexInputCreateInfo;
+	pipelineCreateInfo.pInputAssemblyState = &CreateInfo;
+	pipelineCreateInfo.pRasterizationState = &RasterizationCreateInfo;
+	pipelineCreateInfo.pColorBlendState = &ColorBlendCreateInfo;
+	pipelineCreateInfo.pMultisampleState = &MultiSampleCreateInfo;
+	pipelineCreateInfo.pViewportState = &ViewportCreateInfo;
+	pipelineCreateInfo.pDepthStencilState = &DepthStencilCreateInfo;
+	pipelineCreateInfo.pDynamicState = &DynamicCreateInfo;
+
+	VkPipeline pipeline = VK_NULL_HANDLE;
+
+	VkResult result = vkCreateGraphicsPipelines(device_, pipelineCache_.GetPipelineCache(), 1, &pipelineCreateInfo, nullptr, &pipeline);
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogError("Create Pipeline Failed");
+		return VK_NULL_HANDLE;
+	}
+
+	return pipeline;
+}
+
+void RenderAPI_VulkanRayQuery::SwapInCompiledPipelines(uint64_t currentFrameNumber)
+{
+	std::vector<VulkanRT::VulkanRTData::RayTracerCompiledPipeline> compiledPipelines;
+	{
+		std::lock_guard<std::mutex> lock(compiledPipelinesMutex_);
+		compiledPipelines.swap(compiledPipelines_);
+	}
+
+	VkPipeline compiledDepthPrepassPipeline = VK_NULL_HANDLE;
+	{
+		std::lock_guard<std::mutex> lock(compiledPipelinesMutex_);
+		std::swap(compiledDepthPrepassPipeline, compiledDepthPrepassPipeline_);
+	}
+
+	if (compiledDepthPrepassPipeline != VK_NULL_HANDLE)
+	{
+		depthPrepassPipeline_ = compiledDepthPrepassPipeline;
+		depthPrepassPipelinePending_ = false;
+
+		// Shading pipelines compiled so far write depth themselves, replace them with ones that test against the pre-pass
+		RetireShadingPipelines(currentFrameNumber);
+	}
+
+	for (auto& compiled : compiledPipelines)
+	{
+		pendingPipelines_.erase(compiled.sharedMeshInstanceId);
+
+		// Queued before the tier or the depth test changed or for a mesh removed since, never drawn with so it can go right away.
+		// CreatePipeline queues the mesh again if it still exists
+		if (compiled.qualityTier != qualityTier_ || compiled.depthEqual != (depthPrepassPipeline_ != VK_NULL_HANDLE) ||
+			FindSharedMesh(compiled.sharedMeshInstanceId) == nullptr)
+		{
+			if (compiled.pipeline != VK_NULL_HANDLE)
+			{
+				vkDestroyPipeline(device_, compiled.pipeline, nullptr);
+			}
+			continue;
+		}
+
+		rayQueryPipelineMap[compiled.sharedMeshInstanceId] = compiled.pipeline;
+
+		if (compiled.pipeline == VK_NULL_HANDLE)
+		{
+			continue;
+		}
+
+		if (fallbackPipeline_ == VK_NULL_HANDLE)
+		{
+			fallbackPipeline_ = compiled.pipeline;
+		}
+		else if (fallbackPipeline_ == staleFallbackPipeline_)
+		{
+			VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbagePipeline;
+			garbagePipeline.buffer = make_unique<VulkanRT::VulkanRTData::RayTracerGarbagePipeline>(device_, staleFallbackPipeline_);
+			garbagePipeline.frameCount = currentFrameNumber;
+			garbageBuffers_.push_back(std::move(garbagePipeline));
+
+			staleFallbackPipeline_ = VK_NULL_HANDLE;
+			fallbackPipeline_ = compiled.pipeline;
+		}
+	}
+}
+
+void RenderAPI_VulkanRayQuery::SetQualityTier(int tier)
+{
+	if (tier < static_cast<int>(RayQueryQualityTier::Auto) || tier >= static_cast<int>(RayQueryQualityTier::Count))
+	{
+		NativeLogger::LogWarn("SetQualityTier got an unknown tier");
+		return;
+	}
+
+	requestedQualityTier_ = static_cast<RayQueryQualityTier>(tier);
+
+	// Before Prepare the device properties may not be known yet, Prepare resolves it then
+	if (alreadyPrepared_)
+	{
+		requestedQualityTier_ = ResolveQualityTier(requestedQualityTier_, physicalDeviceProperties_);
+	}
+}
+
+void RenderAPI_VulkanRayQuery::SetMeshOptimization(int flags)
+{
+	const int knownFlags = static_cast<int>(VulkanRT::MeshOptimizer::kOptimizeVertexCache | VulkanRT::MeshOptimizer::kOptimizeOverdraw | VulkanRT::MeshOptimizer::kOptimizeVertexFetch);
+	if ((flags & ~knownFlags) != 0)
+	{
+		NativeLogger::LogWarn("SetMeshOptimization got unknown flags");
+	}
+
+	meshOptimizeFlags_ = static_cast<uint32_t>(flags & knownFlags);
+}
+
+void RenderAPI_VulkanRayQuery::SetTriangleSplitting(float areaRatio, float budget)
+{
+	if (!(areaRatio >= 0.0f) || !(budget >= 1.0f))
+	{
+		NativeLogger::LogWarn("SetTriangleSplitting needs an area ratio of at least 0 and a budget of at least 1");
+		return;
+	}
+
+	triangleSplitAreaRatio_ = areaRatio;
+	triangleSplitBudget_ = budget;
+}
+
+void RenderAPI_VulkanRayQuery::ApplyQualityTier(uint64_t currentFrameNumber)
+{
+	if (requestedQualityTier_ == qualityTier_)
+	{
+		return;
+	}
+
+	qualityTier_ = requestedQualityTier_;
+
+	RetireShadingPipelines(currentFrameNumber);
+}
+
+void RenderAPI_VulkanRayQuery::RetireShadingPipelines(uint64_t currentFrameNumber)
+{
+	// Keep one of the old pipelines drawing until the new ones are compiled
+	if (staleFallbackPipeline_ != VK_NULL_HANDLE && staleFallbackPipeline_ != fallbackPipeline_)
+	{
+		VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbagePipeline;
+		garbagePipeline.buffer = make_unique<VulkanRT::VulkanRTData::RayTracerGarbagePipeline>(device_, staleFallbackPipeline_);
+		garbagePipeline.frameCount = currentFrameNumber;
+		garbageBuffers_.push_back(std::move(garbagePipeline));
+	}
+	staleFallbackPipeline_ = fallbackPipeline_;
+
+	for (auto& entry : rayQueryPipelineMap)
+	{
+		if (entry.second == VK_NULL_HANDLE || entry.second == fallbackPipeline_)
+		{
+			continue;
+		}
+
+		VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbagePipeline;
+		garbagePipeline.buffer = make_unique<VulkanRT::VulkanRTData::RayTracerGarbagePipeline>(device_, entry.second);
+		garbagePipeline.frameCount = currentFrameNumber;
+		garbageBuffers_.push_back(std::move(garbagePipeline));
+	}
+	rayQueryPipelineMap.clear();
+}
+
+void RenderAPI_VulkanRayQuery::BuildAndSubmitRayTracingCommandBuffer(const UnityVulkanRecordingState& recordingState)
+{
+	if (!pushDescriptorSupported_ && rayQueryDescSet == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	BuildDrawList();
+
+	if (drawList_.empty())
+	{
+		return;
+	}
+
+	// The bound tile lists are only this pass's if CullLights dispatched into them right before, otherwise ray_shadow.frag visits every light.
+	// Each cull is used by one pass, so a camera whose cull was skipped doesn't read the lists of the previous camera
+	LightTileConstants tileConstants = {};
+	if (lightTileFrameNumber_ == recordingState.currentFrameNumber)
+	{
+		tileConstants = lightTileConstants_;
+	}
+	lightTileConstants_ = LightTileConstants();
+	vkCmdPushConstants(recordingState.commandBuffer, rayQueryPipelieLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(LightTileConstants), &tileConstants);
+
+	// Until the pre-pass pipeline is compiled the shading pipelines don't test with EQUAL, so they draw on their own.
+	// Once it is, pipelines of either kind pass only the nearest surface the pre-pass left in the depth buffer
+	if (depthPrepass_ && depthPrepassPipeline_ != VK_NULL_HANDLE)
+	{
+		RecordDrawList(recordingState.commandBuffer, true);
+	}
+	RecordDrawList(recordingState.commandBuffer, false);
+}
+
+void RenderAPI_VulkanRayQuery::BuildDrawList()
+{
+	drawList_.clear();
+
+	//󶨹
+	for (auto itor = meshInstancePool_.in_use_begin(); itor != meshInstancePool_.in_use_end(); ++itor)
+	{
+		const auto& instance = meshInstancePool_.data()[itor->second];
+		int idx = instance.sharedMeshInstanceId;
+		const auto rayTracerMeshData = FindSharedMesh(idx);
+		if (rayTracerMeshData == nullptr) continue;
+
+		// Not in the TLAS yet, so it has no instance data either
+		if (instance.customIndex >= instanceData_.size()) continue;
+
+		// Meshes whose own pipeline is still compiling draw with any finished one, they all share the same state
+		auto pipelineItor = rayQueryPipelineMap.find(idx);
+		VkPipeline renderPipeline = (pipelineItor != rayQueryPipelineMap.end() && pipelineItor->second != VK_NULL_HANDLE) ? pipelineItor->second : fallbackPipeline_;
+		if (renderPipeline == VK_NULL_HANDLE) continue;
+
+		VulkanRT::VulkanRTData::RayTracerDrawItem drawItem;
+		drawItem.pipeline = renderPipeline;
+		drawItem.vertexBuffer = rayTracerMeshData->vertexBuffer.GetBuffer();
+		drawItem.indexBuffer = rayTracerMeshData->indexBuffer.GetBuffer();
+		drawItem.indexType = rayTracerMeshData->indexType;
+		drawItem.indexCount = static_cast<uint32_t>(rayTracerMeshData->indexCount);
+		drawItem.instanceIndex = instance.customIndex;
+
+		drawList_.push_back(drawItem);
+	}
+}
+
+void RenderAPI_VulkanRayQuery::RecordDrawList(VkCommandBuffer commandBuffer, bool depthPrepass)
+{
+	VkPipeline boundPipeline = VK_NULL_HANDLE;
+
+	BindDescriptors(commandBuffer);
+
+	for (const auto& drawItem : drawList_)
+	{
+		VkPipeline pipeline = depthPrepass ? depthPrepassPipeline_ : drawItem.pipeline;
+		if (pipeline != boundPipeline)
+		{
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+			boundPipeline = pipeline;
+		}
+
+		VkDeviceSize offsets[1] = {0};
+		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &drawItem.vertexBuffer, offsets);
+		vkCmdBindIndexBuffer(commandBuffer, drawItem.indexBuffer, 0, drawItem.indexType);
+
+		vkCmdDrawIndexed(commandBuffer, drawItem.indexCount, 1, 0, 0, drawItem.instanceIndex);
+	}
+}
+
+void RenderAPI_VulkanRayQuery::SetRenderTargetSize(int width, int height)
+{
+	renderTargetWidth_ = width > 0 ? static_cast<uint32_t>(width) : 0;
+	renderTargetHeight_ = height > 0 ? static_cast<uint32_t>(height) : 0;
+}
+
+void RenderAPI_VulkanRayQuery::SetDepthPrepass(bool enabled)
+{
+	// Shading pipelines bake the depth compare op, so this can't change once they exist
+	if (alreadyPrepared_)
+	{
+		NativeLogger::LogWarn("SetDepthPrepass must be called before Prepare");
+		return;
+	}
+
+	depthPrepass_ = enabled;
+}
+
+void RenderAPI_VulkanRayQuery::CreateDescriptorPool()
+{
+	//  data 0  ->  Acceleration structure
+	//  data 1  ->  Global Uniform Data
+	//  data 2  ->  Instance Data
+	//  data 3  ->  Lights
+	//  data 4  ->  Tile light indices
+	//  data 5  ->  Light alias table
+
+	std::vector<VkDescriptorPoolSize> pool_sizes = {
+		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, kMaxDescriptorSets},
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, kMaxDescriptorSets},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * kMaxDescriptorSets},
+	};
+
+	VkDescriptorPoolCreateInfo descriptor_pool_info{};
+	descriptor_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	descriptor_pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+	descriptor_pool_info.pPoolSizes = pool_sizes.data();
+	descriptor_pool_info.maxSets = kMaxDescriptorSets;
+
+	VkResult result = vkCreateDescriptorPool(device_, &descriptor_pool_info, nullptr, &descriptorPool_);
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogInfo("Create Pool Failed");
+	}
+}
+
+// Fills the writes for bindings 0 to 5, used where no update template is available
+static void FillDescriptorWrites(const VulkanRT::VulkanRTData::RayTracerDescriptorData& descriptorData, VkDescriptorSet dstSet,
+	VkWriteDescriptorSetAccelerationStructureKHR& accelerationStructureInfo, std::array<VkWriteDescriptorSet, 6>& descriptorWrites)
+{
+	accelerationStructureInfo = {};
+	accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+	accelerationStructureInfo.accelerationStructureCount = 1;
+	accelerationStructureInfo.pAccelerationStructures = &descriptorData.accelerationStructure;
+
+	descriptorWrites[0] = {};
+	descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[0].pNext = &accelerationStructureInfo;
+	descriptorWrites[0].dstSet = dstSet;
+	descriptorWrites[0].dstBinding = 0;
+	descriptorWrites[0].descriptorCount = 1;
+	descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+
+	descriptorWrites[1] = {};
+	descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[1].dstSet = dstSet;
+	descriptorWrites[1].dstBinding = 1;
+	descriptorWrites[1].descriptorCount = 1;
+	descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descriptorWrites[1].pBufferInfo = &descriptorData.globalUniform;
+
+	descriptorWrites[2] = {};
+	descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrites[2].dstSet = dstSet;
+	descriptorWrites[2].dstBinding = 2;
+	descriptorWrites[2].descriptorCount = 1;
+	descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorWrites[2].pBufferInfo = &descriptorData.instanceData;
+
+	descriptorWrites[3] = descriptorWrites[2];
+	descriptorWrites[3].dstBinding = 3;
+	descriptorWrites[3].pBufferInfo = &descriptorData.lights;
+
+	descriptorWrites[4] = descriptorWrites[2];
+	descriptorWrites[4].dstBinding = 4;
+	descriptorWrites[4].pBufferInfo = &descriptorData.tileLights;
+
+	descriptorWrites[5] = descriptorWrites[2];
+	descriptorWrites[5].dstBinding = 5;
+	descriptorWrites[5].pBufferInfo = &descriptorData.lightAlias;
+}
+
+void RenderAPI_VulkanRayQuery::CreateDescriptorUpdateTemplate()
+{
+	if (descriptorUpdateTemplate_ != VK_NULL_HANDLE || vkCreateDescriptorUpdateTemplateKHR == nullptr)
+	{
+		return;
+	}
+
+	std::array<VkDescriptorUpdateTemplateEntryKHR, 6> entries = {};
+
+	// binding 0 -> Acceleration structure
+	entries[0].dstBinding = 0;
+	entries[0].descriptorCount = 1;
+	entries[0].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+	entries[0].offset = offsetof(VulkanRT::VulkanRTData::RayTracerDescriptorData, accelerationStructure);
+
+	// binding 1 -> Global Uniform Data
+	entries[1].dstBinding = 1;
+	entries[1].descriptorCount = 1;
+	entries[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	entries[1].offset = offsetof(VulkanRT::VulkanRTData::RayTracerDescriptorData, globalUniform);
+
+	// binding 2 -> Instance Data
+	entries[2].dstBinding = 2;
+	entries[2].descriptorCount = 1;
+	entries[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	entries[2].offset = offsetof(VulkanRT::VulkanRTData::RayTracerDescriptorData, instanceData);
+
+	// binding 3 -> Lights
+	entries[3].dstBinding = 3;
+	entries[3].descriptorCount = 1;
+	entries[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	entries[3].offset = offsetof(VulkanRT::VulkanRTData::RayTracerDescriptorData, lights);
+
+	// binding 4 -> Tile light indices
+	entries[4].dstBinding = 4;
+	entries[4].descriptorCount = 1;
+	entries[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	entries[4].offset = offsetof(VulkanRT::VulkanRTData::RayTracerDescriptorData, tileLights);
+
+	// binding 5 -> Light alias table
+	entries[5].dstBinding = 5;
+	entries[5].descriptorCount = 1;
+	entries[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	entries[5].offset = offsetof(VulkanRT::VulkanRTData::RayTracerDescriptorData, lightAlias);
+
+	VkDescriptorUpdateTemplateCreateInfoKHR templateCreateInfo = {};
+	templateCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO_KHR;
+	templateCreateInfo.descriptorUpdateEntryCount = static_cast<uint32_t>(entries.size());
+	templateCreateInfo.pDescriptorUpdateEntries = entries.data();
+	templateCreateInfo.templateType = pushDescriptorSupported_ ? VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_PUSH_DESCRIPTORS_KHR : VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET_KHR;
+	templateCreateInfo.descriptorSetLayout = rayQueryDescrioptorSetLayout;
+	templateCreateInfo.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	templateCreateInfo.pipelineLayout = rayQueryPipelieLayout;
+	templateCreateInfo.set = 0;
+
+	VkResult result = vkCreateDescriptorUpdateTemplateKHR(device_, &templateCreateInfo, nullptr, &descriptorUpdateTemplate_);
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogWarn("Create DescriptorUpdateTemplate Failed, using vkUpdateDescriptorSets");
+		NativeLogger::LogInfo(vkResultToString(result));
+		descriptorUpdateTemplate_ = VK_NULL_HANDLE;
+	}
+}
+
+void RenderAPI_VulkanRayQuery::UpdateDescriptorSets(uint64_t currentFrameNumber, uint64_t safeFrameNumber)
+{
+	descriptorData_.accelerationStructure = tlas_.accelerationStructure;
+	descriptorData_.globalUniform = globalUniformBufferInfo;
+	descriptorData_.instanceData.buffer = instanceDataSlot_ < instanceDataSlots_.size() ? instanceDataSlots_[instanceDataSlot_].buffer.GetBuffer() : VK_NULL_HANDLE;
+	descriptorData_.instanceData.offset = 0;
+	descriptorData_.instanceData.range = VK_WHOLE_SIZE;
+	descriptorData_.lights.buffer = lightSlot_ < lightSlots_.size() ? lightSlots_[lightSlot_].buffer.GetBuffer() : VK_NULL_HANDLE;
+	descriptorData_.lights.offset = 0;
+	descriptorData_.lights.range = VK_WHOLE_SIZE;
+	descriptorData_.tileLights.buffer = tileLightSlot_ < tileLightSlots_.size() ? tileLightSlots_[tileLightSlot_].buffer.GetBuffer() : VK_NULL_HANDLE;
+	descriptorData_.tileLights.offset = 0;
+	descriptorData_.tileLights.range = VK_WHOLE_SIZE;
+	descriptorData_.lightAlias.buffer = lightSlot_ < lightAliasSlots_.size() ? lightAliasSlots_[lightSlot_].buffer.GetBuffer() : VK_NULL_HANDLE;
+	descriptorData_.lightAlias.offset = 0;
+	descriptorData_.lightAlias.range = VK_WHOLE_SIZE;
+
+	// Pushed straight into the command buffer while recording, nothing to keep alive
+	if (pushDescriptorSupported_)
+	{
+		return;
+	}
+
+	// Reuse a set that already holds these descriptors
+	for (auto& slot : descriptorSetSlots_)
+	{
+		if (slot.data == descriptorData_)
+		{
+			slot.frameNumber = currentFrameNumber;
+			rayQueryDescSet = slot.descriptorSet;
+			return;
+		}
+	}
+
+	// Otherwise rewrite one the GPU is done with, a set must not change while a submitted command buffer uses it
+	VulkanRT::VulkanRTData::RayTracerDescriptorSetSlot* target = nullptr;
+	for (auto& slot : descriptorSetSlots_)
+	{
+		if (slot.frameNumber != currentFrameNumber && slot.frameNumber <= safeFrameNumber)
+		{
+			target = &slot;
+			break;
+		}
+	}
+
+	if (target == nullptr)
+	{
+		if (descriptorSetSlots_.size() >= kMaxDescriptorSets)
+		{
+			NativeLogger::LogWarn("All descriptor sets are in flight, keeping the previous one");
+			return;
+		}
+
+		VkDescriptorSetAllocateInfo descriptor_set_allocate_info{};
+		descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		descriptor_set_allocate_info.descriptorPool = descriptorPool_;
+		descriptor_set_allocate_info.descriptorSetCount = 1;
+		descriptor_set_allocate_info.pSetLayouts = &rayQueryDescrioptorSetLayout;
+
+		VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+		VkResult result = vkAllocateDescriptorSets(device_, &descriptor_set_allocate_info, &descriptorSet);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogInfo("Allocate DescriptorSet Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			return;
+		}
+
+		descriptorSetSlots_.push_back(VulkanRT::VulkanRTData::RayTracerDescriptorSetSlot());
+		target = &descriptorSetSlots_.back();
+		target->descriptorSet = descriptorSet;
+	}
+
+	if (descriptorUpdateTemplate_ != VK_NULL_HANDLE)
+	{
+		vkUpdateDescriptorSetWithTemplateKHR(device_, target->descriptorSet, descriptorUpdateTemplate_, &descriptorData_);
+	}
+	else
+	{
+		VkWriteDescriptorSetAccelerationStructureKHR accelerationStructureInfo;
+		std::array<VkWriteDescriptorSet, 6> descriptorWrites;
+		FillDescriptorWrites(descriptorData_, target->descriptorSet, accelerationStructureInfo, descriptorWrites);
+		vkUpdateDescriptorSets(device_, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, VK_NULL_HANDLE);
+	}
+
+	target->data = descriptorData_;
+	target->frameNumber = currentFrameNumber;
+	rayQueryDescSet = target->descriptorSet;
+}
+
+void RenderAPI_VulkanRayQuery::BindDescriptors(VkCommandBuffer commandBuffer)
+{
+	if (!pushDescriptorSupported_)
+	{
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, rayQueryPipelieLayout, 0, 1, &rayQueryDescSet, 0, 0);
+	}
+	else if (descriptorUpdateTemplate_ != VK_NULL_HANDLE)
+	{
+		vkCmdPushDescriptorSetWithTemplateKHR(commandBuffer, descriptorUpdateTemplate_, rayQueryPipelieLayout, 0, &descriptorData_);
+	}
+	else
+	{
+		VkWriteDescriptorSetAccelerationStructureKHR accelerationStructureInfo;
+		std::array<VkWriteDescriptorSet, 6> descriptorWrites;
+		FillDescriptorWrites(descriptorData_, VK_NULL_HANDLE, accelerationStructureInfo, descriptorWrites);
+		vkCmdPushDescriptorSetKHR(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, rayQueryPipelieLayout, 0, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data());
+	}
+}
+
+void RenderAPI_VulkanRayQuery::SetComputeShadowTargets(void* depthTexture, void* outputTexture, int downsample)
+{
+	computeShadowDepthTexture_ = depthTexture;
+	computeShadowOutputTexture_ = outputTexture;
+	computeShadowDownsample_ = downsample > 0 ? static_cast<uint32_t>(downsample) : 0;
+}
+
+void RenderAPI_VulkanRayQuery::SetComputeShadowTemporal(bool enabled)
+{
+	if (enabled && !computeShadowTemporal_)
+	{
+		historyValid_ = false;
+	}
+	computeShadowTemporal_ = enabled;
+}
+
+void RenderAPI_VulkanRayQuery::TraceShadowsCompute()
+{
+	if (computeShadowDownsample_ == 0 || computeShadowDepthTexture_ == nullptr || computeShadowOutputTexture_ == nullptr || !alreadyPrepared_)
+	{
+		return;
+	}
+
+	ManualBuildTlas();
+
+	if (!CreateComputeShadowPipelines())
+	{
+		return;
+	}
+
+	// Transitions are recorded into Unity's command buffer, so this has to happen before its recording state is taken
+	UnityVulkanImage depthImage;
+	if (!graphicsInterface_->AccessTexture(computeShadowDepthTexture_, UnityVulkanWholeImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, kUnityVulkanResourceAccess_PipelineBarrier, &depthImage))
+	{
+		return;
+	}
+
+	UnityVulkanImage outputImage;
+	if (!graphicsInterface_->AccessTexture(computeShadowOutputTexture_, UnityVulkanWholeImage, VK_IMAGE_LAYOUT_GENERAL,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, kUnityVulkanResourceAccess_PipelineBarrier, &outputImage))
+	{
+		return;
+	}
+
+	UnityVulkanRecordingState recordingState;
+	if (!graphicsInterface_->CommandRecordingState(&recordingState, kUnityVulkanGraphicsQueueAccess_DontCare))
+	{
+		return;
+	}
+
+	if (tlas_.accelerationStructure == VK_NULL_HANDLE || !EnsureVisibilityImage(outputImage.extent, recordingState.currentFrameNumber))
+	{
+		GarbageCollect(recordingState.safeFrameNumber);
+		return;
+	}
+
+	VkDescriptorSet descriptorSet = AcquireTransientDescriptorSet(computeShadowSetSlots_, computeShadowDescriptorPool_, computeShadowDescriptorSetLayout_,
+		recordingState.currentFrameNumber, recordingState.safeFrameNumber);
+	if (descriptorSet == VK_NULL_HANDLE)
+	{
+		GarbageCollect(recordingState.safeFrameNumber);
+		return;
+	}
+
+	// Views of Unity's images only live until the GPU is done with this frame
+	VkImageSubresourceRange colorRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	VkImageSubresourceRange depthRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+
+	auto depthView = make_unique<VulkanRT::Image>(device_, physicalDeviceMemoryProperties_);
+	depthView->LoadFromUnity("ComputeShadowDepth", depthImage.image, depthImage.format);
+	VkResult result = depthView->CreateImageView(VK_IMAGE_VIEW_TYPE_2D, depthImage.format, (depthImage.aspect & VK_IMAGE_ASPECT_DEPTH_BIT) ? depthRange : colorRange);
+
+	auto outputView = make_unique<VulkanRT::Image>(device_, physicalDeviceMemoryProperties_);
+	outputView->LoadFromUnity("ComputeShadowOutput", outputImage.image, outputImage.format);
+	if (result == VK_SUCCESS)
+	{
+		result = outputView->CreateImageView(VK_IMAGE_VIEW_TYPE_2D, outputImage.format, colorRange);
+	}
+
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogWarn("Create compute shadow image views Failed");
+		NativeLogger::LogInfo(vkResultToString(result));
+		GarbageCollect(recordingState.safeFrameNumber);
+		return;
+	}
+
+	//  binding 0  ->  Acceleration structure
+	//  binding 1  ->  Global Uniform Data
+	//  binding 2  ->  Camera depth
+	//  binding 3  ->  Visibility, written by the trace pass
+	//  binding 4  ->  Output texture, written by the upsample pass
+	//  binding 5  ->  Visibility, read by the upsample pass
+	//  binding 6  ->  History of the previous dispatch
+	//  binding 7  ->  History written by this dispatch
+	VkWriteDescriptorSetAccelerationStructureKHR accelerationStructureInfo = {};
+	accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+	accelerationStructureInfo.accelerationStructureCount = 1;
+	accelerationStructureInfo.pAccelerationStructures = &tlas_.accelerationStructure;
+
+	VkDescriptorImageInfo depthInfo = { computeShadowSampler_, depthView->GetImageView(), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	VkDescriptorImageInfo visibilityStorageInfo = { VK_NULL_HANDLE, visibilityImage_->GetImageView(), VK_IMAGE_LAYOUT_GENERAL };
+	VkDescriptorImageInfo outputInfo = { VK_NULL_HANDLE, outputView->GetImageView(), VK_IMAGE_LAYOUT_GENERAL };
+	VkDescriptorImageInfo visibilitySampledInfo = { computeShadowSampler_, visibilityImage_->GetImageView(), VK_IMAGE_LAYOUT_GENERAL };
+
+	VulkanRT::Image& historyRead = *historyImages_[historyIndex_ ^ 1];
+	VulkanRT::Image& historyWrite = *historyImages_[historyIndex_];
+	VkDescriptorImageInfo historyReadInfo = { computeShadowSampler_, historyRead.GetImageView(), VK_IMAGE_LAYOUT_GENERAL };
+	VkDescriptorImageInfo historyWriteInfo = { VK_NULL_HANDLE, historyWrite.GetImageView(), VK_IMAGE_LAYOUT_GENERAL };
+
+	std::array<VkWriteDescriptorSet, 8> descriptorWrites = {};
+	for (uint32_t i = 0; i < descriptorWrites.size(); ++i)
+	{
+		descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[i].dstSet = descriptorSet;
+		descriptorWrites[i].dstBinding = i;
+		descriptorWrites[i].descriptorCount = 1;
+	}
+
+	descriptorWrites[0].pNext = &accelerationStructureInfo;
+	descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+	descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descriptorWrites[1].pBufferInfo = &globalUniformBufferInfo;
+	descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrites[2].pImageInfo = &depthInfo;
+	descriptorWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	descriptorWrites[3].pImageInfo = &visibilityStorageInfo;
+	descriptorWrites[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	descriptorWrites[4].pImageInfo = &outputInfo;
+	descriptorWrites[5].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrites[5].pImageInfo = &visibilitySampledInfo;
+	descriptorWrites[6].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrites[6].pImageInfo = &historyReadInfo;
+	descriptorWrites[7].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	descriptorWrites[7].pImageInfo = &historyWriteInfo;
+
+	vkUpdateDescriptorSets(device_, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, VK_NULL_HANDLE);
+
+	VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbageDepthView;
+	garbageDepthView.buffer = std::move(depthView);
+	garbageDepthView.frameCount = recordingState.currentFrameNumber;
+	garbageBuffers_.push_back(std::move(garbageDepthView));
+
+	VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbageOutputView;
+	garbageOutputView.buffer = std::move(outputView);
+	garbageOutputView.frameCount = recordingState.currentFrameNumber;
+	garbageBuffers_.push_back(std::move(garbageOutputView));
+
+	ComputeShadowConstants constants;
+	constants.visibility_size = ivec2(visibilityExtent_.width, visibilityExtent_.height);
+	constants.output_size = ivec2(outputImage.extent.width, outputImage.extent.height);
+	constants.downsample = static_cast<int>(computeShadowDownsample_);
+	constants.frame_index = static_cast<int>(computeShadowFrameIndex_++);
+	constants.temporal = computeShadowTemporal_ ? (historyValid_ ? 1 : 2) : 0;
+
+	VkCommandBuffer commandBuffer = recordingState.commandBuffer;
+
+	// Every texel is rewritten, so the previous contents can be dropped instead of waiting on a read to write barrier
+	VkImageMemoryBarrier visibilityBarrier = {};
+	visibilityBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	visibilityBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	visibilityBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	visibilityBarrier.image = visibilityImage_->GetImage();
+	visibilityBarrier.subresourceRange = colorRange;
+	visibilityBarrier.srcAccessMask = 0;
+	visibilityBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	visibilityBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	visibilityBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &visibilityBarrier);
+
+	// The history written last dispatch is read now, and the other one is fully overwritten
+	std::array<VkImageMemoryBarrier, 2> historyBarriers = { visibilityBarrier, visibilityBarrier };
+	historyBarriers[0].image = historyRead.GetImage();
+	historyBarriers[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	historyBarriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	historyBarriers[0].oldLayout = historyValid_ ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_UNDEFINED;
+	historyBarriers[1].image = historyWrite.GetImage();
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr,
+		static_cast<uint32_t>(historyBarriers.size()), historyBarriers.data());
+
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computeShadowPipelineLayout_, 0, 1, &descriptorSet, 0, nullptr);
+	vkCmdPushConstants(commandBuffer, computeShadowPipelineLayout_, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ComputeShadowConstants), &constants);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computeShadowTracePipeline_);
+	vkCmdDispatch(commandBuffer, (visibilityExtent_.width + 7) / 8, (visibilityExtent_.height + 7) / 8, 1);
+
+	visibilityBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	visibilityBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	visibilityBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &visibilityBarrier);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computeShadowUpsamplePipeline_);
+	vkCmdDispatch(commandBuffer, (outputImage.extent.width + 7) / 8, (outputImage.extent.height + 7) / 8, 1);
+
+	// Both histories are in GENERAL now, the written one holds valid data only if this dispatch accumulated
+	historyValid_ = computeShadowTemporal_;
+	historyIndex_ ^= 1;
+
+	GarbageCollect(recordingState.safeFrameNumber);
+}
+
+bool RenderAPI_VulkanRayQuery::CreateComputeShadowPipelines()
+{
+	if (computeShadowTracePipeline_ != VK_NULL_HANDLE && computeShadowUpsamplePipeline_ != VK_NULL_HANDLE)
+	{
+		return true;
+	}
+
+	std::vector<char> traceData;
+	std::vector<char> upsampleData;
+	{
+		std::lock_guard<std::mutex> lock(shaderDataMutex_);
+		traceData = rayShadowTraceCompData;
+		upsampleData = rayShadowUpsampleCompData;
+	}
+
+	if (traceData.empty() || upsampleData.empty())
+	{
+		if (!computeShadowShadersMissingLogged_)
+		{
+			NativeLogger::LogError("Compute shadow pass is enabled but ray_shadowTraceComp or ray_shadowUpsampleComp was not set, the pass is skipped");
+			computeShadowShadersMissingLogged_ = true;
+		}
+		return false;
+	}
+
+	if (computeShadowDescriptorSetLayout_ == VK_NULL_HANDLE)
+	{
+		const VkDescriptorType bindingTypes[] = {
+			VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
+			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+		};
+
+		std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings;
+		for (uint32_t i = 0; i < sizeof(bindingTypes) / sizeof(bindingTypes[0]); ++i)
+		{
+			VkDescriptorSetLayoutBinding binding{};
+			binding.descriptorType = bindingTypes[i];
+			binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+			binding.binding = i;
+			binding.descriptorCount = 1;
+			set_layout_bindings.push_back(binding);
+		}
+
+		VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+		descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		descriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(set_layout_bindings.size());
+		descriptorSetLayoutCreateInfo.pBindings = set_layout_bindings.data();
+
+		VkResult result = vkCreateDescriptorSetLayout(device_, &descriptorSetLayoutCreateInfo, nullptr, &computeShadowDescriptorSetLayout_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create compute shadow DescSetLayout Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			computeShadowDescriptorSetLayout_ = VK_NULL_HANDLE;
+			return false;
+		}
+
+		std::vector<VkDescriptorPoolSize> pool_sizes = {
+			{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, kMaxDescriptorSets},
+			{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, kMaxDescriptorSets},
+			{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3 * kMaxDescriptorSets},
+			{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 3 * kMaxDescriptorSets},
+		};
+
+		VkDescriptorPoolCreateInfo descriptor_pool_info{};
+		descriptor_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		descriptor_pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+		descriptor_pool_info.pPoolSizes = pool_sizes.data();
+		descriptor_pool_info.maxSets = kMaxDescriptorSets;
+
+		result = vkCreateDescriptorPool(device_, &descriptor_pool_info, nullptr, &computeShadowDescriptorPool_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create compute shadow Pool Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			computeShadowDescriptorPool_ = VK_NULL_HANDLE;
+			return false;
+		}
+
+		// Both passes fetch exact texels, the upsample filter does its own weighting
+		VkSamplerCreateInfo samplerCreateInfo = {};
+		samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+		samplerCreateInfo.magFilter = VK_FILTER_NEAREST;
+		samplerCreateInfo.minFilter = VK_FILTER_NEAREST;
+		samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+		samplerCreateInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerCreateInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerCreateInfo.maxAnisotropy = 1;
+		samplerCreateInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+		samplerCreateInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+
+		result = vkCreateSampler(device_, &samplerCreateInfo, nullptr, &computeShadowSampler_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create compute shadow Sampler Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			computeShadowSampler_ = VK_NULL_HANDLE;
+			return false;
+		}
+	}
+
+	if (computeShadowPipelineLayout_ == VK_NULL_HANDLE)
+	{
+		VkPushConstantRange push_constant;
+		push_constant.offset = 0;
+		push_constant.size = sizeof(ComputeShadowConstants);
+		push_constant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+		VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+		pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipeline_layout_create_info.pushConstantRangeCount = 1;
+		pipeline_layout_create_info.pPushConstantRanges = &push_constant;
+		pipeline_layout_create_info.setLayoutCount = 1;
+		pipeline_layout_create_info.pSetLayouts = &computeShadowDescriptorSetLayout_;
+
+		VkResult result = vkCreatePipelineLayout(device_, &pipeline_layout_create_info, nullptr, &computeShadowPipelineLayout_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create compute shadow PipelineLayout Failed");
+			computeShadowPipelineLayout_ = VK_NULL_HANDLE;
+			return false;
+		}
+	}
+
+	auto createComputePipeline = [this](const std::vector<char>& data, VkPipeline& pipeline)
+	{
+		if (pipeline != VK_NULL_HANDLE)
+		{
+			return true;
+		}
+
+		VulkanRT::Shader shader(device_);
+		if (!shader.LoadFromShaderByte(data, static_cast<int>(data.size())))
+		{
+			return false;
+		}
 
-	auto index = garbageBuffers_.size();
-	garbageBuffers_.push_back(VulkanRT::VulkanRTData::RayTracerGarbageBuffer());
-	garbageBuffers_[index].frameCount = currentFrameNumber;
-	garbageBuffers_[index].buffer = std::move(scratchBuffer);
+		VkComputePipelineCreateInfo pipelineCreateInfo = {};
+		pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+		pipelineCreateInfo.stage = shader.GetShaderStage(VK_SHADER_STAGE_COMPUTE_BIT);
+		pipelineCreateInfo.layout = computeShadowPipelineLayout_;
 
-	rebuildTlas_ = false;
-	updateTlas_ = false;
-}
+		VkResult result = vkCreateComputePipelines(device_, pipelineCache_.GetPipelineCache(), 1, &pipelineCreateInfo, nullptr, &pipeline);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create compute shadow Pipeline Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			pipeline = VK_NULL_HANDLE;
+			return false;
+		}
+		return true;
+	};
 
+	return createComputePipeline(traceData, computeShadowTracePipeline_)
+		&& createComputePipeline(upsampleData, computeShadowUpsamplePipeline_);
+}
 
-void RenderAPI_VulkanRayQuery::CreateDescriptorSetsLayouts()
+bool RenderAPI_VulkanRayQuery::EnsureVisibilityImage(const VkExtent3D& outputExtent, uint64_t currentFrameNumber)
 {
-	{
-		//ٽṹ
-		VkDescriptorSetLayoutBinding accelerationStructureLayoutBinding{};
-		accelerationStructureLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
-		accelerationStructureLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
-		accelerationStructureLayoutBinding.binding = 0;
-		accelerationStructureLayoutBinding.descriptorCount = 1;
+	const uint32_t width = (outputExtent.width + computeShadowDownsample_ - 1) / computeShadowDownsample_;
+	const uint32_t height = (outputExtent.height + computeShadowDownsample_ - 1) / computeShadowDownsample_;
 
-		//shader uniform
-		VkDescriptorSetLayoutBinding globalUniformLayoutBinding{};
-		globalUniformLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		globalUniformLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
-		globalUniformLayoutBinding.binding = 1;
-		globalUniformLayoutBinding.descriptorCount = 1;
+	if (visibilityImage_ && visibilityExtent_.width == width && visibilityExtent_.height == height)
+	{
+		return true;
+	}
 
-		std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings =
+	std::unique_ptr<VulkanRT::Image>* oldImages[] = { &visibilityImage_, &historyImages_[0], &historyImages_[1] };
+	for (auto oldImage : oldImages)
+	{
+		if (*oldImage)
 		{
-			accelerationStructureLayoutBinding,
-			globalUniformLayoutBinding
-		};
+			VulkanRT::VulkanRTData::RayTracerGarbageBuffer garbageImage;
+			garbageImage.buffer = std::move(*oldImage);
+			garbageImage.frameCount = currentFrameNumber;
+			garbageBuffers_.push_back(std::move(garbageImage));
+		}
+	}
+	historyValid_ = false;
 
-		VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
-		descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-		descriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(set_layout_bindings.size());
-		descriptorSetLayoutCreateInfo.pBindings = set_layout_bindings.data();
+	if (width == 0 || height == 0)
+	{
+		return false;
+	}
 
-		VkResult result = vkCreateDescriptorSetLayout(device_, &descriptorSetLayoutCreateInfo, nullptr, &rayQueryDescrioptorSetLayout);
-		if (result != VK_SUCCESS)
+	// Two 8 bit channels are enough, but storage support for RG8 is optional
+	VkFormat format = VK_FORMAT_R8G8_UNORM;
+	VkFormatProperties formatProperties;
+	vkGetPhysicalDeviceFormatProperties(m_Instance.physicalDevice, format, &formatProperties);
+	if ((formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT) == 0)
+	{
+		format = VK_FORMAT_R8G8B8A8_UNORM;
+	}
+
+	auto image = make_unique<VulkanRT::Image>(device_, physicalDeviceMemoryProperties_);
+	VkResult result = image->Create("VisibilityImage", VK_IMAGE_TYPE_2D, format, { width, height, 1 }, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	if (result == VK_SUCCESS)
+	{
+		result = image->CreateImageView(VK_IMAGE_VIEW_TYPE_2D, format, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+	}
+
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogError("Create VisibilityImage Failed");
+		NativeLogger::LogInfo(vkResultToString(result));
+		return false;
+	}
+
+	// Always created, the trace pipeline references them even when temporal mode is off.
+	// Half floats so the running average doesn't band after many samples
+	std::unique_ptr<VulkanRT::Image> history[2];
+	for (uint32_t i = 0; i < 2 && result == VK_SUCCESS; ++i)
+	{
+		history[i] = make_unique<VulkanRT::Image>(device_, physicalDeviceMemoryProperties_);
+		result = history[i]->Create("HistoryImage", VK_IMAGE_TYPE_2D, VK_FORMAT_R16G16B16A16_SFLOAT, { width, height, 1 }, VK_IMAGE_TILING_OPTIMAL,
+			VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+		if (result == VK_SUCCESS)
 		{
-			NativeLogger::LogInfo("CreateDescSetLayout Failed");
-			NativeLogger::LogInfo(vkResultToString(result));
+			result = history[i]->CreateImageView(VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R16G16B16A16_SFLOAT, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
 		}
+	}
 
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogError("Create HistoryImage Failed");
+		NativeLogger::LogInfo(vkResultToString(result));
+		return false;
 	}
+
+	visibilityImage_ = std::move(image);
+	historyImages_[0] = std::move(history[0]);
+	historyImages_[1] = std::move(history[1]);
+	historyIndex_ = 0;
+	visibilityExtent_.width = width;
+	visibilityExtent_.height = height;
+
+	return true;
 }
 
-void RenderAPI_VulkanRayQuery::CreatePipelineLayout()
+VkDescriptorSet RenderAPI_VulkanRayQuery::AcquireTransientDescriptorSet(std::vector<VulkanRT::VulkanRTData::RayTracerDescriptorSetSlot>& slots, VkDescriptorPool pool, VkDescriptorSetLayout layout,
+	uint64_t currentFrameNumber, uint64_t safeFrameNumber)
 {
-	VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
-	pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	for (auto& slot : slots)
+	{
+		if (slot.frameNumber != currentFrameNumber && slot.frameNumber <= safeFrameNumber)
+		{
+			slot.frameNumber = currentFrameNumber;
+			return slot.descriptorSet;
+		}
+	}
 
-	VkPushConstantRange push_constant;
-	push_constant.offset = 0;
-	push_constant.size = sizeof(PerMeshUniform);
-	push_constant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	if (slots.size() >= kMaxDescriptorSets)
+	{
+		NativeLogger::LogWarn("All transient descriptor sets are in flight, skipping the pass");
+		return VK_NULL_HANDLE;
+	}
 
-	pipeline_layout_create_info.pPushConstantRanges = &push_constant;
-	pipeline_layout_create_info.pushConstantRangeCount = 1;
+	VkDescriptorSetAllocateInfo descriptor_set_allocate_info{};
+	descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	descriptor_set_allocate_info.descriptorPool = pool;
+	descriptor_set_allocate_info.descriptorSetCount = 1;
+	descriptor_set_allocate_info.pSetLayouts = &layout;
 
+	VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+	VkResult result = vkAllocateDescriptorSets(device_, &descriptor_set_allocate_info, &descriptorSet);
+	if (result != VK_SUCCESS)
+	{
+		NativeLogger::LogInfo("Allocate transient DescriptorSet Failed");
+		NativeLogger::LogInfo(vkResultToString(result));
+		return VK_NULL_HANDLE;
+	}
 
-	pipeline_layout_create_info.setLayoutCount = 1;
-	pipeline_layout_create_info.pSetLayouts = &rayQueryDescrioptorSetLayout;
+	slots.push_back(VulkanRT::VulkanRTData::RayTracerDescriptorSetSlot());
+	slots.back().descriptorSet = descriptorSet;
+	slots.back().frameNumber = currentFrameNumber;
 
-	VkResult ret = vkCreatePipelineLayout(device_, &pipeline_layout_create_info, nullptr, &rayQueryPipelieLayout);
+	return descriptorSet;
+}
 
-	if (ret != VK_SUCCESS) {
-		NativeLogger::LogError("Create PipelineLayout Failed");
+void RenderAPI_VulkanRayQuery::DestroyComputeShadowResources()
+{
+	if (computeShadowTracePipeline_ != VK_NULL_HANDLE)
+	{
+		vkDestroyPipeline(device_, computeShadowTracePipeline_, nullptr);
+		computeShadowTracePipeline_ = VK_NULL_HANDLE;
+	}
+	if (computeShadowUpsamplePipeline_ != VK_NULL_HANDLE)
+	{
+		vkDestroyPipeline(device_, computeShadowUpsamplePipeline_, nullptr);
+		computeShadowUpsamplePipeline_ = VK_NULL_HANDLE;
+	}
+	if (computeShadowPipelineLayout_ != VK_NULL_HANDLE)
+	{
+		vkDestroyPipelineLayout(device_, computeShadowPipelineLayout_, nullptr);
+		computeShadowPipelineLayout_ = VK_NULL_HANDLE;
+	}
+	if (computeShadowDescriptorPool_ != VK_NULL_HANDLE)
+	{
+		vkDestroyDescriptorPool(device_, computeShadowDescriptorPool_, nullptr);
+		computeShadowDescriptorPool_ = VK_NULL_HANDLE;
+	}
+	computeShadowSetSlots_.clear();
+	if (computeShadowDescriptorSetLayout_ != VK_NULL_HANDLE)
+	{
+		vkDestroyDescriptorSetLayout(device_, computeShadowDescriptorSetLayout_, nullptr);
+		computeShadowDescriptorSetLayout_ = VK_NULL_HANDLE;
+	}
+	if (computeShadowSampler_ != VK_NULL_HANDLE)
+	{
+		vkDestroySampler(device_, computeShadowSampler_, nullptr);
+		computeShadowSampler_ = VK_NULL_HANDLE;
 	}
+
+	visibilityImage_.reset();
+	historyImages_[0].reset();
+	historyImages_[1].reset();
+	historyValid_ = false;
+	visibilityExtent_ = VkExtent2D();
 }
 
-void RenderAPI_VulkanRayQuery::CreatePipeline(VkRenderPass renderPass)
+void RenderAPI_VulkanRayQuery::CullLights()
 {
-	for (auto itor = sharedMeshesPool_.in_use_begin(); itor != sharedMeshesPool_.in_use_end(); ++itor)
+	if (!alreadyPrepared_)
 	{
-		int idx = itor->first;
+		return;
+	}
 
-		auto pipelineItor = rayQueryPipelineMap.find(idx);
-		if (pipelineItor == rayQueryPipelineMap.end()) {
+	if (renderTargetWidth_ == 0 || renderTargetHeight_ == 0)
+	{
+		return;
+	}
 
-			VulkanRT::Shader rayShadowVert(device_);
-			VulkanRT::Shader rayShadowFrag(device_);
+	if (!CreateLightCullPipeline())
+	{
+		return;
+	}
 
-			//create rtquery shader
-			if (!rayShadowVertData.empty()) {
-				rayShadowVert.LoadFromShaderByte(rayShadowVertData, rayShadowVertDataSize);
-			}
-			else {
-				return;
-			}
+	UnityVulkanRecordingState recordingState;
+	if (!graphicsInterface_->CommandRecordingState(&recordingState, kUnityVulkanGraphicsQueueAccess_DontCare))
+	{
+		return;
+	}
 
-			if (!rayShadowFragData.empty())
-			{
-				rayShadowFrag.LoadFromShaderByte(rayShadowFragData, rayShadowFragDataSize);
-			}
-			else {
-				return;
-			}
+	UploadLights(recordingState.currentFrameNumber, recordingState.safeFrameNumber);
 
-			const std::array<VkPipelineShaderStageCreateInfo, 2> shader_stages = {
-				rayShadowVert.GetShaderStage(VK_SHADER_STAGE_VERTEX_BIT),
-				rayShadowFrag.GetShaderStage(VK_SHADER_STAGE_FRAGMENT_BIT)
-			};
+	VkDescriptorSet descriptorSet = AcquireTransientDescriptorSet(lightCullSetSlots_, lightCullDescriptorPool_, lightCullDescriptorSetLayout_,
+		recordingState.currentFrameNumber, recordingState.safeFrameNumber);
+	if (descriptorSet == VK_NULL_HANDLE)
+	{
+		GarbageCollect(recordingState.safeFrameNumber);
+		return;
+	}
 
-			VkPipelineInputAssemblyStateCreateInfo CreateInfo = {};
-			CreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-			CreateInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-			CreateInfo.primitiveRestartEnable = VK_FALSE;
-			CreateInfo.flags = 0;
-
-			VkPipelineRasterizationStateCreateInfo RasterizationCreateInfo = {};
-			RasterizationCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-			RasterizationCreateInfo.polygonMode = VK_POLYGON_MODE_FILL;
-			RasterizationCreateInfo.cullMode = VK_CULL_MODE_BACK_BIT;
-			RasterizationCreateInfo.frontFace = VK_FRONT_FACE_CLOCKWISE;
-			RasterizationCreateInfo.depthClampEnable = VK_FALSE;
-			RasterizationCreateInfo.rasterizerDiscardEnable = VK_FALSE;
-			RasterizationCreateInfo.depthBiasEnable = VK_FALSE;
-			RasterizationCreateInfo.lineWidth = 1.0f;
-			RasterizationCreateInfo.flags = 0;
-
-			VkPipelineColorBlendAttachmentState ColorBlendAttachmentCreateInfo[1] = {};
-			ColorBlendAttachmentCreateInfo[0].colorWriteMask = 0xf;
-			ColorBlendAttachmentCreateInfo[0].blendEnable = VK_FALSE;
-
-			VkPipelineColorBlendStateCreateInfo ColorBlendCreateInfo = {};
-			ColorBlendCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-			ColorBlendCreateInfo.attachmentCount = 1;
-			ColorBlendCreateInfo.pAttachments = ColorBlendAttachmentCreateInfo;
-
-
-			VkPipelineViewportStateCreateInfo ViewportCreateInfo = {};
-			ViewportCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-			ViewportCreateInfo.viewportCount = 1;
-			ViewportCreateInfo.scissorCount = 1;
-			ViewportCreateInfo.flags = 0;
-
-			const VkDynamicState dynamicStateEnables[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
-			VkPipelineDynamicStateCreateInfo DynamicCreateInfo = {};
-			DynamicCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-			DynamicCreateInfo.pDynamicStates = dynamicStateEnables;
-			DynamicCreateInfo.dynamicStateCount = sizeof(dynamicStateEnables) / sizeof(*dynamicStateEnables);
-			DynamicCreateInfo.flags = 0;
-
-			VkPipelineMultisampleStateCreateInfo MultiSampleCreateInfo = {};
-			MultiSampleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-			MultiSampleCreateInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-			MultiSampleCreateInfo.flags = 0;
-
-			VkPipelineDepthStencilStateCreateInfo DepthStencilCreateInfo = {};
-			DepthStencilCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-			DepthStencilCreateInfo.depthTestEnable = VK_TRUE;
-			DepthStencilCreateInfo.depthWriteEnable = VK_TRUE;
-			DepthStencilCreateInfo.depthBoundsTestEnable = VK_FALSE;
-			DepthStencilCreateInfo.stencilTestEnable = VK_FALSE;
-			DepthStencilCreateInfo.depthCompareOp = VK_COMPARE_OP_GREATER_OR_EQUAL; // Unity/Vulkan uses reverse Z
-			DepthStencilCreateInfo.front = DepthStencilCreateInfo.back;
-			DepthStencilCreateInfo.back.failOp = VK_STENCIL_OP_KEEP;
-			DepthStencilCreateInfo.back.passOp = VK_STENCIL_OP_KEEP;
-			DepthStencilCreateInfo.back.compareOp = VK_COMPARE_OP_ALWAYS;
-
-			// Vertex:  ray_shadow.vert
-			// float3 vpos;
-			// float3 normal;
-			VkVertexInputBindingDescription VertexInputDesc = {};
-			VertexInputDesc.binding = 0;
-			VertexInputDesc.stride = sizeof(RayQueryVertex);
-			VertexInputDesc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-
-			VkVertexInputAttributeDescription VertexInputAttrDesc[2];
-			VertexInputAttrDesc[0].binding = 0;
-			VertexInputAttrDesc[0].location = 0;
-			VertexInputAttrDesc[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-			VertexInputAttrDesc[0].offset = 0;
-
-			VertexInputAttrDesc[1].binding = 0;
-			VertexInputAttrDesc[1].location = 1;
-			VertexInputAttrDesc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-			VertexInputAttrDesc[1].offset = sizeof(RayQueryVertex::position);
-
-			VkPipelineVertexInputStateCreateInfo VertexInputCreateInfo = {};
-			VertexInputCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-			VertexInputCreateInfo.vertexBindingDescriptionCount = 1;
-			VertexInputCreateInfo.pVertexBindingDescriptions = &VertexInputDesc;
-			VertexInputCreateInfo.vertexAttributeDescriptionCount = 2;
-			VertexInputCreateInfo.pVertexAttributeDescriptions = VertexInputAttrDesc;
-
-			VkGraphicsPipelineCreateInfo pipelineCreateInfo = {};
-			pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-			pipelineCreateInfo.layout = rayQueryPipelieLayout;
-			pipelineCreateInfo.renderPass = renderPass;
-
-			pipelineCreateInfo.stageCount = shader_stages.size();
-			pipelineCreateInfo.pStages = shader_stages.data();
-			pipelineCreateInfo.pVertexInputState = &VertexInputCreateInfo;
-			pipelineCreateInfo.pInputAssemblyState = &CreateInfo;
-			pipelineCreateInfo.pRasterizationState = &RasterizationCreateInfo;
-			pipelineCreateInfo.pColorBlendState = &ColorBlendCreateInfo;
-			pipelineCreateInfo.pMultisampleState = &MultiSampleCreateInfo;
-			pipelineCreateInfo.pViewportState = &ViewportCreateInfo;
-			pipelineCreateInfo.pDepthStencilState = &DepthStencilCreateInfo;
-			pipelineCreateInfo.pDynamicState = &DynamicCreateInfo;
-
-			VkPipeline pipeline;
-
-			VkResult result = vkCreateGraphicsPipelines(device_, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &pipeline);
-			if (result != VK_SUCCESS)
-			{
+	// Last step that can fail, once the tile buffer moves to another copy the dispatch below always fills it
+	const uint32_t tileCountX = (renderTargetWidth_ + kLightTileSize - 1) / kLightTileSize;
+	const uint32_t tileCountY = (renderTargetHeight_ + kLightTileSize - 1) / kLightTileSize;
+	if (lightSlot_ >= lightSlots_.size() || lightSlots_[lightSlot_].buffer.GetBuffer() == VK_NULL_HANDLE ||
+		!EnsureTileLightBuffer(tileCountX * tileCountY, recordingState.currentFrameNumber, recordingState.safeFrameNumber))
+	{
+		GarbageCollect(recordingState.safeFrameNumber);
+		return;
+	}
 
-			}
+	//  binding 0  ->  Global Uniform Data
+	//  binding 1  ->  Lights
+	//  binding 2  ->  Tile light indices, written by this pass
+	const VkBuffer tileLightBuffer = tileLightSlots_[tileLightSlot_].buffer.GetBuffer();
+	VkDescriptorBufferInfo lightsInfo = { lightSlots_[lightSlot_].buffer.GetBuffer(), 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo tileLightsInfo = { tileLightBuffer, 0, VK_WHOLE_SIZE };
 
-			rayQueryPipelineMap.insert(std::make_pair(idx, std::move(pipeline)));
-		}
+	std::array<VkWriteDescriptorSet, 3> descriptorWrites = {};
+	for (uint32_t i = 0; i < descriptorWrites.size(); ++i)
+	{
+		descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[i].dstSet = descriptorSet;
+		descriptorWrites[i].dstBinding = i;
+		descriptorWrites[i].descriptorCount = 1;
+		descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	}
+
+	descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descriptorWrites[0].pBufferInfo = &globalUniformBufferInfo;
+	descriptorWrites[1].pBufferInfo = &lightsInfo;
+	descriptorWrites[2].pBufferInfo = &tileLightsInfo;
+
+	vkUpdateDescriptorSets(device_, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, VK_NULL_HANDLE);
+
+	LightCullConstants constants;
+	constants.target_size = ivec2(renderTargetWidth_, renderTargetHeight_);
+	constants.tile_size = kLightTileSize;
+
+	VkCommandBuffer commandBuffer = recordingState.commandBuffer;
+
+	// A copy is only reused within a frame when culling runs again, after draws that read it
+	VkBufferMemoryBarrier tileBarrier = {};
+	tileBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	tileBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	tileBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	tileBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	tileBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	tileBarrier.buffer = tileLightBuffer;
+	tileBarrier.offset = 0;
+	tileBarrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &tileBarrier, 0, nullptr);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lightCullPipeline_);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lightCullPipelineLayout_, 0, 1, &descriptorSet, 0, nullptr);
+	vkCmdPushConstants(commandBuffer, lightCullPipelineLayout_, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(LightCullConstants), &constants);
+	vkCmdDispatch(commandBuffer, tileCountX, tileCountY, 1);
+
+	tileBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	tileBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 1, &tileBarrier, 0, nullptr);
+
+	// Switches the next ray query pass of this frame from visiting every light to the tile lists just written
+	lightTileConstants_.tile_count_x = tileCountX;
+	lightTileConstants_.tile_count_y = tileCountY;
+	lightTileConstants_.tile_size = kLightTileSize;
+	lightTileFrameNumber_ = recordingState.currentFrameNumber;
+
+	GarbageCollect(recordingState.safeFrameNumber);
 }
 
-void RenderAPI_VulkanRayQuery::BuildAndSubmitRayTracingCommandBuffer(int cameraInstanceId, VkCommandBuffer commandBuffer, uint64_t currentFrameNumber)
+void RenderAPI_VulkanRayQuery::UploadLights(uint64_t currentFrameNumber, uint64_t safeFrameNumber)
 {
-	//󶨹
-	for (auto itor = meshInstancePool_.in_use_begin(); itor != meshInstancePool_.in_use_end(); ++itor)
+	const uint32_t lightCount = static_cast<uint32_t>(lightPool_.pool_size());
+
+	// Every copy has to pick up the change, not only the one written this frame
+	if (lightsDirty_)
 	{
-		int gameObjectInstanceId = itor->first;
-		int idx = meshInstancePool_[gameObjectInstanceId].sharedMeshInstanceId;
-		auto& rayTracerMeshData = sharedMeshesPool_[idx];
-		auto& renderPipeline = rayQueryPipelineMap[idx];
-		float* modelMat = sharedMeshesL2WMatrices_[idx];
+		BuildLightAliasTable(lightPool_.data(), lightCount, lightAliasTable_);
+		for (auto& slot : lightSlots_)
+		{
+			slot.dirtyBegin = 0;
+			slot.dirtyEnd = ~0u;
+		}
 
-		if(nullptr == modelMat) continue;
+		auto globalUniform = reinterpret_cast<GlobalUniform*>(globalUniformData_.Map());
+		globalUniform->light_count = lightCount;
+		globalUniformData_.Unmap();
 
-		
-		
-		VkBuffer vertexBuffer = rayTracerMeshData->vertexBuffer.GetBuffer();
-		VkBuffer indexBuffer = rayTracerMeshData->indexBuffer.GetBuffer();
+		lightsDirty_ = false;
+	}
+
+	// Nothing changed, keep binding the same copy
+	if (lightSlot_ < lightSlots_.size())
+	{
+		auto& slot = lightSlots_[lightSlot_];
+		if (slot.capacity >= lightCount && slot.dirtyBegin >= slot.dirtyEnd)
+		{
+			slot.frameNumber = currentFrameNumber;
+			return;
+		}
+	}
 
+	const uint32_t index = AcquireFrameBufferSlot(lightSlots_, lightSlot_, currentFrameNumber, safeFrameNumber);
+	if (index == ~0u)
+	{
+		NativeLogger::LogWarn("All light buffers are in flight, keeping the previous one");
+		lightSlots_[lightSlot_].frameNumber = currentFrameNumber;
+		return;
+	}
 
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, renderPipeline);
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, rayQueryPipelieLayout, 0, 1, &rayQueryDescSet, 0, 0);
-		vkCmdPushConstants(commandBuffer, rayQueryPipelieLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PerMeshUniform), modelMat);
+	if (lightAliasSlots_.size() < lightSlots_.size())
+	{
+		lightAliasSlots_.resize(lightSlots_.size());
+	}
 
-		VkDeviceSize offsets[1] = {0};
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+	auto& slot = lightSlots_[index];
+	auto& aliasSlot = lightAliasSlots_[index];
+	if (!ReserveFrameBufferSlot(slot, "lights", lightCount, 16, sizeof(RayQueryLight), currentFrameNumber) ||
+		!ReserveFrameBufferSlot(aliasSlot, "lightAlias", lightCount, 16, sizeof(RayQueryLightAlias), currentFrameNumber))
+	{
+		return;
+	}
 
-		
+	if ((slot.dirtyBegin < slot.dirtyEnd || aliasSlot.dirtyBegin < aliasSlot.dirtyEnd) && lightCount > 0)
+	{
+		slot.buffer.UploadData(lightPool_.data(), lightCount * sizeof(RayQueryLight));
+		aliasSlot.buffer.UploadData(lightAliasTable_.data(), lightCount * sizeof(RayQueryLightAlias));
+	}
+
+	slot.dirtyBegin = lightCount;
+	slot.dirtyEnd = 0;
+	slot.frameNumber = currentFrameNumber;
+	aliasSlot.dirtyBegin = lightCount;
+	aliasSlot.dirtyEnd = 0;
+	aliasSlot.frameNumber = currentFrameNumber;
+	lightSlot_ = index;
+}
+
+bool RenderAPI_VulkanRayQuery::EnsureTileLightBuffer(uint32_t tileCount, uint64_t currentFrameNumber, uint64_t safeFrameNumber)
+{
+	const uint32_t index = AcquireFrameBufferSlot(tileLightSlots_, tileLightSlot_, currentFrameNumber, safeFrameNumber);
+	if (index == ~0u)
+	{
+		NativeLogger::LogWarn("All tile light buffers are in flight, skipping light culling");
+		return false;
+	}
 
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(rayTracerMeshData->indexCount), 1, 0, 0, 0);
+	auto& slot = tileLightSlots_[index];
+	if (!ReserveFrameBufferSlot(slot, "tileLights", tileCount, 64, (kMaxLightsPerTile + 1) * sizeof(uint32_t), currentFrameNumber, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+	{
+		return false;
 	}
+
+	slot.frameNumber = currentFrameNumber;
+	tileLightSlot_ = index;
+	return true;
 }
 
-void RenderAPI_VulkanRayQuery::BuildDescriptorBufferInfos(int cameraInstanceId, uint64_t currentFrameNumber)
+bool RenderAPI_VulkanRayQuery::CreateLightCullPipeline()
 {
-	uint32_t i;
-	i = 1;
+	if (lightCullPipeline_ != VK_NULL_HANDLE)
+	{
+		return true;
+	}
+
+	std::vector<char> lightCullData;
+	{
+		std::lock_guard<std::mutex> lock(shaderDataMutex_);
+		lightCullData = rayLightCullCompData;
+	}
 
-	int meshInUseSize = meshInstancePool_.in_use_size();
-	meshInstancesDataBufferInfos_.resize(meshInUseSize);
+	if (lightCullData.empty())
+	{
+		return false;
+	}
 
-	auto meshBeginItor = meshInstancePool_.in_use_begin();
-	auto meshEndItor = meshInstancePool_.in_use_end();
-	i = 0;
-	for (auto itor = meshBeginItor; itor != meshEndItor; ++itor)
+	if (lightCullDescriptorSetLayout_ == VK_NULL_HANDLE)
 	{
-		auto gameObjectInstanceId = (*itor).first;
-		auto sharedMeshInstanced = meshInstancePool_[gameObjectInstanceId].sharedMeshInstanceId;
+		const VkDescriptorType bindingTypes[] = {
+			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		};
+
+		std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings;
+		for (uint32_t i = 0; i < sizeof(bindingTypes) / sizeof(bindingTypes[0]); ++i)
+		{
+			VkDescriptorSetLayoutBinding binding{};
+			binding.descriptorType = bindingTypes[i];
+			binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+			binding.binding = i;
+			binding.descriptorCount = 1;
+			set_layout_bindings.push_back(binding);
+		}
+
+		VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+		descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		descriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(set_layout_bindings.size());
+		descriptorSetLayoutCreateInfo.pBindings = set_layout_bindings.data();
+
+		VkResult result = vkCreateDescriptorSetLayout(device_, &descriptorSetLayoutCreateInfo, nullptr, &lightCullDescriptorSetLayout_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create light cull DescSetLayout Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			lightCullDescriptorSetLayout_ = VK_NULL_HANDLE;
+			return false;
+		}
 
+		std::vector<VkDescriptorPoolSize> pool_sizes = {
+			{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, kMaxDescriptorSets},
+			{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * kMaxDescriptorSets},
+		};
+
+		VkDescriptorPoolCreateInfo descriptor_pool_info{};
+		descriptor_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		descriptor_pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+		descriptor_pool_info.pPoolSizes = pool_sizes.data();
+		descriptor_pool_info.maxSets = kMaxDescriptorSets;
+
+		result = vkCreateDescriptorPool(device_, &descriptor_pool_info, nullptr, &lightCullDescriptorPool_);
+		if (result != VK_SUCCESS)
 		{
-			const VulkanRT::Buffer& buffer = meshInstancePool_[gameObjectInstanceId].instanceData;
-			meshInstancesDataBufferInfos_[i].buffer = buffer.GetBuffer();
-			meshInstancesDataBufferInfos_[i].offset = 0;
-			meshInstancesDataBufferInfos_[i].range = buffer.GetSize();
+			NativeLogger::LogError("Create light cull Pool Failed");
+			NativeLogger::LogInfo(vkResultToString(result));
+			lightCullDescriptorPool_ = VK_NULL_HANDLE;
+			return false;
 		}
-		++i;
 	}
-}
 
-void RenderAPI_VulkanRayQuery::CreateDescriptorPool()
-{
-	//  data 0  ->  Acceleration structure
-	//  data 1  ->  Global Uniform Data
+	if (lightCullPipelineLayout_ == VK_NULL_HANDLE)
+	{
+		VkPushConstantRange push_constant;
+		push_constant.offset = 0;
+		push_constant.size = sizeof(LightCullConstants);
+		push_constant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+		VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+		pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipeline_layout_create_info.pushConstantRangeCount = 1;
+		pipeline_layout_create_info.pPushConstantRanges = &push_constant;
+		pipeline_layout_create_info.setLayoutCount = 1;
+		pipeline_layout_create_info.pSetLayouts = &lightCullDescriptorSetLayout_;
+
+		VkResult result = vkCreatePipelineLayout(device_, &pipeline_layout_create_info, nullptr, &lightCullPipelineLayout_);
+		if (result != VK_SUCCESS)
+		{
+			NativeLogger::LogError("Create light cull PipelineLayout Failed");
+			lightCullPipelineLayout_ = VK_NULL_HANDLE;
+			return false;
+		}
+	}
 
-	std::vector<VkDescriptorPoolSize> pool_sizes = {
-		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 5},
-		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1},
-	};
+	VulkanRT::Shader shader(device_);
+	if (!shader.LoadFromShaderByte(lightCullData, static_cast<int>(lightCullData.size())))
+	{
+		return false;
+	}
 
-	VkDescriptorPoolCreateInfo descriptor_pool_info{};
-	descriptor_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	descriptor_pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
-	descriptor_pool_info.pPoolSizes = pool_sizes.data();
-	descriptor_pool_info.maxSets = pool_sizes.size() * 10;
+	VkComputePipelineCreateInfo pipelineCreateInfo = {};
+	pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineCreateInfo.stage = shader.GetShaderStage(VK_SHADER_STAGE_COMPUTE_BIT);
+	pipelineCreateInfo.layout = lightCullPipelineLayout_;
 
-	VkResult result = vkCreateDescriptorPool(device_, &descriptor_pool_info, nullptr, &descriptorPool_);
+	VkResult result = vkCreateComputePipelines(device_, pipelineCache_.GetPipelineCache(), 1, &pipelineCreateInfo, nullptr, &lightCullPipeline_);
 	if (result != VK_SUCCESS)
 	{
-		NativeLogger::LogInfo("Create Pool Failed");
+		NativeLogger::LogError("Create light cull Pipeline Failed");
+		NativeLogger::LogInfo(vkResultToString(result));
+		lightCullPipeline_ = VK_NULL_HANDLE;
+		return false;
 	}
+
+	return true;
 }
 
-void RenderAPI_VulkanRayQuery::UpdateDescriptorSets(int cameraInstanceId, uint64_t currentFrameNumber)
+void RenderAPI_VulkanRayQuery::DestroyLightResources()
 {
-	/*VkDescriptorSetAllocateInfo descriptor_set_allocate_info = vkb::initializers::descriptor_set_allocate_info(descriptor_pool, &descriptor_set_layout, 1);*/
-	
+	if (lightCullPipeline_ != VK_NULL_HANDLE)
+	{
+		vkDestroyPipeline(device_, lightCullPipeline_, nullptr);
+		lightCullPipeline_ = VK_NULL_HANDLE;
+	}
+	if (lightCullPipelineLayout_ != VK_NULL_HANDLE)
+	{
+		vkDestroyPipelineLayout(device_, lightCullPipelineLayout_, nullptr);
+		lightCullPipelineLayout_ = VK_NULL_HANDLE;
+	}
+	if (lightCullDescriptorPool_ != VK_NULL_HANDLE)
+	{
+		vkDestroyDescriptorPool(device_, lightCullDescriptorPool_, nullptr);
+		lightCullDescriptorPool_ = VK_NULL_HANDLE;
+	}
+	lightCullSetSlots_.clear();
+	if (lightCullDescriptorSetLayout_ != VK_NULL_HANDLE)
+	{
+		vkDestroyDescriptorSetLayout(device_, lightCullDescriptorSetLayout_, nullptr);
+		lightCullDescriptorSetLayout_ = VK_NULL_HANDLE;
+	}
 
-	VkDescriptorSetAllocateInfo descriptor_set_allocate_info{};
-	descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	descriptor_set_allocate_info.descriptorPool = descriptorPool_;
-	descriptor_set_allocate_info.descriptorSetCount = 1;
-	descriptor_set_allocate_info.pSetLayouts = &rayQueryDescrioptorSetLayout;
-
-	VkResult result = vkAllocateDescriptorSets(device_, &descriptor_set_allocate_info, &rayQueryDescSet);
-
-	//rayQueryDescrioptorSetVec.resize(1);
-
-
-	std::vector<VkWriteDescriptorSet> descriptorWrites;
-	{
-		// Set up the descriptor for binding our top level acceleration structure to the ray tracing shaders
-		VkWriteDescriptorSetAccelerationStructureKHR descriptor_acceleration_structure_info{};
-		descriptor_acceleration_structure_info.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
-		descriptor_acceleration_structure_info.accelerationStructureCount = 1;
-		descriptor_acceleration_structure_info.pAccelerationStructures = &tlas_.accelerationStructure;
-
-		VkWriteDescriptorSet accelerationStructureWrite;
-		accelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		accelerationStructureWrite.pNext = &descriptor_acceleration_structure_info; // Notice that pNext is assigned here!
-		accelerationStructureWrite.dstSet = rayQueryDescSet;
-		accelerationStructureWrite.dstBinding = 0;
-		accelerationStructureWrite.dstArrayElement = 0;
-		accelerationStructureWrite.descriptorCount = 1;
-		accelerationStructureWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
-		accelerationStructureWrite.pImageInfo = nullptr;
-		accelerationStructureWrite.pBufferInfo = nullptr;
-		accelerationStructureWrite.pTexelBufferView = nullptr;
-
-		descriptorWrites.push_back(accelerationStructureWrite);
-
-		//global uniform
-		VkWriteDescriptorSet globalUniformBufferWrite;
-		globalUniformBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		globalUniformBufferWrite.pNext = nullptr;
-		globalUniformBufferWrite.dstSet = rayQueryDescSet;
-		globalUniformBufferWrite.dstBinding = 1;
-		globalUniformBufferWrite.dstArrayElement = 0;
-		globalUniformBufferWrite.descriptorCount = 1;
-		globalUniformBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		globalUniformBufferWrite.pImageInfo = nullptr;
-		globalUniformBufferWrite.pBufferInfo = &globalUniformBufferInfo;
-		globalUniformBufferWrite.pTexelBufferView = nullptr;
-
-		descriptorWrites.push_back(globalUniformBufferWrite);
+	for (auto& slot : lightSlots_)
+	{
+		slot.buffer.Destroy();
 	}
-	
-	vkUpdateDescriptorSets(device_, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, VK_NULL_HANDLE);
+	lightSlots_.clear();
+	for (auto& slot : lightAliasSlots_)
+	{
+		slot.buffer.Destroy();
+	}
+	lightAliasSlots_.clear();
+	lightSlot_ = 0;
+	lightsDirty_ = true;
+
+	for (auto& slot : tileLightSlots_)
+	{
+		slot.buffer.Destroy();
+	}
+	tileLightSlots_.clear();
+	tileLightSlot_ = 0;
 }
 
 
@@ -1846,7 +5354,7 @@ void RenderAPI_VulkanRayQuery::GarbageCollect(uint64_t frameCount)
 		if (garbageBuffers_[i].frameCount < frameCount)
 		{
 			garbageBuffers_[i].buffer->Destroy();
-			garbageBuffers_[i].buffer.release();
+			garbageBuffers_[i].buffer.reset();
 			removeIndices.push_back(i);
 		}
 	}
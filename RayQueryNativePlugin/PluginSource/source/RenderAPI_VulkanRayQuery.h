@@ -21,7 +21,14 @@ const bool enableValidationLayers = true;
 #include "VulkanRTData.h"
 #include "ResourcePool.h"
 #include "RayQueryShsaderConst.h"
+#include "VulkanRTPipelineCache.h"
+#include "ThreadPool.h"
+#include "StagingRing.h"
+#include "MeshIngest.h"
 #include <memory>
+#include <set>
+#include <deque>
+#include <unordered_map>
 
 
 /// <summary>
@@ -94,8 +101,21 @@ public:
 	virtual void UpdateLight(int lightInstanceId, float x, float y, float z, float dx, float dy, float dz, float r, float g, float b, float bounceIntensity, float intensity, float range, float spotAngle, int type, bool enabled);
 	virtual void RemoveLight(int lightInstanceId);
 
-	virtual void UpdateCameraMat(float x, float y, float z, float* world2cameraProj);
-	virtual void UpdateModelMat(int sharedMeshInstanceId, float* l2w);
+	virtual void UpdateCameraMat(int cameraInstanceId, float x, float y, float z, float* world2cameraProj);
+
+	virtual void SetPipelineCachePath(const char* path);
+	virtual void SetRenderTargetSize(int width, int height);
+	virtual void SetDepthPrepass(bool enabled);
+	virtual void SetComputeShadowTargets(void* depthTexture, void* outputTexture, int downsample);
+	virtual void TraceShadowsCompute();
+	virtual void SetComputeShadowTemporal(bool enabled);
+	virtual void SetQualityTier(int tier);
+	virtual void SetMeshOptimization(int flags);
+	virtual void SetTriangleSplitting(float areaRatio, float budget);
+	virtual void CullLights();
+	virtual void ImportNativeMeshes();
+	virtual bool IsSharedMeshPending(int sharedMeshInstanceId);
+	virtual bool GetSharedMeshBounds(int sharedMeshInstanceId, float* boundsMin, float* boundsMax);
 
 	static VkDevice NullDevice;
 
@@ -130,25 +150,105 @@ private:
 	VkCommandPool graphicsCommandPool_;
 	VkCommandPool transferCommandPool_;
 
+	VkPhysicalDeviceProperties physicalDeviceProperties_;
 	VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties_;
 	VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingProperties_;
 
+	// VK_KHR_push_descriptor was found and enabled at device creation
+	bool pushDescriptorSupported_;
+
 	bool alreadyPrepared_;
 	bool alreadyProcessEvent;
 
 #pragma region SharedMeshMembers
 
 	VulkanRT::resourcePool<int, std::unique_ptr<VulkanRT::VulkanRTData::RayTracerMeshSharedData>> sharedMeshesPool_;
-	std::map<int, float*> sharedMeshesL2WMatrices_;
+
+	// Ids that were added and not removed yet with their bounds, whether they reached the pool or not. Main thread only,
+	// so adding and removing meshes never reads sharedMeshesPool_ while the render thread changes it
+	std::map<int, VulkanRT::VulkanRTData::RayTracerMeshBounds> sharedMeshIds_;
+
+	// Generated normals and tangents by MeshIngest::HashShadingSource, the oldest are dropped once they take more than
+	// the budget. Main thread only
+	static const size_t kGeneratedShadingCacheBytes = 32 * 1024 * 1024;
+	std::unordered_map<uint64_t, VulkanRT::VulkanRTData::RayTracerGeneratedShading> generatedShadingCache_;
+	std::deque<uint64_t> generatedShadingOrder_;
+	size_t generatedShadingBytes_;
+
+	// AddSharedMeshNative calls waiting for the next ImportNativeMeshes event, filled on the main thread.
+	// The mutex is held through the imports, a request is only taken out once its copies are recorded
+	std::vector<VulkanRT::VulkanRTData::RayTracerNativeMeshRequest> pendingNativeMeshes_;
+	std::mutex pendingNativeMeshesMutex_;
+
+	// ray_mesh_repack.comp moves AddSharedMeshNative vertices from Unity's layout into RayQueryVertex, each import
+	// takes its own descriptor set from the pool and frees it through the garbage list
+	static const uint32_t kMaxMeshRepackSets = 64;
+	VkDescriptorSetLayout meshRepackDescriptorSetLayout_;
+	VkPipelineLayout meshRepackPipelineLayout_;
+	VkPipeline meshRepackPipeline_;
+	VkDescriptorPool meshRepackDescriptorPool_;
+
+	static const VkDeviceSize kMeshStagingRingSize = 32 * 1024 * 1024;
+
+	// AddSharedMesh data staged in meshStagingRing_ and copied on transferQueue_, in submission order, along with meshes
+	// written straight into host visible buffers. The mutex also guards meshStagingRing_ and transferCommandPool_
+	VulkanRT::StagingRing meshStagingRing_;
+	std::vector<VulkanRT::VulkanRTData::RayTracerMeshUpload> meshUploads_;
+	std::mutex meshUploadsMutex_;
+
+	// TLAS instances per shared mesh id, instances added before their mesh count too
+	std::unordered_map<int, uint32_t> sharedMeshReferences_;
+
+	// RemoveSharedMesh came while instances still used them, released along with the last one
+	std::set<int> removedSharedMeshes_;
+
+	// Retired on the main thread, taken out of sharedMeshesPool_ by the next ImportNativeMeshes on the render thread
+	std::vector<int> retiredSharedMeshIds_;
+	std::mutex retiredSharedMeshesMutex_;
+
+	// Out of sharedMeshesPool_ but tlas_ may still reference their BLAS, handed to the garbage list once a TLAS
+	// without them is built or tlas_ is cleared. Render thread only
+	std::vector<std::unique_ptr<VulkanRT::VulkanRTData::RayTracerMeshSharedData>> tlasRetiredSharedMeshes_;
+
+	// MeshOptimizer::kOptimize* stages run on AddSharedMesh data before it is uploaded, on the calling thread. None by default
+	uint32_t meshOptimizeFlags_;
+
+	// Split AddSharedMesh triangles for the BLAS while box surface / area is above the ratio, up to budget times the
+	// original triangle count. A ratio of 0 turns splitting off
+	float triangleSplitAreaRatio_;
+	float triangleSplitBudget_;
 
 #pragma endregion SharedMeshMembers
 
+#pragma region ArenaMembers
+
+	// Tagged onto every mesh and instance added while it is set, VulkanRTData::kNoArena when none is active
+	int activeArena_;
+	int nextArena_;
+	std::unordered_map<int, VulkanRT::VulkanRTData::RayTracerArena> arenas_;
+
+	// Arena of each shared mesh id added while one was active, to take the id back out of it
+	std::unordered_map<int, int> sharedMeshArenas_;
+
+#pragma endregion ArenaMembers
+
 #pragma region MeshInstanceMembers
 
 	// meshInstanceID -> Buffer that represents ShaderMeshInstanceData
 	VulkanRT::resourcePool<int, VulkanRT::VulkanRTData::RayTracerMeshInstanceData> meshInstancePool_;
 
-	std::vector<VkDescriptorBufferInfo> meshInstancesDataBufferInfos_;
+	// Generation of each meshInstancePool_ index, bumped when the instance there is removed. Indices never removed are at 0
+	std::vector<uint32_t> meshInstanceGenerations_;
+
+	// RayQueryTLASInstanceData of every instance in one storage buffer, indexed by instanceCustomIndex.
+	// A frame writes a copy no in flight frame reads, instanceDataSlot_ is the one bound
+	std::vector<VulkanRT::VulkanRTData::RayTracerFrameBufferSlot> instanceDataSlots_;
+	uint32_t instanceDataSlot_;
+	std::vector<RayQueryTLASInstanceData> instanceData_;
+
+	// [begin, end) of instanceData_ changed since the last UploadInstanceData
+	uint32_t instanceDataDirtyBegin_;
+	uint32_t instanceDataDirtyEnd_;
 
 	// Buffer that represents VkAccelerationStructureInstanceKHR
 	VulkanRT::Buffer instancesAccelerationStructuresBuffer_;
@@ -157,6 +257,18 @@ private:
 	bool rebuildTlas_;
 	bool updateTlas_;
 
+	// Transforms written in place from C#, two halves of RayTracerTransformSlot indexed by the pool index of a TLAS instance handle.
+	// The main thread owns transformArena_[transformArenaWrite_], the render thread reads the other half while transformArenaPublished_ is set
+	std::vector<VulkanRT::VulkanRTData::RayTracerTransformSlot> transformArena_[2];
+	uint32_t transformArenaWrite_;
+	bool transformArenaPublished_;
+
+	// Transforms of the UpdateTlasInstance calls, applied by the render thread before the transform arena
+	std::vector<VulkanRT::VulkanRTData::RayTracerPendingTransform> pendingTransforms_;
+
+	// Guards transformArena_ and pendingTransforms_
+	std::mutex transformArenaMutex_;
+
 #pragma endregion MeshInstanceMembers
 
 #pragma region ShaderResources
@@ -171,9 +283,19 @@ private:
 
 	VkDescriptorSetLayout rayQueryDescrioptorSetLayout;
 
+	static const uint32_t kMaxDescriptorSets = 8;
+
+	// Copies of a buffer rewritten every frame, enough for the frames Unity keeps in flight
+	static const uint32_t kMaxFrameBufferSlots = 4;
+
 	VkDescriptorSet						rayQueryDescSet;
 	VkDescriptorPool                   descriptorPool_;
 
+	// Rewrites bindings 0 to 2 from a RayTracerDescriptorData, for a push descriptor or a set from descriptorSetSlots_
+	VkDescriptorUpdateTemplateKHR descriptorUpdateTemplate_;
+	VulkanRT::VulkanRTData::RayTracerDescriptorData descriptorData_;
+	std::vector<VulkanRT::VulkanRTData::RayTracerDescriptorSetSlot> descriptorSetSlots_;
+
 
 	std::vector<VulkanRT::VulkanRTData::RayTracerGarbageBuffer> garbageBuffers_;
 
@@ -181,17 +303,146 @@ private:
 
 #pragma region PipelineResources
 
+	// Seeded from and saved to pipelineCachePath_ so pipelines are not recompiled on every launch
+	VulkanRT::PipelineCache pipelineCache_;
+	std::string pipelineCachePath_;
 
 	VkPipelineLayout rayQueryPipelieLayout;
 
+	// Pipelines are compiled on workerPool_ and swapped into rayQueryPipelineMap at the start of a frame
+	std::unique_ptr<VulkanRT::ThreadPool> workerPool_;
+	std::set<int> pendingPipelines_;
+	std::mutex compiledPipelinesMutex_;
+	std::vector<VulkanRT::VulkanRTData::RayTracerCompiledPipeline> compiledPipelines_;
+
+	// Any compiled pipeline, used to draw meshes whose own pipeline is not ready yet
+	VkPipeline fallbackPipeline_;
+
+	// Specialization of ray_shadow.frag, a new tier is applied at the next frame boundary and its pipelines compiled in the background.
+	// The previous tier's fallback keeps drawing until the first pipeline of the new tier is ready.
+	RayQueryQualityTier qualityTier_;
+	RayQueryQualityTier requestedQualityTier_;
+	VkPipeline staleFallbackPipeline_;
+
+	// Depth only pipeline drawn over the whole draw list first, the ray query pass then tests with EQUAL and doesn't write depth.
+	// Until it is compiled the shading pipelines test with GREATER_OR_EQUAL and the pre-pass is skipped
+	bool depthPrepass_;
+	VkPipeline depthPrepassPipeline_;
+	bool depthPrepassPipelinePending_;
+	VkPipeline compiledDepthPrepassPipeline_;
+
 #pragma endregion PipelineResources
 
+#pragma region RecordingResources
+
+	std::vector<VulkanRT::VulkanRTData::RayTracerDrawItem> drawList_;
+
+	// Camera target size, the light culling pass works out its screen tiles from it
+	uint32_t renderTargetWidth_;
+	uint32_t renderTargetHeight_;
+
+#pragma endregion RecordingResources
+
+#pragma region ComputeShadowResources
+
+	// Shadow and AO traced in compute from the camera depth at 1 / computeShadowDownsample_ resolution, 0 disables it
+	uint32_t computeShadowDownsample_;
+	void* computeShadowDepthTexture_;
+	void* computeShadowOutputTexture_;
+
+	// Shared by the trace and upsample pipelines, every binding either of them uses
+	VkDescriptorSetLayout computeShadowDescriptorSetLayout_;
+	VkPipelineLayout computeShadowPipelineLayout_;
+	VkPipeline computeShadowTracePipeline_;
+	VkPipeline computeShadowUpsamplePipeline_;
+	VkDescriptorPool computeShadowDescriptorPool_;
+	VkSampler computeShadowSampler_;
+
+	// The pass is skipped every frame while its SPIR-V is missing, only report that once
+	bool computeShadowShadersMissingLogged_;
+
+	// Views of Unity's textures are recreated every dispatch, so a set is rewritten each time and only reused once the GPU is done with it
+	std::vector<VulkanRT::VulkanRTData::RayTracerDescriptorSetSlot> computeShadowSetSlots_;
+
+	// r = light visibility, g = ambient occlusion
+	std::unique_ptr<VulkanRT::Image> visibilityImage_;
+	VkExtent2D visibilityExtent_;
+
+	// Temporal mode traces fewer rotated rays per frame and accumulates them into the history, which ping-pongs every dispatch
+	bool computeShadowTemporal_;
+	uint32_t computeShadowFrameIndex_;
+	std::unique_ptr<VulkanRT::Image> historyImages_[2];
+	uint32_t historyIndex_;
+	bool historyValid_;
+
+	// Reprojection uses the previous view projection of the camera being drawn, the history only holds one camera's result
+	std::map<int, mat4> cameraViewProjs_;
+	int historyCameraInstanceId_;
+
+#pragma endregion ComputeShadowResources
+
+#pragma region LightResources
+
+	// lightInstanceId -> light element, a removed light leaves a zeroed hole that the next AddLight reuses
+	VulkanRT::resourcePool<int, RayQueryLight> lightPool_;
+	bool lightsDirty_;
+
+	// Importance sampling table over light power, rebuilt when lights change, same element count
+	std::vector<RayQueryLightAlias> lightAliasTable_;
+	uint32_t lightSampleFrameIndex_;
+
+	// Copies of the lights and their alias table for the frames in flight, element i of both is written together
+	std::vector<VulkanRT::VulkanRTData::RayTracerFrameBufferSlot> lightSlots_;
+	std::vector<VulkanRT::VulkanRTData::RayTracerFrameBufferSlot> lightAliasSlots_;
+	uint32_t lightSlot_;
+
+	// kMaxLightsPerTile + 1 uints per screen tile, only written and read on the GPU. Each frame culls into a copy no earlier frame still reads
+	std::vector<VulkanRT::VulkanRTData::RayTracerFrameBufferSlot> tileLightSlots_;
+	uint32_t tileLightSlot_;
+
+	// Tiles CullLights binned into tileLightSlots_[tileLightSlot_] and the frame it did, the next ray query pass of that frame pushes them to ray_shadow.frag
+	LightTileConstants lightTileConstants_;
+	uint64_t lightTileFrameNumber_;
+
+	VkDescriptorSetLayout lightCullDescriptorSetLayout_;
+	VkPipelineLayout lightCullPipelineLayout_;
+	VkPipeline lightCullPipeline_;
+	VkDescriptorPool lightCullDescriptorPool_;
+	std::vector<VulkanRT::VulkanRTData::RayTracerDescriptorSetSlot> lightCullSetSlots_;
+
+#pragma endregion LightResources
+
 	//RT API
 public:
 	AddResourceResult AddSharedMesh(int sharedMeshInstanceId, float* verticesArray, float* normalsArray, float* tangentsArray, float* uvsArray, int vertexCount, int* indicesArray, int indexCount);
-	AddResourceResult AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId, float* l2wMatrix, float* w2lMatrix);
+	AddResourceResult AddSharedMesh16(int sharedMeshInstanceId, float* verticesArray, float* normalsArray, float* tangentsArray, float* uvsArray, int vertexCount, unsigned short* indicesArray, int indexCount);
+	AddResourceResult AddSharedMeshNative(int sharedMeshInstanceId, void* vertexBuffer, int vertexStride, int positionOffset, int positionFormat, int normalOffset, int vertexCount, void* indexBuffer, bool indices16, int indexCount);
+	AddResourceResult AddSharedMeshLayout(int sharedMeshInstanceId, const VulkanRT::MeshIngest::VertexLayout* vertexLayout, const void* const* vertexStreams, int vertexCount, const void* indices, bool indices16, int indexCount);
+	AddResourceResult AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId, float* l2wMatrix, float* w2lMatrix, int mask, int flags);
+	int AddTlasInstances(int count, const int* gameObjectInstanceIds, int sharedMeshInstanceId, const float* l2wMatrices, const float* w2lMatrices, int mask, int flags);
+
+	/// <summary>
+	/// Remove a shared mesh once no TLAS instance uses it any more
+	/// </summary>
+	/// <param name="sharedMeshInstanceId"></param>
+	void RemoveSharedMesh(int sharedMeshInstanceId);
+
+	int CreateArena();
+	void SetActiveArena(int arena);
+
+	/// <summary>
+	/// Remove every instance and mesh of the arena in one pass with a single TLAS rebuild
+	/// </summary>
+	/// <param name="arena"></param>
+	void DestroyArena(int arena);
 
 	void UpdateTlasInstance(int gameObjectInstanceId, float* l2wMatrix, float* w2lMatrix);
+	void UpdateTlasInstances(int count, const int* gameObjectInstanceIds, const float* l2wMatrices, const float* w2lMatrices);
+	int GetTlasInstanceHandle(int gameObjectInstanceId);
+	void UpdateTlasInstancesByHandle(int count, const int* handles, const float* l2wMatrices, const float* w2lMatrices);
+	void UpdateTlasInstanceMask(int gameObjectInstanceId, int mask, int flags);
+	void* GetTransformArena(int* capacity);
+	void* PublishTransformArena(int* capacity);
 
 	/// <summary>
 	/// Removes instance to be removed on next tlas build
@@ -199,16 +450,170 @@ public:
 	/// <param name="meshInstanceIndex"></param>
 	void RemoveTlasInstance(int gameObjectInstanceId);
 private:
+	/// <summary>
+	/// Fill a newly added pool entry, the caller counts the mesh reference and requests the TLAS rebuild
+	/// </summary>
+	void InitTlasInstance(VulkanRT::VulkanRTData::RayTracerMeshInstanceData& instance, int gameObjectInstanceId, int sharedMeshInstanceId, const float* l2wMatrix, const float* w2lMatrix, int mask, int flags);
+
+	/// <summary>
+	/// Queue a new transform for the instance at a pool index, the caller holds transformArenaMutex_
+	/// </summary>
+	void StageTlasInstanceTransform(uint32_t index, const float* l2wMatrix, const float* w2lMatrix);
+
+	/// <summary>
+	/// Store a new transform, mark the instance data element dirty and request the TLAS update, render thread only
+	/// </summary>
+	void SetTlasInstanceTransform(VulkanRT::VulkanRTData::RayTracerMeshInstanceData& instance, const mat4& localToWorld, const mat4& worldToLocal);
+
+	/// <summary>
+	/// Apply the staged transforms and the dirty slots of the published transform arena half, render thread only
+	/// </summary>
+	void ConsumeTransformArena();
+
+	/// <summary>
+	/// Shared part of AddSharedMesh, AddSharedMesh16 and AddSharedMeshLayout, exactly one of indices32 and indices16 is set
+	/// </summary>
+	AddResourceResult AddSharedMeshData(int sharedMeshInstanceId, const VulkanRT::MeshIngest::VertexLayout& vertexLayout, const void* const* vertexStreams, int vertexCount, const int32_t* indices32, const uint16_t* indices16, int indexCount);
+
+	/// <summary>
+	/// Repack one AddSharedMeshNative mesh into its own buffers with commands recorded on commandBuffer, then build its BLAS.
+	/// repackSet is only used when the layout doesn't already match RayQueryVertex
+	/// </summary>
+	bool ImportNativeMesh(VkCommandBuffer commandBuffer, VkDescriptorSet repackSet, const VulkanRT::VulkanRTData::RayTracerNativeMeshRequest& request);
+
+	/// <summary>
+	/// Create the descriptor set layout, pool and pipeline of ray_mesh_repack.comp, returns false until all of them exist
+	/// </summary>
+	bool CreateMeshRepackPipeline();
+
+	void DestroyMeshRepackResources();
+
+	/// <summary>
+	/// Record the copies of a mesh staged at the given ring offsets and submit them on transferQueue_, takes meshUploadsMutex_.
+	/// Takes mesh on success
+	/// </summary>
+	bool SubmitMeshUpload(std::unique_ptr<VulkanRT::VulkanRTData::RayTracerMeshSharedData>& mesh, VkDeviceSize vertexStagingOffset, VkDeviceSize indexStagingOffset);
+
+	/// <summary>
+	/// Hand the meshes whose transfer finished over to the graphics queue and build their BLAS, render thread only
+	/// </summary>
+	void FinishMeshUploads();
+
+	/// <summary>
+	/// Wait for the transfer queue and release the staging ring, uploads still in flight are dropped
+	/// </summary>
+	void DestroyMeshUploads();
+
+	/// <summary>
+	/// Queue a mesh for DestroyRetiredSharedMeshes, which takes it out of sharedMeshesPool_ on the render thread
+	/// </summary>
+	void RetireSharedMesh(int sharedMeshInstanceId);
+
+	/// <summary>
+	/// Drop one instance reference of a mesh, the last one retires it if RemoveSharedMesh was called for it
+	/// </summary>
+	void ReleaseSharedMeshReference(int sharedMeshInstanceId);
+
+	/// <summary>
+	/// Record a new shared mesh id in the active arena, if any
+	/// </summary>
+	void AddArenaSharedMesh(int sharedMeshInstanceId);
+
+	/// <summary>
+	/// Erase a shared mesh id from sharedMeshIds_ and from the arena it was added in
+	/// </summary>
+	void EraseSharedMeshId(int sharedMeshInstanceId);
+
+	/// <summary>
+	/// Handle of the instance at index of meshInstancePool_, -1 past the indices a handle can hold
+	/// </summary>
+	int MakeTlasInstanceHandle(uint32_t index) const;
+
+	/// <summary>
+	/// Pool index of a handle, false when the instance it was handed out for has been removed
+	/// </summary>
+	bool ResolveTlasInstanceHandle(int handle, uint32_t& index);
+
+	/// <summary>
+	/// Invalidate every handle handed out for index, called when its instance is removed
+	/// </summary>
+	void RetireTlasInstanceHandle(uint32_t index);
+
+	/// <summary>
+	/// Take retired meshes out of sharedMeshesPool_ and hand their pipelines to the garbage list, render thread only.
+	/// The meshes wait in tlasRetiredSharedMeshes_ for the TLAS rebuild this requests
+	/// </summary>
+	void DestroyRetiredSharedMeshes();
+
+	/// <summary>
+	/// Hand tlasRetiredSharedMeshes_ to the garbage list, once tlas_ no longer references them
+	/// </summary>
+	void DestroyTlasRetiredSharedMeshes(uint64_t currentFrameNumber);
+
+	/// <summary>
+	/// Hand tlas_ to the garbage list and clear it, so the passes skip tracing until instances come back
+	/// </summary>
+	void ClearTlas(uint64_t currentFrameNumber);
+
+	/// <summary>
+	/// Shared mesh by id, nullptr while it doesn't exist or is still waiting for ImportNativeMeshes
+	/// </summary>
+	VulkanRT::VulkanRTData::RayTracerMeshSharedData* FindSharedMesh(int sharedMeshInstanceId);
+
+	// Guards the SPIR-V below, SetShaderData comes from the main thread while pipelines compile on the workers
+	std::mutex shaderDataMutex_;
+
 	std::vector<char> rayShadowVertData;
 	std::vector<char> rayShadowFragData;
 	int rayShadowVertDataSize;
 	int rayShadowFragDataSize;
 
+	// Optional position only vertex shader for the depth pre-pass, ray_shadow.vert is used without it
+	std::vector<char> rayDepthVertData;
+	int rayDepthVertDataSize;
+
+	// Compute shadow pass, trace at low resolution then upsample to the output texture
+	std::vector<char> rayShadowTraceCompData;
+	std::vector<char> rayShadowUpsampleCompData;
+	int rayShadowTraceCompDataSize;
+	int rayShadowUpsampleCompDataSize;
+
+	// Light culling pass, bins lights into the screen tiles read by ray_shadow.frag
+	std::vector<char> rayLightCullCompData;
+	int rayLightCullCompDataSize;
+
+	// Vertex repack of AddSharedMeshNative meshes
+	std::vector<char> rayMeshRepackCompData;
+	int rayMeshRepackCompDataSize;
+
+	// Set when ray_meshRepackComp didn't make a pipeline, AddSharedMeshNative then only takes the RayQueryVertex layout until it is set again
+	bool meshRepackFailed_;
+
 	/// <summary>
 	/// Build a bottom level acceleration structure for an added shared mesh
 	/// </summary>
 	/// <param name="sharedMeshPoolIndex"></param>
 	void BuildBlas(int sharedMeshInstanceId);
+
+	/// <summary>
+	/// Upload a split triangle set BuildBlas uses instead of the mesh's own buffers
+	/// </summary>
+	/// <returns>False when the buffers couldn't be created, the BLAS is built from the original triangles then</returns>
+	bool CreateBlasInput(VulkanRT::VulkanRTData::RayTracerMeshSharedData& mesh, const std::vector<vec3>& positions, const std::vector<uint32_t>& indices);
+
+	/// <summary>
+	/// Generate the normals and tangents a mesh doesn't have, or take them from an earlier mesh with the same data
+	/// </summary>
+	/// <param name="vertices">Gathered vertices, the normals are written when generateNormals is set</param>
+	/// <param name="attributes">Gathered attributes with uvs, the tangents are written when generateTangents is set</param>
+	void GenerateShading(std::vector<RayQueryVertex>& vertices, std::vector<RayQueryVertexAttributes>& attributes, bool generateNormals, bool generateTangents, const int32_t* indices32, const uint16_t* indices16, int indexCount);
+
+	/// <summary>
+	/// Create and fill the mesh's RayQueryVertexAttributes buffer
+	/// </summary>
+	/// <param name="cachedAttributes">Already gathered and reordered attributes, nullptr to gather them from the streams</param>
+	/// <returns>False when the buffer couldn't be created, the mesh is added without it</returns>
+	bool CreateAttributeBuffer(VulkanRT::VulkanRTData::RayTracerMeshSharedData& mesh, const VulkanRT::MeshIngest::VertexLayout& vertexLayout, const void* const* vertexStreams, const RayQueryVertexAttributes* cachedAttributes);
 	void BuildTlas(VkCommandBuffer commandBuffer, uint64_t currentFrameNumber);
 	void ManualBuildTlas();
 
@@ -223,21 +628,53 @@ private:
 	void CreatePipelineLayout();
 
 	/// <summary>
-	/// Creates ray tracing pipeline
+	/// Queues pipeline compiles for shared meshes that don't have one yet
 	/// </summary>
 	void CreatePipeline(VkRenderPass renderPass);
 
+	/// <summary>
+	/// Creates ray tracing pipeline, or the depth pre-pass pipeline when depthOnly is set. Safe to call from worker threads
+	/// </summary>
+	/// <param name="depthEqual">Test depth with EQUAL against the pre-pass instead of writing it</param>
+	VkPipeline CompilePipeline(VkRenderPass renderPass, bool depthOnly, bool depthEqual, RayQueryQualityTier qualityTier);
+
+	/// <summary>
+	/// Moves pipelines finished by the workers into rayQueryPipelineMap, only call at a frame boundary
+	/// </summary>
+	void SwapInCompiledPipelines(uint64_t currentFrameNumber);
+
+	/// <summary>
+	/// Switch to requestedQualityTier_, pipelines of the previous tier are released once the GPU is done with them
+	/// </summary>
+	void ApplyQualityTier(uint64_t currentFrameNumber);
+
+	/// <summary>
+	/// Drops every pipeline in rayQueryPipelineMap so CreatePipeline compiles them again, the current fallback keeps drawing until then
+	/// </summary>
+	void RetireShadingPipelines(uint64_t currentFrameNumber);
+
 	/// <summary>
 	/// Builds and submits ray tracing commands
 	/// </summary>
-	void BuildAndSubmitRayTracingCommandBuffer(int cameraInstanceId, VkCommandBuffer commandBuffer, uint64_t currentFrameNumber);
+	void BuildAndSubmitRayTracingCommandBuffer(const UnityVulkanRecordingState& recordingState);
+
+	/// <summary>
+	/// Collects per instance draw state into drawList_, recorded once per pass by RecordDrawList
+	/// </summary>
+	void BuildDrawList();
+
+	/// <summary>
+	/// Records drawList_ into commandBuffer, with the depth pre-pass pipeline when depthPrepass is set
+	/// </summary>
+	void RecordDrawList(VkCommandBuffer commandBuffer, bool depthPrepass);
 
 	void CopyRenderToRenderTarget(int cameraInstanceId, VkCommandBuffer commandBuffer);
 
 	/// <summary>
-	/// Builds descriptor buffer infos for descriptor sets
+	/// Brings the instance data copy bound this frame up to date with instanceData_, switching to a copy the GPU is done with
+	/// when something changed. Always leaves a buffer to bind, even before the first instance
 	/// </summary>
-	void BuildDescriptorBufferInfos(int cameraInstanceId, uint64_t currentFrameNumber);
+	void UploadInstanceData(uint64_t currentFrameNumber, uint64_t safeFrameNumber);
 
 	/// <summary>
 	/// Create the descriptor pool for generating descriptor sets
@@ -245,10 +682,68 @@ private:
 	void CreateDescriptorPool();
 
 	/// <summary>
-	/// Update the descriptor sets for the shader
+	/// Create the update template used to write the descriptor set or push descriptors from descriptorData_
+	/// </summary>
+	void CreateDescriptorUpdateTemplate();
+
+	/// <summary>
+	/// Update the descriptor sets for the shader when the TLAS or uniform buffer changed
+	/// </summary>
+	void UpdateDescriptorSets(uint64_t currentFrameNumber, uint64_t safeFrameNumber);
+
+	/// <summary>
+	/// Bind descriptorData_ to set 0 of the ray query pipeline layout
+	/// </summary>
+	void BindDescriptors(VkCommandBuffer commandBuffer);
+
+	/// <summary>
+	/// Create the descriptor set layout, pool, sampler and pipelines of the compute shadow pass, returns false until all of them exist
+	/// </summary>
+	bool CreateComputeShadowPipelines();
+
+	/// <summary>
+	/// Recreate visibilityImage_ and the history images when the output size or downsample factor changed
+	/// </summary>
+	bool EnsureVisibilityImage(const VkExtent3D& outputExtent, uint64_t currentFrameNumber);
+
+	/// <summary>
+	/// Find a descriptor set in slots that no in flight command buffer uses, allocating one from pool if needed
+	/// </summary>
+	VkDescriptorSet AcquireTransientDescriptorSet(std::vector<VulkanRT::VulkanRTData::RayTracerDescriptorSetSlot>& slots, VkDescriptorPool pool, VkDescriptorSetLayout layout,
+		uint64_t currentFrameNumber, uint64_t safeFrameNumber);
+
+	/// <summary>
+	/// Index of a copy in slots to write this frame: current if this frame already uses it, otherwise one no in flight
+	/// frame reads, appending one if needed. ~0u when all kMaxFrameBufferSlots are in flight
+	/// </summary>
+	uint32_t AcquireFrameBufferSlot(std::vector<VulkanRT::VulkanRTData::RayTracerFrameBufferSlot>& slots, uint32_t current,
+		uint64_t currentFrameNumber, uint64_t safeFrameNumber);
+
+	/// <summary>
+	/// Grow slot to hold count elements of elementSize, starting at minCapacity and doubling. A new buffer marks
+	/// the whole copy dirty, the old one goes to the garbage list
+	/// </summary>
+	bool ReserveFrameBufferSlot(VulkanRT::VulkanRTData::RayTracerFrameBufferSlot& slot, const char* name, uint32_t count, uint32_t minCapacity,
+		VkDeviceSize elementSize, uint64_t currentFrameNumber, VkMemoryPropertyFlags memoryPropertyFlags = VulkanRT::Buffer::kDefaultMemoryPropertyFlags);
+
+	void DestroyComputeShadowResources();
+
+	/// <summary>
+	/// Pick the light copy this frame binds, rewriting one no in flight frame reads if the registry changed
+	/// </summary>
+	void UploadLights(uint64_t currentFrameNumber, uint64_t safeFrameNumber);
+
+	/// <summary>
+	/// Pick the tile light copy this frame culls into, grown to hold tileCount tiles. False when none is free
+	/// </summary>
+	bool EnsureTileLightBuffer(uint32_t tileCount, uint64_t currentFrameNumber, uint64_t safeFrameNumber);
+
+	/// <summary>
+	/// Create the descriptor set layout, pool and pipeline of the light cull pass, returns false until all of them exist
 	/// </summary>
-	void UpdateDescriptorSets(int cameraInstanceId, uint64_t currentFrameNumber);
+	bool CreateLightCullPipeline();
 
+	void DestroyLightResources();
 
 	void GarbageCollect(uint64_t frameCount);
 };
@@ -156,7 +156,7 @@ extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API AddLight(int lightInst
 {
 	PLUGIN_CHECK_RETURN(-1);
 
-	return (int)s_CurrentAPI->AddLight(lightInstanceId, x, y, dx, dy, dz, z, r, g, b, bounceIntensity, intensity, range, spotAngle, type, enabled);
+	return (int)s_CurrentAPI->AddLight(lightInstanceId, x, y, z, dx, dy, dz, r, g, b, bounceIntensity, intensity, range, spotAngle, type, enabled);
 }
 
 extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateLight(int lightInstanceId, float x, float y, float z, float dx, float dy, float dz, float r, float g, float b, float bounceIntensity, float intensity, float range, float spotAngle, int type, bool enabled)
@@ -179,12 +179,40 @@ extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API AddSharedMesh(int shar
 	return (int)s_CurrentAPI->AddSharedMesh(sharedMeshInstanceId, verticesArray, normalsArray, tangentsArray, uvsArray, vertexCount, indicesArray, indexCount);
 }
 
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API AddSharedMeshNative(int sharedMeshInstanceId, void* vertexBuffer, int vertexStride, int positionOffset, int positionFormat, int normalOffset, int vertexCount, void* indexBuffer, bool indices16, int indexCount)
+{
+	PLUGIN_CHECK_RETURN(-1);
+
+	return (int)s_CurrentAPI->AddSharedMeshNative(sharedMeshInstanceId, vertexBuffer, vertexStride, positionOffset, positionFormat, normalOffset, vertexCount, indexBuffer, indices16, indexCount);
+}
+
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API AddSharedMeshLayout(int sharedMeshInstanceId, const VulkanRT::MeshIngest::VertexLayout* vertexLayout, const void* const* vertexStreams, int vertexCount, const void* indices, bool indices16, int indexCount)
+{
+	PLUGIN_CHECK_RETURN(-1);
 
-extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId, float* l2wMatrix, float* w2lMatrix)
+	return (int)s_CurrentAPI->AddSharedMeshLayout(sharedMeshInstanceId, vertexLayout, vertexStreams, vertexCount, indices, indices16, indexCount);
+}
+
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API AddSharedMesh16(int sharedMeshInstanceId, float* verticesArray, float* normalsArray, float* tangentsArray, float* uvsArray, int vertexCount, unsigned short* indicesArray, int indexCount)
 {
 	PLUGIN_CHECK_RETURN(-1);
 
-	return (int)s_CurrentAPI->AddTlasInstance(gameObjectInstanceId, sharedMeshInstanceId, l2wMatrix, w2lMatrix);
+	return (int)s_CurrentAPI->AddSharedMesh16(sharedMeshInstanceId, verticesArray, normalsArray, tangentsArray, uvsArray, vertexCount, indicesArray, indexCount);
+}
+
+
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API AddTlasInstance(int gameObjectInstanceId, int sharedMeshInstanceId, float* l2wMatrix, float* w2lMatrix, int mask, int flags)
+{
+	PLUGIN_CHECK_RETURN(-1);
+
+	return (int)s_CurrentAPI->AddTlasInstance(gameObjectInstanceId, sharedMeshInstanceId, l2wMatrix, w2lMatrix, mask, flags);
+}
+
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API AddTlasInstances(int count, const int* gameObjectInstanceIds, int sharedMeshInstanceId, const float* l2wMatrices, const float* w2lMatrices, int mask, int flags)
+{
+	PLUGIN_CHECK_RETURN(0);
+
+	return s_CurrentAPI->AddTlasInstances(count, gameObjectInstanceIds, sharedMeshInstanceId, l2wMatrices, w2lMatrices, mask, flags);
 }
 
 extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateTlasInstance(int gameObjectInstanceId, float* l2wMatrix, float* w2lMatrix)
@@ -194,6 +222,50 @@ extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateTlasInstance(in
 	s_CurrentAPI->UpdateTlasInstance(gameObjectInstanceId, l2wMatrix, w2lMatrix);
 }
 
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateTlasInstances(int count, const int* gameObjectInstanceIds, const float* l2wMatrices, const float* w2lMatrices)
+{
+	PLUGIN_CHECK();
+
+	s_CurrentAPI->UpdateTlasInstances(count, gameObjectInstanceIds, l2wMatrices, w2lMatrices);
+}
+
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API GetTlasInstanceHandle(int gameObjectInstanceId)
+{
+	PLUGIN_CHECK_RETURN(-1);
+
+	return s_CurrentAPI->GetTlasInstanceHandle(gameObjectInstanceId);
+}
+
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateTlasInstancesByHandle(int count, const int* handles, const float* l2wMatrices, const float* w2lMatrices)
+{
+	PLUGIN_CHECK();
+
+	s_CurrentAPI->UpdateTlasInstancesByHandle(count, handles, l2wMatrices, w2lMatrices);
+}
+
+extern "C" UNITY_INTERFACE_EXPORT void* UNITY_INTERFACE_API GetTransformArena(int* capacity)
+{
+	*capacity = 0;
+	PLUGIN_CHECK_RETURN(nullptr);
+
+	return s_CurrentAPI->GetTransformArena(capacity);
+}
+
+extern "C" UNITY_INTERFACE_EXPORT void* UNITY_INTERFACE_API PublishTransformArena(int* capacity)
+{
+	*capacity = 0;
+	PLUGIN_CHECK_RETURN(nullptr);
+
+	return s_CurrentAPI->PublishTransformArena(capacity);
+}
+
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateTlasInstanceMask(int gameObjectInstanceId, int mask, int flags)
+{
+	PLUGIN_CHECK();
+
+	s_CurrentAPI->UpdateTlasInstanceMask(gameObjectInstanceId, mask, flags);
+}
+
 extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API RemoveTlasInstance(int gameObjectInstanceId)
 {
 	PLUGIN_CHECK();
@@ -201,10 +273,55 @@ extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API RemoveTlasInstance(in
 	s_CurrentAPI->RemoveTlasInstance(gameObjectInstanceId);
 }
 
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API RemoveSharedMesh(int sharedMeshInstanceId)
+{
+	PLUGIN_CHECK();
+
+	s_CurrentAPI->RemoveSharedMesh(sharedMeshInstanceId);
+}
+
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API IsSharedMeshPending(int sharedMeshInstanceId)
+{
+	PLUGIN_CHECK_RETURN(0);
+
+	return s_CurrentAPI->IsSharedMeshPending(sharedMeshInstanceId) ? 1 : 0;
+}
+
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API GetSharedMeshBounds(int sharedMeshInstanceId, float* boundsMin, float* boundsMax)
+{
+	PLUGIN_CHECK_RETURN(0);
+
+	return s_CurrentAPI->GetSharedMeshBounds(sharedMeshInstanceId, boundsMin, boundsMax) ? 1 : 0;
+}
+
+extern "C" int UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API CreateArena()
+{
+	PLUGIN_CHECK_RETURN(0);
+
+	return s_CurrentAPI->CreateArena();
+}
+
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetActiveArena(int arena)
+{
+	PLUGIN_CHECK();
+
+	s_CurrentAPI->SetActiveArena(arena);
+}
+
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API DestroyArena(int arena)
+{
+	PLUGIN_CHECK();
+
+	s_CurrentAPI->DestroyArena(arena);
+}
+
 enum class Events
 {
 	None = 0,
-	TraceRays = 1
+	TraceRays = 1,
+	TraceShadowsCompute = 2,
+	CullLights = 3,
+	ImportNativeMeshes = 4
 };
 
 static void UNITY_INTERFACE_API OnEventAndData(int eventId, void* data)
@@ -216,10 +333,27 @@ static void UNITY_INTERFACE_API OnEventAndData(int eventId, void* data)
 	switch (event)
 	{
 	case Events::TraceRays:
+	{
 		int cameraInstanceId = *static_cast<int*>(data);
 		s_CurrentAPI->TraceRays(cameraInstanceId);
 		break;
 	}
+	case Events::TraceShadowsCompute:
+	{
+		s_CurrentAPI->TraceShadowsCompute();
+		break;
+	}
+	case Events::CullLights:
+	{
+		s_CurrentAPI->CullLights();
+		break;
+	}
+	case Events::ImportNativeMeshes:
+	{
+		s_CurrentAPI->ImportNativeMeshes();
+		break;
+	}
+	}
 }
 
 
@@ -245,14 +379,49 @@ extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API Prepare()
 }
 
 
-extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateCameraMat(float x, float y, float z, float* world2cameraProj)
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateCameraMat(int cameraInstanceId, float x, float y, float z, float* world2cameraProj)
 {
 	PLUGIN_CHECK();
-	s_CurrentAPI->UpdateCameraMat(x, y, z,world2cameraProj);
+	s_CurrentAPI->UpdateCameraMat(cameraInstanceId, x, y, z, world2cameraProj);
 }
 
-extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UpdateModelMat(int sharedMeshInstanceId, float* local2World)
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetPipelineCachePath(const char* path)
+{
+	PLUGIN_CHECK();
+	s_CurrentAPI->SetPipelineCachePath(path);
+}
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetRenderTargetSize(int width, int height)
+{
+	PLUGIN_CHECK();
+	s_CurrentAPI->SetRenderTargetSize(width, height);
+}
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetDepthPrepass(bool enabled)
+{
+	PLUGIN_CHECK();
+	s_CurrentAPI->SetDepthPrepass(enabled);
+}
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetComputeShadowTargets(void* depthTexture, void* outputTexture, int downsample)
 {
 	PLUGIN_CHECK();
-	s_CurrentAPI->UpdateModelMat(sharedMeshInstanceId, local2World);
-}
\ No newline at end of file
+	s_CurrentAPI->SetComputeShadowTargets(depthTexture, outputTexture, downsample);
+}
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetComputeShadowTemporal(bool enabled)
+{
+	PLUGIN_CHECK();
+	s_CurrentAPI->SetComputeShadowTemporal(enabled);
+}
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetQualityTier(int tier)
+{
+	PLUGIN_CHECK();
+	s_CurrentAPI->SetQualityTier(tier);
+}
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetMeshOptimization(int flags)
+{
+	PLUGIN_CHECK();
+	s_CurrentAPI->SetMeshOptimization(flags);
+}
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetTriangleSplitting(float areaRatio, float budget)
+{
+	PLUGIN_CHECK();
+	s_CurrentAPI->SetTriangleSplitting(areaRatio, budget);
+}
@@ -52,6 +52,18 @@ namespace VulkanRT
 			return index;
 		}
 
+		// Add at a fresh slot past the end of the pool, leaving the free slots to add. A run of appends stays
+		// contiguous in the pool, the map still allocates a node per key
+		uint32_t append(const K& key, T&& object)
+		{
+			const uint32_t index = static_cast<uint32_t>(pool_.size());
+			pool_.push_back(std::move(object));
+
+			map_.insert(std::make_pair(key, index));
+
+			return index;
+		}
+
 		typename std::map<K, int>::iterator find(const K& key)
 		{
 			return map_.find(key);
@@ -67,6 +79,12 @@ namespace VulkanRT
 			available_index_.push_back(index);
 		}
 
+		// Room for count more appended objects without reallocating the pool
+		void reserve_append(size_t count)
+		{
+			pool_.reserve(pool_.size() + count);
+		}
+
 		T& operator[](K key)
 		{
 			return pool_[map_[key]];
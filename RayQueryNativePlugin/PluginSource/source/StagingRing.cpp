@@ -0,0 +1,135 @@
+#include "PlatformBase.h"
+
+#if SUPPORT_VULKAN
+
+#include "StagingRing.h"
+
+namespace VulkanRT
+{
+	StagingRing::StagingRing()
+		: mapped_(nullptr)
+		, head_(0)
+	{
+
+	}
+
+	StagingRing::~StagingRing()
+	{
+		Destroy();
+	}
+
+	VkResult StagingRing::Create(VkDevice device, const VkPhysicalDeviceMemoryProperties& physicalDeviceMemoryProperties, VkDeviceSize size)
+	{
+		VkResult result = buffer_.Create("Mesh staging ring", device, physicalDeviceMemoryProperties, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, Buffer::kDefaultMemoryPropertyFlags);
+		if (result != VK_SUCCESS)
+		{
+			return result;
+		}
+
+		// Mapped once for the lifetime of the ring
+		mapped_ = static_cast<uint8_t*>(buffer_.Map());
+		if (mapped_ == nullptr)
+		{
+			buffer_.Destroy();
+			return VK_ERROR_MEMORY_MAP_FAILED;
+		}
+
+		head_ = 0;
+		allocations_.clear();
+
+		return VK_SUCCESS;
+	}
+
+	void StagingRing::Destroy()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (mapped_ != nullptr)
+		{
+			buffer_.Unmap();
+			mapped_ = nullptr;
+		}
+		buffer_.Destroy();
+
+		head_ = 0;
+		allocations_.clear();
+	}
+
+	void* StagingRing::Allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		const VkDeviceSize capacity = buffer_.GetSize();
+		if (mapped_ == nullptr || size == 0 || size > capacity)
+		{
+			return nullptr;
+		}
+
+		if (alignment == 0)
+		{
+			alignment = 1;
+		}
+
+		VkDeviceSize begin = (head_ + alignment - 1) / alignment * alignment;
+
+		if (allocations_.empty())
+		{
+			// Nothing in flight, start over from the front so the whole ring is available
+			begin = 0;
+		}
+		else
+		{
+			const VkDeviceSize tail = allocations_.front().begin;
+
+			if (head_ > tail)
+			{
+				// Free space is [head_, capacity) followed by [0, tail)
+				if (begin + size > capacity)
+				{
+					begin = 0;
+					if (size > tail)
+					{
+						return nullptr;
+					}
+				}
+			}
+			else
+			{
+				// Already wrapped, free space is [head_, tail)
+				if (begin + size > tail)
+				{
+					return nullptr;
+				}
+			}
+		}
+
+		allocations_.push_back({ begin, begin + size });
+		head_ = begin + size;
+
+		offset = begin;
+		return mapped_ + begin;
+	}
+
+	void StagingRing::ReleaseOldest()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (!allocations_.empty())
+		{
+			allocations_.pop_front();
+		}
+	}
+
+	void StagingRing::ReleaseNewest()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (!allocations_.empty())
+		{
+			allocations_.pop_back();
+			head_ = allocations_.empty() ? 0 : allocations_.back().end;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "PlatformBase.h"
+
+#if SUPPORT_VULKAN
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include "Buffer.h"
+
+namespace VulkanRT
+{
+	/// <summary>
+	/// Persistently mapped host visible buffer handed out front to back as a ring. Allocations are released in the order
+	/// they were made, which is the order the copies reading them complete on one queue
+	/// </summary>
+	class StagingRing
+	{
+	public:
+		StagingRing();
+		~StagingRing();
+
+		StagingRing(const StagingRing&) = delete;
+		StagingRing& operator=(const StagingRing&) = delete;
+
+		VkResult Create(VkDevice device, const VkPhysicalDeviceMemoryProperties& physicalDeviceMemoryProperties, VkDeviceSize size);
+		void Destroy();
+
+		/// <summary>
+		/// Reserve size bytes behind everything still in flight
+		/// </summary>
+		/// <param name="offset">Offset of the allocation in GetBuffer()</param>
+		/// <returns>Mapped pointer, nullptr when the ring has no room until older allocations are released</returns>
+		void* Allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+
+		/// <summary>
+		/// Give back the oldest allocation
+		/// </summary>
+		void ReleaseOldest();
+
+		/// <summary>
+		/// Give back the latest allocation, for a caller that failed before submitting the copy reading it
+		/// </summary>
+		void ReleaseNewest();
+
+		VkBuffer GetBuffer() const { return buffer_.GetBuffer(); }
+		VkDeviceSize GetSize() const { return buffer_.GetSize(); }
+		bool IsCreated() const { return mapped_ != nullptr; }
+
+	private:
+		struct Allocation
+		{
+			VkDeviceSize begin;
+			VkDeviceSize end;
+		};
+
+		Buffer buffer_;
+		uint8_t* mapped_;
+
+		// Next free byte, allocations in flight live between allocations_.front().begin and head_, wrapping at the end
+		VkDeviceSize head_;
+		std::deque<Allocation> allocations_;
+		std::mutex mutex_;
+	};
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace VulkanRT
+{
+	ThreadPool::ThreadPool(uint32_t workerCount)
+		: activeJobs_(0)
+		, stopping_(false)
+	{
+		if (workerCount == 0)
+		{
+			const uint32_t hardwareThreads = std::thread::hardware_concurrency();
+
+			// Leave a core for Unity's main and render threads
+			workerCount = std::max(1u, hardwareThreads > 1 ? hardwareThreads - 1 : 1u);
+		}
+
+		workers_.reserve(workerCount);
+		for (uint32_t i = 0; i < workerCount; ++i)
+		{
+			workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		jobAvailable_.notify_all();
+
+		for (auto& worker : workers_)
+		{
+			if (worker.joinable())
+			{
+				worker.join();
+			}
+		}
+	}
+
+	void ThreadPool::Enqueue(std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			jobs_.push_back(std::move(job));
+		}
+		jobAvailable_.notify_one();
+	}
+
+	void ThreadPool::WaitIdle()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		idle_.wait(lock, [this]() { return jobs_.empty() && activeJobs_ == 0; });
+	}
+
+	void ThreadPool::ParallelFor(uint32_t count, std::function<void(uint32_t)> job)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+
+		struct Batch
+		{
+			std::function<void(uint32_t)> job;
+			std::atomic<uint32_t> next;
+			std::atomic<uint32_t> done;
+			std::mutex mutex;
+			std::condition_variable finished;
+		};
+
+		// Shared so helpers that only get scheduled after the batch is complete can still exit safely
+		auto batch = std::make_shared<Batch>();
+		batch->job = std::move(job);
+		batch->next = 0;
+		batch->done = 0;
+
+		auto run = [count](Batch& b)
+		{
+			for (uint32_t i = b.next++; i < count; i = b.next++)
+			{
+				b.job(i);
+				if (++b.done == count)
+				{
+					std::lock_guard<std::mutex> lock(b.mutex);
+					b.finished.notify_all();
+				}
+			}
+		};
+
+		const uint32_t helperCount = std::min(count - 1, GetWorkerCount());
+		for (uint32_t i = 0; i < helperCount; ++i)
+		{
+			Enqueue([batch, run]() { run(*batch); });
+		}
+
+		run(*batch);
+
+		std::unique_lock<std::mutex> lock(batch->mutex);
+		batch->finished.wait(lock, [&batch, count]() { return batch->done == count; });
+	}
+
+	void ThreadPool::WorkerLoop()
+	{
+		for (;;)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				jobAvailable_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+
+				if (stopping_ && jobs_.empty())
+				{
+					return;
+				}
+
+				job = std::move(jobs_.front());
+				jobs_.pop_front();
+				++activeJobs_;
+			}
+
+			job();
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				--activeJobs_;
+				if (jobs_.empty() && activeJobs_ == 0)
+				{
+					idle_.notify_all();
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace VulkanRT
+{
+	/// <summary>
+	/// Fixed size pool of worker threads used to keep expensive work off Unity's render thread
+	/// </summary>
+	class ThreadPool
+	{
+	public:
+		/// <summary>
+		/// Start workers
+		/// </summary>
+		/// <param name="workerCount">Number of threads, 0 picks one less than the hardware concurrency</param>
+		explicit ThreadPool(uint32_t workerCount = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		/// <summary>
+		/// Queue a job to run on the next free worker
+		/// </summary>
+		/// <param name="job"></param>
+		void Enqueue(std::function<void()> job);
+
+		/// <summary>
+		/// Block until every queued job has finished
+		/// </summary>
+		void WaitIdle();
+
+		/// <summary>
+		/// Run job(0) .. job(count - 1) across the workers and return once all of them are done.
+		/// The calling thread takes part too, so this still finishes when every worker is busy with long jobs.
+		/// </summary>
+		/// <param name="count"></param>
+		/// <param name="job"></param>
+		void ParallelFor(uint32_t count, std::function<void(uint32_t)> job);
+
+		uint32_t GetWorkerCount() const { return static_cast<uint32_t>(workers_.size()); }
+
+	private:
+		void WorkerLoop();
+
+		std::vector<std::thread> workers_;
+		std::deque<std::function<void()>> jobs_;
+
+		std::mutex mutex_;
+		std::condition_variable jobAvailable_;
+		std::condition_variable idle_;
+
+		uint32_t activeJobs_;
+		bool stopping_;
+	};
+}
@@ -4,10 +4,12 @@
 #include "Image.h"
 #include "IResource.h"
 #include "PlatformBase.h"
+#include "RayQueryShsaderConst.h"
 
 #include <vector>
 #include <map>
 #include <memory>
+#include <unordered_set>
 
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
@@ -111,6 +113,9 @@ namespace VulkanRT
 	class VulkanRTData
 	{
 	public:
+		// Arena handle of meshes and instances added while no arena is active
+		static const int kNoArena = 0;
+
 		struct RayTracerAccelerationStructure
 		{
 			RayTracerAccelerationStructure()
@@ -124,13 +129,48 @@ namespace VulkanRT
 			Buffer                buffer;
 		};
 
+		/// <summary>
+		/// Object space bounds of a shared mesh's positions, worked out while its vertices are ingested
+		/// </summary>
+		struct RayTracerMeshBounds
+		{
+			RayTracerMeshBounds()
+				: valid(false)
+				, min(0.0f)
+				, max(0.0f)
+			{}
+
+			// False for AddSharedMeshNative meshes, their positions never reach the CPU
+			bool valid;
+			glm::vec3 min;
+			glm::vec3 max;
+		};
+
+		/// <summary>
+		/// Normals and tangents generated for a mesh, kept by the hash of their source so meshes with the same data share them
+		/// </summary>
+		struct RayTracerGeneratedShading
+		{
+			uint32_t vertexCount;
+
+			// Empty when the mesh came with its own
+			std::vector<glm::vec3> normals;
+
+			// Empty when none were generated
+			std::vector<glm::vec4> tangents;
+		};
+
 		struct RayTracerMeshSharedData
 		{
 			RayTracerMeshSharedData()
 				: sharedMeshInstanceId(-1)
 				, vertexCount(0)
 				, indexCount(0)
+				, indexType(VK_INDEX_TYPE_UINT32)
+				, blasInputVertexCount(0)
+				, blasInputTriangleCount(0)
 				, blas(RayTracerAccelerationStructure())
+				, arena(kNoArena)
 			{}
 
 			int sharedMeshInstanceId;
@@ -138,13 +178,60 @@ namespace VulkanRT
 			int vertexCount;
 			int indexCount;
 
+			// UINT16 unless the mesh has more than 65536 vertices, used for the BLAS input and the draw
+			VkIndexType indexType;
+
 			Buffer vertexBuffer;         
 			Buffer indexBuffer;           
 
+			// RayQueryVertexAttributes in vertex buffer order, only set when the mesh has tangents or uvs
+			std::unique_ptr<Buffer> attributeBuffer;
+
+			// Long triangles split for the BLAS, tightly packed positions and 32 bit indices. Only set when something was
+			// split, handed to the garbage list once the BLAS build is recorded
+			std::unique_ptr<Buffer> blasInputVertexBuffer;
+			std::unique_ptr<Buffer> blasInputIndexBuffer;
+			uint32_t blasInputVertexCount;
+			uint32_t blasInputTriangleCount;
+
 			RayTracerAccelerationStructure blas;
+
+			// Arena that was active when the mesh was added, DestroyArena releases it
+			int arena;
 		};
 
 
+		/// <summary>
+		/// Mesh handed over as Unity's own GPU buffers by AddSharedMeshNative, imported on the render thread
+		/// </summary>
+		struct RayTracerNativeMeshRequest
+		{
+			int         sharedMeshInstanceId;
+			void*       nativeVertexBuffer;
+			void*       nativeIndexBuffer;
+			uint32_t    vertexStride;
+			uint32_t    positionOffset;
+			uint32_t    normalOffset;
+			uint32_t    vertexCount;
+			VkIndexType indexType;
+			uint32_t    indexCount;
+			int         arena;
+		};
+
+		/// <summary>
+		/// Mesh whose buffers are being filled from the staging ring on the transfer queue, added to the pool once fence is signaled.
+		/// Without a fence its buffers were written on the host and it is added by the next FinishMeshUploads
+		/// </summary>
+		struct RayTracerMeshUpload
+		{
+			std::unique_ptr<RayTracerMeshSharedData> mesh;
+			VkCommandBuffer                          commandBuffer;
+			VkFence                                  fence;
+
+			// RemoveSharedMesh came while the copy was running, the mesh goes to the garbage list instead of the pool
+			bool                                     cancelled;
+		};
+
 		struct RayTracerAccelerationStructureBuildInfo
 		{
 			VkAccelerationStructureBuildGeometryInfoKHR& accelerationBuildGeometryInfo;
@@ -155,6 +242,10 @@ namespace VulkanRT
 			RayTracerMeshInstanceData()
 				: gameObjectInstanceId(0)
 				, sharedMeshInstanceId(0)
+				, mask(kRayQueryMaskDefault)
+				, flags(VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR)
+				, customIndex(~0u)
+				, arena(kNoArena)
 			{}
 
 			int32_t  gameObjectInstanceId;
@@ -162,7 +253,282 @@ namespace VulkanRT
 			mat4     localToWorld;
 			mat4     worldToLocal;
 
-			Buffer instanceData;
+			// Written to VkAccelerationStructureInstanceKHR, see kRayQueryMask* for the bits the shaders test
+			uint32_t                   mask;
+			VkGeometryInstanceFlagsKHR flags;
+
+			// instanceCustomIndex given by the last TLAS rebuild, also the element in the instance data buffer
+			uint32_t customIndex;
+
+			// Arena that was active when the instance was added, DestroyArena removes it
+			int32_t  arena;
+		};
+
+		// RayTracerTransformSlot::flags bit, set by the writer, cleared once the render thread picked the transform up
+		static const uint32_t kTransformSlotDirty = 0x1;
+
+		// A TLAS instance handle is the instance's pool index in the low bits and the generation of that index above them,
+		// so a handle kept past RemoveTlasInstance doesn't address the next instance added at the same index
+		static const uint32_t kTlasHandleIndexBits = 20;
+		static const uint32_t kTlasHandleIndexMask = (1u << kTlasHandleIndexBits) - 1;
+		static const uint32_t kTlasHandleGenerationMask = (1u << (31 - kTlasHandleIndexBits)) - 1;
+
+		/// <summary>
+		/// Ids added while an arena was active, so DestroyArena only visits its own instances and meshes
+		/// </summary>
+		struct RayTracerArena
+		{
+			std::unordered_set<int> instances;
+			std::unordered_set<int> meshes;
+		};
+
+		/// <summary>
+		/// One instance transform in the arena shared with C#, indexed by the pool index of a TLAS instance handle.
+		/// Same 3x4 row major layout VkAccelerationStructureInstanceKHR takes, padded to 64 bytes
+		/// </summary>
+		struct RayTracerTransformSlot
+		{
+			VkTransformMatrixKHR transform;
+			uint32_t             flags;
+
+			// Full handle the transform was written for, a stale one is ignored
+			int32_t              handle;
+			uint32_t             padding[2];
+		};
+
+		/// <summary>
+		/// Transform passed to UpdateTlasInstances or UpdateTlasInstancesByHandle, the render thread applies it with the transform arena
+		/// </summary>
+		struct RayTracerPendingTransform
+		{
+			int32_t handle;
+			mat4    localToWorld;
+			mat4    worldToLocal;
+		};
+
+		struct RayTracerDrawItem
+		{
+			VkPipeline   pipeline;
+			VkBuffer     vertexBuffer;
+			VkBuffer     indexBuffer;
+			VkIndexType  indexType;
+			uint32_t     indexCount;
+
+			// instanceCustomIndex, drawn as firstInstance so the vertex shaders find the transform in the instance data buffer
+			uint32_t     instanceIndex;
+		};
+
+		/// <summary>
+		/// Everything the ray query descriptor set points at, laid out to be read by a descriptor update template
+		/// </summary>
+		struct RayTracerDescriptorData
+		{
+			RayTracerDescriptorData()
+				: accelerationStructure(VK_NULL_HANDLE)
+				, globalUniform(VkDescriptorBufferInfo())
+				, instanceData(VkDescriptorBufferInfo())
+				, lights(VkDescriptorBufferInfo())
+				, tileLights(VkDescriptorBufferInfo())
+				, lightAlias(VkDescriptorBufferInfo())
+			{}
+
+			bool operator==(const RayTracerDescriptorData& other) const
+			{
+				return accelerationStructure == other.accelerationStructure
+					&& globalUniform.buffer == other.globalUniform.buffer
+					&& globalUniform.offset == other.globalUniform.offset
+					&& globalUniform.range == other.globalUniform.range
+					&& instanceData.buffer == other.instanceData.buffer
+					&& instanceData.offset == other.instanceData.offset
+					&& instanceData.range == other.instanceData.range
+					&& lights.buffer == other.lights.buffer
+					&& lights.range == other.lights.range
+					&& tileLights.buffer == other.tileLights.buffer
+					&& tileLights.range == other.tileLights.range
+					&& lightAlias.buffer == other.lightAlias.buffer
+					&& lightAlias.range == other.lightAlias.range;
+			}
+
+			bool operator!=(const RayTracerDescriptorData& other) const { return !(*this == other); }
+
+			VkAccelerationStructureKHR accelerationStructure;
+			VkDescriptorBufferInfo     globalUniform;
+			VkDescriptorBufferInfo     instanceData;
+			VkDescriptorBufferInfo     lights;
+			VkDescriptorBufferInfo     tileLights;
+			VkDescriptorBufferInfo     lightAlias;
+		};
+
+		/// <summary>
+		/// Descriptor set used when push descriptors are not available, rewritten only once the GPU is done with frameNumber
+		/// </summary>
+		struct RayTracerDescriptorSetSlot
+		{
+			RayTracerDescriptorSetSlot()
+				: descriptorSet(VK_NULL_HANDLE)
+				, frameNumber(0)
+			{}
+
+			VkDescriptorSet         descriptorSet;
+			RayTracerDescriptorData data;
+			uint64_t                frameNumber;
+		};
+
+		/// <summary>
+		/// One per frame copy of a buffer the shaders read, only rewritten once the GPU is done with frameNumber
+		/// </summary>
+		struct RayTracerFrameBufferSlot
+		{
+			RayTracerFrameBufferSlot()
+				: capacity(0)
+				, frameNumber(0)
+				, dirtyBegin(0)
+				, dirtyEnd(0)
+			{}
+
+			Buffer   buffer;
+			uint32_t capacity;
+			uint64_t frameNumber;
+
+			// [dirtyBegin, dirtyEnd) elements changed since this copy was last written
+			uint32_t dirtyBegin;
+			uint32_t dirtyEnd;
+		};
+
+		/// <summary>
+		/// Acceleration structure that may still be referenced by in flight command buffers, destroyed by GarbageCollect
+		/// </summary>
+		class RayTracerGarbageAccelerationStructure : public IResource
+		{
+		public:
+			RayTracerGarbageAccelerationStructure(VkDevice device, VkAccelerationStructureKHR accelerationStructure, const Buffer& buffer)
+				: device_(device)
+				, accelerationStructure_(accelerationStructure)
+				, buffer_(buffer)
+			{}
+
+			virtual void Destroy()
+			{
+				if (accelerationStructure_ != VK_NULL_HANDLE)
+				{
+					vkDestroyAccelerationStructureKHR(device_, accelerationStructure_, nullptr);
+					accelerationStructure_ = VK_NULL_HANDLE;
+				}
+				buffer_.Destroy();
+			}
+
+		private:
+			VkDevice                   device_;
+			VkAccelerationStructureKHR accelerationStructure_;
+			Buffer                     buffer_;
+		};
+
+		/// <summary>
+		/// Pipeline replaced while in flight command buffers may still use it, destroyed by GarbageCollect
+		/// </summary>
+		class RayTracerGarbagePipeline : public IResource
+		{
+		public:
+			RayTracerGarbagePipeline(VkDevice device, VkPipeline pipeline)
+				: device_(device)
+				, pipeline_(pipeline)
+			{}
+
+			virtual void Destroy()
+			{
+				if (pipeline_ != VK_NULL_HANDLE)
+				{
+					vkDestroyPipeline(device_, pipeline_, nullptr);
+					pipeline_ = VK_NULL_HANDLE;
+				}
+			}
+
+		private:
+			VkDevice   device_;
+			VkPipeline pipeline_;
+		};
+
+		/// <summary>
+		/// Descriptor set of a single dispatch, freed back to its pool by GarbageCollect once the GPU is done with it
+		/// </summary>
+		class RayTracerGarbageDescriptorSet : public IResource
+		{
+		public:
+			RayTracerGarbageDescriptorSet(VkDevice device, VkDescriptorPool pool, VkDescriptorSet descriptorSet)
+				: device_(device)
+				, pool_(pool)
+				, descriptorSet_(descriptorSet)
+			{}
+
+			virtual void Destroy()
+			{
+				if (descriptorSet_ != VK_NULL_HANDLE)
+				{
+					vkFreeDescriptorSets(device_, pool_, 1, &descriptorSet_);
+					descriptorSet_ = VK_NULL_HANDLE;
+				}
+			}
+
+		private:
+			VkDevice         device_;
+			VkDescriptorPool pool_;
+			VkDescriptorSet  descriptorSet_;
+		};
+
+		/// <summary>
+		/// Removed shared mesh whose buffers and BLAS may still be used by in flight command buffers, destroyed by GarbageCollect
+		/// </summary>
+		class RayTracerGarbageMesh : public IResource
+		{
+		public:
+			RayTracerGarbageMesh(VkDevice device, std::unique_ptr<RayTracerMeshSharedData> mesh)
+				: device_(device)
+				, mesh_(std::move(mesh))
+			{}
+
+			virtual void Destroy()
+			{
+				if (!mesh_)
+				{
+					return;
+				}
+
+				mesh_->vertexBuffer.Destroy();
+				mesh_->indexBuffer.Destroy();
+				if (mesh_->attributeBuffer)
+				{
+					mesh_->attributeBuffer->Destroy();
+				}
+				if (mesh_->blasInputVertexBuffer)
+				{
+					mesh_->blasInputVertexBuffer->Destroy();
+				}
+				if (mesh_->blasInputIndexBuffer)
+				{
+					mesh_->blasInputIndexBuffer->Destroy();
+				}
+				if (mesh_->blas.accelerationStructure != VK_NULL_HANDLE)
+				{
+					vkDestroyAccelerationStructureKHR(device_, mesh_->blas.accelerationStructure, nullptr);
+				}
+				mesh_->blas.buffer.Destroy();
+				mesh_.reset();
+			}
+
+		private:
+			VkDevice                                 device_;
+			std::unique_ptr<RayTracerMeshSharedData> mesh_;
+		};
+
+		/// <summary>
+		/// Pipeline finished by a worker, tagged with the quality tier it was specialized for and whether it tests depth with EQUAL
+		/// </summary>
+		struct RayTracerCompiledPipeline
+		{
+			int                 sharedMeshInstanceId;
+			RayQueryQualityTier qualityTier;
+			bool                depthEqual;
+			VkPipeline          pipeline;
 		};
 
 		struct RayTracerGarbageBuffer
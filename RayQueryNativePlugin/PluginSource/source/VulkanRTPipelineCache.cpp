@@ -0,0 +1,152 @@
+#include "VulkanRTPipelineCache.h"
+#include <fstream>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include "Volk/volk.h"
+#include "NativeLogger.h"
+
+
+namespace VulkanRT
+{
+
+	PipelineCache::PipelineCache()
+		: device_(VK_NULL_HANDLE)
+		, pipelineCache_(VK_NULL_HANDLE)
+		, physicalDeviceProperties_(VkPhysicalDeviceProperties())
+	{
+
+	}
+
+	PipelineCache::~PipelineCache()
+	{
+		Destroy();
+	}
+
+	VkResult PipelineCache::Create(VkDevice device, const VkPhysicalDeviceProperties& physicalDeviceProperties, const std::string& path)
+	{
+		device_ = device;
+		physicalDeviceProperties_ = physicalDeviceProperties;
+		path_ = path;
+
+		std::vector<char> initialData;
+
+		if (!path_.empty())
+		{
+			std::ifstream file(path_, std::ios::in | std::ios::binary);
+			if (file) {
+				file.seekg(0, std::ios::end);
+				const std::streamoff fileSize = file.tellg();
+				file.seekg(0, std::ios::beg);
+
+				if (fileSize > 0) {
+					initialData.resize(static_cast<size_t>(fileSize));
+					file.read(initialData.data(), fileSize);
+				}
+			}
+
+			if (!initialData.empty() && !IsCompatible(initialData))
+			{
+				NativeLogger::LogInfo("PipelineCache on disk is from another device or driver, ignoring it");
+				initialData.clear();
+			}
+		}
+
+		VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
+		pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		pipelineCacheCreateInfo.initialDataSize = initialData.size();
+		pipelineCacheCreateInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+
+		VkResult result = vkCreatePipelineCache(device_, &pipelineCacheCreateInfo, nullptr, &pipelineCache_);
+
+		// Driver may still refuse data that passed the header check, start from empty in that case
+		if (result != VK_SUCCESS && !initialData.empty())
+		{
+			pipelineCacheCreateInfo.initialDataSize = 0;
+			pipelineCacheCreateInfo.pInitialData = nullptr;
+			result = vkCreatePipelineCache(device_, &pipelineCacheCreateInfo, nullptr, &pipelineCache_);
+		}
+		else if (result == VK_SUCCESS && !initialData.empty())
+		{
+			NativeLogger::LogInfoFormat("PipelineCache loaded %d bytes", static_cast<int>(initialData.size()));
+		}
+
+		if (result != VK_SUCCESS)
+		{
+			pipelineCache_ = VK_NULL_HANDLE;
+		}
+
+		return result;
+	}
+
+	bool PipelineCache::Save() const
+	{
+		if (pipelineCache_ == VK_NULL_HANDLE || path_.empty())
+		{
+			return false;
+		}
+
+		size_t dataSize = 0;
+		if (vkGetPipelineCacheData(device_, pipelineCache_, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0)
+		{
+			return false;
+		}
+
+		std::vector<char> data(dataSize);
+		if (vkGetPipelineCacheData(device_, pipelineCache_, &dataSize, data.data()) != VK_SUCCESS)
+		{
+			return false;
+		}
+
+		// Write next to the target first so a crash mid-write never leaves a truncated cache behind
+		const std::string tempPath = path_ + ".tmp";
+		{
+			std::ofstream file(tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!file) {
+				return false;
+			}
+			file.write(data.data(), static_cast<std::streamsize>(dataSize));
+			if (!file) {
+				return false;
+			}
+		}
+
+		std::remove(path_.c_str());
+		if (std::rename(tempPath.c_str(), path_.c_str()) != 0)
+		{
+			std::remove(tempPath.c_str());
+			return false;
+		}
+
+		NativeLogger::LogInfoFormat("PipelineCache saved %d bytes", static_cast<int>(dataSize));
+
+		return true;
+	}
+
+	void PipelineCache::Destroy()
+	{
+		if (pipelineCache_ != VK_NULL_HANDLE)
+		{
+			vkDestroyPipelineCache(device_, pipelineCache_, nullptr);
+			pipelineCache_ = VK_NULL_HANDLE;
+		}
+	}
+
+	bool PipelineCache::IsCompatible(const std::vector<char>& data) const
+	{
+		VkPipelineCacheHeaderVersionOne header;
+		if (data.size() < sizeof(header))
+		{
+			return false;
+		}
+
+		std::memcpy(&header, data.data(), sizeof(header));
+
+		return header.headerSize >= sizeof(header)
+			&& header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+			&& header.vendorID == physicalDeviceProperties_.vendorID
+			&& header.deviceID == physicalDeviceProperties_.deviceID
+			&& std::memcmp(header.pipelineCacheUUID, physicalDeviceProperties_.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+	}
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "PlatformBase.h"
+#include <string>
+#include <vector>
+
+#ifndef UNITY_VULKAN_HEADER
+#define UNITY_VULKAN_HEADER <vulkan/vulkan.h>
+#endif
+
+#define VK_NO_PROTOTYPES
+#include UNITY_VULKAN_HEADER
+
+#if SUPPORT_VULKAN
+
+namespace VulkanRT
+{
+	/// <summary>
+	/// Represents a pipeline cache that is seeded from and written back to disk
+	/// </summary>
+	class PipelineCache {
+	public:
+		PipelineCache();
+		~PipelineCache();
+
+		/// <summary>
+		/// Create pipeline cache, seeded from the file at path if it was written by the same driver and device
+		/// </summary>
+		/// <param name="device"></param>
+		/// <param name="physicalDeviceProperties">Used to validate the cache header</param>
+		/// <param name="path">File to load from and save to, empty keeps the cache in memory only</param>
+		/// <returns></returns>
+		VkResult Create(VkDevice device, const VkPhysicalDeviceProperties& physicalDeviceProperties, const std::string& path);
+
+		/// <summary>
+		/// Write pipeline cache data to disk
+		/// </summary>
+		/// <returns></returns>
+		bool Save() const;
+
+		/// <summary>
+		/// Destroy pipeline cache
+		/// </summary>
+		void Destroy();
+
+		VkPipelineCache GetPipelineCache() const { return pipelineCache_; }
+
+	private:
+		/// <summary>
+		/// Check the cache header matches the current device, driver data from another device must not be used
+		/// </summary>
+		/// <param name="data"></param>
+		/// <returns></returns>
+		bool IsCompatible(const std::vector<char>& data) const;
+
+		VkDevice                    device_;
+		VkPipelineCache             pipelineCache_;
+		VkPhysicalDeviceProperties  physicalDeviceProperties_;
+		std::string                 path_;
+	};
+}
+
+#endif
@@ -90,7 +90,7 @@ namespace VulkanRT
 		}
 	}
 
-	VkPipelineShaderStageCreateInfo Shader::GetShaderStage(VkShaderStageFlagBits stage)
+	VkPipelineShaderStageCreateInfo Shader::GetShaderStage(VkShaderStageFlagBits stage, const VkSpecializationInfo* specializationInfo)
 	{
 		return VkPipelineShaderStageCreateInfo{
 			/*sType*/ VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
@@ -99,7 +99,7 @@ namespace VulkanRT
 			/*stage*/ stage,
 			/*module*/ shaderModule_,
 			/*pName*/ "main",
-			/*pSpecializationInfo*/ nullptr
+			/*pSpecializationInfo*/ specializationInfo
 		};
 	}
 
@@ -40,8 +40,9 @@ namespace VulkanRT
 		/// Get shader stage information
 		/// </summary>
 		/// <param name="stage"></param>
+		/// <param name="specializationInfo">Constant values baked into the pipeline, must outlive pipeline creation</param>
 		/// <returns></returns>
-		VkPipelineShaderStageCreateInfo GetShaderStage(VkShaderStageFlagBits stage);
+		VkPipelineShaderStageCreateInfo GetShaderStage(VkShaderStageFlagBits stage, const VkSpecializationInfo* specializationInfo = nullptr);
 		VkShaderModule GetShaderModule() { return shaderModule_; };
 
 	private:
@@ -0,0 +1,493 @@
+// Compares every MeshIngest kernel set the CPU runs against the scalar one on randomized meshes.
+// Counts walk through the SIMD prologues, main loops and tails, destinations are placed off their preferred alignment.
+// Attribute decoding and normal and tangent generation are checked against known results once
+
+#include "MeshIngest.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace VulkanRT;
+
+namespace
+{
+	const uint8_t kGuardByte = 0xCD;
+	const size_t kGuardSize = 64;
+
+	std::mt19937 generator(0x5eed);
+	int failures = 0;
+
+	void Fail(const char* kernelSet, const char* test, uint32_t count, size_t offset)
+	{
+		++failures;
+		printf("FAIL %s %s count %u offset %zu\n", kernelSet, test, count, offset);
+	}
+
+	/// <summary>
+	/// Destination placed offset bytes past a 64 byte boundary, followed by guard bytes the kernels must not touch
+	/// </summary>
+	struct GuardedDestination
+	{
+		GuardedDestination(size_t size, size_t offset)
+			: storage(size + offset + 64 + kGuardSize, kGuardByte)
+			, size(size)
+		{
+			const uintptr_t base = reinterpret_cast<uintptr_t>(storage.data());
+			data = storage.data() + ((64 - (base & 63)) & 63) + offset;
+		}
+
+		bool GuardIntact() const
+		{
+			for (size_t i = 0; i < kGuardSize; ++i)
+			{
+				if (data[size + i] != kGuardByte)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		std::vector<uint8_t> storage;
+		uint8_t* data;
+		size_t size;
+	};
+
+	float RandomFloat()
+	{
+		return std::uniform_real_distribution<float>(-1000.0f, 1000.0f)(generator);
+	}
+
+	void FillRandom(std::vector<uint8_t>& bytes)
+	{
+		for (auto& byte : bytes)
+		{
+			byte = static_cast<uint8_t>(generator());
+		}
+	}
+
+	// Random half that isn't Inf or NaN, their payloads aren't part of the contract
+	uint16_t RandomHalf()
+	{
+		uint16_t half = static_cast<uint16_t>(generator());
+		if (((half >> 10) & 0x1f) == 0x1f)
+		{
+			half &= 0xbfff;
+		}
+		return half;
+	}
+
+	bool SameVertices(const RayQueryVertex* a, const RayQueryVertex* b, uint32_t count)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (std::memcmp(&a[i].position, &b[i].position, sizeof(vec3)) != 0 || std::memcmp(&a[i].normal, &b[i].normal, sizeof(vec3)) != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Runs write(dst) with the scalar kernels and with kernelSet into separate destinations and compares them
+	template<typename Write, typename Compare>
+	void CompareWithScalar(uint32_t kernelSet, const char* test, uint32_t count, size_t size, size_t offset, Write write, Compare compare)
+	{
+		GuardedDestination expected(size, offset);
+		GuardedDestination actual(size, offset);
+
+		MeshIngest::SetKernelSetOverride(0);
+		write(expected.data);
+		MeshIngest::SetKernelSetOverride(kernelSet);
+		write(actual.data);
+		MeshIngest::SetKernelSetOverride(~0u);
+
+		if (!compare(expected.data, actual.data) || !actual.GuardIntact())
+		{
+			Fail(MeshIngest::GetKernelSetName(kernelSet), test, count, offset);
+		}
+	}
+
+	void TestInterleave(uint32_t kernelSet, uint32_t count, size_t offset)
+	{
+		std::vector<float> positions(3 * count);
+		std::vector<float> normals(3 * count);
+		for (uint32_t i = 0; i < 3 * count; ++i)
+		{
+			positions[i] = RandomFloat();
+			normals[i] = RandomFloat();
+		}
+
+		CompareWithScalar(kernelSet, "InterleaveVertices", count, sizeof(RayQueryVertex) * count, offset,
+			[&](uint8_t* dst) { MeshIngest::InterleaveVertices(reinterpret_cast<RayQueryVertex*>(dst), positions.data(), normals.data(), count); },
+			[&](const uint8_t* a, const uint8_t* b) { return SameVertices(reinterpret_cast<const RayQueryVertex*>(a), reinterpret_cast<const RayQueryVertex*>(b), count); });
+	}
+
+	void TestCopyVertices(uint32_t kernelSet, uint32_t count, size_t offset)
+	{
+		std::vector<RayQueryVertex> vertices(count);
+		for (auto& vertex : vertices)
+		{
+			vertex.position = vec3(RandomFloat(), RandomFloat(), RandomFloat());
+			vertex.normal = vec3(RandomFloat(), RandomFloat(), RandomFloat());
+		}
+
+		CompareWithScalar(kernelSet, "CopyVertices", count, sizeof(RayQueryVertex) * count, offset,
+			[&](uint8_t* dst) { MeshIngest::CopyVertices(reinterpret_cast<RayQueryVertex*>(dst), vertices.data(), count); },
+			[&](const uint8_t* a, const uint8_t* b) { return SameVertices(reinterpret_cast<const RayQueryVertex*>(a), reinterpret_cast<const RayQueryVertex*>(b), count); });
+	}
+
+	void TestGather(uint32_t kernelSet, uint32_t count, size_t offset)
+	{
+		// Stream 0: float3 position, half4 normal. Stream 1: snorm8x4 and snorm16x4 normals. Stream 2: float4 position
+		MeshIngest::VertexLayout layout = {};
+		layout.streamStrides[0] = 20;
+		layout.streamStrides[1] = 12;
+		layout.streamStrides[2] = 16;
+		layout.tangent = { -1, 0, VK_FORMAT_UNDEFINED };
+		layout.uv = { -1, 0, VK_FORMAT_UNDEFINED };
+
+		std::vector<uint8_t> streamData[3];
+		for (uint32_t stream = 0; stream < 3; ++stream)
+		{
+			streamData[stream].resize(static_cast<size_t>(layout.streamStrides[stream]) * count + 1);
+			FillRandom(streamData[stream]);
+		}
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const float position[4] = { RandomFloat(), RandomFloat(), RandomFloat(), 1.0f };
+			std::memcpy(&streamData[0][20 * i], position, 3 * sizeof(float));
+			std::memcpy(&streamData[2][16 * i], position, sizeof(position));
+			for (int c = 0; c < 4; ++c)
+			{
+				const uint16_t half = RandomHalf();
+				std::memcpy(&streamData[0][20 * i + 12 + 2 * c], &half, sizeof(half));
+			}
+		}
+		const void* streams[MeshIngest::kMaxVertexStreams] = { streamData[0].data(), streamData[1].data(), streamData[2].data(), nullptr };
+
+		const MeshIngest::VertexAttributeLayout positionLayouts[3] = {
+			{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT }, { 2, 0, VK_FORMAT_R32G32B32A32_SFLOAT }, { 0, 12, VK_FORMAT_R16G16B16A16_SFLOAT } };
+		const MeshIngest::VertexAttributeLayout normalLayouts[4] = {
+			{ 0, 12, VK_FORMAT_R16G16B16A16_SFLOAT }, { 1, 0, VK_FORMAT_R8G8B8A8_SNORM }, { 1, 4, VK_FORMAT_R16G16B16A16_SNORM }, { -1, 0, VK_FORMAT_UNDEFINED } };
+
+		for (const auto& positionLayout : positionLayouts)
+		{
+			for (const auto& normalLayout : normalLayouts)
+			{
+				layout.position = positionLayout;
+				layout.normal = normalLayout;
+				if (!MeshIngest::IsLayoutSupported(layout))
+				{
+					Fail(MeshIngest::GetKernelSetName(kernelSet), "IsLayoutSupported", count, offset);
+					continue;
+				}
+
+				vec3 bounds[2][2];
+				int run = 0;
+				CompareWithScalar(kernelSet, "GatherVertices", count, sizeof(RayQueryVertex) * count, offset,
+					[&](uint8_t* dst)
+					{
+						MeshIngest::GatherVertices(reinterpret_cast<RayQueryVertex*>(dst), layout, streams, count, &bounds[run][0], &bounds[run][1]);
+						++run;
+					},
+					[&](const uint8_t* a, const uint8_t* b)
+					{
+						return SameVertices(reinterpret_cast<const RayQueryVertex*>(a), reinterpret_cast<const RayQueryVertex*>(b), count)
+							&& std::memcmp(bounds[0], bounds[1], sizeof(bounds[0])) == 0;
+					});
+			}
+		}
+
+		// Separate float3 arrays take the interleave kernel
+		std::vector<uint8_t> packed[2];
+		for (auto& stream : packed)
+		{
+			stream.resize(3 * sizeof(float) * count);
+			for (uint32_t i = 0; i < 3 * count; ++i)
+			{
+				const float value = RandomFloat();
+				std::memcpy(&stream[sizeof(float) * i], &value, sizeof(value));
+			}
+		}
+		const void* packedStreams[MeshIngest::kMaxVertexStreams] = { packed[0].data(), packed[1].data(), nullptr, nullptr };
+		const MeshIngest::VertexLayout packedLayout = MeshIngest::PackedFloat3Layout();
+
+		vec3 bounds[2][2];
+		int run = 0;
+		CompareWithScalar(kernelSet, "GatherVertices packed", count, sizeof(RayQueryVertex) * count, offset,
+			[&](uint8_t* dst)
+			{
+				MeshIngest::GatherVertices(reinterpret_cast<RayQueryVertex*>(dst), packedLayout, packedStreams, count, &bounds[run][0], &bounds[run][1]);
+				++run;
+			},
+			[&](const uint8_t* a, const uint8_t* b)
+			{
+				return SameVertices(reinterpret_cast<const RayQueryVertex*>(a), reinterpret_cast<const RayQueryVertex*>(b), count)
+					&& std::memcmp(bounds[0], bounds[1], sizeof(bounds[0])) == 0;
+			});
+	}
+
+	void TestGatherAttributes(uint32_t kernelSet, uint32_t count, size_t offset)
+	{
+		// One interleaved stream: float3 position, half4 tangent, float2 uv, snorm8x4 tangent, half2 uv
+		MeshIngest::VertexLayout layout = MeshIngest::PackedFloat3Layout();
+		layout.streamStrides[2] = 40;
+		layout.position = { 2, 0, VK_FORMAT_R32G32B32_SFLOAT };
+		layout.normal = { -1, 0, VK_FORMAT_UNDEFINED };
+
+		std::vector<uint8_t> streamData(static_cast<size_t>(layout.streamStrides[2]) * count);
+		FillRandom(streamData);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint8_t* vertex = &streamData[40 * i];
+			const float floats[5] = { RandomFloat(), RandomFloat(), RandomFloat(), RandomFloat(), RandomFloat() };
+			std::memcpy(vertex, floats, 3 * sizeof(float));
+			std::memcpy(vertex + 20, floats + 3, 2 * sizeof(float));
+			for (int c = 0; c < 4; ++c)
+			{
+				const uint16_t half = RandomHalf();
+				std::memcpy(vertex + 12 + 2 * c, &half, sizeof(half));
+			}
+			for (int c = 0; c < 2; ++c)
+			{
+				const uint16_t half = RandomHalf();
+				std::memcpy(vertex + 36 + 2 * c, &half, sizeof(half));
+			}
+		}
+		const void* streams[MeshIngest::kMaxVertexStreams] = { nullptr, nullptr, streamData.data(), nullptr };
+
+		const MeshIngest::VertexAttributeLayout tangentLayouts[3] = {
+			{ 2, 12, VK_FORMAT_R16G16B16A16_SFLOAT }, { 2, 28, VK_FORMAT_R8G8B8A8_SNORM }, { -1, 0, VK_FORMAT_UNDEFINED } };
+		const MeshIngest::VertexAttributeLayout uvLayouts[3] = {
+			{ 2, 20, VK_FORMAT_R32G32_SFLOAT }, { 2, 36, VK_FORMAT_R16G16_SFLOAT }, { -1, 0, VK_FORMAT_UNDEFINED } };
+
+		for (const auto& tangentLayout : tangentLayouts)
+		{
+			for (const auto& uvLayout : uvLayouts)
+			{
+				layout.tangent = tangentLayout;
+				layout.uv = uvLayout;
+				if (!MeshIngest::IsLayoutSupported(layout))
+				{
+					Fail(MeshIngest::GetKernelSetName(kernelSet), "IsLayoutSupported attributes", count, offset);
+					continue;
+				}
+
+				CompareWithScalar(kernelSet, "GatherAttributes", count, sizeof(RayQueryVertexAttributes) * count, offset,
+					[&](uint8_t* dst) { MeshIngest::GatherAttributes(reinterpret_cast<RayQueryVertexAttributes*>(dst), layout, streams, count); },
+					[&](const uint8_t* a, const uint8_t* b) { return std::memcmp(a, b, sizeof(RayQueryVertexAttributes) * count) == 0; });
+			}
+		}
+	}
+
+	// Decoded values and the formats each attribute takes, independent of the kernel sets
+	void TestAttributeFormats()
+	{
+		const int8_t tangent[4] = { 127, -128, 0, -127 };
+		const uint16_t uv[2] = { 0x3c00, 0xc000 };
+		uint8_t vertex[8];
+		std::memcpy(vertex, tangent, sizeof(tangent));
+		std::memcpy(vertex + 4, uv, sizeof(uv));
+		const void* streams[MeshIngest::kMaxVertexStreams] = { vertex, nullptr, nullptr, nullptr };
+
+		MeshIngest::VertexLayout layout = MeshIngest::PackedFloat3Layout();
+		layout.streamStrides[0] = 8;
+		layout.tangent = { 0, 0, VK_FORMAT_R8G8B8A8_SNORM };
+		layout.uv = { 0, 4, VK_FORMAT_R16G16_SFLOAT };
+
+		RayQueryVertexAttributes attributes;
+		MeshIngest::GatherAttributes(&attributes, layout, streams, 1);
+		if (attributes.tangent != vec4(1.0f, -1.0f, 0.0f, -1.0f) || attributes.uv != vec2(1.0f, -2.0f))
+		{
+			Fail("scalar", "GatherAttributes values", 1, 0);
+		}
+
+		// Two component formats only hold uvs, normalized integers no positions
+		layout.position = { 0, 0, VK_FORMAT_R16G16_SFLOAT };
+		const bool positionUV = MeshIngest::IsLayoutSupported(layout);
+		layout.position = { 1, 0, VK_FORMAT_R32G32B32_SFLOAT };
+		layout.uv = { 0, 0, VK_FORMAT_R8G8B8A8_SNORM };
+		const bool uvSnorm = MeshIngest::IsLayoutSupported(layout);
+		layout.uv = { 0, 4, VK_FORMAT_R16G16_SFLOAT };
+		layout.tangent = { 0, 0, VK_FORMAT_R32G32_SFLOAT };
+		const bool tangentUV = MeshIngest::IsLayoutSupported(layout);
+		if (positionUV || uvSnorm || tangentUV)
+		{
+			Fail("scalar", "IsLayoutSupported formats", 1, 0);
+		}
+	}
+
+	// Generated normals and tangents on a flat grid with planar uvs, and the same result with and without workers
+	void TestGeneratedShading()
+	{
+		const uint32_t side = 300;
+		std::vector<RayQueryVertex> vertices(side * side);
+		std::vector<RayQueryVertexAttributes> attributes(side * side);
+		for (uint32_t y = 0; y < side; ++y)
+		{
+			for (uint32_t x = 0; x < side; ++x)
+			{
+				vertices[y * side + x].position = vec3(static_cast<float>(x), static_cast<float>(y), 0.0f);
+				attributes[y * side + x].uv = vec2(static_cast<float>(x) / side, static_cast<float>(y) / side);
+			}
+		}
+
+		// Counter clockwise seen from +z
+		std::vector<int32_t> indices;
+		for (uint32_t y = 0; y + 1 < side; ++y)
+		{
+			for (uint32_t x = 0; x + 1 < side; ++x)
+			{
+				const int32_t v = static_cast<int32_t>(y * side + x);
+				const int32_t quad[6] = { v, v + 1, v + static_cast<int32_t>(side), v + 1, v + static_cast<int32_t>(side) + 1, v + static_cast<int32_t>(side) };
+				indices.insert(indices.end(), quad, quad + 6);
+			}
+		}
+		const uint32_t indexCount = static_cast<uint32_t>(indices.size());
+
+		auto close = [](const vec4& a, const vec4& b) { return glm::all(glm::lessThan(glm::abs(a - b), vec4(1e-5f))); };
+
+		MeshIngest::GenerateNormals(vertices.data(), side * side, indices.data(), indexCount, nullptr);
+		MeshIngest::GenerateTangents(attributes.data(), vertices.data(), side * side, indices.data(), indexCount, nullptr);
+		for (uint32_t v = 0; v < side * side; ++v)
+		{
+			if (!close(vec4(vertices[v].normal, 0.0f), vec4(0.0f, 0.0f, 1.0f, 0.0f)) || !close(attributes[v].tangent, vec4(1.0f, 0.0f, 0.0f, 1.0f)))
+			{
+				Fail("scalar", "GenerateTangents", v, 0);
+				break;
+			}
+		}
+
+		// Mirrored uvs flip the tangent and its handedness
+		std::vector<RayQueryVertexAttributes> mirrored(attributes);
+		for (auto& attribute : mirrored)
+		{
+			attribute.uv.x = -attribute.uv.x;
+		}
+		MeshIngest::GenerateTangents(mirrored.data(), vertices.data(), side * side, indices.data(), indexCount, nullptr);
+		for (uint32_t v = 0; v < side * side; ++v)
+		{
+			if (!close(mirrored[v].tangent, vec4(-1.0f, 0.0f, 0.0f, -1.0f)))
+			{
+				Fail("scalar", "GenerateTangents mirrored", v, 0);
+				break;
+			}
+		}
+
+		// Workers only change who computes which range, not the sums
+		for (auto& vertex : vertices)
+		{
+			vertex.position.z = std::sin(vertex.position.x * 0.37f) * std::cos(vertex.position.y * 0.21f);
+		}
+		std::vector<RayQueryVertex> pooledVertices(vertices);
+		std::vector<RayQueryVertexAttributes> pooledAttributes(attributes);
+		ThreadPool pool(4);
+		MeshIngest::GenerateNormals(vertices.data(), side * side, indices.data(), indexCount, nullptr);
+		MeshIngest::GenerateTangents(attributes.data(), vertices.data(), side * side, indices.data(), indexCount, nullptr);
+		MeshIngest::GenerateNormals(pooledVertices.data(), side * side, indices.data(), indexCount, &pool);
+		MeshIngest::GenerateTangents(pooledAttributes.data(), pooledVertices.data(), side * side, indices.data(), indexCount, &pool);
+		if (!SameVertices(vertices.data(), pooledVertices.data(), side * side)
+			|| std::memcmp(attributes.data(), pooledAttributes.data(), sizeof(RayQueryVertexAttributes) * attributes.size()) != 0)
+		{
+			Fail("scalar", "GenerateTangents workers", side * side, 0);
+		}
+
+		// An empty mesh has zero bounds
+		vec3 bounds[2] = { vec3(1.0f), vec3(1.0f) };
+		const void* streams[MeshIngest::kMaxVertexStreams] = { nullptr, nullptr, nullptr, nullptr };
+		MeshIngest::GatherVertices(nullptr, MeshIngest::PackedFloat3Layout(), streams, 0, &bounds[0], &bounds[1]);
+		if (bounds[0] != vec3(0.0f) || bounds[1] != vec3(0.0f))
+		{
+			Fail("scalar", "GatherVertices empty bounds", 0, 0);
+		}
+	}
+
+	void TestIndices(uint32_t kernelSet, uint32_t count, size_t offset)
+	{
+		std::vector<int32_t> indices(count);
+		std::vector<int32_t> indices16(count);
+		std::vector<uint16_t> shortIndices(count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			indices[i] = static_cast<int32_t>(generator() & 0x7fffffff);
+			indices16[i] = static_cast<int32_t>(generator() & 0xffff);
+			shortIndices[i] = static_cast<uint16_t>(generator());
+		}
+
+		auto same = [&](size_t size)
+		{
+			return [size](const uint8_t* a, const uint8_t* b) { return std::memcmp(a, b, size) == 0; };
+		};
+
+		CompareWithScalar(kernelSet, "CopyIndices", count, sizeof(uint32_t) * count, offset * sizeof(uint32_t),
+			[&](uint8_t* dst) { MeshIngest::CopyIndices(reinterpret_cast<uint32_t*>(dst), indices.data(), count); },
+			same(sizeof(uint32_t) * count));
+
+		CompareWithScalar(kernelSet, "CopyIndices16", count, sizeof(uint16_t) * count, offset * sizeof(uint16_t),
+			[&](uint8_t* dst) { MeshIngest::CopyIndices16(reinterpret_cast<uint16_t*>(dst), shortIndices.data(), count); },
+			same(sizeof(uint16_t) * count));
+
+		CompareWithScalar(kernelSet, "NarrowIndices", count, sizeof(uint16_t) * count, offset * sizeof(uint16_t),
+			[&](uint8_t* dst) { MeshIngest::NarrowIndices(reinterpret_cast<uint16_t*>(dst), indices16.data(), count); },
+			same(sizeof(uint16_t) * count));
+	}
+}
+
+int main()
+{
+	const uint32_t kernelSetCount = MeshIngest::GetKernelSetCount();
+	printf("Kernel sets:");
+	for (uint32_t kernelSet = 0; kernelSet < kernelSetCount; ++kernelSet)
+	{
+		printf(" %s", MeshIngest::GetKernelSetName(kernelSet));
+	}
+	printf(", selected %s\n", MeshIngest::GetKernelName());
+
+	// Every count up to a few SIMD blocks for the tails, then generator large meshes
+	std::vector<uint32_t> counts;
+	for (uint32_t count = 0; count <= 200; ++count)
+	{
+		counts.push_back(count);
+	}
+	for (int i = 0; i < 16; ++i)
+	{
+		counts.push_back(std::uniform_int_distribution<uint32_t>(201, 70000)(generator));
+	}
+
+	TestAttributeFormats();
+	TestGeneratedShading();
+
+	for (uint32_t kernelSet = 1; kernelSet < kernelSetCount; ++kernelSet)
+	{
+		for (uint32_t count : counts)
+		{
+			// Vertices stay 16 byte aligned as RayQueryVertex requires, 16 and 48 miss the 32 and 64 byte boundaries
+			for (size_t offset : { size_t(0), size_t(16), size_t(48) })
+			{
+				TestInterleave(kernelSet, count, offset);
+				TestCopyVertices(kernelSet, count, offset);
+				TestGather(kernelSet, count, offset);
+				TestGatherAttributes(kernelSet, count, offset);
+			}
+
+			// Index offsets in elements
+			for (size_t offset = 0; offset < 17; ++offset)
+			{
+				TestIndices(kernelSet, count, offset);
+			}
+		}
+	}
+
+	if (kernelSetCount < 2)
+	{
+		printf("Only the scalar kernels run here, nothing to compare\n");
+	}
+
+	printf(failures == 0 ? "All kernel sets match the scalar one\n" : "%d mismatches\n", failures);
+	return failures == 0 ? 0 : 1;
+}
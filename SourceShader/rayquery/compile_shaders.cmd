@@ -15,6 +15,19 @@ set COPY_DST_PROJECT_FOLDER=D:\Github\UnityMobileRayTrancing\Assets\Resources\Co
 :: closest-hit shaders
 %GLSL_COMPILER% --target-env vulkan1.2 -V -S vert %SOURCE_FOLDER%ray_shadow.vert -o %BINARIES_FOLDER%ray_shadow.vert
 
+:: depth pre-pass shaders
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S vert %SOURCE_FOLDER%ray_depth.vert -o %BINARIES_FOLDER%ray_depth.vert
+
+:: compute shadow shaders
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S comp %SOURCE_FOLDER%ray_shadow_trace.comp -o %BINARIES_FOLDER%ray_shadow_trace.comp
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S comp %SOURCE_FOLDER%ray_shadow_upsample.comp -o %BINARIES_FOLDER%ray_shadow_upsample.comp
+
+:: light culling shaders
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S comp %SOURCE_FOLDER%ray_light_cull.comp -o %BINARIES_FOLDER%ray_light_cull.comp
+
+:: mesh import shaders
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S comp %SOURCE_FOLDER%ray_mesh_repack.comp -o %BINARIES_FOLDER%ray_mesh_repack.comp
+
 
 ::my folder
 
@@ -24,5 +37,23 @@ set COPY_DST_PROJECT_FOLDER=D:\Github\UnityMobileRayTrancing\Assets\Resources\Co
 :: closest-hit shaders
 %GLSL_COMPILER% --target-env vulkan1.2 -V -S vert %SOURCE_FOLDER%ray_shadow.vert -o %MY_FOLDER%ray_shadowVert.bytes
 
+:: depth pre-pass shaders
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S vert %SOURCE_FOLDER%ray_depth.vert -o %MY_FOLDER%ray_depthVert.bytes
+
+:: compute shadow shaders
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S comp %SOURCE_FOLDER%ray_shadow_trace.comp -o %MY_FOLDER%ray_shadowTraceComp.bytes
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S comp %SOURCE_FOLDER%ray_shadow_upsample.comp -o %MY_FOLDER%ray_shadowUpsampleComp.bytes
+
+:: light culling shaders
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S comp %SOURCE_FOLDER%ray_light_cull.comp -o %MY_FOLDER%ray_lightCullComp.bytes
+
+:: mesh import shaders
+%GLSL_COMPILER% --target-env vulkan1.2 -V -S comp %SOURCE_FOLDER%ray_mesh_repack.comp -o %MY_FOLDER%ray_meshRepackComp.bytes
+
 copy  "%COPY_SRC_PROJECT_FOLDER%ray_shadowFrag.bytes" "%COPY_DST_PROJECT_FOLDER%ray_shadowFrag.bytes" /Y
-copy  "%COPY_SRC_PROJECT_FOLDER%ray_shadowVert.bytes" "%COPY_DST_PROJECT_FOLDER%ray_shadowVert.bytes" /Y
\ No newline at end of file
+copy  "%COPY_SRC_PROJECT_FOLDER%ray_shadowVert.bytes" "%COPY_DST_PROJECT_FOLDER%ray_shadowVert.bytes" /Y
+copy  "%COPY_SRC_PROJECT_FOLDER%ray_depthVert.bytes" "%COPY_DST_PROJECT_FOLDER%ray_depthVert.bytes" /Y
+copy  "%COPY_SRC_PROJECT_FOLDER%ray_shadowTraceComp.bytes" "%COPY_DST_PROJECT_FOLDER%ray_shadowTraceComp.bytes" /Y
+copy  "%COPY_SRC_PROJECT_FOLDER%ray_shadowUpsampleComp.bytes" "%COPY_DST_PROJECT_FOLDER%ray_shadowUpsampleComp.bytes" /Y
+copy  "%COPY_SRC_PROJECT_FOLDER%ray_lightCullComp.bytes" "%COPY_DST_PROJECT_FOLDER%ray_lightCullComp.bytes" /Y
+copy  "%COPY_SRC_PROJECT_FOLDER%ray_meshRepackComp.bytes" "%COPY_DST_PROJECT_FOLDER%ray_meshRepackComp.bytes" /Y
\ No newline at end of file
@@ -0,0 +1,37 @@
+#version 460
+
+// Depth only pre-pass for ray_shadow, reads just the position of the RayQueryVertex stream.
+// gl_Position must match ray_shadow.vert bit for bit, the shading pass tests depth with EQUAL.
+
+layout(location = 0) in vec3 position;
+
+layout(set = 0, binding = 1) uniform GlobalUniform
+{
+	mat4 view_proj;
+	vec3 camera_position;
+	vec3 light_position;
+	vec3 light_direction;
+}
+global_uniform;
+
+// Per instance data, indexed by instanceCustomIndex. Every draw passes it as firstInstance
+struct TLASInstanceData
+{
+	mat4 local_to_world;    // Unity's rows as columns, so positions multiply from the left
+	mat4 world_to_local;
+};
+
+layout(set = 0, binding = 2) readonly buffer InstanceData
+{
+	TLASInstanceData instances[];
+}
+instance_data;
+
+invariant gl_Position;
+
+void main(void)
+{
+	vec4 wPos = vec4(position, 1.0) * instance_data.instances[gl_InstanceIndex].local_to_world;
+
+	gl_Position = global_uniform.view_proj * wPos;
+}
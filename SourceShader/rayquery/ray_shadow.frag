@@ -24,6 +24,25 @@ layout(location = 2) in vec4 in_scene_pos;
 
 layout(location = 0) out vec4 o_color;
 
+// Set per quality tier through VkSpecializationInfo, the defaults match the original hard coded values
+layout(constant_id = 0) const uint  AO_SAMPLES_EACH = 3;
+layout(constant_id = 1) const float AO_MAX_DISTANCE = 2.0;
+layout(constant_id = 2) const float RAY_TMIN = 0.01;
+layout(constant_id = 3) const bool  ENABLE_AO = true;
+layout(constant_id = 4) const bool  ENABLE_SHADOW = true;
+layout(constant_id = 5) const uint  SHADOW_RAY_BUDGET = 2;
+
+// Instance mask bits, kept in sync with kRayQueryMask* in RayQueryShsaderConst.h
+const uint SHADOW_CASTER_MASK = 0x01;
+const uint AO_OCCLUDER_MASK = 0x02;
+
+// Kept in sync with kLightTileSize, kMaxLightsPerTile and the light types in RayQueryShsaderConst.h
+const uint MAX_LIGHTS_PER_TILE = 31;
+const uint TILE_STRIDE = MAX_LIGHTS_PER_TILE + 1;
+const int  LIGHT_TYPE_SPOT = 0;
+const int  LIGHT_TYPE_DIRECTIONAL = 1;
+const float DIRECTIONAL_SHADOW_DISTANCE = 1000.0;
+
 layout(set = 0, binding = 0) uniform accelerationStructureEXT topLevelAS;
 
 layout(set = 0, binding = 1) uniform GlobalUniform
@@ -32,9 +51,61 @@ layout(set = 0, binding = 1) uniform GlobalUniform
 	vec3 camera_position;
 	vec3 light_position;
 	vec3 light_direction;
+	mat4 inv_view_proj;
+	mat4 prev_view_proj;
+	uint light_count;       // 0 falls back to light_position
+	uint frame_index;       // varies the stochastic light picks
 }
 global_uniform;
 
+// Tiles of the tile light buffer below, pushed with the draws so they always match the copy bound for this frame
+layout(push_constant) uniform LightTileConstants
+{
+	uint tile_count_x;      // 0 when ray_light_cull.comp didn't run, every light is then visited
+	uint tile_count_y;
+	uint tile_size;
+}
+tile_constants;
+
+struct Light
+{
+	vec4 position_range;        // xyz world position, w range
+	vec4 direction_cos_angle;   // xyz forward, w cosine of half the spot angle
+	vec4 color_intensity;
+	int  type;
+	int  enabled;
+	int  light_instance_id;
+	int  padding;
+};
+
+layout(set = 0, binding = 3) readonly buffer Lights
+{
+	Light lights[];
+}
+light_data;
+
+// Per screen tile: [count, light index 0, light index 1, ...]
+layout(set = 0, binding = 4) readonly buffer TileLights
+{
+	uint indices[];
+}
+tile_lights;
+
+// Walker alias table over light power, rebuilt on the CPU whenever lights change
+struct LightAlias
+{
+	float threshold;
+	uint  alias;
+	float pdf;
+	uint  padding;
+};
+
+layout(set = 0, binding = 5) readonly buffer LightAliasTable
+{
+	LightAlias entries[];
+}
+light_alias;
+
 
 /**
 Calculate ambient occlusion
@@ -44,10 +115,9 @@ Calculate ambient occlusion
 float calculate_ambient_occlusion(vec3 object_point, vec3 object_normal)
 {
 	const float ao_mult = 1;
-	uint max_ao_each = 3;
-	uint max_ao = max_ao_each * max_ao_each;
-	const float max_dist = 2;
-	const float tmin = 0.01, tmax = max_dist;
+	const uint max_ao_each = AO_SAMPLES_EACH;
+	const float max_dist = AO_MAX_DISTANCE;
+	const float tmin = RAY_TMIN, tmax = max_dist;
 	float accumulated_ao = 0.f;
 	vec3 u = abs(dot(object_normal, vec3(0, 0, 1))) > 0.9 ? cross(object_normal, vec3(1, 0, 0)) : cross(object_normal, vec3(0, 0, 1));
 	vec3 v = cross(object_normal, u);
@@ -63,7 +133,7 @@ float calculate_ambient_occlusion(vec3 object_point, vec3 object_normal)
 			vec3 direction = x * u + y * v + z * object_normal;
 
 			rayQueryEXT query;
-			rayQueryInitializeEXT(query, topLevelAS, gl_RayFlagsTerminateOnFirstHitEXT, 0xFF, object_point, tmin, direction.xyz, tmax);
+			rayQueryInitializeEXT(query, topLevelAS, gl_RayFlagsTerminateOnFirstHitEXT, AO_OCCLUDER_MASK, object_point, tmin, direction.xyz, tmax);
 			rayQueryProceedEXT(query);
 			float dist = max_dist;
 			if (rayQueryGetIntersectionTypeEXT(query, true) != gl_RayQueryCommittedIntersectionNoneEXT)
@@ -87,17 +157,16 @@ Apply ray tracing to determine whether the point intersects light
 */
 
 
-bool intersects_light(vec3 light_origin, vec3 light_direction, vec3 pos)
+bool occluded(vec3 pos, vec3 direction)
 {
-	const float tmin = 0.01, tmax = 1000;
-	const vec3  direction = light_origin - pos;
+	const float tmin = RAY_TMIN;
 
 	rayQueryEXT query;
 
 	// The following runs the actual ray query
 	// For performance, use gl_RayFlagsTerminateOnFirstHitEXT, since we only need to know
 	// whether an intersection exists, and not necessarily any particular intersection
-	rayQueryInitializeEXT(query, topLevelAS, gl_RayFlagsTerminateOnFirstHitEXT, 0xFF, pos, tmin, direction.xyz, 1.0);
+	rayQueryInitializeEXT(query, topLevelAS, gl_RayFlagsTerminateOnFirstHitEXT, SHADOW_CASTER_MASK, pos, tmin, direction.xyz, 1.0);
 	// The following is the canonical way of using ray Queries from the fragment shader when
 	// there's more than one bounce or hit to traverse:
 	// while (rayQueryProceedEXT(query)) { }
@@ -113,11 +182,163 @@ bool intersects_light(vec3 light_origin, vec3 light_direction, vec3 pos)
 	return false;
 }
 
+bool intersects_light(vec3 light_origin, vec3 light_direction, vec3 pos)
+{
+	return occluded(pos, light_origin - pos);
+}
+
+/**
+Contribution of a light to pos, 0 when it is out of range, outside the spot cone or behind the surface
+*/
+
+
+float light_contribution(Light light, vec3 pos, vec3 normal, out vec3 to_light)
+{
+	to_light = vec3(0.0);
+	if (light.enabled == 0)
+	{
+		return 0.0;
+	}
+
+	float attenuation = 1.0;
+	if (light.type == LIGHT_TYPE_DIRECTIONAL)
+	{
+		to_light = -light.direction_cos_angle.xyz * DIRECTIONAL_SHADOW_DISTANCE;
+	}
+	else
+	{
+		to_light = light.position_range.xyz - pos;
+		const float dist = length(to_light);
+		if (dist >= light.position_range.w)
+		{
+			return 0.0;
+		}
+		attenuation = 1.0 - dist / light.position_range.w;
+		attenuation *= attenuation;
+
+		if (light.type == LIGHT_TYPE_SPOT && dot(-to_light / dist, light.direction_cos_angle.xyz) < light.direction_cos_angle.w)
+		{
+			return 0.0;
+		}
+	}
+
+	return attenuation * light.color_intensity.w * max(dot(normal, normalize(to_light)), 0.0);
+}
+
+uint pcg_hash(uint v)
+{
+	const uint state = v * 747796405u + 2891336453u;
+	const uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+float random_float(inout uint seed)
+{
+	seed = pcg_hash(seed);
+	return float(seed >> 8) * (1.0 / 16777216.0);
+}
+
+/**
+Shadow from every registered light that reaches this pixel, weighted by how much each one contributes.
+Up to SHADOW_RAY_BUDGET lights are traced exactly, past that SHADOW_RAY_BUDGET lights are picked stochastically:
+from the tile list in proportion to their contribution here, or from the power alias table when there is no tile list
+*/
+
+
+float light_visibility(vec3 pos, vec3 normal)
+{
+	if (global_uniform.light_count == 0)
+	{
+		return intersects_light(global_uniform.light_position, global_uniform.light_direction, pos) ? 0.2 : 1.0;
+	}
+
+	const bool tiled = tile_constants.tile_count_x > 0;
+	uint base = 0;
+	uint count = global_uniform.light_count;
+	if (tiled)
+	{
+		const uvec2 tile = min(uvec2(gl_FragCoord.xy) / tile_constants.tile_size, uvec2(tile_constants.tile_count_x, tile_constants.tile_count_y) - 1);
+		base = (tile.y * tile_constants.tile_count_x + tile.x) * TILE_STRIDE;
+		count = tile_lights.indices[base];
+	}
+
+	vec3 to_light;
+	if (count <= SHADOW_RAY_BUDGET)
+	{
+		float lit = 0.0;
+		float total = 0.0;
+		for (uint i = 0; i < count; ++i)
+		{
+			// Back facing lights add nothing, so they need no ray either
+			const float contribution = light_contribution(light_data.lights[tiled ? tile_lights.indices[base + 1 + i] : i], pos, normal, to_light);
+			if (contribution > 0.0)
+			{
+				lit += occluded(pos, to_light) ? 0.2 * contribution : contribution;
+				total += contribution;
+			}
+		}
+		return total > 0.0 ? lit / total : 1.0;
+	}
+
+	uint seed = pcg_hash(uint(gl_FragCoord.x) + pcg_hash(uint(gl_FragCoord.y) + pcg_hash(global_uniform.frame_index)));
+
+	if (tiled)
+	{
+		// Contributions cost no rays, so the whole tile list is weighed and SHADOW_RAY_BUDGET stratified picks walk its CDF once.
+		// Picking in proportion to contribution makes the mean visibility of the picks the weighted visibility
+		float total = 0.0;
+		for (uint i = 0; i < count; ++i)
+		{
+			total += light_contribution(light_data.lights[tile_lights.indices[base + 1 + i]], pos, normal, to_light);
+		}
+		if (total <= 0.0)
+		{
+			return 1.0;
+		}
+
+		const float offset = random_float(seed);
+		float cumulative = 0.0;
+		float visible = 0.0;
+		uint picked = 0;
+		for (uint i = 0; i < count && picked < SHADOW_RAY_BUDGET; ++i)
+		{
+			cumulative += light_contribution(light_data.lights[tile_lights.indices[base + 1 + i]], pos, normal, to_light);
+			for (; picked < SHADOW_RAY_BUDGET && (float(picked) + offset) * total / float(SHADOW_RAY_BUDGET) < cumulative; ++picked)
+			{
+				visible += occluded(pos, to_light) ? 0.2 : 1.0;
+			}
+		}
+		return picked > 0 ? visible / float(picked) : 1.0;
+	}
+
+	float lit = 0.0;
+	float total = 0.0;
+	for (uint k = 0; k < SHADOW_RAY_BUDGET; ++k)
+	{
+		// Alias table lookup, one uniform number picks a column and then either it or its alias
+		const float u = random_float(seed) * float(count);
+		const uint  column = min(uint(u), count - 1);
+		const LightAlias entry = light_alias.entries[column];
+		const uint  index = (u - float(column)) < entry.threshold ? column : entry.alias;
+		const float pdf = light_alias.entries[index].pdf;
+
+		const float contribution = light_contribution(light_data.lights[index], pos, normal, to_light);
+		if (contribution > 0.0 && pdf > 0.0)
+		{
+			lit += (occluded(pos, to_light) ? 0.2 : 1.0) * contribution / pdf;
+			total += contribution / pdf;
+		}
+	}
+	return total > 0.0 ? lit / total : 1.0;
+}
+
 void main(void)
 {
 	// this is where we apply the shadow
-	const float ao = calculate_ambient_occlusion(in_scene_pos.xyz, in_normal);
-	const vec4 lighting = intersects_light(global_uniform.light_position, global_uniform.light_direction, in_scene_pos.xyz) ? vec4(0.2, 0.2, 0.2, 1) : vec4(1, 1, 1, 1);
+	// Both conditions are specialization constants, so a disabled feature compiles to nothing
+	const float ao = (ENABLE_AO && AO_SAMPLES_EACH > 0) ? calculate_ambient_occlusion(in_scene_pos.xyz, in_normal) : 1.0;
+	const float visibility = ENABLE_SHADOW ? light_visibility(in_scene_pos.xyz, normalize(in_normal)) : 1.0;
+	const vec4 lighting = vec4(vec3(visibility), 1);
 	//vec3 normalColor = (in_normal + 1) * 0.5;
 	o_color = lighting * vec4(ao * vec3(1,1,1), 1);
 	//o_color = vec4(normalColor,1);
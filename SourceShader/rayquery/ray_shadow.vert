@@ -32,24 +32,36 @@ layout(set = 0, binding = 1) uniform GlobalUniform
 }
 global_uniform;
 
-layout(push_constant) uniform ConstantsUniform
+// Per instance data, indexed by instanceCustomIndex. Every draw passes it as firstInstance
+struct TLASInstanceData
 {
-	mat4 model;
+	mat4 local_to_world;    // Unity's rows as columns, so positions multiply from the left
+	mat4 world_to_local;
+};
+
+layout(set = 0, binding = 2) readonly buffer InstanceData
+{
+	TLASInstanceData instances[];
 }
-pushConstant;
+instance_data;
 
 layout(location = 0) out vec4 o_pos;
 layout(location = 1) out vec3 o_normal;
 layout(location = 2) out vec4 scene_pos;        // scene with respect to BVH coordinates
 
+// Must match ray_depth.vert when the depth pre-pass is on
+invariant gl_Position;
+
 void main(void)
 {
-	vec4 wPos = pushConstant.model * vec4(position, 1.0);
+	// Same expression as ray_depth.vert, the depth pre-pass relies on gl_Position matching exactly
+	vec4 wPos = vec4(position, 1.0) * instance_data.instances[gl_InstanceIndex].local_to_world;
 
 	// We want to be able to perform ray tracing, so don't apply any matrix to scene_pos
 	scene_pos = wPos;
 
-	vec4 wNormal = pushConstant.model * vec4(normal,0);
+	// world_to_local holds the transposed inverse, which keeps normals right under non uniform scale
+	vec4 wNormal = instance_data.instances[gl_InstanceIndex].world_to_local * vec4(normal,0);
 	wNormal = normalize(wNormal);
 	o_normal = wNormal.xyz;
 